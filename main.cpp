@@ -20,11 +20,15 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h> // for strcmp
+#include <math.h>   // for fabs
 #include <locale.h> // for thousands separator
 #include <unistd.h> // for sleep
 #include <libindi/indifocuser.h>
 
 #include "pimoco_stepper.h"
+#include "pimoco_emulator.h"
+#include "pimoco_time.h"
 
 // Unused dummies for Indi functions to avoid linker errors
 //
@@ -64,64 +68,436 @@ void getAndPrintState(Stepper *stepper) {
 	puts(buffer);
 }
 
-int main(int argc, char ** argv) {
-	puts("Starting up...");
+// Prints and resets SPI statistics for the given phase, with the given number of operations and elapsed time
+void printAndResetStats(Stepper *stepper, const char *phase, uint32_t numOps, uint64_t elapsedUs) {
+	const SPI::Stats &stats=stepper->getStats();
+	printf("%-20s %'7u ops %'9llu us %'9.1f us/op | %'7llu messages %'8llu frames %'9llu bytes %'9llu us busy %'7llu us max %'7llu us wait\n",
+	       phase, numOps, (unsigned long long) elapsedUs, numOps>0 ? ((double) elapsedUs)/numOps : 0.0,
+	       (unsigned long long) stats.messages, (unsigned long long) stats.frames, (unsigned long long) stats.bytes,
+	       (unsigned long long) stats.busyUs, (unsigned long long) stats.maxUs, (unsigned long long) stats.waitUs);
+	stepper->resetStats();
+}
 
-	setlocale(LC_ALL, ""); // for thousands separator
-	Stepper stepper("Default stepper");
+// Prints min/mean/max of the driver telemetry samples taken so far
+void printTelemetry(Stepper *stepper) {
+	Telemetry::Summary s;
+	uint32_t n=stepper->getTelemetry().summarize(&s, 0, UINT64_MAX);
+	printf("Telemetry: %'u samples, %'llu in total, %u overtemperature warnings\n", n, (unsigned long long) stepper->getTelemetry().size(), s.flagCounts[2]);
+	const char *names[Telemetry::NUM_CHANNELS]={ "SG_RESULT", "CS_ACTUAL", "PWM_SCALE_SUM", "TSTEP", "LOST_STEPS" };
+	for(int c=0; c<Telemetry::NUM_CHANNELS; c++)
+		printf("  %-14s min %'9.0f mean %'11.1f max %'9.0f\n", names[c], s.min[c], s.mean[c], s.max[c]);
+}
 
-	if(!stepper.open(Stepper::defaultSPIDevice))
-		panicf("Error opening device %s\n", Stepper::defaultSPIDevice);
+// Benchmarks SPI traffic and latency of typical control loop operations
+void benchmark(Stepper *stepper, uint32_t numPolls) {
+	puts("Benchmarking control loop operations...");
 
-	getAndPrintState(&stepper);
+	Timestamp start;
+	for(uint32_t i=0; i<numPolls; i++) {
+		Stepper::MotionStatus ms;
+		if(!stepper->getMotionStatus(&ms))
+			panicf("Error getting motion status\n");
+	}
+	Timestamp end;
+	printAndResetStats(stepper, "getMotionStatus", numPolls, end.usSince(start));
+
+	start=Timestamp();
+	for(uint32_t i=0; i<numPolls; i++) {
+		int32_t pos, speed;
+		if(!stepper->getPosition(&pos) || !stepper->getSpeed(&speed))
+			panicf("Error getting position and speed\n");
+	}
+	end=Timestamp();
+	printAndResetStats(stepper, "getPosition+Speed", numPolls, end.usSince(start));
+
+	start=Timestamp();
+	for(uint32_t i=0; i<numPolls; i++)
+		if(!stepper->setTargetSpeed((i&1) ? 1000 : -1000))
+			panicf("Error on setSpeed\n");
+	end=Timestamp();
+	printAndResetStats(stepper, "setTargetSpeed", numPolls, end.usSince(start));
+
+	// time spent by the caller queuing asynchronous commands, staying below the queue size
+	uint32_t numPosts=numPolls<SPIWorker::QUEUE_SIZE/2 ? numPolls : SPIWorker::QUEUE_SIZE/2;
+	start=Timestamp();
+	for(uint32_t i=0; i<numPosts; i++)
+		if(!stepper->setTargetSpeedAsync((i&1) ? 1000 : -1000))
+			panicf("Error on setSpeedAsync\n");
+	end=Timestamp();
+	auto noop=[](){ };
+	stepper->call(noop);
+	printAndResetStats(stepper, "setTargetSpeedAsync", numPosts, end.usSince(start));
+
+	if(!stepper->setTargetSpeed(0))
+		panicf("Error on setSpeed\n");
+	start=Timestamp();
+	for(uint32_t i=0; i<numPolls; i++)
+		if(!stepper->setTargetPosition((i&1) ? 1000 : -1000))
+			panicf("Error on goto\n");
+	end=Timestamp();
+	printAndResetStats(stepper, "setTargetPosition", numPolls, end.usSince(start));
+
+	// one full motor revolution and back, with 256 microsteps and 200 steps/rev
+	start=Timestamp();
+	if(!stepper->setTargetPositionBlocking(256*200, 60000) || !stepper->setTargetPositionBlocking(0, 60000))
+		panicf("Error on goto\n");
+	end=Timestamp();
+	printAndResetStats(stepper, "blocking goto", 2, end.usSince(start));
+}
+
+// A go-to as recorded from XACTUAL: the ramp settings, clock and motion state it started from, and the positions sampled until it completed
+struct GoToTrace {
+	enum {
+		MAX_SAMPLES = 16384  // enough for five minutes at the 10 ms sampling interval
+	};
+	Ramp::Settings settings;
+	uint32_t clockHz;
+	int32_t  position, speed, target;  // XACTUAL and VACTUAL before the move, and XTARGET
+	double   durationSeconds;          // time from setting XTARGET to position reached
+	uint32_t numSamples;
+	double   seconds  [MAX_SAMPLES];   // sample times since setting XTARGET
+	int32_t  positions[MAX_SAMPLES];   // XACTUAL at these times
+};
+
+// Largest deviations of recorded go-tos from the ramp model which still pass. Samples may deviate by a fixed distance plus the
+// distance travelled at the predicted speed within the timing tolerance, covering the latency of reading XACTUAL from user space
+static const double goToToleranceUsteps=32;
+static const double goToToleranceSeconds=0.01;
+static const double goToDurationToleranceSeconds=0.05;
+
+// Saves the given go-to trace as text to the given file. Returns true on success, else false
+bool saveGoToTrace(const char *fileName, const GoToTrace &trace, const char *source) {
+	FILE *f=fopen(fileName, "w");
+	if(f==NULL)
+		return false;
+	const Ramp::Settings &s=trace.settings;
+	fprintf(f, "# PiMoCo go-to trace from %s. Check against the ramp model with pimoco_test -v <file>\n", source);
+	fprintf(f, "clock %u\nvstart %u\na1 %u\nv1 %u\namax %u\nvmax %u\ndmax %u\nd1 %u\nvstop %u\ntzerowait %u\n",
+	        trace.clockHz, s.vstart, s.a1, s.v1, s.amax, s.vmax, s.dmax, s.d1, s.vstop, s.tzerowait);
+	fprintf(f, "position %d\nspeed %d\ntarget %d\nduration %.6f\nsamples %u\n", trace.position, trace.speed, trace.target,
+	        trace.durationSeconds, trace.numSamples);
+	for(uint32_t i=0; i<trace.numSamples; i++)
+		fprintf(f, "%.6f %d\n", trace.seconds[i], trace.positions[i]);
+	return fclose(f)==0;
+}
+
+// Loads a go-to trace saved with saveGoToTrace() from the given file. Returns true on success, else false
+bool loadGoToTrace(const char *fileName, GoToTrace *trace) {
+	FILE *f=fopen(fileName, "r");
+	if(f==NULL)
+		return false;
+	Ramp::Settings &s=trace->settings;
+	struct { const char *name; uint32_t *value; } fields[]={
+		{ "clock", &trace->clockHz }, { "vstart", &s.vstart }, { "a1", &s.a1 }, { "v1", &s.v1 }, { "amax", &s.amax },
+		{ "vmax", &s.vmax }, { "dmax", &s.dmax }, { "d1", &s.d1 }, { "vstop", &s.vstop }, { "tzerowait", &s.tzerowait },
+		{ "position", (uint32_t*) &trace->position }, { "speed", (uint32_t*) &trace->speed }, { "target", (uint32_t*) &trace->target },
+		{ "samples", &trace->numSamples },
+	};
+	const uint32_t numFields=sizeof(fields)/sizeof(fields[0]);
+	uint32_t numFound=0;
+	bool durationFound=false;
+	char line[256], key[32];
+	double value;
+	while(numFound<numFields || !durationFound) {
+		if(fgets(line, sizeof(line), f)==NULL)
+			break;
+		if(line[0]=='#' || sscanf(line, "%31s %lf", key, &value)!=2)
+			continue;
+		if(!strcmp(key, "duration")) {
+			trace->durationSeconds=value;
+			durationFound=true;
+			continue;
+		}
+		for(uint32_t i=0; i<numFields; i++)
+			if(!strcmp(key, fields[i].name)) {
+				*fields[i].value=(uint32_t) (int64_t) value;
+				numFound++;
+			}
+	}
+	bool res=numFound==numFields && durationFound && trace->numSamples<=GoToTrace::MAX_SAMPLES;
+	for(uint32_t i=0; res && i<trace->numSamples; i++)
+		res=fscanf(f, "%lf %d", &trace->seconds[i], &trace->positions[i])==2;
+	fclose(f);
+	return res;
+}
+
+// Compares the given go-to trace against the ramp model prediction and prints the result.
+// Returns true if duration and positions are within tolerance, else false
+bool checkGoToTrace(const GoToTrace &trace, const char *name) {
+	Ramp ramp;
+	if(!ramp.plan(trace.settings, trace.position, trace.speed, trace.target)) {
+		printf("%s: unable to plan go-to from %+d to %+d\n", name, trace.position, trace.target);
+		return false;
+	}
 
-	if(!stepper.syncPosition(0))
+	// deviation relative to the tolerance at each sample, so fast and slow phases are judged alike
+	double maxError=0, maxErrorAt=0, maxExcess=0;
+	for(uint32_t i=0; i<trace.numSamples; i++) {
+		double t=Ramp::fromSeconds(trace.seconds[i], trace.clockHz);
+		double error=fabs(trace.positions[i]-ramp.positionAt(t));
+		double speedPerSecond=fabs(ramp.velocityAt(t))*trace.clockHz/(double) (1ul<<24);
+		double excess=error/(goToToleranceUsteps + speedPerSecond*goToToleranceSeconds);
+		if(error>maxError) {
+			maxError=error;
+			maxErrorAt=trace.seconds[i];
+		}
+		if(excess>maxExcess)
+			maxExcess=excess;
+	}
+	double predictedSeconds=ramp.getDurationSeconds(trace.clockHz);
+	bool res=maxExcess<=1 && fabs(predictedSeconds-trace.durationSeconds)<=goToDurationToleranceSeconds;
+
+	printf("%s: go-to from %+d to %+d predicted %.3f s actual %.3f s, peak speed %.0f, max deviation %.0f usteps (%.4f%% of move) "
+	       "at %.3f s over %u samples, %.0f%% of tolerance: %s\n", name, trace.position, trace.target, predictedSeconds, trace.durationSeconds,
+	       ramp.getPeakVelocity(), maxError, 100.0*maxError/fabs((double) trace.target-trace.position), maxErrorAt, trace.numSamples,
+	       100.0*maxExcess, res ? "ok" : "FAILED");
+	return res;
+}
+
+// Performs a go-to to the given target while recording XACTUAL, and checks the trace against the ramp model prediction.
+// Saves the trace to the given file unless NULL
+void validateGoTo(Stepper *stepper, int32_t target, const char *traceFileName) {
+	static GoToTrace trace;
+	if(!stepper->getGoToRampSettings(&trace.settings) || !stepper->getClockHz(&trace.clockHz))
+		panicf("Error getting ramp settings\n");
+
+	// cost of planning, as e.g. in a control loop
+	const uint32_t numPlans=100000;
+	Stepper::MotionStatus ms;
+	if(!stepper->getMotionStatus(&ms))
+		panicf("Error getting motion status\n");
+	Ramp ramp;
+	Timestamp start;
+	double checksum=0;
+	for(uint32_t i=0; i<numPlans; i++) {
+		ramp.plan(trace.settings, ms.position, ms.speed, target+(int32_t) (i&255));
+		checksum+=ramp.getDuration();
+	}
+	uint64_t planUs=Timestamp().usSince(start);
+	printf("Planning %.3f us/op (checksum %.0f)\n", (double) planUs/numPlans, checksum);
+
+	// the motion state right before the move is where the prediction starts
+	if(!stepper->getMotionStatus(&ms))
+		panicf("Error getting motion status\n");
+	trace.position=ms.position;
+	trace.speed=ms.speed;
+	trace.target=target;
+	trace.numSamples=0;
+	start=Timestamp();
+	std::future<bool> completion=stepper->setTargetPositionAsync(target);
+	if(!completion.valid())
+		panicf("Error on goto\n");
+	while(completion.wait_for(std::chrono::milliseconds(10))!=std::future_status::ready) {
+		// XACTUAL was read somewhere during the exchange
+		double before=Timestamp().usSince(start)*1e-6;
+		if(!stepper->getMotionStatus(&ms))
+			panicf("Error getting motion status\n");
+		double after=Timestamp().usSince(start)*1e-6;
+		if(trace.numSamples<GoToTrace::MAX_SAMPLES) {
+			trace.seconds  [trace.numSamples]=0.5*(before+after);
+			trace.positions[trace.numSamples]=ms.position;
+			trace.numSamples++;
+		}
+	}
+	trace.durationSeconds=Timestamp().usSince(start)*1e-6;
+	if(!completion.get())
+		panicf("Error on goto\n");
+
+	if(traceFileName!=NULL && !saveGoToTrace(traceFileName, trace, stepper->isHardware() ? "hardware" : "the software emulator"))
+		panicf("Error saving go-to trace to %s\n", traceFileName);
+	if(!checkGoToTrace(trace, "Ramp model"))
+		panicf("Ramp model deviates from the go-to beyond tolerance\n");
+}
+
+// Exercises basic motion: gotos, tracking at sidereal rate and stopping
+void exercise(Stepper *stepper, const char *goToTracePrefix) {
+	puts("Exercising motion...");
+
+	getAndPrintState(stepper);
+
+	if(!stepper->syncPosition(0))
 		panicf("Error syncing position\n");
 
-	getAndPrintState(&stepper);
+	getAndPrintState(stepper);
 
 	uint32_t fullRevolutionInUsteps=256ul*400*3*144;
-	// move by 1h of RA with 256 microsteps, 400 steps/rev, belt ratio 1:3 and Vixen worm gear ratio 1:144  
-	if(!stepper.setTargetPositionBlocking((fullRevolutionInUsteps*1ul)/24))  
-		panicf("Error on goto");
+	// move by 1h of RA with 256 microsteps, 400 steps/rev, belt ratio 1:3 and Vixen worm gear ratio 1:144 and back,
+	// then reverse out of a slew, validating the ramp model against the recorded position traces
+	char goToTraceFileName[256];
+	auto goToTrace=[&](int index) {
+		if(goToTracePrefix==NULL)
+			return (const char*) NULL;
+		snprintf(goToTraceFileName, sizeof(goToTraceFileName), "%s%d.txt", goToTracePrefix, index);
+		return (const char*) goToTraceFileName;
+	};
+	validateGoTo(stepper, (fullRevolutionInUsteps*1ul)/24, goToTrace(1));
+
+	getAndPrintState(stepper);
+
+	validateGoTo(stepper, 0, goToTrace(2));
+	
+	getAndPrintState(stepper);
 
-	getAndPrintState(&stepper);
+	if(!stepper->setTargetSpeed(-50000))
+		panicf("Error on setSpeed");
+	sleep(2);
+	validateGoTo(stepper, (fullRevolutionInUsteps*1ul)/96, goToTrace(3));
 
-	if(!stepper.setTargetPositionBlocking(0))
-		panicf("Error on goto");
-	
-	getAndPrintState(&stepper);
+	getAndPrintState(stepper);
 
-	// WiringPi uses crystal osciallator running at 19.2 MHz for void gpioClockSet (int pin, int freq). 
-	// See https://github.com/WiringPi/WiringPi/blob/master/wiringPi/wiringPi.c
-	// TMC5160 needs 8..10-16 MHz, see section 26.2.1 in https://www.trinamic.com/fileadmin/assets/Products/ICs_Documents/TMC5160A_Datasheet_Rev1.14.pdf 
-	// To have an exact frequency based on an integer divider of two, we choose 9.6 MHz.
-	double stepperClockInHz=9600000;  
+	uint32_t clockHz;
+	if(!stepper->getClockHz(&clockHz))
+		panicf("Error getting clock frequency");
+	double stepperClockInHz=clockHz;
 	double stepperChipTimeScaler=(double) (1ul<<24);
 	double stepperTimeUnit=stepperChipTimeScaler/stepperClockInHz;
 
 	double siderealDayInSeconds=86164.0905;
 
 	double siderealRateInUstepsPerTimeUnit=(((double)fullRevolutionInUsteps)/siderealDayInSeconds)*stepperTimeUnit;
-	uint32_t siderealRateInUstepsPerTimeUnitRounded=(uint32_t) (siderealRateInUstepsPerTimeUnit+0.5);
-	if(!stepper.setTargetSpeed(siderealRateInUstepsPerTimeUnitRounded))
+	if(!stepper->setTargetSpeedFractional(siderealRateInUstepsPerTimeUnit))
 		panicf("Error on setSpeed");
 
 	for(int i=0; i<60; i++) {
 		sleep(1);
-		getAndPrintState(&stepper);
+		getAndPrintState(stepper);
 	}
 
-	if(!stepper.setTargetSpeed(0))
+	TMC5160::FractionalSpeedStatus ds;
+	if(!stepper->getFractionalSpeedStatus(&ds))
+		panicf("Error getting fractional speed status");
+	printf("Sidereal rate requested %.9f achieved %.9f error %.3f ppb residual %+.6f with %u %s updates\n", ds.requested, ds.achieved,
+	       ds.requested!=0 ? (ds.achieved-ds.requested)/ds.requested*1e9 : 0.0, ds.residual, ds.updates, ds.position ? "XTARGET" : "VMAX");
+
+	if(!stepper->setTargetSpeed(0))
 		panicf("Error on setSpeed");
-	getAndPrintState(&stepper);
+	getAndPrintState(stepper);
 	sleep(1);
-	getAndPrintState(&stepper);
+	getAndPrintState(stepper);
 
-	if(!stepper.setTargetPositionBlocking(0))
+	if(!stepper->setTargetPositionBlocking(0))
 		panicf("Error on goto");
 	
+	getAndPrintState(stepper);
+}
+
+void usage(const char *prog) {
+	printf("Usage: %s [-x] [-g prefix] [-v file]... [-r] [-n polls] [-t file] [-p fields] [-m hz] [-c ms] [-s hz] [device]\n"
+	       "  -x        exercise motion after benchmarking\n"
+	       "  -g prefix save the go-to traces recorded while exercising to files with the given prefix\n"
+	       "  -v file   check a saved go-to trace against the ramp model and exit, failing beyond tolerance. Repeatable\n"
+	       "  -r        close and reopen the device after opening, to measure reconnects\n"
+	       "  -n polls  number of iterations per benchmark (default 1000)\n"
+	       "  -t file   save the raw SPI trace to the given file on exit\n"
+	       "  -p fields switch to the given register profile after opening, e.g. \"TOFF=4 TBL=1\"\n"
+	       "  -m hz     sample driver telemetry at the given rate while running, and print it on exit (default 0=off)\n"
+	       "  -c ms     track in position mode with the given XTARGET update cadence (default 0=velocity mode)\n"
+	       "  -s hz     SPI clock, 0 to calibrate on open (default %u)\n"
+	       "  device    SPI device (default %s)\n"
+	       "Set environment variable PIMOCO_EMULATOR to run against the software TMC5160 emulator.\n",
+	       prog, Stepper::defaultSPIMaxSpeedHz, Stepper::defaultSPIDevice);
+	exit(-1);
+}
+
+int main(int argc, char ** argv) {
+	bool doExercise=false;
+	bool doReopen=false;
+	uint32_t numPolls=1000;
+	const char *traceFile=NULL;
+	const char *profileFields=NULL;
+	uint32_t telemetryRate=0;
+	uint32_t trackingCadence=0;
+	uint32_t spiSpeed=Stepper::defaultSPIMaxSpeedHz;
+	const char *goToTracePrefix=NULL;
+	const int maxGoToTraceChecks=64;
+	const char *goToTraceChecks[maxGoToTraceChecks];
+	int numGoToTraceChecks=0;
+	int opt;
+	while((opt=getopt(argc, argv, "xg:v:rn:t:p:m:c:s:h"))!=-1) {
+		switch(opt) {
+			case 'x': doExercise=true; break;
+			case 'g': goToTracePrefix=optarg; break;
+			case 'v': if(numGoToTraceChecks<maxGoToTraceChecks) goToTraceChecks[numGoToTraceChecks++]=optarg; break;
+			case 'r': doReopen=true; break;
+			case 'n': numPolls=(uint32_t) atoi(optarg); break;
+			case 't': traceFile=optarg; break;
+			case 'p': profileFields=optarg; break;
+			case 'm': telemetryRate=(uint32_t) atoi(optarg); break;
+			case 'c': trackingCadence=(uint32_t) atoi(optarg); break;
+			case 's': spiSpeed=(uint32_t) atoi(optarg); break;
+			default:  usage(argv[0]);
+		}
+	}
+	const char *device=(optind<argc) ? argv[optind] : Stepper::defaultSPIDevice;
+
+	// checking saved go-to traces needs no device
+	if(numGoToTraceChecks>0) {
+		static GoToTrace trace;
+		int numFailed=0;
+		for(int i=0; i<numGoToTraceChecks; i++)
+			if(!loadGoToTrace(goToTraceChecks[i], &trace)) {
+				printf("%s: unable to load go-to trace\n", goToTraceChecks[i]);
+				numFailed++;
+			} else if(!checkGoToTrace(trace, goToTraceChecks[i]))
+				numFailed++;
+		printf("%d of %d go-to traces within tolerance\n", numGoToTraceChecks-numFailed, numGoToTraceChecks);
+		return numFailed>0 ? 1 : 0;
+	}
+
+	puts("Starting up...");
+
+	setlocale(LC_ALL, ""); // for thousands separator
+	Stepper stepper("Pimoco test", "Test");
+	if(!stepper.setTelemetryRate(telemetryRate))
+		panicf("Error setting telemetry rate %u Hz\n", telemetryRate);
+	if(!stepper.setTrackingCadence(trackingCadence))
+		panicf("Error setting tracking cadence %u ms\n", trackingCadence);
+	if(!stepper.setSPISpeedSetting(spiSpeed))
+		panicf("Error setting SPI clock %u Hz\n", spiSpeed);
+
+	Timestamp start;
+	if(!stepper.open(device))
+		panicf("Error opening device %s\n", device);
+	Timestamp end;
+	printf("Opened %s device %s\n", stepper.isHardware() ? "hardware" : "emulated", device);
+
+	// WiringPi uses crystal osciallator running at 19.2 MHz for void gpioClockSet (int pin, int freq). 
+	// See https://github.com/WiringPi/WiringPi/blob/master/wiringPi/wiringPi.c
+	// TMC5160 needs 8..10-16 MHz, see section 26.2.1 in https://www.trinamic.com/fileadmin/assets/Products/ICs_Documents/TMC5160A_Datasheet_Rev1.14.pdf 
+	// To have an exact frequency based on an integer divider of two, we choose 9.6 MHz. The emulator runs on its own clock
+	if(!stepper.setClockHz(stepper.isHardware() ? 9600000 : TMC5160Emulator::defaultClockHz))
+		panicf("Error setting clock frequency\n");
+	printAndResetStats(&stepper, "open", 1, end.usSince(start));
+
+	if(doReopen) {
+		Timestamp reopenStart;
+		if(!stepper.close() || !stepper.open(device))
+			panicf("Error reopening device %s\n", device);
+		Timestamp reopenEnd;
+		printAndResetStats(&stepper, "reopen", 1, reopenEnd.usSince(reopenStart));
+	}
+
+	if(profileFields!=NULL) {
+		Timestamp profileStart;
+		if(!stepper.setProfile("custom", profileFields))
+			panicf("Error setting register profile %s", profileFields);
+		Timestamp profileEnd;
+		printAndResetStats(&stepper, "setProfile", 1, profileEnd.usSince(profileStart));
+	}
+
 	getAndPrintState(&stepper);
+	benchmark(&stepper, numPolls);
+	if(doExercise)
+		exercise(&stepper, goToTracePrefix);
+
+	if(telemetryRate>0)
+		printTelemetry(&stepper);
+
+	if(traceFile!=NULL) {
+		if(!stepper.getTrace().save(traceFile))
+			panicf("Error saving SPI trace to %s", traceFile);
+		printf("Saved SPI trace to %s, %'llu datagrams recorded in total\n", traceFile, (unsigned long long) stepper.getTrace().size());
+	}
 
 	puts("Exiting...");
 	return 0;
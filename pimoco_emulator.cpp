@@ -0,0 +1,338 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "pimoco_emulator.h"
+#include <string.h>  // for memset, memcpy
+#include <math.h>    // for fabs, llround
+#include <time.h>    // for clock_gettime
+#include <stdio.h>   // for fopen etc.
+#include <stdlib.h>  // for getenv
+
+
+const uint32_t TMC5160Emulator::defaultClockHz=10000000;
+const uint32_t TMC5160Emulator::defaultMaxSpeedHz=10000000;
+const double   TMC5160Emulator::maxStepSeconds=0.001;
+
+
+TMC5160Emulator::TMC5160Emulator(uint32_t theClockHz) : isOpened(false), clockHz(theClockHz), speedHz(0), maxSpeedHz(defaultMaxSpeedHz), brownoutAt(-1) {
+	stateFileName[0]=0;
+	reset();
+}
+
+void TMC5160Emulator::reset() {
+	memset(registers, 0, sizeof(registers));
+	registers[TMC5160::TMCR_GSTAT]   =0x00000001;  // reset flag
+	registers[TMC5160::TMCR_CHOPCONF]=0x10410150;  // power-on defaults per datasheet
+	registers[TMC5160::TMCR_PWMCONF] =0xC40C001E;
+	pendingData=0;
+	position=0;
+	speed=0;
+	zeroWait=0;
+	lastUpdate=-1;
+}
+
+bool TMC5160Emulator::open(const char *deviceName) {
+	// state file name is the prefix followed by the device name with slashes replaced, e.g. /tmp/emu_dev_spidev0.0
+	const char *prefix=getenv("PIMOCO_EMULATOR_STATE");
+	stateFileName[0]=0;
+	if(prefix!=NULL) {
+		int len=snprintf(stateFileName, sizeof(stateFileName), "%s", prefix);
+		for(const char *c=deviceName; *c && len<(int) sizeof(stateFileName)-1; c++)
+			stateFileName[len++]=(*c=='/') ? '_' : *c;
+		stateFileName[len]=0;
+		loadState();
+	}
+	isOpened=true;
+	lastUpdate=-1;
+
+	const char *brownout=getenv("PIMOCO_EMULATOR_BROWNOUT");
+	brownoutAt=-1;
+	if(brownout!=NULL) {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		brownoutAt=ts.tv_sec + 1e-9*ts.tv_nsec + atof(brownout);
+	}
+	return true;
+}
+
+bool TMC5160Emulator::close() {
+	advanceToNow();
+	saveState();
+	isOpened=false;
+	return true;
+}
+
+bool TMC5160Emulator::loadState() {
+	if(stateFileName[0]==0)
+		return false;
+	FILE *f=fopen(stateFileName, "rb");
+	if(f==NULL)
+		return false;
+	uint32_t regs[TMC5160::TMCR_NUM_REGISTERS];
+	double pos;
+	bool res=fread(regs, sizeof(regs), 1, f)==1 && fread(&pos, sizeof(pos), 1, f)==1;
+	fclose(f);
+	if(!res)
+		return false;
+	memcpy(registers, regs, sizeof(registers));
+	position=pos;
+	speed=0;  // motion stopped by the driver on close
+	return true;
+}
+
+bool TMC5160Emulator::saveState() {
+	if(stateFileName[0]==0)
+		return false;
+	FILE *f=fopen(stateFileName, "wb");
+	if(f==NULL)
+		return false;
+	bool res=fwrite(registers, sizeof(registers), 1, f)==1 && fwrite(&position, sizeof(position), 1, f)==1;
+	return (fclose(f)==0) && res;
+}
+
+bool TMC5160Emulator::transfer(const uint8_t *tx, uint8_t *rx, uint32_t frameLen, uint32_t numFrames) {
+	if(!isOpened || frameLen!=5)
+		return false;
+	advanceToNow();
+	for(uint32_t i=0; i<numFrames; i++)
+		transferFrame(tx+i*frameLen, rx+i*frameLen);
+	return true;
+}
+
+bool TMC5160Emulator::transfer(const SPIFrame *frames, uint32_t numFrames) {
+	if(!isOpened)
+		return false;
+	for(uint32_t i=0; i<numFrames; i++)
+		if(frames[i].len!=5)
+			return false;  // TMC5160 datagrams are 40 bits
+	advanceToNow();
+	for(uint32_t i=0; i<numFrames; i++)
+		transferFrame(frames[i].tx, frames[i].rx);
+	return true;
+}
+
+void TMC5160Emulator::transferFrame(const uint8_t *tx, uint8_t *rx) {
+	// respond with status and the data requested by the previous datagram
+	rx[0]=getStatusByte();
+	rx[1]=(uint8_t) (pendingData>>24);
+	rx[2]=(uint8_t) (pendingData>>16);
+	rx[3]=(uint8_t) (pendingData>> 8);
+	rx[4]=(uint8_t) (pendingData    );
+	if(speedHz>maxSpeedHz)
+		rx[4]^=0x01;  // bit error on the MISO line
+
+	uint8_t  address=tx[0] & (TMC5160::TMCR_NUM_REGISTERS-1);
+	uint32_t value=(((uint32_t) tx[1])<<24) | (((uint32_t) tx[2])<<16) | (((uint32_t) tx[3])<<8) | ((uint32_t) tx[4]);
+	if(tx[0] & 0x80) {
+		writeRegister(address, value);
+		pendingData=value;  // writes echo the written data
+	} else
+		pendingData=readRegister(address);
+}
+
+uint32_t TMC5160Emulator::readRegister(uint8_t address) {
+	if(!TMC5160::canReadRegister(address))
+		return 0;
+
+	switch(address) {
+		case TMC5160::TMCR_IOIN:
+			return 0x30ul<<24;  // chip version
+
+		case TMC5160::TMCR_TSTEP: {
+			double s=fabs(speed);
+			double tstep=(s>0) ? clockHz/s : (double) ((1ul<<20)-1);
+			return tstep>(double) ((1ul<<20)-1) ? (1ul<<20)-1 : (uint32_t) tstep;
+		}
+
+		case TMC5160::TMCR_XACTUAL:
+			return (uint32_t) (int32_t) llround(position);
+
+		case TMC5160::TMCR_VACTUAL:
+			return ((uint32_t) (int32_t) llround(speed * (double) (1ul<<24) / clockHz)) & 0x00ffffff;
+
+		case TMC5160::TMCR_RAMP_STAT:
+			return TMC5160::TMCF_RAMP_STAT::extract(registers[TMC5160::TMCR_RAMP_STAT]);
+
+		case TMC5160::TMCR_DRV_STATUS: {
+			uint32_t drv=0;
+			uint32_t ihold=TMC5160::TMCF_IHOLD::extract(registers[TMC5160::TMCR_IHOLD_IRUN]);
+			uint32_t irun =TMC5160::TMCF_IRUN ::extract(registers[TMC5160::TMCR_IHOLD_IRUN]);
+			drv=TMC5160::TMCF_STST     ::insert(drv, speed==0);
+			drv=TMC5160::TMCF_CS_ACTUAL::insert(drv, speed==0 ? ihold : irun);
+			drv|=(speed==0 ? 0 : 200);                                // SG_RESULT
+			return drv;
+		}
+
+		case TMC5160::TMCR_PWM_SCALE:
+			return TMC5160::TMCF_EN_PWM_MODE::extract(registers[TMC5160::TMCR_GCONF]) && speed!=0 ? 0x00400040 : 0;
+
+		case TMC5160::TMCR_PWM_AUTO:
+			return TMC5160::TMCF_EN_PWM_MODE::extract(registers[TMC5160::TMCR_GCONF]) ? (14ul<<16) | 36 : 0;
+
+		default:
+			return registers[address];
+	}
+}
+
+void TMC5160Emulator::writeRegister(uint8_t address, uint32_t value) {
+	if(!TMC5160::canWriteRegister(address))
+		return;
+
+	switch(address) {
+		case TMC5160::TMCR_GSTAT:
+			registers[address]&=~value;  // write 1 to clear
+			break;
+
+		case TMC5160::TMCR_RAMP_STAT:
+			registers[address]&=~(value & TMC5160::RAMP_EVENTS_LATCHED);  // write 1 to clear event flags
+			break;
+
+		case TMC5160::TMCR_XACTUAL:
+			position=(int32_t) value;
+			registers[address]=value;
+			break;
+
+		default:
+			registers[address]=value;
+			break;
+	}
+}
+
+uint8_t TMC5160Emulator::getStatusByte() {
+	uint32_t rs=registers[TMC5160::TMCR_RAMP_STAT];
+	uint8_t status=registers[TMC5160::TMCR_GSTAT] & 0x03;  // reset, driver error
+	if(speed==0)
+		status|=TMC5160::TMC_STAND_STILL;
+	if(TMC5160::TMCF_VELOCITY_REACHED::extract(rs))
+		status|=TMC5160::TMC_VELOCITY_REACHED;
+	if(TMC5160::TMCF_POSITION_REACHED::extract(rs))
+		status|=TMC5160::TMC_POSITION_REACHED;
+	return status;
+}
+
+void TMC5160Emulator::advanceToNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	double now=ts.tv_sec + 1e-9*ts.tv_nsec;
+	if(lastUpdate>=0 && now>lastUpdate)
+		advance(now-lastUpdate);
+	lastUpdate=now;
+	if(brownoutAt>=0 && now>=brownoutAt) {
+		brownoutAt=-1;
+		reset();
+		lastUpdate=now;
+	}
+}
+
+double TMC5160Emulator::decelerationDistance(double s) {
+	double dmax =accelerationFromNative(registers[TMC5160::TMCR_DMAX]);
+	double d1   =accelerationFromNative(registers[TMC5160::TMCR_D1]);
+	double v1   =velocityFromNative(registers[TMC5160::TMCR_V1]);
+	double vstop=velocityFromNative(registers[TMC5160::TMCR_VSTOP]);
+	if(dmax<=0 || s<=vstop)
+		return 0;
+	if(v1<=0 || d1<=0 || s<=v1)
+		return (s*s-vstop*vstop)/(2*(v1>0 && d1>0 ? d1 : dmax));
+	if(vstop>=v1)
+		return (s*s-vstop*vstop)/(2*dmax);
+	return (s*s-v1*v1)/(2*dmax) + (v1*v1-vstop*vstop)/(2*d1);
+}
+
+void TMC5160Emulator::advance(double seconds) {
+	uint32_t rampMode=TMC5160::TMCF_RAMPMODE::extract(registers[TMC5160::TMCR_RAMPMODE]);
+	double   vmax =velocityFromNative(registers[TMC5160::TMCR_VMAX]);
+	double   vstart=velocityFromNative(registers[TMC5160::TMCR_VSTART]);
+	double   vstop=velocityFromNative(registers[TMC5160::TMCR_VSTOP]);
+	double   v1   =velocityFromNative(registers[TMC5160::TMCR_V1]);
+	double   amax =accelerationFromNative(registers[TMC5160::TMCR_AMAX]);
+	double   dmax =accelerationFromNative(registers[TMC5160::TMCR_DMAX]);
+	double   a1   =accelerationFromNative(registers[TMC5160::TMCR_A1]);
+	double   d1   =accelerationFromNative(registers[TMC5160::TMCR_D1]);
+	double   target=(int32_t) registers[TMC5160::TMCR_XTARGET];
+	double   tzerowait=TMC5160::TMCF_TZEROWAIT::extract(registers[TMC5160::TMCR_TZEROWAIT])*512.0/clockHz;
+	uint32_t *rs=&registers[TMC5160::TMCR_RAMP_STAT];
+
+	while(seconds>0) {
+		double dt=seconds<maxStepSeconds ? seconds : maxStepSeconds;
+		seconds-=dt;
+
+		if(rampMode==0 && speed==0 && zeroWait>0) {
+			// positioning mode: stand still for TZEROWAIT after ramping down to zero
+			zeroWait-=dt;
+		} else if(rampMode==0) {
+			// positioning mode: trapezoidal ramp towards XTARGET, using A1/D1 below V1 and AMAX/DMAX above,
+			// starting from standstill at VSTART and stopping at the target from VSTOP
+			double dist=target-position;
+			double dir =(dist>=0) ? 1 : -1;
+			double s=speed*dir;  // speed towards target
+			double accel=(v1>0 && a1>0 && fabs(speed)<v1) ? a1 : amax;
+			double decel=(v1>0 && d1>0 && fabs(speed)<v1) ? d1 : dmax;
+			if(s==0 && dist!=0 && vstart>0)
+				s=(vstart<vmax) ? vstart : vmax;
+			if(s<0) {
+				s+=decel*dt;   // moving away from target, stop first
+				if(s>=0) {
+					s=0;
+					zeroWait=tzerowait;
+				}
+			} else if(decelerationDistance(s)>=fabs(dist) || s>vmax) {
+				s-=decel*dt;
+				if(s<vstop)
+					s=vstop;
+			} else {
+				s+=accel*dt;
+				if(s>vmax)
+					s=vmax;
+			}
+			speed=s*dir;
+			if(s>0 && s*dt>=fabs(dist)) {
+				position=target;
+				speed=0;
+				zeroWait=tzerowait;
+			} else
+				position+=speed*dt;
+		} else if(rampMode==1 || rampMode==2) {
+			// velocity mode: accelerate or decelerate towards +/-VMAX with AMAX
+			double v=(rampMode==1) ? vmax : -vmax;
+			zeroWait=0;
+			if(speed<v)
+				speed=(speed+amax*dt<v) ? speed+amax*dt : v;
+			else if(speed>v)
+				speed=(speed-amax*dt>v) ? speed-amax*dt : v;
+			position+=speed*dt;
+		} else {
+			// hold mode: keep current speed
+			zeroWait=0;
+			position+=speed*dt;
+		}
+
+		// wrap around like the 32-bit XACTUAL register
+		if(position>= 2147483648.0) position-=4294967296.0;
+		if(position< -2147483648.0) position+=4294967296.0;
+
+		// update ramp status flags, with a rising edge of position_reached in positioning mode triggering event_pos_reached
+		bool wasReached=TMC5160::TMCF_POSITION_REACHED::extract(*rs)!=0;
+		bool isReached =llround(position)==llround(target);
+		if(rampMode==0 && isReached && !wasReached)
+			*rs=TMC5160::TMCF_EVENT_POS_REACHED::insert(*rs, 1);
+		*rs=TMC5160::TMCF_VELOCITY_REACHED::insert(*rs, rampMode==0 ? (isReached || fabs(speed)==vmax) : (rampMode==3 || fabs(speed)==vmax));
+		*rs=TMC5160::TMCF_POSITION_REACHED::insert(*rs, isReached);
+		*rs=TMC5160::TMCF_VZERO           ::insert(*rs, speed==0);
+	}
+	registers[TMC5160::TMCR_XACTUAL]=(uint32_t) (int32_t) llround(position);
+}
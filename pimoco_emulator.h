@@ -0,0 +1,129 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef PIMOCO_EMULATOR_H
+#define PIMOCO_EMULATOR_H
+
+#include "pimoco_tmc5160.h"
+
+// A software emulation of a TMC5160 stepper driver, usable as SPI backend without physical hardware.
+// Models the register file and access modes, the status byte, the one-datagram read latency
+// and a simplified ramp generator running in real time, with VSTART, A1/V1/AMAX, DMAX/D1, VSTOP and TZEROWAIT in positioning mode. If environment variable PIMOCO_EMULATOR_STATE is set,
+// the register file and position persist in a file with this prefix across close() and open(), emulating a
+// device which stays powered while the driver restarts. If environment variable PIMOCO_EMULATOR_BROWNOUT is set, the device
+// resets to power-on state once, the given number of seconds after open(), emulating a brownout during a session.
+class TMC5160Emulator : public SPIBackend {
+public:
+	// Creates an emulated TMC5160 running at the given clock frequency, in power-on reset state
+	TMC5160Emulator(uint32_t theClockHz=defaultClockHz);
+
+	virtual bool open(const char *deviceName) override;
+	virtual bool close() override;
+	virtual bool isOpen() const override { return isOpened; }
+	virtual bool transfer(const uint8_t *tx, uint8_t *rx, uint32_t frameLen, uint32_t numFrames) override;
+	virtual bool transfer(const SPIFrame *frames, uint32_t numFrames) override;
+	virtual bool isHardware() const override { return false; }
+	virtual bool setSpeed(uint32_t hz) override { speedHz=hz; return true; }
+
+	// Resets the emulated device to power-on state
+	void reset();
+
+	// Advances the emulated ramp generator by the given amount of seconds
+	void advance(double seconds);
+
+protected:
+	// Processes a single datagram, returning the response to the previous one
+	void transferFrame(const uint8_t *tx, uint8_t *rx);
+
+	// Reads the given register as seen via SPI
+	uint32_t readRegister(uint8_t address);
+
+	// Writes the given register as seen via SPI
+	void writeRegister(uint8_t address, uint32_t value);
+
+	// Returns the status byte sent with each response
+	uint8_t getStatusByte();
+
+	// Advances the emulated ramp generator to the current system time
+	void advanceToNow();
+
+	// Loads registers and position from the state file, if any. Returns true if loaded, else false
+	bool loadState();
+
+	// Saves registers and position to the state file, if any. Returns true if saved, else false
+	bool saveState();
+
+	// Returns the distance in microsteps needed to decelerate from the given absolute speed in microsteps per second to VSTOP
+	double decelerationDistance(double speed);
+
+	// Converts a velocity register value in units of 2^24/f_clk to microsteps per second
+	double velocityFromNative(uint32_t v) const { return ((double) v) * clockHz / (double) (1ul<<24); }
+
+	// Converts an acceleration register value in units of 2^41/f_clk^2 to microsteps per second squared
+	double accelerationFromNative(uint32_t a) const { return ((double) a) * clockHz * clockHz / (double) (1ull<<41); }
+
+	// Flag: device has been opened
+	bool isOpened;
+
+	// Emulated clock frequency in Hz
+	double clockHz;
+
+	// SPI clock speed in Hz. Responses are corrupted above maxSpeedHz, emulating signal integrity limits
+	uint32_t speedHz;
+
+	// Highest SPI clock speed in Hz with reliable transfers
+	uint32_t maxSpeedHz;
+
+	// Register file, as last written via SPI
+	uint32_t registers[TMC5160::TMCR_NUM_REGISTERS];
+
+	// Data returned with the next datagram, per the one-datagram read latency
+	uint32_t pendingData;
+
+	// Actual position in microsteps, with subsample resolution
+	double position;
+
+	// Actual speed in microsteps per second
+	double speed;
+
+	// Remaining standstill in seconds before the ramp generator may start moving again, per TZEROWAIT
+	double zeroWait;
+
+	// Monotonic time of the last ramp generator update in seconds, negative if none
+	double lastUpdate;
+
+	// Monotonic time of the emulated brownout in seconds, negative if none
+	double brownoutAt;
+
+	// Name of the file persisting the emulated device state, empty if none
+	char stateFileName[256];
+
+	// Maximum simulation step in seconds
+	static const double maxStepSeconds;
+
+public:
+	// Default clock frequency in Hz
+	static const uint32_t defaultClockHz;
+
+	// Default highest SPI clock speed in Hz with reliable transfers
+	static const uint32_t defaultMaxSpeedHz;
+};
+
+#endif // PIMOCO_EMULATOR_H
@@ -24,44 +24,12 @@
 #define CDRIVER_VERSION_MINOR	0
 
 
-// Singleton instance
-PimocoFocuser focuser;
-
-// C function interface redirecting to singleton
-//
-extern "C" {
-
-void ISGetProperties(const char *dev) {
-	focuser.ISGetProperties(dev);
-}
-
-void ISNewBLOB(const char *dev, const char *name, int sizes[], int blobsizes[], char *blobs[], char *formats[], char *names[], int n) {
-	focuser.ISNewBLOB(dev, name, sizes, blobsizes, blobs, formats, names, n);
-}
-
-void ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n) {
-	focuser.ISNewNumber(dev, name, values, names, n);
-}
-
-void ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n) {
-	focuser.ISNewSwitch(dev, name, states, names, n);
-}
-
-void ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n) {
-	focuser.ISNewText(dev, name, texts, names, n);
-}
-
-void ISSnoopDevice(XMLEle *root) {
-	focuser.ISSnoopDevice(root);
-}
-
-} // extern "C"
-
-
 // Public class members
 //
 
-PimocoFocuser::PimocoFocuser() : stepper(getDeviceName(), "Focuser", FOCUSER_DIAG0_PIN), spiDeviceFilename("/dev/spidev0.2") {
+PimocoFocuser::PimocoFocuser(const char *theDefaultName, const char *theSPIDeviceFilename, int theDiag0Pin, const char *theAxisName) 
+	: stepper(getDeviceName(), theAxisName, theDiag0Pin), spiDeviceFilename(theSPIDeviceFilename), defaultName(theDefaultName) {
+	stepper.setBusPriority(SPIArbiter::PRIORITY_LOW);  // focuser polls and init bursts yield the shared bus to the mount
 	setVersion(CDRIVER_VERSION_MAJOR, CDRIVER_VERSION_MINOR);
     FI::SetCapability(FOCUSER_CAN_ABS_MOVE | FOCUSER_CAN_REL_MOVE | FOCUSER_CAN_ABORT | 
     	              // FOCUSER_CAN_REVERSE  |        // superseded by stepper class controls which serve both mount and focuser 
@@ -69,6 +37,9 @@ PimocoFocuser::PimocoFocuser() : stepper(getDeviceName(), "Focuser", FOCUSER_DIA
     	              // | FOCUSER_HAS_VARIABLE_SPEED  // superseded by stepper class controls which serve both mount and focuser      
     	              0);	
 	setSupportedConnections(CONNECTION_NONE);
+
+	stepper.subscribeRampEvents(Stepper::RAMP_EVENT_POSITION_REACHED | Stepper::RAMP_EVENTS_STOP,
+	                            [this](enum Stepper::TMCRampEvent event, uint64_t /* timestampNs */) { moveEvents|=event; });
 }
 
 PimocoFocuser::~PimocoFocuser() {
@@ -76,7 +47,7 @@ PimocoFocuser::~PimocoFocuser() {
 }
 
 const char *PimocoFocuser::getDefaultName() {
-	return "Pimoco focuser";
+	return defaultName;
 }
 
 bool PimocoFocuser::initProperties() {
@@ -86,13 +57,16 @@ bool PimocoFocuser::initProperties() {
 	FocusMaxPosN[0].max=2000000000;
 	IUUpdateMinMax(&FocusMaxPosNP);
 
-	stepper.initProperties(MotorN, &MotorNP, MSwitchS, &MSwitchSP, RampN, &RampNP, 
-						   "MOTOR", "Motor", "SWITCHES", "Switches", "RAMP", "Ramp", FOCUS_TAB);
+	stepper.initProperties(MotorN, &MotorNP, MSwitchS, &MSwitchSP, RampN, &RampNP, ProfileT, &ProfileTP, TuneN, &TuneNP, TelemetryN, &TelemetryNP,
+						   "MOTOR", "Motor", "SWITCHES", "Switches", "RAMP", "Ramp", "PROFILE", "Register profile", "TUNE", "StealthChop tuning",
+						   "TELEMETRY", "Driver telemetry", FOCUS_TAB);
 
 	// load configuration data from file, as there is no device with own storage
 	loadConfig(true, MotorNP.name);
 	loadConfig(true, MSwitchSP.name);
 	loadConfig(true, RampNP.name);
+	loadConfig(true, ProfileTP.name);
+	loadConfig(true, TuneNP.name);
 
     addDebugControl();
     return true;
@@ -102,11 +76,12 @@ bool PimocoFocuser::updateProperties() {
 	if(!INDI::Focuser::updateProperties())
 		return false;
 
-	if(!stepper.updateProperties(this, MotorN, &MotorNP, MSwitchS, &MSwitchSP, RampN, &RampNP))
+	if(!stepper.updateProperties(this, MotorN, &MotorNP, MSwitchS, &MSwitchSP, RampN, &RampNP, ProfileT, &ProfileTP, TuneN, &TuneNP, TelemetryN, &TelemetryNP))
 		return false;
 
 	if(isConnected()) {
-		// ...
+		// persist tuning results obtained on connect
+		saveConfig(true, TuneNP.name);
 	} else {
 		// ...
 	}
@@ -139,9 +114,10 @@ bool PimocoFocuser::ISNewNumber(const char *dev, const char *name, double values
 		return INDI::Focuser::ISNewNumber(dev, name, values, names, n);
 
 	int res;
-	if((res=stepper.ISNewNumber(&MotorNP, &RampNP, name, values, names, n)) > 0) {
+	if((res=stepper.ISNewNumber(&MotorNP, &RampNP, &TuneNP, name, values, names, n)) > 0) {
 		saveConfig(true, MotorNP.name);
 		saveConfig(true, RampNP.name);
+		saveConfig(true, TuneNP.name);
 		return true;
 	} else if(res==0)
 		return false;
@@ -167,7 +143,12 @@ bool PimocoFocuser::ISNewText(const char *dev, const char *name, char *texts[],
 	if(dev==NULL || strcmp(dev,getDeviceName()))
 		return INDI::Focuser::ISNewText(dev, name, texts, names, n);
 
-    // if(strcmp(name, ...)) { } else
+	int res;
+	if((res=stepper.ISNewText(&ProfileTP, &RampNP, name, texts, names, n)) >0) {
+		saveConfig(true, ProfileTP.name);
+		return true;
+	} else if(res==0)
+		return false;
 
 	return INDI::Focuser::ISNewText(dev, name, texts, names, n);
 }
@@ -182,6 +163,8 @@ bool PimocoFocuser::saveConfigItems(FILE *fp){
     IUSaveConfigNumber(fp, &MotorNP);
     IUSaveConfigSwitch(fp, &MSwitchSP);
     IUSaveConfigNumber(fp, &RampNP);
+    IUSaveConfigText(fp, &ProfileTP);
+    IUSaveConfigNumber(fp, &TuneNP);
 
     return true;
 }
@@ -224,24 +207,35 @@ void PimocoFocuser::TimerHit() {
 		return;
 
 	ReadFocuserStatus();
+	stepper.checkRecovery(&MotorNP);
+	stepper.updateTelemetry(&TelemetryNP);
 
     SetTimer(getCurrentPollingPeriod());
 }
 
 
 bool PimocoFocuser::ReadFocuserStatus() {
-	auto pos=0;
-	if(!stepper.getPosition(&pos)) {
+	// retrieve position, speed and status flags with one pipelined exchange
+	Stepper::MotionStatus ms;
+	if(!stepper.getMotionStatus(&ms)) {
 		LOG_ERROR("Error reading position");
 	    FocusAbsPosNP.s = IPS_ALERT;
 	    return false;
 	} else {
-	    auto status=stepper.getStatus();
-	    if((FocusAbsPosNP.s==IPS_BUSY) && (status&Stepper::TMC_STAND_STILL))
-	    	LOGF_INFO("Focuser has reached position %u", pos);
+	    // moves complete on ramp events, which the status read above has dispatched if not done by an interrupt already
+	    auto pos=ms.position;
+	    uint32_t events=moveEvents.exchange(0);
+	    if(FocusAbsPosNP.s==IPS_BUSY) {
+	    	if(events & Stepper::RAMP_EVENTS_STOP) {
+	    		LOGF_ERROR("Focuser stopped unexpectedly at position %d", pos);
+	    		FocusAbsPosNP.s = IPS_ALERT;
+	    	} else if(events & Stepper::RAMP_EVENT_POSITION_REACHED) {
+	    		LOGF_INFO("Focuser has reached position %u", pos);
+	    		FocusAbsPosNP.s = IPS_OK;
+	    	}
+	    }
 
 	    FocusAbsPosN[0].value = pos;
-	    FocusAbsPosNP.s = (status & Stepper::TMC_STAND_STILL) ? IPS_OK : IPS_BUSY;
 	    FocusRelPosNP.s = FocusAbsPosNP.s;
 	    IDSetNumber(&FocusAbsPosNP, NULL);		
 	    IDSetNumber(&FocusRelPosNP, NULL);		
@@ -251,6 +245,7 @@ bool PimocoFocuser::ReadFocuserStatus() {
 
 
 IPState PimocoFocuser::MoveAbsFocuser(uint32_t targetTicks) {
+	moveEvents=0;
 	if(!stepper.setTargetPosition(targetTicks)) {
 		LOG_ERROR("Error setting focuser target position");
 		return IPS_ALERT;
@@ -267,6 +262,7 @@ IPState PimocoFocuser::MoveRelFocuser(FocusDirection dir, uint32_t ticks) {
 
 	int32_t targetPos=(dir==FOCUS_OUTWARD) ? pos + ticks : pos - ticks;
 	LOGF_INFO("Focuser is moving by %c%u to target position %u", (dir==FOCUS_OUTWARD)?'+':'-', ticks, targetPos);
+	moveEvents=0;
 	if(!stepper.setTargetPosition(targetPos)) {
 		LOG_ERROR("Error setting focuser target position");
 		return IPS_ALERT;
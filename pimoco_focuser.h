@@ -22,13 +22,16 @@
 #define PIMOCO_FOCUSER_H
 
 #include <libindi/indifocuser.h>
+#include <atomic>
 #include "pimoco_stepper.h"
 
 // Indi class for pimoco focusers
 class PimocoFocuser : public INDI::Focuser {
 public:
-	// Creates a Pimoco focuser
-	PimocoFocuser();
+	// Creates a Pimoco focuser with the given default INDI device name, SPI device and physical Diag0 pin number, or -1 to poll without interrupts.
+	// The axis name identifies the focuser in log messages and GPIO consumer labels, and must be distinct per instance
+	PimocoFocuser(const char *theDefaultName="Pimoco focuser", const char *theSPIDeviceFilename="/dev/spidev0.2", int theDiag0Pin=FOCUSER_DIAG0_PIN,
+	              const char *theAxisName="Focuser");
 
 	// Destroys this pimoco focuser. Stops device motion for safety's sake
 	~PimocoFocuser();
@@ -66,8 +69,14 @@ protected:
 
 	Stepper stepper;
 
+    // Ramp events relevant to the current move, accumulated on the I/O worker thread until the next status update
+    std::atomic<uint32_t> moveEvents{0};
+
     const char *spiDeviceFilename;
 
+    // Default INDI device name
+    const char *defaultName;
+
     // Physical connector GPIO pin numbers for stepper DIAG0 lines
     enum { FOCUSER_DIAG0_PIN = 38 };
 
@@ -83,6 +92,15 @@ protected:
     INumber RampN[Stepper::RAMPN_SIZE]={};
     INumberVectorProperty RampNP;
 
+    IText ProfileT[Stepper::PROFILET_SIZE]={};
+    ITextVectorProperty ProfileTP;
+
+    INumber TuneN[Stepper::TUNEN_SIZE]={};
+    INumberVectorProperty TuneNP;
+
+    INumber TelemetryN[Stepper::TELEMETRYN_SIZE]={};
+    INumberVectorProperty TelemetryNP;
+
 };
 
 #endif // PIMOCO_FOCUSER_H
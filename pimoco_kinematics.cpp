@@ -0,0 +1,114 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "pimoco_kinematics.h"
+#include <math.h>     // for floor, fabs, isnan
+#include <numeric>    // for std::gcd
+
+
+const long double Kinematics::unitsPerRev[Kinematics::NUM_UNITS]={ 2.0L*3.141592653589793238462643383279502884L, 360.0L, 24.0L, 360.0L*60.0L*60.0L };
+
+
+Kinematics::Kinematics() {
+	clear();
+}
+
+
+void Kinematics::clear() {
+	ustepsPerRevNum=0;
+	ustepsPerRevDen=1;
+	for(int u=0; u<NUM_UNITS; u++)
+		nativePerUnit[u]=unitsPerNative[u]=0;
+	speedPerArcsecPerSec=arcsecPerSecPerSpeed=0;
+}
+
+
+bool Kinematics::update(uint32_t microsteps, double stepsPerRev, double gearRatio, uint32_t clockHz) {
+	clear();
+
+	uint64_t stepsNum, stepsDen, gearNum, gearDen;
+	if(microsteps==0 || !toFraction(stepsPerRev, &stepsNum, &stepsDen) || !toFraction(gearRatio, &gearNum, &gearDen))
+		return false;
+
+	// reduce crosswise before multiplying to keep the product small. Realistic settings fit comfortably into 64 bits
+	uint64_t g=std::gcd(stepsNum, gearDen);
+	stepsNum/=g; gearDen/=g;
+	g=std::gcd(gearNum, stepsDen);
+	gearNum/=g; stepsDen/=g;
+	g=std::gcd((uint64_t) microsteps, stepsDen*gearDen);
+	ustepsPerRevNum=(microsteps/g)*stepsNum*gearNum;
+	ustepsPerRevDen=(stepsDen*gearDen)/g;
+
+	// derive each scale factor from the exact fraction in extended precision, rounding once
+	long double ustepsPerRev=(long double) ustepsPerRevNum / (long double) ustepsPerRevDen;
+	for(int u=0; u<NUM_UNITS; u++) {
+		nativePerUnit[u] =(double) (ustepsPerRev / unitsPerRev[u]);
+		unitsPerNative[u]=(double) (unitsPerRev[u] / ustepsPerRev);
+	}
+
+	if(clockHz==0)
+		return false;
+	long double speedScale=ustepsPerRev * (long double) (1ul<<24) / (unitsPerRev[UNIT_ARCSECS] * (long double) clockHz);
+	speedPerArcsecPerSec=(double) speedScale;
+	arcsecPerSecPerSpeed=(double) (1.0L/speedScale);
+	return true;
+}
+
+
+int32_t Kinematics::roundToInt32(double value) {
+	if(isnan(value))
+		return 0;
+	double r=floor(fabs(value)+0.5);
+	if(r>(double) INT32_MAX)
+		r=(double) INT32_MAX;
+	return (int32_t) (value<0 ? -r : r);
+}
+
+
+bool Kinematics::toFraction(double value, uint64_t *num, uint64_t *den) {
+	if(!(value>0) || value>=(double) (1ull<<32))
+		return false;
+
+	// convergents h/k of the continued fraction expansion, stopping before the denominator bound is exceeded
+	uint64_t h0=0, h1=1, k0=1, k1=0;
+	long double x=value;
+	for(int i=0; i<64; i++) {
+		uint64_t a=(uint64_t) floorl(x);
+		uint64_t h2=a*h1+h0, k2=a*k1+k0;
+		if(k2>MAX_DENOMINATOR) {
+			// the largest semiconvergent within the bound can be closer than the last convergent
+			uint64_t s=(MAX_DENOMINATOR-k0)/k1, hs=s*h1+h0, ks=s*k1+k0;
+			if(s>0 && fabsl((long double) value-(long double) hs/ks) < fabsl((long double) value-(long double) h1/k1)) {
+				h1=hs;
+				k1=ks;
+			}
+			break;
+		}
+		h0=h1; h1=h2;
+		k0=k1; k1=k2;
+		long double frac=x-(long double) a;
+		if(frac<1e-12L)
+			break;
+		x=1.0L/frac;
+	}
+	if(h1==0)
+		return false;
+	*num=h1;
+	*den=k1;
+	return true;
+}
@@ -0,0 +1,104 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef PIMOCO_KINEMATICS_H
+#define PIMOCO_KINEMATICS_H
+
+#include <stdint.h>
+
+// Conversion between native microstep positions and speeds of one axis and physical units of the controlled object.
+// Microsteps per revolution are kept as an exact reduced fraction. Scale factors for each unit are derived from it once
+// with a single rounding when the motor settings change, so conversions on the control path are one multiplication each.
+class Kinematics {
+public:
+	// Physical units for a full revolution of the controlled object
+	enum Unit : int {
+		UNIT_RADIANS = 0,  // 2*pi per revolution
+		UNIT_DEGREES = 1,  // 360 per revolution
+		UNIT_HOURS   = 2,  // 24 per revolution
+		UNIT_ARCSECS = 3,  // 1296000 per revolution
+		NUM_UNITS    = 4
+	};
+
+	enum {
+		MAX_DENOMINATOR = 1<<16  // largest denominator used to represent non-integer motor settings as fractions
+	};
+
+	// Creates an invalid model. All conversions return 0 until updated
+	Kinematics();
+
+	// Rebuilds the model from microsteps per full step, full steps per motor revolution, the gear ratio 1:x and the chip clock in Hz.
+	// Non-integer steps per revolution and gear ratios are represented by the closest fraction with a denominator of at most MAX_DENOMINATOR.
+	// A zero clock leaves speed conversions invalid. Returns true if positions and speeds are valid, else false
+	bool update(uint32_t microsteps, double stepsPerRev, double gearRatio, uint32_t clockHz);
+
+	// Returns true if position conversions are valid, else false
+	bool isValid() const { return ustepsPerRevNum!=0; }
+
+	// Returns true if speed conversions are valid, else false
+	bool isSpeedValid() const { return speedPerArcsecPerSec!=0; }
+
+	// Returns the numerator of microsteps per revolution of the controlled object, as reduced fraction. 0 if invalid
+	uint64_t getUstepsPerRevNumerator() const { return ustepsPerRevNum; }
+
+	// Returns the denominator of microsteps per revolution of the controlled object, as reduced fraction. Never 0
+	uint64_t getUstepsPerRevDenominator() const { return ustepsPerRevDen; }
+
+	// Converts the given value in the given unit to native microsteps, rounded to nearest
+	int32_t toNative(double value, enum Unit unit) const { return roundToInt32(value*nativePerUnit[unit]); }
+
+	// Converts the given native microsteps to the given unit
+	double fromNative(int32_t value, enum Unit unit) const { return value*unitsPerNative[unit]; }
+
+	// Converts the given speed in arcseconds per second of the controlled object to fractional microsteps per 2^24/f_clk
+	double speedFromArcsecPerSec(double arcsecPerSec) const { return arcsecPerSec*speedPerArcsecPerSec; }
+
+	// Converts the given speed in fractional microsteps per 2^24/f_clk to arcseconds per second of the controlled object
+	double speedToArcsecPerSec(double speed) const { return speed*arcsecPerSecPerSpeed; }
+
+protected:
+	// Returns the given value rounded to nearest, with halves away from zero, saturated to the int32_t range. NaN yields 0
+	static int32_t roundToInt32(double value);
+
+	// Represents the given positive value as the closest fraction with a denominator of at most MAX_DENOMINATOR, choosing
+	// between the last convergent of its continued fraction and the largest semiconvergent within the bound. Integers are
+	// represented exactly. Returns true on success, else false
+	static bool toFraction(double value, uint64_t *num, uint64_t *den);
+
+	// Invalidates all conversions
+	void clear();
+
+	// Microsteps per revolution of the controlled object, as reduced fraction
+	uint64_t ustepsPerRevNum, ustepsPerRevDen;
+
+	// Native microsteps per unit, per unit
+	double nativePerUnit[NUM_UNITS];
+
+	// Units per native microstep, per unit
+	double unitsPerNative[NUM_UNITS];
+
+	// Fractional microsteps per 2^24/f_clk per arcsecond per second, and its inverse
+	double speedPerArcsecPerSec, arcsecPerSecPerSpeed;
+
+	// Units per full revolution, per unit
+	static const long double unitsPerRev[NUM_UNITS];
+};
+
+#endif // PIMOCO_KINEMATICS_H
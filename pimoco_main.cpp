@@ -0,0 +1,81 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "pimoco_mount.h"
+#include "pimoco_focuser.h"
+#include <string.h>  // for strcmp
+
+
+// Devices hosted in a single driver process. They share one GPIO initialization and one I/O worker per SPI bus,
+// so their traffic is serialized in-process without cross-process bus arbitration, and all polling timers
+// run on the same INDI event loop
+PimocoMount mount;
+
+// Focusers and further stepper axes. Axes without a Diag0 line use -1 and are polled
+PimocoFocuser focusers[]={
+	{ },                                                        // default focuser on /dev/spidev0.2
+	{ "Pimoco focuser 2", "/dev/spidev0.3", -1, "Focuser 2" },  // fourth chip select, requires the spi0-4cs overlay
+};
+
+
+// Returns true if a request for the given device name addresses the given device. NULL addresses all devices.
+// Devices answer to their default name until INDI assigns one
+template<class D> static bool addresses(const char *dev, D *device) {
+	const char *name=(*device->getDeviceName()) ? device->getDeviceName() : device->getDefaultName();
+	return dev==NULL || !strcmp(dev, name);
+}
+
+// Invokes the given callable on each hosted device addressed by the given device name
+template<class F> static void forEachDevice(const char *dev, F f) {
+	if(addresses(dev, &mount))
+		f(&mount);
+	for(auto &focuser : focusers)
+		if(addresses(dev, &focuser))
+			f(&focuser);
+}
+
+
+// C function interface dispatching to hosted devices by name
+//
+extern "C" {
+
+void ISGetProperties(const char *dev) {
+	forEachDevice(dev, [&](auto *device) { device->ISGetProperties(dev); });
+}
+
+void ISNewBLOB(const char *dev, const char *name, int sizes[], int blobsizes[], char *blobs[], char *formats[], char *names[], int n) {
+	forEachDevice(dev, [&](auto *device) { device->ISNewBLOB(dev, name, sizes, blobsizes, blobs, formats, names, n); });
+}
+
+void ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n) {
+	forEachDevice(dev, [&](auto *device) { device->ISNewNumber(dev, name, values, names, n); });
+}
+
+void ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n) {
+	forEachDevice(dev, [&](auto *device) { device->ISNewSwitch(dev, name, states, names, n); });
+}
+
+void ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n) {
+	forEachDevice(dev, [&](auto *device) { device->ISNewText(dev, name, texts, names, n); });
+}
+
+void ISSnoopDevice(XMLEle *root) {
+	forEachDevice(NULL, [&](auto *device) { device->ISSnoopDevice(root); });
+}
+
+} // extern "C"
@@ -26,9 +26,6 @@
 #define CDRIVER_VERSION_MINOR	0
 
 
-// Singleton instance
-PimocoMount mount;
-
 const double PimocoMount::trackRates[]={
     15.041067, // TRACK_SIDEREAL
     15.0,      // TRACK_SOLAR
@@ -57,37 +54,6 @@ const char *PimocoMount::HA_TAB="Hour angle";
 const char *PimocoMount::DEC_TAB="Declination";
 
 
-// C function interface redirecting to singleton
-//
-extern "C" {
-
-void ISGetProperties(const char *dev) {
-	mount.ISGetProperties(dev);
-}
-
-void ISNewBLOB(const char *dev, const char *name, int sizes[], int blobsizes[], char *blobs[], char *formats[], char *names[], int n) {
-	mount.ISNewBLOB(dev, name, sizes, blobsizes, blobs, formats, names, n);
-}
-
-void ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n) {
-	mount.ISNewNumber(dev, name, values, names, n);
-}
-
-void ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n) {
-	mount.ISNewSwitch(dev, name, states, names, n);
-}
-
-void ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n) {
-	mount.ISNewText(dev, name, texts, names, n);
-}
-
-void ISSnoopDevice(XMLEle *root) {
-	mount.ISSnoopDevice(root);
-}
-
-} // extern "C"
-
-
 // Public class members
 //
 
@@ -114,6 +80,10 @@ PimocoMount::PimocoMount() : stepperHA(getDeviceName(), "HA", HA_DIAG0_PIN), ste
 	setTelescopeConnection(CONNECTION_NONE);
 
     SetParkDataType(PARK_HA_DEC);
+
+    auto onStop=[this](enum Stepper::TMCRampEvent /* event */, uint64_t /* timestampNs */) { unplannedStop=true; };
+    stepperHA .subscribeRampEvents(Stepper::RAMP_EVENTS_STOP, onStop);
+    stepperDec.subscribeRampEvents(Stepper::RAMP_EVENTS_STOP, onStop);
 }
 
 PimocoMount::~PimocoMount() {
@@ -151,8 +121,8 @@ bool PimocoMount::Connect() {
 		return false;
 	}
 
-	// Restore park status. Must be performed after connection
-	if(isParked())
+	// Restore park status. Must be performed after connection. Not needed if both axes kept their position
+	if(isParked() && !(stepperHA.isWarmStart() && stepperDec.isWarmStart()))
 		SyncDeviceHADec(GetAxis1Park(), GetAxis2Park());
 
 	uint32_t pp=getPollingPeriod();
@@ -24,6 +24,7 @@
 #include <libindi/indicom.h>
 #include <libindi/inditelescope.h>
 #include <libindi/indiguiderinterface.h>
+#include <atomic>
 #include "pimoco_stepper.h"
 
 // Indi class for pimoco mounts
@@ -151,6 +152,10 @@ protected:
     // Returns true on success, false if the device coordniates are outside defined bounds 
     bool deviceFromEquatorial(double *deviceHA, double *deviceDec, double equRA, double equDec, TelescopePierSide equPS, double lst=-1);
 
+    // Predicts the remaining goto time in seconds from the given motion status of both axes, until the later of both arrives
+    // at its last commanded device target. Axes which have reached their target count as arrived. Returns -1 on failure
+    double predictGotoSeconds(const Stepper::MotionStatus &statusHA, const Stepper::MotionStatus &statusDec);
+
     // Converts equatorial coordinates to device coordinates. If Julian date below zero is given, uses current time.
     void horizonFromEquatorial(double *horAlt, double *horAz, double eqRA, double eqDec, double jd=-1);
 
@@ -215,8 +220,14 @@ protected:
     // Target side of pier for gotos
     TelescopePierSide gotoTargetPS=PIER_EAST;
 
-    // Speed up polling frequency once gotos are closer than this number of degrees
-    static const double gotoSpeedupPollingDegrees;
+    // Device HA in hours and Dec in degrees last commanded for gotos
+    double  gotoTargetDevHA=0, gotoTargetDevDec=0;
+
+    // Predicted remaining time of the current goto in seconds, until the later of both axes arrives. Negative if unknown
+    double  gotoRemainingSeconds=-1;
+
+    // Shortest polling period during gotos, in milliseconds
+    static const uint32_t gotoMinPollingMs;
 
     // Manual slewing speed active on the given axis, or zero if inactive
     double manualSlewArcsecPerSecRA=0, manualSlewArcsecPerSecDec=0;
@@ -224,6 +235,9 @@ protected:
     // Flag: guider pulse currently active on the given axis
     bool guiderActiveRA=false, guiderActiveDec=false;
 
+    // Flag: an axis was stopped by a reference switch or StallGuard. Set from ramp events on the I/O worker thread
+    std::atomic<bool> unplannedStop{false};
+
     // Timeouts for guider pulse
     uint64_t guiderTimeoutRA, guiderTimeoutDec;
 
@@ -253,6 +267,15 @@ protected:
     INumber HARampN[Stepper::RAMPN_SIZE]={};
     INumberVectorProperty HARampNP;
 
+    IText HAProfileT[Stepper::PROFILET_SIZE]={};
+    ITextVectorProperty HAProfileTP;
+
+    INumber HATuneN[Stepper::TUNEN_SIZE]={};
+    INumberVectorProperty HATuneNP;
+
+    INumber HATelemetryN[Stepper::TELEMETRYN_SIZE]={};
+    INumberVectorProperty HATelemetryNP;
+
     INumber DecMotorN[Stepper::MOTORN_SIZE]={};
     INumberVectorProperty DecMotorNP;
 
@@ -262,6 +285,15 @@ protected:
     INumber DecRampN[Stepper::RAMPN_SIZE]={};
     INumberVectorProperty DecRampNP;
 
+    IText DecProfileT[Stepper::PROFILET_SIZE]={};
+    ITextVectorProperty DecProfileTP;
+
+    INumber DecTuneN[Stepper::TUNEN_SIZE]={};
+    INumberVectorProperty DecTuneNP;
+
+    INumber DecTelemetryN[Stepper::TELEMETRYN_SIZE]={};
+    INumberVectorProperty DecTelemetryNP;
+
     INumber SlewRatesN[NUM_SLEW_RATES]={};
     INumberVectorProperty SlewRatesNP;
 
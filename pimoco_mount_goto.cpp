@@ -24,7 +24,7 @@
 #include <libnova/sidereal_time.h>
 
 
-const double PimocoMount::gotoSpeedupPollingDegrees=5;
+const uint32_t PimocoMount::gotoMinPollingMs=100;
 
 
 bool PimocoMount::Sync(double equRA, double equDec) {
@@ -108,8 +108,8 @@ bool PimocoMount::Goto(double equRA, double equDec, TelescopePierSide equPS, boo
  	else
  		; // don't touch
 
-	if(!stepperHA.setTargetPositionHours(deviceHA, wasTrackingBeforeSlew ? stepperHA.arcsecPerSecToNative(getTrackRateRA()) : 0) || 
-	   !stepperDec.setTargetPositionDegrees(deviceDec, wasTrackingBeforeSlew ? stepperDec.arcsecPerSecToNative(getTrackRateDec()) : 0) ) {
+	if(!stepperHA.setTargetPositionHours(deviceHA, wasTrackingBeforeSlew ? stepperHA.arcsecPerSecToNativeFractional(getTrackRateRA()) : 0) || 
+	   !stepperDec.setTargetPositionDegrees(deviceDec, wasTrackingBeforeSlew ? stepperDec.arcsecPerSecToNativeFractional(getTrackRateDec()) : 0) ) {
 		LOG_ERROR("Goto");
 		return false;
 	}
@@ -118,16 +118,36 @@ bool PimocoMount::Goto(double equRA, double equDec, TelescopePierSide equPS, boo
 	gotoTargetRA =equRA;  
 	gotoTargetDec=equDec;
     gotoTargetPS =equPS;
+    gotoTargetDevHA =deviceHA;
+    gotoTargetDevDec=deviceDec;
   	manualSlewArcsecPerSecRA=manualSlewArcsecPerSecDec=0;
 	guiderActiveRA=guiderActiveDec=false;
 
-    double distLimit=gotoSpeedupPollingDegrees*0.001*(double)getCurrentPollingPeriod();
-    if((abs(EqN[0].value-gotoTargetRA)*15 < distLimit) && 
-       (abs(EqN[1].value-gotoTargetDec)   < distLimit)    )
-    	SetTimer(100);  // Workaround: when close, increase polling frequency to continuously update HA target during slew
-
     TrackState = SCOPE_SLEWING;
-  	return true;
+
+    // poll when the goto is predicted to arrive, if sooner than the regular polling period
+    Stepper::MotionStatus statusHA, statusDec;
+    gotoRemainingSeconds=-1;
+    if(stepperHA.getMotionStatus(&statusHA) && stepperDec.getMotionStatus(&statusDec))
+        gotoRemainingSeconds=predictGotoSeconds(statusHA, statusDec);
+    uint32_t pollingPeriod=getNextTimerInterval();
+    if(pollingPeriod<getCurrentPollingPeriod())
+        SetTimer(pollingPeriod);
+    return true;
+}
+
+
+double PimocoMount::predictGotoSeconds(const Stepper::MotionStatus &statusHA, const Stepper::MotionStatus &statusDec) {
+    uint32_t clockHA, clockDec;
+    Ramp rampHA, rampDec;
+    if(!stepperHA.getClockHz(&clockHA) || !stepperDec.getClockHz(&clockDec))
+        return -1;
+    if(!stepperHA.hasReachedTargetPos() && !stepperHA.predictGoTo(&rampHA, stepperHA.hoursToNative(gotoTargetDevHA), statusHA))
+        return -1;
+    if(!stepperDec.hasReachedTargetPos() && !stepperDec.predictGoTo(&rampDec, stepperDec.degreesToNative(gotoTargetDevDec), statusDec))
+        return -1;
+    double secondsHA=rampHA.getDurationSeconds(clockHA), secondsDec=rampDec.getDurationSeconds(clockDec);
+    return secondsHA>secondsDec ? secondsHA : secondsDec;
 }
 
 
@@ -32,7 +32,7 @@ IPState PimocoMount::GuideNorth(uint32_t ms) {
 
 	// Indi: North is defined as DEC+
 	double arcsecPerSec=getTrackRateDec() + GuiderSpeedN[0].value * trackRates[0];
-	if(!stepperDec.setTargetVelocityArcsecPerSec(arcsecPerSec))
+	if(!stepperDec.setTargetVelocityArcsecPerSecAsync(arcsecPerSec))
 		return IPS_ALERT;
 
 	guiderActiveDec=true;
@@ -57,7 +57,7 @@ IPState PimocoMount::GuideSouth(uint32_t ms) {
 
 	// Indi: South is defined as DEC-
 	double arcsecPerSec=getTrackRateDec() - GuiderSpeedN[0].value * trackRates[0];
-	if(!stepperDec.setTargetVelocityArcsecPerSec(arcsecPerSec))
+	if(!stepperDec.setTargetVelocityArcsecPerSecAsync(arcsecPerSec))
 		return IPS_ALERT;
 
 	guiderActiveDec=true;
@@ -82,7 +82,7 @@ IPState PimocoMount::GuideEast(uint32_t ms) {
 
 	// Indi: East is defined as RA+, so HA-
 	double arcsecPerSec=getTrackRateRA() - GuiderSpeedN[0].value * trackRates[0];
-	if(!stepperHA.setTargetVelocityArcsecPerSec(arcsecPerSec))
+	if(!stepperHA.setTargetVelocityArcsecPerSecAsync(arcsecPerSec))
 		return IPS_ALERT;
 
 	guiderActiveRA=true;
@@ -107,7 +107,7 @@ IPState PimocoMount::GuideWest(uint32_t ms) {
 
 	// Indi: West is defined as RA-, so HA+
 	double arcsecPerSec=getTrackRateRA() + GuiderSpeedN[0].value * trackRates[0];
-	if(!stepperHA.setTargetVelocityArcsecPerSec(arcsecPerSec))
+	if(!stepperHA.setTargetVelocityArcsecPerSecAsync(arcsecPerSec))
 		return IPS_ALERT;
 
 	guiderActiveRA=true;
@@ -126,7 +126,7 @@ bool PimocoMount::guiderTimerHit() {
 	bool rc=true;
 
 	if(guiderActiveRA  && guiderTimeoutRA<=now) {
-		if(!stepperHA.setTargetVelocityArcsecPerSec(getTrackRateRA())) {
+		if(!stepperHA.setTargetVelocityArcsecPerSecAsync(getTrackRateRA())) {
 			LOG_ERROR("Error resetting RA speed after guiding");
 			rc=false;
 		}
@@ -137,7 +137,7 @@ bool PimocoMount::guiderTimerHit() {
 	}
 
 	if(guiderActiveDec && guiderTimeoutDec<=now) {
-		if(!stepperDec.setTargetVelocityArcsecPerSec(getTrackRateDec())) {
+		if(!stepperDec.setTargetVelocityArcsecPerSecAsync(getTrackRateDec())) {
 			LOG_ERROR("Error resetting Dec speed after guiding");
 			rc=false;
 		}
@@ -0,0 +1,53 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "pimoco_mount.h"
+
+
+// Singleton instance
+PimocoMount mount;
+
+// C function interface redirecting to singleton
+//
+extern "C" {
+
+void ISGetProperties(const char *dev) {
+	mount.ISGetProperties(dev);
+}
+
+void ISNewBLOB(const char *dev, const char *name, int sizes[], int blobsizes[], char *blobs[], char *formats[], char *names[], int n) {
+	mount.ISNewBLOB(dev, name, sizes, blobsizes, blobs, formats, names, n);
+}
+
+void ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n) {
+	mount.ISNewNumber(dev, name, values, names, n);
+}
+
+void ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n) {
+	mount.ISNewSwitch(dev, name, states, names, n);
+}
+
+void ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n) {
+	mount.ISNewText(dev, name, texts, names, n);
+}
+
+void ISSnoopDevice(XMLEle *root) {
+	mount.ISSnoopDevice(root);
+}
+
+} // extern "C"
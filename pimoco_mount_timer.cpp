@@ -28,11 +28,23 @@ void PimocoMount::TimerHit() {
 	if(!isConnected())
 		return;
 
+	// the stopped axis has logged the cause. Stop the other one too, and drop any goto, park or tracking state
+	if(unplannedStop.exchange(false)) {
+		LOG_ERROR("Axis stopped unexpectedly, aborting all motion");
+		Abort();
+	}
+
+	stepperHA .checkRecovery(& HAMotorNP);
+	stepperDec.checkRecovery(&DecMotorNP);
+
 	bool rc;
 	if(guiderActiveRA || guiderActiveDec) 
 		rc=guiderTimerHit(); 	// guiding is time-critical, avoid general scope updates
-	else
+	else {
 		rc=ReadScopeStatus();
+		stepperHA .updateTelemetry(& HATelemetryNP);
+		stepperDec.updateTelemetry(&DecTelemetryNP);
+	}
 
 	if(!rc) {
         EqNP.s = IPS_ALERT;
@@ -58,12 +70,13 @@ uint32_t PimocoMount::getNextTimerInterval() {
 			return (uint32_t) ms;
 		guiderTimerHit();
 		return getNextTimerInterval();		
-	} else if(TrackState==SCOPE_SLEWING) {
-	    // during gotos, when close continuously update the HA target position based on system time
-	    double distLimit=gotoSpeedupPollingDegrees*0.001*(double)getCurrentPollingPeriod();
-    	if((abs(EqN[0].value-gotoTargetRA)*15 < distLimit) && 
-    	   (abs(EqN[1].value-gotoTargetDec)   < distLimit)    )
-    		return 100; 
+	} else if(TrackState==SCOPE_SLEWING && gotoRemainingSeconds>=0) {
+	    // during gotos, poll when both axes are predicted to arrive to refine the HA target and restore tracking promptly
+	    double ms=ceil(gotoRemainingSeconds*1000.0);
+	    if(ms<gotoMinPollingMs)
+	    	return gotoMinPollingMs;
+	    if(ms<getCurrentPollingPeriod())
+	    	return (uint32_t) ms;
     	// fallthrough
 	}
 	return getCurrentPollingPeriod();
@@ -71,10 +84,12 @@ uint32_t PimocoMount::getNextTimerInterval() {
 
 
 bool PimocoMount::ReadScopeStatus() {
-	// update device coordinates
-	double deviceHA, deviceDec; // hour angle in hours, declination in degrees
-	if(!stepperHA.getPositionHours(&deviceHA) || !stepperDec.getPositionDegrees(&deviceDec))
+	// update device coordinates, retrieving position, speed and status flags of each axis with one pipelined exchange
+	Stepper::MotionStatus statusHA, statusDec;
+	if(!stepperHA.getMotionStatus(&statusHA) || !stepperDec.getMotionStatus(&statusDec))
 	   	return false;
+	double deviceHA =stepperHA .nativeToHours  (statusHA .position); // hour angle in hours
+	double deviceDec=stepperDec.nativeToDegrees(statusDec.position); // declination in degrees
 	DeviceCoordN[0].value=deviceHA;
 	DeviceCoordN[1].value=deviceDec;
 
@@ -120,26 +135,38 @@ bool PimocoMount::ReadScopeStatus() {
     		if(!stepperHA.hasReachedTargetPos()) {
 	        	// while HA axis is moving, recalculate HA target based on current time
                 double targetDevHA, targetDevDec;
-                bool valid=deviceFromEquatorial(&targetDevHA, &targetDevDec, gotoTargetRA, gotoTargetDec, gotoTargetPS);
+                auto targetPS=gotoTargetPS;
+                bool valid=deviceFromEquatorial(&targetDevHA, &targetDevDec, gotoTargetRA, gotoTargetDec, targetPS, lst);
                 if(!valid) {
                 	// deal with edge case that goto target has moved too far beyond the meridian 
                 	// since the goto command was issued, which can be healed with a flip.
-         			auto newTargetPS= (gotoTargetPS==PIER_WEST) ? PIER_EAST : PIER_WEST;
-                	valid=deviceFromEquatorial(&targetDevHA, &targetDevDec, gotoTargetRA, gotoTargetDec, newTargetPS);
+         			targetPS= (gotoTargetPS==PIER_WEST) ? PIER_EAST : PIER_WEST;
+                	valid=deviceFromEquatorial(&targetDevHA, &targetDevDec, gotoTargetRA, gotoTargetDec, targetPS, lst);
                 	if(!valid) {
 	                	Abort();
 					   	return false;
                 	}
                 }
 
-                // reissue goto command if HA difference is above threshold
-                double absHADistArcsec=abs(targetDevHA-deviceHA)*60*60;
+                // aim where the target hour angle will be once the HA axis arrives, as predicted by the ramp model
+                Ramp ramp;
+                uint32_t clockHz;
+                if(stepperHA.getClockHz(&clockHz) && stepperHA.predictGoTo(&ramp, stepperHA.hoursToNative(targetDevHA), statusHA)) {
+                	double leadHours=ramp.getDurationSeconds(clockHz)*trackRates[TRACK_SIDEREAL]/(15.0*60.0*60.0);
+                	double ledDevHA, ledDevDec;
+                	if(deviceFromEquatorial(&ledDevHA, &ledDevDec, gotoTargetRA, gotoTargetDec, targetPS, range24(lst+leadHours)))
+                		targetDevHA=ledDevHA;
+                }
+
+                // reissue goto command if the HA target has moved by more than the threshold
+                double absHADistArcsec=abs(targetDevHA-gotoTargetDevHA)*60*60;
                 if(absHADistArcsec>=0.25) {
-     				if(!stepperHA.setTargetPositionHours(targetDevHA, wasTrackingBeforeSlew ? stepperHA.arcsecPerSecToNative(getTrackRateRA()) : 0 )) {
+     				if(!stepperHA.setTargetPositionHours(targetDevHA, wasTrackingBeforeSlew ? stepperHA.arcsecPerSecToNativeFractional(getTrackRateRA()) : 0 )) {
 	   					LOG_ERROR("HA: Updating goto target");
 	   					Abort();
 			  			return false;
 				    }
+				    gotoTargetDevHA=targetDevHA;
                 }
         	} else if(stepperDec.hasReachedTargetPos()) {
         		// physical axis tracking has been re-enabled by the ISRs already
@@ -149,6 +176,8 @@ bool PimocoMount::ReadScopeStatus() {
 				guiderActiveRA=guiderActiveDec=false;
         		TrackState=wasTrackingBeforeSlew ? SCOPE_TRACKING : SCOPE_IDLE;
         	}
+        	if(TrackState==SCOPE_SLEWING)
+        		gotoRemainingSeconds=predictGotoSeconds(statusHA, statusDec);
         	break;
 
         case SCOPE_TRACKING:
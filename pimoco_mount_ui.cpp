@@ -35,10 +35,12 @@ bool PimocoMount::initProperties() {
 	AddTrackMode(trackRateNames[TRACK_CUSTOM],   trackRateLabels[TRACK_CUSTOM],   false);
 
 	// Initialize stepper properties
-	stepperHA .initProperties( HAMotorN, & HAMotorNP,  HAMSwitchS, & HAMSwitchSP, HARampN, & HARampNP,  
-							  "HA_MOTOR", "Motor", "HA_MSWITCH", "Switches", "HA_RAMP", "Ramp", HA_TAB);
-	stepperDec.initProperties(DecMotorN, &DecMotorNP, DecMSwitchS, &DecMSwitchSP, DecRampN, &DecRampNP, 
-							  "DEC_MOTOR", "Motor", "DEC_MSWITCH", "Switches", "DEC_RAMP", "Ramp", DEC_TAB);
+	stepperHA .initProperties( HAMotorN, & HAMotorNP,  HAMSwitchS, & HAMSwitchSP, HARampN, & HARampNP,  HAProfileT, & HAProfileTP,  HATuneN, & HATuneNP,  HATelemetryN, & HATelemetryNP,
+							  "HA_MOTOR", "Motor", "HA_MSWITCH", "Switches", "HA_RAMP", "Ramp", "HA_PROFILE", "Register profile", "HA_TUNE", "StealthChop tuning",
+							  "HA_TELEMETRY", "Driver telemetry", HA_TAB);
+	stepperDec.initProperties(DecMotorN, &DecMotorNP, DecMSwitchS, &DecMSwitchSP, DecRampN, &DecRampNP, DecProfileT, &DecProfileTP, DecTuneN, &DecTuneNP, DecTelemetryN, &DecTelemetryNP,
+							  "DEC_MOTOR", "Motor", "DEC_MSWITCH", "Switches", "DEC_RAMP", "Ramp", "DEC_PROFILE", "Register profile", "DEC_TUNE", "StealthChop tuning",
+							  "DEC_TELEMETRY", "Driver telemetry", DEC_TAB);
 
 	// Initialize mount properties
 	IUFillNumber(&DeviceCoordN[0], "HA", "HA [hh:mm:ss]", "%010.6m", -6-12, -6+12, 0.25, -6);
@@ -84,10 +86,14 @@ bool PimocoMount::initProperties() {
 	loadConfig(true, HAMotorNP.name);
 	loadConfig(true, HAMSwitchSP.name);
 	loadConfig(true, HARampNP.name);
+	loadConfig(true, HAProfileTP.name);
+	loadConfig(true, HATuneNP.name);
 
 	loadConfig(true, DecMotorNP.name);
 	loadConfig(true, DecMSwitchSP.name);
 	loadConfig(true, DecRampNP.name);
+	loadConfig(true, DecProfileTP.name);
+	loadConfig(true, DecTuneNP.name);
 
 	loadConfig(true, SlewRatesNP.name);
 	loadConfig(true, HALimitsNP.name);
@@ -109,12 +115,16 @@ bool PimocoMount::updateProperties() {
 	if(!INDI::Telescope::updateProperties())
 		return false;
 
-	if(!stepperHA .updateProperties(this,  HAMotorN, & HAMotorNP,  HAMSwitchS, & HAMSwitchSP,  HARampN, & HARampNP))
+	if(!stepperHA .updateProperties(this,  HAMotorN, & HAMotorNP,  HAMSwitchS, & HAMSwitchSP,  HARampN, & HARampNP,  HAProfileT, & HAProfileTP,  HATuneN, & HATuneNP,  HATelemetryN, & HATelemetryNP))
 		return false;
-	if(!stepperDec.updateProperties(this, DecMotorN, &DecMotorNP, DecMSwitchS, &DecMSwitchSP, DecRampN, &DecRampNP))
+	if(!stepperDec.updateProperties(this, DecMotorN, &DecMotorNP, DecMSwitchS, &DecMSwitchSP, DecRampN, &DecRampNP, DecProfileT, &DecProfileTP, DecTuneN, &DecTuneNP, DecTelemetryN, &DecTelemetryNP))
 		return false;
 
 	if(isConnected()) {
+		// persist tuning results obtained on connect
+		saveConfig(true, HATuneNP.name);
+		saveConfig(true, DecTuneNP.name);
+
 	    defineProperty(&SlewRatesNP);
 	    defineProperty(&HALimitsNP);
 	    defineProperty(&AltLimitsNP);
@@ -191,16 +201,18 @@ bool PimocoMount::ISNewNumber(const char *dev, const char *name, double values[]
 		return INDI::Telescope::ISNewNumber(dev, name, values, names, n);
 
 	int res;
-	if((res=stepperHA.ISNewNumber(&HAMotorNP, &HARampNP, name, values, names, n)) > 0) {
+	if((res=stepperHA.ISNewNumber(&HAMotorNP, &HARampNP, &HATuneNP, name, values, names, n)) > 0) {
 		saveConfig(true, HAMotorNP.name);
 		saveConfig(true, HARampNP.name);
+		saveConfig(true, HATuneNP.name);
 		return true;
 	} else if(res==0)
 		return false;
 
-	if((res=stepperDec.ISNewNumber(&DecMotorNP, &DecRampNP, name, values, names, n)) > 0) {
+	if((res=stepperDec.ISNewNumber(&DecMotorNP, &DecRampNP, &DecTuneNP, name, values, names, n)) > 0) {
 		saveConfig(true, DecMotorNP.name);
 		saveConfig(true, DecRampNP.name);
+		saveConfig(true, DecTuneNP.name);
 		return true;
 	} else if(res==0)
 		return false;
@@ -286,7 +298,18 @@ bool PimocoMount::ISNewText(const char *dev, const char *name, char *texts[], ch
 	if(dev==NULL || strcmp(dev,getDeviceName()))
 		return INDI::Telescope::ISNewText(dev, name, texts, names, n);
 
-    // if(strcmp(name, ...)) { } else
+	int res;
+	if((res=stepperHA.ISNewText(&HAProfileTP, &HARampNP, name, texts, names, n)) >0) {
+		saveConfig(true, HAProfileTP.name);
+		return true;
+	} else if(res==0)
+		return false;
+
+	if((res=stepperDec.ISNewText(&DecProfileTP, &DecRampNP, name, texts, names, n)) >0) {
+		saveConfig(true, DecProfileTP.name);
+		return true;
+	} else if(res==0)
+		return false;
 
 	return INDI::Telescope::ISNewText(dev, name, texts, names, n);
 }
@@ -304,10 +327,14 @@ bool PimocoMount::saveConfigItems(FILE *fp){
     IUSaveConfigNumber(fp, &HAMotorNP);
     IUSaveConfigSwitch(fp, &HAMSwitchSP);
     IUSaveConfigNumber(fp, &HARampNP);
+    IUSaveConfigText(fp, &HAProfileTP);
+    IUSaveConfigNumber(fp, &HATuneNP);
 
     IUSaveConfigNumber(fp, &DecMotorNP);
     IUSaveConfigSwitch(fp, &DecMSwitchSP);
     IUSaveConfigNumber(fp, &DecRampNP);
+    IUSaveConfigText(fp, &DecProfileTP);
+    IUSaveConfigNumber(fp, &DecTuneNP);
 
     IUSaveConfigNumber(fp, &SlewRatesNP);
     IUSaveConfigNumber(fp, &HALimitsNP);
@@ -0,0 +1,234 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "pimoco_ramp.h"
+#include <math.h>    // for fabs, sqrt
+
+
+// Velocity change per time unit 2^24/f_clk per acceleration register unit 2^41/f_clk^2
+static const double accelerationScale=128;
+
+// Time unit 2^24/f_clk per TZEROWAIT register unit 512/f_clk
+static const double zeroWaitScale=1.0/(double) (1ul<<15);
+
+// Distance tolerance in microsteps below which a target counts as reachable without overshooting
+static const double overshootTolerance=0.5;
+
+
+Ramp::Rates Ramp::accelerationRates(const Settings &s) {
+	// V1=0 disables A1 and D1, as does a zero A1
+	Rates r;
+	r.high=accelerationScale*s.amax;
+	r.low =(s.v1>0 && s.a1>0) ? accelerationScale*s.a1 : r.high;
+	r.threshold=s.v1;
+	return r;
+}
+
+
+Ramp::Rates Ramp::decelerationRates(const Settings &s) {
+	Rates r;
+	r.high=accelerationScale*s.dmax;
+	r.low =(s.v1>0 && s.d1>0) ? accelerationScale*s.d1 : r.high;
+	r.threshold=s.v1;
+	return r;
+}
+
+
+double Ramp::changeDistance(double from, double to, const Rates &r) {
+	double lo=from<to ? from : to, hi=from<to ? to : from;
+	double dist=0;
+	if(lo<r.threshold) {
+		double top=hi<r.threshold ? hi : r.threshold;
+		dist+=(top*top-lo*lo)/(2*r.low);
+	}
+	if(hi>r.threshold) {
+		double bottom=lo>r.threshold ? lo : r.threshold;
+		dist+=(hi*hi-bottom*bottom)/(2*r.high);
+	}
+	return dist;
+}
+
+
+double Ramp::brakingDistance(const Settings &s, double speed) {
+	if(speed<=s.vstop || s.dmax==0)
+		return 0;
+	return changeDistance(speed, s.vstop, decelerationRates(s));
+}
+
+
+double Ramp::peakSpeed(const Settings &s, double speed, double distance, double *cruise) {
+	Rates acc=accelerationRates(s), dec=decelerationRates(s);
+	double vmax=s.vmax;
+
+	// total distance as function of the peak is piecewise quadratic, with breaks at V1 and VSTOP
+	auto total=[&](double v) { return changeDistance(speed, v, acc) + brakingDistance(s, v); };
+	double full=total(vmax);
+	if(full<=distance) {
+		*cruise=distance-full;
+		return vmax;
+	}
+	*cruise=0;
+
+	double breaks[3]={ (double) s.v1, (double) s.vstop, vmax };
+	if(breaks[0]>breaks[1]) {
+		double b=breaks[0]; breaks[0]=breaks[1]; breaks[1]=b;
+	}
+	double lo=speed;
+	for(int i=0; i<3; i++) {
+		double hi=breaks[i];
+		if(hi<=lo)
+			continue;
+		if(hi>vmax)
+			hi=vmax;
+		double totalHi=total(hi);
+		if(totalHi>=distance || hi>=vmax) {
+			// within [lo, hi] the distance grows with v^2 at the rates of this band
+			double mid=0.5*(lo+hi);
+			double alpha=0.5/(mid<acc.threshold ? acc.low : acc.high);
+			if(mid>s.vstop)
+				alpha+=0.5/(mid<dec.threshold ? dec.low : dec.high);
+			double v2=lo*lo + (distance-total(lo))/alpha;
+			double v=v2>0 ? sqrt(v2) : 0;
+			return v<lo ? lo : (v>hi ? hi : v);
+		}
+		lo=hi;
+	}
+	return lo;
+}
+
+
+void Ramp::clear(double position) {
+	numSegments=0;
+	startPosition=endPosition=position;
+	duration=0;
+	peakVelocity=0;
+}
+
+
+void Ramp::append(double dt, double velocity, double acceleration) {
+	if(!(dt>0) || numSegments>=MAX_SEGMENTS)
+		return;
+	Segment &seg=segments[numSegments++];
+	seg.start=duration;
+	seg.duration=dt;
+	seg.position=endPosition;
+	seg.velocity=velocity;
+	seg.acceleration=acceleration;
+	endPosition+=velocity*dt + 0.5*acceleration*dt*dt;
+	duration+=dt;
+	double vEnd=fabs(velocity+acceleration*dt);
+	if(fabs(velocity)>peakVelocity)
+		peakVelocity=fabs(velocity);
+	if(vEnd>peakVelocity)
+		peakVelocity=vEnd;
+}
+
+
+void Ramp::change(double dir, double from, double to, const Rates &r) {
+	if(from<to) {
+		if(from<r.threshold) {
+			double top=to<r.threshold ? to : r.threshold;
+			append((top-from)/r.low, dir*from, dir*r.low);
+			from=top;
+		}
+		if(from<to)
+			append((to-from)/r.high, dir*from, dir*r.high);
+	} else if(from>to) {
+		if(from>r.threshold) {
+			double bottom=to>r.threshold ? to : r.threshold;
+			append((from-bottom)/r.high, dir*from, -dir*r.high);
+			from=bottom;
+		}
+		if(from>to)
+			append((from-to)/r.low, dir*from, -dir*r.low);
+	}
+}
+
+
+bool Ramp::plan(const Settings &s, int32_t position, int32_t velocity, int32_t target) {
+	clear(position);
+	if(s.amax==0 || s.dmax==0 || s.vmax==0)
+		return position==target && velocity==0;
+
+	Rates acc=accelerationRates(s), dec=decelerationRates(s);
+	double v=velocity;
+	for(int pass=0; pass<2; pass++) {
+		double dist=(double) target-endPosition;
+		if(dist==0 && v==0)
+			break;
+		double dir=(dist>0 || (dist==0 && v>0)) ? 1 : -1;
+		double speed=v*dir;  // speed towards the target
+
+		if(speed<0 || brakingDistance(s, speed)>fabs(dist)+overshootTolerance) {
+			// moving away or unable to stop in time: stop, wait and reverse
+			double d=v>0 ? 1 : -1;
+			change(d, fabs(v), 0, dec);
+			append(s.tzerowait*zeroWaitScale, 0, 0);
+			v=0;
+			continue;
+		}
+
+		// start from standstill at VSTART, and slow down first if above VMAX
+		if(speed==0)
+			speed=s.vstart;
+		if(speed>s.vmax) {
+			change(dir, speed, s.vmax, dec);
+			speed=s.vmax;
+		}
+
+		double cruise;
+		double peak=peakSpeed(s, speed, fabs((double) target-endPosition), &cruise);
+		change(dir, speed, peak, acc);
+		if(cruise>0 && peak>0)
+			append(cruise/peak, dir*peak, 0);
+		if(peak>s.vstop)
+			change(dir, peak, s.vstop, dec);
+
+		// the ramp generator stops exactly at the target from VSTOP
+		endPosition=target;
+		return true;
+	}
+	endPosition=target;
+	return true;
+}
+
+
+double Ramp::positionAt(double t) const {
+	if(t<=0 || numSegments==0)
+		return startPosition;
+	for(uint32_t i=0; i<numSegments; i++) {
+		const Segment &seg=segments[i];
+		double dt=t-seg.start;
+		if(dt<=seg.duration)
+			return seg.position + seg.velocity*dt + 0.5*seg.acceleration*dt*dt;
+	}
+	return endPosition;
+}
+
+
+double Ramp::velocityAt(double t) const {
+	if(t<0)
+		t=0;
+	for(uint32_t i=0; i<numSegments; i++) {
+		const Segment &seg=segments[i];
+		double dt=t-seg.start;
+		if(dt<=seg.duration)
+			return seg.velocity + seg.acceleration*dt;
+	}
+	return 0;
+}
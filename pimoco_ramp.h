@@ -0,0 +1,143 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef PIMOCO_RAMP_H
+#define PIMOCO_RAMP_H
+
+#include <stdint.h>
+
+// A software model of the TMC5160 six-point ramp generator in positioning mode, as per datasheet section 14.1, p.102ff.
+// Plans a move from the current position and speed towards a target as a sequence of constant-acceleration segments.
+// Predicts time to target, position and velocity over time and peak velocity without stepping through time.
+// Works in chip units: positions in microsteps, time in units of t=2^24/f_clk, velocities in microsteps per t as per
+// VMAX and VACTUAL. In these units, an acceleration register value A changes the velocity by 128*A per t, independent of the clock.
+// Planning and queries do not allocate.
+class Ramp {
+public:
+	// Ramp generator settings, in register units
+	struct Settings {
+		uint32_t vstart;     // VSTART, start speed from standstill, in units of 2^24/f_clk
+		uint32_t a1;         // A1, acceleration below V1, in units of 2^41/f_clk^2
+		uint32_t v1;         // V1, threshold speed between A1/D1 and AMAX/DMAX. 0 disables A1 and D1
+		uint32_t amax;       // AMAX, acceleration above V1
+		uint32_t vmax;       // VMAX, maximum speed
+		uint32_t dmax;       // DMAX, deceleration above V1
+		uint32_t d1;         // D1, deceleration below V1
+		uint32_t vstop;      // VSTOP, stop speed at the target
+		uint32_t tzerowait;  // TZEROWAIT, wait at standstill before reversing direction, in units of 512 t_clk
+	};
+
+	// A segment of constant acceleration
+	struct Segment {
+		double start;         // start time in units of 2^24/f_clk
+		double duration;      // duration in units of 2^24/f_clk
+		double position;      // position at start in microsteps
+		double velocity;      // signed velocity at start in microsteps per 2^24/f_clk
+		double acceleration;  // signed acceleration in microsteps per (2^24/f_clk)^2
+	};
+
+	enum {
+		MAX_SEGMENTS = 12  // upper bound on segments per move: reversal, wait, slowdown, acceleration, cruise and deceleration
+	};
+
+	// Creates an empty plan, at rest at position 0
+	Ramp() { clear(0); }
+
+	// Plans a move from the given position in microsteps and signed speed in units of 2^24/f_clk to the given target,
+	// using the given settings. Returns true on success, else false leaving a plan at rest at the given position
+	bool plan(const Settings &settings, int32_t position, int32_t velocity, int32_t target);
+
+	// Returns the time to reach the target in units of 2^24/f_clk
+	double getDuration() const { return duration; }
+
+	// Returns the time to reach the target in seconds for the given clock frequency
+	double getDurationSeconds(uint32_t clockHz) const { return toSeconds(duration, clockHz); }
+
+	// Returns the highest absolute speed during the move in units of 2^24/f_clk
+	double getPeakVelocity() const { return peakVelocity; }
+
+	// Returns the predicted position in microsteps at the given time in units of 2^24/f_clk after planning
+	double positionAt(double t) const;
+
+	// Returns the predicted signed velocity in units of 2^24/f_clk at the given time in units of 2^24/f_clk after planning
+	double velocityAt(double t) const;
+
+	// Returns the number of segments of the plan
+	uint32_t getNumSegments() const { return numSegments; }
+
+	// Returns the given segment of the plan
+	const Segment &getSegment(uint32_t index) const { return segments[index]; }
+
+	// Returns the distance in microsteps needed to decelerate from the given absolute speed in units of 2^24/f_clk to VSTOP
+	static double brakingDistance(const Settings &settings, double speed);
+
+	// Converts the given time in units of 2^24/f_clk to seconds for the given clock frequency
+	static double toSeconds(double t, uint32_t clockHz) { return clockHz>0 ? t*(double) (1ul<<24)/(double) clockHz : 0; }
+
+	// Converts the given time in seconds to units of 2^24/f_clk for the given clock frequency
+	static double fromSeconds(double seconds, uint32_t clockHz) { return seconds*(double) clockHz/(double) (1ul<<24); }
+
+protected:
+	// Rates of a velocity change, per absolute speed band
+	struct Rates {
+		double threshold;  // speed separating the bands, V1
+		double low;        // rate below the threshold, A1 or D1
+		double high;       // rate at or above the threshold, AMAX or DMAX
+	};
+
+	// Returns the rates for accelerating with the given settings
+	static Rates accelerationRates(const Settings &settings);
+
+	// Returns the rates for decelerating with the given settings
+	static Rates decelerationRates(const Settings &settings);
+
+	// Returns the distance in microsteps covered while changing the absolute speed between the two given values with the given rates
+	static double changeDistance(double from, double to, const Rates &rates);
+
+	// Returns the highest absolute speed not above VMAX with which the given distance can be covered starting from the given speed,
+	// accelerating and then decelerating to VSTOP. Stores the remaining distance to cruise at that speed in cruise
+	static double peakSpeed(const Settings &settings, double speed, double distance, double *cruise);
+
+	// Resets the plan to rest at the given position
+	void clear(double position);
+
+	// Appends segments changing the absolute speed from the given value to the other in the given direction with the given rates
+	void change(double dir, double from, double to, const Rates &rates);
+
+	// Appends a segment with the given duration, signed velocity and signed acceleration. Ignores empty segments
+	void append(double duration, double velocity, double acceleration);
+
+	// Segments of the plan, in order
+	Segment segments[MAX_SEGMENTS];
+
+	// Number of valid segments
+	uint32_t numSegments;
+
+	// Position at the start and at the end of the plan, in microsteps
+	double startPosition, endPosition;
+
+	// Total duration of the plan, in units of 2^24/f_clk
+	double duration;
+
+	// Highest absolute speed during the plan, in units of 2^24/f_clk
+	double peakVelocity;
+};
+
+#endif // PIMOCO_RAMP_H
@@ -24,9 +24,11 @@
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
 #include <cstdio>
+#include <string.h>  // for memset
 #include <libindi/indilogger.h> // for LOG_..., LOGF_... macros
 
 #include "pimoco_spi.h"
+#include "pimoco_time.h"
 
 const char    *SPI::defaultSPIDevice="/dev/spidev0.0";
 const uint8_t  SPI::defaultSPIMode=SPI_MODE_3;
@@ -36,12 +38,189 @@ const uint32_t SPI::defaultSPIDelayUsec=0;
 
 
 bool SPI::open(const char *deviceName) {
-	if(fd>=0)
+	if(isConnected())
 		close();
 
 	if(debugLevel>=TMC_DEBUG_DEBUG)
 		LOGF_DEBUG("Device %s: opening", deviceName!=NULL ? deviceName : "NULL");
 
+	delete backend;
+	backend=createBackend(deviceName);
+	if(!backend->open(deviceName))
+		return false;
+
+	worker=SPIWorker::acquire(deviceName);
+	if(worker==NULL) {
+		LOGF_ERROR("Device %s: unable to start I/O worker", deviceName!=NULL ? deviceName : "NULL");
+		backend->close();
+		return false;
+	}
+
+	// share physical buses with other driver processes. Without arbitration, traffic still works but is unsynchronized
+	if(backend->isHardware()) {
+		int err=0;
+		auto f=[&](){ if(!worker->getArbiter()->isOpen() && !worker->getArbiter()->open(worker->getBusName())) err=errno; };
+		call(f);
+		if(err!=0)
+			LOGF_WARN("Device %s: unable to attach bus arbiter: %s", deviceName, strerror(err));
+	}
+	return true;
+}
+
+
+SPIArbiter::Stats SPI::getBusStats() {
+	SPIArbiter::Stats res=SPIArbiter::Stats();
+	if(worker==NULL)
+		return res;
+	auto f=[&](){ res=worker->getArbiter()->getStats(); };
+	call(f);
+	return res;
+}
+
+
+SPIArbiter *SPI::lockBus() {
+	if(worker==NULL || !backend->isHardware() || !worker->getArbiter()->isOpen())
+		return NULL;
+	SPIArbiter *arbiter=worker->getArbiter();
+	stats.waitUs+=arbiter->lock(busPriority)/1000;
+	return arbiter;
+}
+
+
+bool SPI::setSpeedHz(uint32_t value) {
+	if(value==0) {
+		LOG_ERROR("SPI speed: must be nonzero");
+		return false;
+	}
+	speedHz=value;
+	if(!isConnected())
+		return true;
+
+	bool res=false;
+	auto f=[&](){ res=backend->setSpeed(value); };
+	call(f);
+	return res;
+}
+
+
+bool SPI::close() {
+	if(!isConnected())
+		return true;
+	if(debugLevel>=TMC_DEBUG_DEBUG)
+		LOG_DEBUG("Shutting down existing device");
+
+	// complete pending commands and close on the worker thread, then release it
+	bool res=false;
+	auto f=[&](){ res=backend->close(); };
+	call(f);
+	SPIWorker::release(worker);
+	worker=NULL;
+	return res;
+}
+
+
+bool SPI::post(std::function<void()> &&command) {
+	if(worker==NULL) {
+		LOG_ERROR("SPI post: device not open");
+		return false;
+	}
+	if(!worker->post(std::move(command))) {
+		LOG_ERROR("SPI post: command queue full");
+		return false;
+	}
+	return true;
+}
+
+
+bool SPI::sendReceive(const uint8_t *tx, uint8_t *rx, uint32_t len) {
+	if((len==0) || ((len%5)!=0)) {
+		LOGF_ERROR("SPI send/receive: length %d not a nonzero multiple of 5", len);
+		return false;		
+	}
+	if(len/5>SPIBackend::MAX_FRAMES) {
+		LOGF_ERROR("SPI send/receive: %d datagrams exceed maximum of %d", len/5, SPIBackend::MAX_FRAMES);
+		return false;
+	}
+	if(!isConnected()) {
+		LOG_ERROR("SPI send/receive: device not open");
+		return false;
+	}
+
+	bool res=false;
+	auto f=[&](){ res=transfer(tx, rx, len); };
+	call(f);
+	return res;
+}
+
+
+bool SPI::sendReceive(const SPIFrame *frames, uint32_t numFrames) {
+	if(numFrames==0 || numFrames>SPIBackend::MAX_FRAMES) {
+		LOGF_ERROR("SPI send/receive: %d datagrams not in range 1..%d", numFrames, SPIBackend::MAX_FRAMES);
+		return false;
+	}
+	for(uint32_t i=0; i<numFrames; i++)
+		if(frames[i].len==0 || frames[i].tx==NULL || frames[i].rx==NULL) {
+			LOGF_ERROR("SPI send/receive: datagram %d is empty", i);
+			return false;
+		}
+	if(!isConnected()) {
+		LOG_ERROR("SPI send/receive: device not open");
+		return false;
+	}
+
+	bool res=false;
+	auto f=[&](){ res=transfer(frames, numFrames); };
+	call(f);
+	return res;
+}
+
+
+bool SPI::transfer(const uint8_t *tx, uint8_t *rx, uint32_t len) {
+	SPIArbiter *arbiter=lockBus();
+	Timestamp start;
+	bool res=backend->transfer(tx, rx, 5, len/5);
+	Timestamp end;
+	if(arbiter!=NULL)
+		arbiter->unlock();
+	updateStats(len/5, len, end.usSince(start));
+	trace.record(tx, rx, 5, len/5, !res);
+	return res;
+}
+
+
+bool SPI::transfer(const SPIFrame *frames, uint32_t numFrames) {
+	SPIArbiter *arbiter=lockBus();
+	Timestamp start;
+	bool res=backend->transfer(frames, numFrames);
+	Timestamp end;
+	if(arbiter!=NULL)
+		arbiter->unlock();
+
+	uint32_t numBytes=0;
+	uint64_t ts=SPITrace::now();
+	for(uint32_t i=0; i<numFrames; i++) {
+		numBytes+=frames[i].len;
+		trace.record(frames[i].tx, frames[i].rx, frames[i].len, (i==0 ? SPITrace::TRACE_FIRST : 0) | (res ? 0 : SPITrace::TRACE_FAILED), ts);
+	}
+	updateStats(numFrames, numBytes, end.usSince(start));
+	return res;
+}
+
+
+void SPI::updateStats(uint32_t numFrames, uint32_t numBytes, uint64_t us) {
+	stats.messages++;
+	stats.frames+=numFrames;
+	stats.bytes +=numBytes;
+	stats.busyUs+=us;
+	if(us>stats.maxUs)
+		stats.maxUs=us;
+}
+
+
+bool SPIDevBackend::open(const char *deviceName) {
+	if(fd>=0)
+		close();
+
 	fd=::open(deviceName, O_RDWR);
 	if(fd<0) {
 		LOGF_ERROR("Device %s: opening: %s", deviceName!=NULL ? deviceName : "NULL", strerror(errno));
@@ -50,27 +229,52 @@ bool SPI::open(const char *deviceName) {
 
 	// Set SPI mode, bits per word and speed
 	//
-	if(ioctl(fd, SPI_IOC_WR_MODE, &defaultSPIMode)<0) {
-		LOGF_ERROR("Device %s: Setting SPI mode 0x%02x: %s", deviceName!=NULL ? deviceName : "NULL", defaultSPIMode, strerror(errno));
+	if(ioctl(fd, SPI_IOC_WR_MODE, &SPI::defaultSPIMode)<0) {
+		LOGF_ERROR("Device %s: Setting SPI mode 0x%02x: %s", deviceName!=NULL ? deviceName : "NULL", SPI::defaultSPIMode, strerror(errno));
 		return false;
 	}
-	if(ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &defaultSPIBits)<0) {
-		LOGF_ERROR("Device %s: Setting SPI bits to %d: %s", deviceName!=NULL ? deviceName : "NULL", defaultSPIBits, strerror(errno));
+	if(ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &SPI::defaultSPIBits)<0) {
+		LOGF_ERROR("Device %s: Setting SPI bits to %d: %s", deviceName!=NULL ? deviceName : "NULL", SPI::defaultSPIBits, strerror(errno));
 		return false;
 	}
-	if(ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &defaultSPIMaxSpeedHz)<0) {
-		LOGF_ERROR("Device %s: Setting SPI speed to %d: %s", deviceName!=NULL ? deviceName : "NULL", defaultSPIMaxSpeedHz, strerror(errno));
+	if(ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speedHz)<0) {
+		LOGF_ERROR("Device %s: Setting SPI speed to %d: %s", deviceName!=NULL ? deviceName : "NULL", speedHz, strerror(errno));
 		return false;
 	}
 
+	initDescriptors();
 	return true;
 }
 
 
-bool SPI::close() {
+bool SPIDevBackend::setSpeed(uint32_t hz) {
+	speedHz=hz;
+	if(fd<0)
+		return true;
+
+	if(ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speedHz)<0) {
+		LOGF_ERROR("Setting SPI speed to %d: %s", speedHz, strerror(errno));
+		return false;
+	}
+	for(uint32_t t=0; t<MAX_FRAMES; t++)
+		descriptors[t].speed_hz=speedHz;
+	return true;
+}
+
+
+void SPIDevBackend::initDescriptors() {
+	memset(descriptors, 0, sizeof(descriptors));
+	for(uint32_t t=0; t<MAX_FRAMES; t++) {
+		descriptors[t].speed_hz     =speedHz;
+		descriptors[t].delay_usecs  =SPI::defaultSPIDelayUsec;
+		descriptors[t].bits_per_word=SPI::defaultSPIBits;
+		descriptors[t].cs_change    =1;
+	}
+}
+
+
+bool SPIDevBackend::close() {
 	if(fd>=0) {
-		if(debugLevel>=TMC_DEBUG_DEBUG)
-			LOGF_DEBUG("Shutting down existing device with file descriptor %d", fd);
 		::close(fd);
 		fd=-1;
 	}
@@ -78,26 +282,35 @@ bool SPI::close() {
 }
 
 
-bool SPI::sendReceive(const uint8_t *tx, uint8_t *rx, uint32_t len) {
-	if((len==0) || ((len%5)!=0)) {
-		LOGF_ERROR("SPI send/receive: length %d not a nonzero multiple of 5", len);
-		return false;		
+bool SPIDevBackend::transfer(const uint8_t *tx, uint8_t *rx, uint32_t frameLen, uint32_t numFrames) {
+	if(numFrames==0 || numFrames>MAX_FRAMES)
+		return false;
+	for(uint32_t t=0; t<numFrames; t++) {
+		descriptors[t].tx_buf=(unsigned long) &tx[frameLen*t];
+		descriptors[t].rx_buf=(unsigned long) &rx[frameLen*t];
+		descriptors[t].len   =frameLen;
+	}
+	return submit(numFrames);
+}
+
+
+bool SPIDevBackend::transfer(const SPIFrame *frames, uint32_t numFrames) {
+	if(numFrames==0 || numFrames>MAX_FRAMES)
+		return false;
+	for(uint32_t t=0; t<numFrames; t++) {
+		descriptors[t].tx_buf=(unsigned long) frames[t].tx;
+		descriptors[t].rx_buf=(unsigned long) frames[t].rx;
+		descriptors[t].len   =frames[t].len;
 	}
+	return submit(numFrames);
+}
+
 
-	const uint32_t numTransfers=len/5;
-	struct spi_ioc_transfer tr[numTransfers];
-	for(uint32_t t=0; t<numTransfers; t++)
-		tr[t] = {
-			.tx_buf        = (unsigned long) &tx[5*t],
-			.rx_buf        = (unsigned long) &rx[5*t],
-			.len           = 5,
-			.speed_hz      = defaultSPIMaxSpeedHz,
-			.delay_usecs   = defaultSPIDelayUsec,
-			.bits_per_word = defaultSPIBits,
-			.cs_change     = ((t==(numTransfers-1)) ? (uint8_t) 0 : (uint8_t) 0xff),
-			.pad           = 0,
-		};
-	int res=ioctl(fd, SPI_IOC_MESSAGE(numTransfers), tr);
+bool SPIDevBackend::submit(uint32_t numFrames) {
+	// the last datagram releases chip select at the end of the message. Restore the preset afterwards
+	descriptors[numFrames-1].cs_change=0;
+	int res=ioctl(fd, SPI_IOC_MESSAGE(numFrames), descriptors);
+	descriptors[numFrames-1].cs_change=1;
 
 	if(res<0) 
 		LOGF_ERROR("SPI send/receive: %s", strerror(errno));
@@ -23,6 +23,94 @@
 #define PIMOCO_SPI_H
 
 #include <stdint.h>
+#include <stddef.h>  // for NULL
+#include <functional>
+#include <linux/spi/spidev.h>  // for spi_ioc_transfer
+#include "pimoco_spi_worker.h"
+#include "pimoco_spi_trace.h"
+
+// One datagram within an SPI message. Chip select is toggled after each datagram except the last one
+struct SPIFrame {
+	const uint8_t *tx;  // bytes to send
+	uint8_t       *rx;  // buffer for received bytes, same length as tx
+	uint32_t       len; // number of bytes
+};
+
+
+// A backend performing raw SPI transfers for a device, e.g. the Linux spidev driver or a software emulator
+class SPIBackend {
+public:
+	// Destroys this backend
+	virtual ~SPIBackend() { }
+
+	// Opens the given device. Returns true on success, else false
+	virtual bool open(const char *deviceName)=0;
+
+	// Closes the device. Returns true on success, else false
+	virtual bool close()=0;
+
+	// Returns true if the device is open, else false
+	virtual bool isOpen() const=0;
+
+	// Sends the given number of datagrams of the given length each from contiguous buffers, toggling chip select in between,
+	// and retrieves the same number of bytes. At most MAX_FRAMES datagrams. Returns true on success, else false
+	virtual bool transfer(const uint8_t *tx, uint8_t *rx, uint32_t frameLen, uint32_t numFrames)=0;
+
+	// Sends the given list of datagrams with individual buffers and lengths as a single message, toggling chip select
+	// in between. At most MAX_FRAMES datagrams. Returns true on success, else false
+	virtual bool transfer(const SPIFrame *frames, uint32_t numFrames)=0;
+
+	// Returns true if the backend drives physical hardware, including GPIO interrupt lines, else false
+	virtual bool isHardware() const { return true; }
+
+	// Sets the SPI clock speed in Hz, taking effect immediately if open, else on open. Returns true on success, else false
+	virtual bool setSpeed(uint32_t hz) { (void) hz; return true; }
+
+	enum {
+		MAX_FRAMES = 128  // maximum number of datagrams per message
+	};
+};
+
+
+// A backend for SPI devices attached via the Linux spidev driver
+class SPIDevBackend : public SPIBackend {
+public:
+	// Creates a spidev backend with the given SPI clock speed in Hz. INDI device name is used by logging macros
+	SPIDevBackend(const char *theIndiDeviceName, uint32_t theSpeedHz) : fd(-1), speedHz(theSpeedHz), indiDeviceName(theIndiDeviceName) { }
+
+	// Destroys this backend, closing the device if open
+	virtual ~SPIDevBackend() { close(); }
+
+	virtual bool open(const char *deviceName) override;
+	virtual bool close() override;
+	virtual bool isOpen() const override { return fd>=0; }
+	virtual bool transfer(const uint8_t *tx, uint8_t *rx, uint32_t frameLen, uint32_t numFrames) override;
+	virtual bool transfer(const SPIFrame *frames, uint32_t numFrames) override;
+	virtual bool setSpeed(uint32_t hz) override;
+
+	// Get Indi device name. Used by logging macros
+	const char *getDeviceName() const { return indiDeviceName; }
+
+protected:
+	// Initializes all transfer descriptors with the constant settings for this device, so transfers only fill in buffers and lengths
+	void initDescriptors();
+
+	// Submits the given number of prepared transfer descriptors as a single message. Returns true on success, else false
+	bool submit(uint32_t numFrames);
+
+	// Preallocated transfer descriptors, one per datagram in a message
+	alignas(64) struct spi_ioc_transfer descriptors[MAX_FRAMES];
+
+	// File descriptor for the SPI device
+	int fd;
+
+	// SPI clock speed in Hz
+	uint32_t speedHz;
+
+	// INDI device name. Used by logging macros
+	const char *indiDeviceName;
+};
+
 
 // A SPI device
 class SPI {
@@ -38,10 +126,11 @@ public:
 	};
 
 	// Creates device connected via SPI
-	SPI(const char *theIndiDeviceName, const char *theAxisName) : fd(-1), debugLevel(TMC_DEBUG_DEBUG), indiDeviceName(theIndiDeviceName), axisName(theAxisName) { }
+	SPI(const char *theIndiDeviceName, const char *theAxisName) : backend(NULL), worker(NULL), speedHz(defaultSPIMaxSpeedHz), 
+	    busPriority(SPIArbiter::PRIORITY_NORMAL), debugLevel(TMC_DEBUG_DEBUG), indiDeviceName(theIndiDeviceName), axisName(theAxisName), stats() { }
 
 	// Destroys this device connected via SPI
-	~SPI() { close(); }
+	virtual ~SPI() { close(); delete backend; }
 
 	// Opens and initializes an SPI device. Returns true on success, else false
 	bool open(const char *device);
@@ -50,12 +139,42 @@ public:
 	bool close();
 
 	// Returns true if the device is connected, else false
-	bool isConnected() const { return fd>=0; }
+	bool isConnected() const { return backend!=NULL && backend->isOpen(); }
+
+	// Returns true if the device is backed by physical hardware, false if emulated
+	bool isHardware() const { return backend==NULL || backend->isHardware(); }
 
 	// Sends the given number of bytes to the device, then retrieves the same number of bytes.  Number of bytes must be dividable by 5.
-	// Returns true on success, else false
+	// Executed on the I/O worker thread of the bus. Returns true on success, else false
 	virtual bool sendReceive(const uint8_t *tx, uint8_t *rx, uint32_t numBytes);
 
+	// Sends the given list of datagrams as a single message, toggling chip select in between, and retrieves the same number of bytes.
+	// Datagrams may have any nonzero length. Executed on the I/O worker thread of the bus. Returns true on success, else false
+	bool sendReceive(const SPIFrame *frames, uint32_t numFrames);
+
+	// Queues the given command for asynchronous execution on the I/O worker thread of the bus. Returns immediately.
+	// Returns true if queued, false if the device is not open or the queue is full
+	bool post(std::function<void()> &&command);
+
+	// Executes the given callable on the I/O worker thread of the bus and waits for its completion.
+	// Runs inline if called from the worker thread, or if the device is not open
+	template<class F> void call(F &f) { if(worker!=NULL) worker->call(f); else f(); }
+
+	// Returns the SPI clock speed in Hz used for transfers
+	uint32_t getSpeedHz() const { return speedHz; }
+
+	// Sets the SPI clock speed in Hz for subsequent transfers. Takes effect immediately if open, else on open. Returns true on success, else false
+	bool setSpeedHz(uint32_t value);
+
+	// Returns the priority of this device's messages when arbitrating the bus with other processes
+	enum SPIArbiter::Priority getBusPriority() const { return busPriority; }
+
+	// Sets the priority of this device's messages when arbitrating the bus with other processes, e.g. low for a focuser
+	void setBusPriority(enum SPIArbiter::Priority value) { busPriority=value; }
+
+	// Returns bus statistics accumulated by all processes sharing the bus. All zero if not arbitrated
+	SPIArbiter::Stats getBusStats();
+
 	// Gets driver debugging level	
 	enum DriverDebugLevel getDebugLevel() const { return debugLevel; }
 
@@ -68,10 +187,53 @@ public:
 	// Get Axis name. Used by logging macros
 	const char *getAxisName() const { return axisName; }
 
+	// SPI traffic statistics, e.g. for benchmarking
+	struct Stats {
+		uint64_t messages; // number of SPI messages, i.e. ioctl calls
+		uint64_t frames;   // number of datagrams
+		uint64_t bytes;    // number of bytes sent, equal to the number received
+		uint64_t busyUs;   // wall clock time spent in send/receive, in microseconds
+		uint64_t maxUs;    // maximum wall clock time of a single send/receive, in microseconds
+		uint64_t waitUs;   // wall clock time spent waiting for other processes to release the bus, in microseconds
+	};
+
+	// Returns SPI traffic statistics since the last reset
+	const Stats &getStats() const { return stats; }
+
+	// Resets SPI traffic statistics
+	void resetStats() { stats=Stats(); }
+
+	// Returns the trace of raw datagrams exchanged with this device. Always recording
+	const SPITrace &getTrace() const { return trace; }
+
 
 protected:
-	// File descriptor for the SPI device
-	int fd;
+	// Creates the backend for the given device. Defaults to the Linux spidev driver, which opens the device itself
+	virtual SPIBackend *createBackend(const char * /* deviceName */) { return new SPIDevBackend(indiDeviceName, speedHz); }
+
+	// Performs the transfer for sendReceive() on the current thread and updates statistics. Returns true on success, else false
+	bool transfer(const uint8_t *tx, uint8_t *rx, uint32_t numBytes);
+
+	// Performs the transfer for sendReceive() with a frame list on the current thread and updates statistics. Returns true on success, else false
+	bool transfer(const SPIFrame *frames, uint32_t numFrames);
+
+	// Acquires the bus from other processes for one message. Returns the arbiter to unlock afterwards, or NULL if not arbitrated
+	SPIArbiter *lockBus();
+
+	// Updates statistics with a transfer of the given size and duration
+	void updateStats(uint32_t numFrames, uint32_t numBytes, uint64_t us);
+
+	// Backend performing the raw transfers. Created on open
+	SPIBackend *backend;
+
+	// I/O worker thread serializing all traffic on the bus. Acquired on open
+	SPIWorker *worker;
+
+	// SPI clock speed in Hz
+	uint32_t speedHz;
+
+	// Priority of this device's messages on the bus
+	enum SPIArbiter::Priority busPriority;
 
 	// Debug level
 	enum DriverDebugLevel debugLevel;
@@ -82,21 +244,29 @@ protected:
 	// Axis name. Used by logging macros
 	const char *axisName;
 
+	// SPI traffic statistics
+	Stats stats;
+
+	// Trace of raw datagrams, written on the I/O worker thread only
+	SPITrace trace;
+
 
 public:
 	// Default SPI device
 	static const char *defaultSPIDevice;
 
+	// Default SPI maximum speed in Hertz. Known to be safe with the TMC5160-BOB
+	static const uint32_t defaultSPIMaxSpeedHz;
+
 protected:
+	friend class SPIDevBackend;
+
 	// Default SPI mode settings
 	static const uint8_t defaultSPIMode;
 
 	// Default SPI bit settings
 	static const uint8_t defaultSPIBits;
 
-	// Default SPI maximum speed in Hertz
-	static const uint32_t defaultSPIMaxSpeedHz;
-
 	// Default SPI delay in microseconds
 	static const uint32_t defaultSPIDelayUsec;
 };
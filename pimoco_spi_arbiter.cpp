@@ -0,0 +1,197 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "pimoco_spi_arbiter.h"
+#include "pimoco_spi_trace.h"  // for SPITrace::now
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>            // for INT_MAX
+#include <signal.h>            // for kill
+#include <stdio.h>             // for snprintf
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+
+const uint64_t SPIArbiter::waitSliceNs=1000000;
+
+// Waits on the given shared futex word while it holds the given value, for at most the given time
+static void futexWait(std::atomic<uint32_t> *word, uint32_t value, uint64_t timeoutNs) {
+	struct timespec ts={ (time_t) (timeoutNs/1000000000ull), (long) (timeoutNs%1000000000ull) };
+	syscall(SYS_futex, (uint32_t*) word, FUTEX_WAIT, value, &ts, NULL, 0);
+}
+
+// Wakes all waiters on the given shared futex word
+static void futexWakeAll(std::atomic<uint32_t> *word) {
+	syscall(SYS_futex, (uint32_t*) word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+
+bool SPIArbiter::open(const char *busName) {
+	close();
+
+	// segment name is the bus name with slashes replaced, e.g. /pimoco_dev_spidev0 for /dev/spidev0
+	char name[128];
+	int len=snprintf(name, sizeof(name), "/pimoco");
+	for(const char *c=busName; *c && len<(int) sizeof(name)-1; c++)
+		name[len++]=(*c=='/') ? '_' : *c;
+	name[len]=0;
+
+	int fd=shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0660);
+	if(fd<0)
+		return false;
+
+	// share the segment with the group owning the bus devices, e.g. spi, as all drivers on the bus need that group anyway.
+	// Only the creator can change ownership; others fail harmlessly
+	char device[128];
+	snprintf(device, sizeof(device), "%s.0", busName);
+	struct stat st;
+	if(stat(device, &st)==0 && fchown(fd, (uid_t) -1, st.st_gid)<0) {
+		// keep the group of the creator
+	}
+	fchmod(fd, 0660);  // regardless of umask
+	if(ftruncate(fd, sizeof(Shared))<0) {
+		::close(fd);
+		return false;
+	}
+	void *p=mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(p==MAP_FAILED)
+		return false;
+	shared=(Shared*) p;
+	pid=(int32_t) getpid();
+	return true;
+}
+
+
+void SPIArbiter::close() {
+	if(shared==NULL)
+		return;
+	munmap(shared, sizeof(Shared));
+	shared=NULL;
+}
+
+
+bool SPIArbiter::isDead(int32_t pid) {
+	return kill(pid, 0)<0 && errno==ESRCH;
+}
+
+
+bool SPIArbiter::hasHigherPriorityWaiters(enum Priority priority) {
+	bool res=false;
+	for(int i=0; i<MAX_WAITERS; i++) {
+		uint64_t w=shared->waiters[i].load(std::memory_order_acquire);
+		if(w==0 || (int32_t) (w>>32)==pid)
+			continue;
+		if(isDead((int32_t) (w>>32))) {
+			shared->waiters[i].compare_exchange_strong(w, 0, std::memory_order_acq_rel);
+			continue;
+		}
+		if((uint32_t) w>(uint32_t) priority)
+			res=true;
+	}
+	return res;
+}
+
+
+bool SPIArbiter::recoverFromDeadOwner() {
+	uint32_t c=shared->lockWord.load(std::memory_order_acquire);
+	int32_t owner=(int32_t) (c & LOCK_PID);
+	if(owner==0 || owner==pid || !isDead(owner))
+		return false;
+	// the owner id is part of the word, so this fails if the lock changed hands in the meantime
+	if(!shared->lockWord.compare_exchange_strong(c, 0, std::memory_order_acq_rel))
+		return false;
+	futexWakeAll(&shared->lockWord);
+	return true;
+}
+
+
+uint64_t SPIArbiter::lock(enum Priority priority) {
+	if(shared==NULL)
+		return 0;
+
+	uint64_t start=SPITrace::now();
+
+	// fast path: uncontended, and no waiter of higher priority
+	uint32_t c=0;
+	if(!hasHigherPriorityWaiters(priority) && shared->lockWord.compare_exchange_strong(c, (uint32_t) pid, std::memory_order_acquire)) {
+		lockStartNs=start;
+		return 0;
+	}
+
+	// register as waiter under our process id, so survivors can free the slot should we die while waiting.
+	// If all slots are taken, wait without announcing our priority
+	uint64_t slotValue=(((uint64_t) (uint32_t) pid)<<32) | (uint32_t) priority;
+	int slot=-1;
+	for(int i=0; i<MAX_WAITERS && slot<0; i++) {
+		uint64_t expected=0;
+		if(shared->waiters[i].compare_exchange_strong(expected, slotValue, std::memory_order_acq_rel))
+			slot=i;
+	}
+
+	// once we have slept, others may be sleeping as well. Acquire as contended so unlock wakes them
+	uint32_t acquireAs=(uint32_t) pid;
+	for(;;) {
+		c=shared->lockWord.load(std::memory_order_acquire);
+		if(c==0) {
+			if(!hasHigherPriorityWaiters(priority) && shared->lockWord.compare_exchange_strong(c, acquireAs, std::memory_order_acquire))
+				break;
+			// let the higher priority waiter go first
+			futexWait(&shared->lockWord, 0, waitSliceNs/10);
+		} else {
+			if(!(c & LOCK_WAITERS) && !shared->lockWord.compare_exchange_strong(c, c | LOCK_WAITERS, std::memory_order_acq_rel))
+				continue;
+			futexWait(&shared->lockWord, c | LOCK_WAITERS, waitSliceNs);
+			recoverFromDeadOwner();
+		}
+		acquireAs=((uint32_t) pid) | LOCK_WAITERS;
+	}
+
+	if(slot>=0)
+		shared->waiters[slot].store(0, std::memory_order_release);
+	lockStartNs=SPITrace::now();
+	uint64_t waited=lockStartNs-start;
+	shared->waitNs[priority].fetch_add(waited, std::memory_order_relaxed);
+	return waited;
+}
+
+
+void SPIArbiter::unlock() {
+	if(shared==NULL)
+		return;
+
+	shared->messages.fetch_add(1, std::memory_order_relaxed);
+	shared->busyNs.fetch_add(SPITrace::now()-lockStartNs, std::memory_order_relaxed);
+	if(shared->lockWord.exchange(0, std::memory_order_release) & LOCK_WAITERS)
+		futexWakeAll(&shared->lockWord);
+}
+
+
+SPIArbiter::Stats SPIArbiter::getStats() const {
+	Stats s=Stats();
+	if(shared==NULL)
+		return s;
+	s.messages=shared->messages.load(std::memory_order_relaxed);
+	s.busyNs  =shared->busyNs.load(std::memory_order_relaxed);
+	for(int p=0; p<NUM_PRIORITIES; p++)
+		s.waitNs[p]=shared->waitNs[p].load(std::memory_order_relaxed);
+	return s;
+}
@@ -0,0 +1,116 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef PIMOCO_SPI_ARBITER_H
+#define PIMOCO_SPI_ARBITER_H
+
+#include <stdint.h>
+#include <stddef.h>  // for NULL
+#include <atomic>
+
+// Arbitrates one SPI bus between processes, e.g. the mount and focuser drivers sharing /dev/spidev0.x.
+// Uses a futex-based lock in a POSIX shared memory segment named after the bus. Waiters of higher priority
+// take precedence: a lower-priority message is not started while a higher-priority one is waiting.
+// The lock word and the waiter slots record the process ids involved, so state left behind by a process
+// which died at any point is recovered by the survivors. Also maintains bus utilization counters across
+// all processes. Not reentrant; each message locks once. Use from one thread per process and bus.
+class SPIArbiter {
+public:
+	// Message priorities, in ascending order
+	enum Priority : int {
+		PRIORITY_LOW    = 0,  // background traffic, e.g. status polls and initialization bursts
+		PRIORITY_NORMAL = 1,  // regular commands
+		PRIORITY_HIGH   = 2,  // latency-critical commands, e.g. guide pulse velocity writes
+		NUM_PRIORITIES  = 3
+	};
+
+	// Bus statistics accumulated by all processes since the shared segment was created
+	struct Stats {
+		uint64_t messages;                // number of messages locked
+		uint64_t busyNs;                  // time the bus was held, in nanoseconds
+		uint64_t waitNs[NUM_PRIORITIES];  // time spent waiting for the bus, per priority, in nanoseconds
+	};
+
+	// Creates an arbiter which is not yet attached to a bus
+	SPIArbiter() : shared(NULL), pid(0), lockStartNs(0) { }
+
+	// Detaches from the bus
+	~SPIArbiter() { close(); }
+
+	// Attaches to the shared segment for the given bus name, e.g. /dev/spidev0, creating it if needed. Returns true on success, else false
+	bool open(const char *busName);
+
+	// Detaches from the shared segment. The segment itself persists for other processes
+	void close();
+
+	// Returns true if attached to a shared segment, else false
+	bool isOpen() const { return shared!=NULL; }
+
+	// Acquires the bus for one message with the given priority, waiting as needed. Returns the time waited in nanoseconds
+	uint64_t lock(enum Priority priority);
+
+	// Releases the bus and accounts for the time it was held
+	void unlock();
+
+	// Returns a snapshot of bus statistics. All zero if not open
+	Stats getStats() const;
+
+protected:
+	enum {
+		LOCK_WAITERS = 0x80000000u,  // lock word flag: other processes may be sleeping on the lock
+		LOCK_PID     = 0x3fffffffu,  // lock word mask: id of the owning process, 0 if free
+	};
+
+	enum {
+		MAX_WAITERS  = 32  // number of waiter slots. Further waiters wait without priority
+	};
+
+	// Layout of the shared segment. All-zero is a valid initial state
+	struct Shared {
+		std::atomic<uint32_t> lockWord;                  // owner process id, or 0 if free, plus LOCK_WAITERS. Set in one step on acquire
+		std::atomic<uint64_t> waiters[MAX_WAITERS];      // waiter slots: process id in the upper, priority in the lower 32 bits. 0 if free
+		std::atomic<uint64_t> messages;
+		std::atomic<uint64_t> busyNs;
+		std::atomic<uint64_t> waitNs[NUM_PRIORITIES];
+	};
+
+	// Returns true if a live waiter with priority above the given one is present. Frees slots of dead waiters
+	bool hasHigherPriorityWaiters(enum Priority priority);
+
+	// Returns true if the process with the given id no longer exists
+	static bool isDead(int32_t pid);
+
+	// Releases the lock if its owner process no longer exists. Returns true if released
+	bool recoverFromDeadOwner();
+
+	// Shared segment, or NULL if not attached
+	Shared *shared;
+
+	// Id of this process, as stored in the lock word and waiter slots
+	int32_t pid;
+
+	// Time the bus was locked by this process, in nanoseconds
+	uint64_t lockStartNs;
+
+	// Time a waiter sleeps before rechecking priorities and the owner, in nanoseconds
+	static const uint64_t waitSliceNs;
+};
+
+#endif // PIMOCO_SPI_ARBITER_H
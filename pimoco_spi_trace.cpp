@@ -0,0 +1,94 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "pimoco_spi_trace.h"
+#include <string.h>  // for memcpy
+#include <stdio.h>   // for fopen etc.
+#include <time.h>    // for clock_gettime
+
+
+uint64_t SPITrace::now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec)*1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+
+void SPITrace::record(const uint8_t *tx, const uint8_t *rx, uint32_t frameLen, uint32_t numFrames, bool failed) {
+	uint64_t ts=now();
+	for(uint32_t i=0; i<numFrames; i++)
+		record(tx+i*frameLen, rx+i*frameLen, frameLen, (i==0 ? TRACE_FIRST : 0) | (failed ? TRACE_FAILED : 0), ts);
+}
+
+
+void SPITrace::record(const uint8_t *tx, const uint8_t *rx, uint32_t len, uint8_t flags, uint64_t timestampNs) {
+	uint64_t h=head.load(std::memory_order_relaxed);
+	Record &r=records[h & (CAPACITY-1)];
+	uint32_t n=len<sizeof(r.tx) ? len : sizeof(r.tx);
+	r.timestampNs=timestampNs;
+	memcpy(r.tx, tx, n);
+	memcpy(r.rx, rx, n);
+	r.len=(uint16_t) len;
+	r.flags=flags;
+	head.store(h+1, std::memory_order_release);
+}
+
+
+uint32_t SPITrace::snapshot(Record *result, uint32_t maxRecords) const {
+	uint64_t end=head.load(std::memory_order_acquire);
+	uint64_t available=end<(uint64_t) CAPACITY ? end : (uint64_t) CAPACITY;
+	uint64_t n=available<maxRecords ? available : maxRecords;
+	uint64_t start=end-n;
+	for(uint64_t i=0; i<n; i++)
+		result[i]=records[(start+i) & (CAPACITY-1)];
+
+	// drop records the writer may have overwritten while copying. Keeps one slot of slack for a write in progress
+	uint64_t newEnd=head.load(std::memory_order_acquire);
+	uint64_t firstValid=(newEnd+1>CAPACITY) ? newEnd+1-CAPACITY : 0;
+	if(start>=firstValid)
+		return (uint32_t) n;
+	uint64_t skip=firstValid-start;
+	if(skip>=n)
+		return 0;
+	memmove(result, result+skip, (n-skip)*sizeof(Record));
+	return (uint32_t) (n-skip);
+}
+
+
+bool SPITrace::save(const char *fileName) const {
+	Record *buffer=new Record[CAPACITY];
+	uint32_t n=snapshot(buffer, CAPACITY);
+	FILE *f=fopen(fileName, "wb");
+	bool res=(f!=NULL) && (fwrite(buffer, sizeof(Record), n, f)==n);
+	if(f!=NULL && fclose(f)!=0)
+		res=false;
+	delete[] buffer;
+	return res;
+}
+
+
+bool SPITrace::load(const char *fileName, Record *result, uint32_t maxRecords, uint32_t *numRecords) {
+	*numRecords=0;
+	FILE *f=fopen(fileName, "rb");
+	if(f==NULL)
+		return false;
+	*numRecords=(uint32_t) fread(result, sizeof(Record), maxRecords, f);
+	bool res=!ferror(f);
+	fclose(f);
+	return res;
+}
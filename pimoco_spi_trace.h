@@ -0,0 +1,86 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef PIMOCO_SPI_TRACE_H
+#define PIMOCO_SPI_TRACE_H
+
+#include <stdint.h>
+#include <atomic>
+
+// A fixed-size ring buffer of raw SPI datagrams with monotonic timestamps. Recording is cheap enough
+// to stay enabled permanently: no formatting, no allocation, no locks. A single writer (the I/O worker
+// thread of the bus) appends; readers on any thread take consistent snapshots and decode on demand.
+class SPITrace {
+public:
+	// A recorded datagram
+	struct Record {
+		uint64_t timestampNs; // CLOCK_MONOTONIC time at which the message completed, in nanoseconds
+		uint8_t  tx[8];       // first bytes sent
+		uint8_t  rx[8];       // first bytes received
+		uint16_t len;         // full datagram length in bytes
+		uint8_t  flags;       // TRACE_* flags
+		uint8_t  pad[5];
+	};
+
+	// Record flags
+	enum {
+		TRACE_FIRST  = 1,  // first datagram of a message
+		TRACE_FAILED = 2,  // message failed
+	};
+
+	enum {
+		CAPACITY = 4096  // number of records, must be a power of two
+	};
+
+	// Creates an empty trace
+	SPITrace() : head(0) { }
+
+	// Appends the given number of datagrams of the given length each from contiguous buffers as one message. Writer thread only
+	void record(const uint8_t *tx, const uint8_t *rx, uint32_t frameLen, uint32_t numFrames, bool failed);
+
+	// Appends one datagram with the given flags and timestamp. Writer thread only
+	void record(const uint8_t *tx, const uint8_t *rx, uint32_t len, uint8_t flags, uint64_t timestampNs);
+
+	// Copies up to the given number of most recent records into the given array, oldest first.
+	// Returns the number of records copied. Safe to call from any thread
+	uint32_t snapshot(Record *result, uint32_t maxRecords) const;
+
+	// Returns the total number of records appended since creation
+	uint64_t size() const { return head.load(std::memory_order_acquire); }
+
+	// Writes a snapshot of the trace to the given file in raw binary form, for offline decoding. Returns true on success, else false
+	bool save(const char *fileName) const;
+
+	// Reads up to the given number of records written by save() from the given file into the given array, oldest first.
+	// Stores the number of records read in the variable pointed to by numRecords. Returns true on success, else false
+	static bool load(const char *fileName, Record *result, uint32_t maxRecords, uint32_t *numRecords);
+
+	// Returns the current CLOCK_MONOTONIC time in nanoseconds
+	static uint64_t now();
+
+protected:
+	// Ring of records, indexed by sequence number modulo CAPACITY
+	Record records[CAPACITY];
+
+	// Sequence number of the next record to write
+	std::atomic<uint64_t> head;
+};
+
+#endif // PIMOCO_SPI_TRACE_H
@@ -0,0 +1,267 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "pimoco_spi_worker.h"
+#include <unistd.h>
+#include <string.h>
+#include <sched.h>         // for sched_yield
+#include <stdio.h>         // for fprintf
+#include <errno.h>
+#include <semaphore.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <mutex>
+
+
+SPIWorker *SPIWorker::workers[MAX_WORKERS]={ NULL };
+
+// Protects the table of workers. Only used on acquire and release, never on the I/O path
+static std::mutex workersMutex;
+
+
+SPIWorker *SPIWorker::acquire(const char *deviceName) {
+	// bus name is the device name up to the last dot, e.g. /dev/spidev0 for /dev/spidev0.1
+	char bus[sizeof(((SPIWorker*)0)->busName)];
+	strncpy(bus, deviceName!=NULL ? deviceName : "", sizeof(bus)-1);
+	bus[sizeof(bus)-1]=0;
+	char *dot=strrchr(bus, '.');
+	if(dot!=NULL)
+		*dot=0;
+
+	std::lock_guard<std::mutex> lock(workersMutex);
+	int freeIndex=-1;
+	for(int i=0; i<MAX_WORKERS; i++) {
+		if(workers[i]!=NULL && !strcmp(workers[i]->busName, bus)) {
+			workers[i]->refCount++;
+			return workers[i];
+		}
+		if(workers[i]==NULL && freeIndex<0)
+			freeIndex=i;
+	}
+	if(freeIndex<0)
+		return NULL;
+	SPIWorker *worker=new SPIWorker(bus);
+	if(worker->eventFd<0) {
+		// producers could never wake the worker
+		delete worker;
+		return NULL;
+	}
+	workers[freeIndex]=worker;
+	return worker;
+}
+
+
+void SPIWorker::release(SPIWorker *worker) {
+	if(worker==NULL)
+		return;
+	std::lock_guard<std::mutex> lock(workersMutex);
+	if(--worker->refCount>0)
+		return;
+	for(int i=0; i<MAX_WORKERS; i++)
+		if(workers[i]==worker)
+			workers[i]=NULL;
+	delete worker;
+}
+
+
+SPIWorker::SPIWorker(const char *theBusName) : refCount(1), head(0), tail(0), numWatches(0), running(true) {
+	strncpy(busName, theBusName, sizeof(busName)-1);
+	busName[sizeof(busName)-1]=0;
+	for(uint32_t i=0; i<QUEUE_SIZE; i++) {
+		slots[i].sequence.store(i, std::memory_order_relaxed);
+		slots[i].fn=NULL;
+		slots[i].arg=NULL;
+		slots[i].done=NULL;
+	}
+	for(uint32_t i=0; i<MAX_WATCHES; i++)
+		watches[i].fd=-1;
+	eventFd=eventfd(0, EFD_CLOEXEC);
+	if(eventFd<0) {
+		fprintf(stderr, "SPI worker %s: unable to create event descriptor: %s\n", busName, strerror(errno));
+		return;
+	}
+	thread=std::thread(&SPIWorker::run, this);
+}
+
+
+SPIWorker::~SPIWorker() {
+	if(thread.joinable()) {
+		auto stop=[this](){ running.store(false, std::memory_order_relaxed); };
+		call(stop);
+		thread.join();
+	}
+	if(eventFd>=0)
+		::close(eventFd);
+}
+
+
+SPIWorker::Slot *SPIWorker::claim(uint32_t *pos, bool wait) {
+	uint32_t p=head.load(std::memory_order_relaxed);
+	for(;;) {
+		Slot *slot=&slots[p & (QUEUE_SIZE-1)];
+		int32_t diff=(int32_t) (slot->sequence.load(std::memory_order_acquire) - p);
+		if(diff==0) {
+			if(head.compare_exchange_weak(p, p+1, std::memory_order_relaxed)) {
+				*pos=p;
+				return slot;
+			}
+		} else if(diff<0) {
+			if(!wait)
+				return NULL;  // queue full
+			sched_yield();
+			p=head.load(std::memory_order_relaxed);
+		} else
+			p=head.load(std::memory_order_relaxed);
+	}
+}
+
+
+void SPIWorker::publish(Slot *slot, uint32_t pos) {
+	slot->sequence.store(pos+1, std::memory_order_release);
+	uint64_t one=1;
+	if(::write(eventFd, &one, sizeof(one))<0)
+		{ }  // counter overflow is harmless, the worker is awake anyway
+}
+
+
+bool SPIWorker::post(std::function<void()> &&command) {
+	uint32_t pos;
+	Slot *slot=claim(&pos, false);
+	if(slot==NULL)
+		return false;
+	slot->command=std::move(command);
+	slot->fn=NULL;
+	slot->done=NULL;
+	publish(slot, pos);
+	return true;
+}
+
+
+void SPIWorker::callRaw(void (*fn)(void *), void *arg) {
+	if(isWorkerThread()) {
+		fn(arg);
+		return;
+	}
+
+	sem_t done;
+	sem_init(&done, 0, 0);
+	uint32_t pos;
+	Slot *slot=claim(&pos, true);
+	slot->fn=fn;
+	slot->arg=arg;
+	slot->done=&done;
+	publish(slot, pos);
+	while(sem_wait(&done)<0 && errno==EINTR)
+		;
+	sem_destroy(&done);
+}
+
+
+bool SPIWorker::watch(int fd, std::function<void()> &&handler) {
+	bool res=false;
+	auto f=[&]() {
+		if(fd<0 || numWatches>=MAX_WATCHES)
+			return;
+		watches[numWatches].fd=fd;
+		watches[numWatches].handler=std::move(handler);
+		numWatches++;
+		res=true;
+	};
+	call(f);
+	return res;
+}
+
+
+void SPIWorker::unwatch(int fd) {
+	auto f=[&]() {
+		for(uint32_t i=0; i<numWatches; i++)
+			if(watches[i].fd==fd) {
+				watches[i]=std::move(watches[--numWatches]);
+				watches[numWatches].fd=-1;
+				watches[numWatches].handler=nullptr;
+				return;
+			}
+	};
+	call(f);
+}
+
+
+bool SPIWorker::wait() {
+	struct pollfd fds[1+MAX_WATCHES];
+	fds[0].fd=eventFd;
+	fds[0].events=POLLIN;
+	uint32_t n=numWatches;
+	for(uint32_t i=0; i<n; i++) {
+		fds[1+i].fd=watches[i].fd;
+		fds[1+i].events=POLLIN;
+	}
+	if(poll(fds, 1+n, -1)<0)
+		return errno==EINTR;
+
+	if(fds[0].revents & POLLIN) {
+		uint64_t count;
+		if(::read(eventFd, &count, sizeof(count))<0 && errno!=EINTR && errno!=EAGAIN)
+			return false;
+	}
+	// look up handlers by descriptor, as a handler may unwatch others
+	for(uint32_t i=0; i<n; i++) {
+		if(!(fds[1+i].revents & (POLLIN | POLLERR | POLLHUP)))
+			continue;
+		for(uint32_t j=0; j<numWatches; j++)
+			if(watches[j].fd==fds[1+i].fd) {
+				std::function<void()> handler=watches[j].handler;
+				handler();
+				break;
+			}
+	}
+	return true;
+}
+
+
+void SPIWorker::run() {
+	bool waitFailing=false;
+	while(running.load(std::memory_order_relaxed)) {
+		Slot *slot=&slots[tail & (QUEUE_SIZE-1)];
+		if((int32_t) (slot->sequence.load(std::memory_order_acquire) - (tail+1)) < 0) {
+			// queue empty, sleep until a producer signals or a watched descriptor has input. On errors keep serving
+			// commands, as callers would block forever otherwise, but back off so a persistent error does not spin
+			if(wait())
+				waitFailing=false;
+			else {
+				if(!waitFailing)
+					fprintf(stderr, "SPI worker %s: waiting for commands failed: %s\n", busName, strerror(errno));
+				waitFailing=true;
+				usleep(1000);
+			}
+			continue;
+		}
+
+		if(slot->fn!=NULL) {
+			slot->fn(slot->arg);
+			sem_post((sem_t*) slot->done);
+		} else {
+			std::function<void()> command=std::move(slot->command);
+			slot->command=nullptr;
+			command();
+		}
+		slot->fn=NULL;
+		slot->done=NULL;
+		slot->sequence.store(tail+QUEUE_SIZE, std::memory_order_release);
+		tail++;
+	}
+}
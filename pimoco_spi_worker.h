@@ -0,0 +1,157 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef PIMOCO_SPI_WORKER_H
+#define PIMOCO_SPI_WORKER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include "pimoco_spi_arbiter.h"
+
+// An I/O thread serializing all traffic on one SPI bus. Commands are queued from any thread
+// via a bounded lock-free multi-producer single-consumer ring, and executed in order on the worker thread.
+// The worker sleeps on an eventfd while idle, together with any watched file descriptors such as GPIO line events.
+// Workers are shared by all devices on the same bus.
+class SPIWorker {
+public:
+	// Returns the worker for the bus of the given device, e.g. /dev/spidev0 for /dev/spidev0.1, starting it if needed.
+	// Returns NULL if too many buses are in use or the worker cannot be started
+	static SPIWorker *acquire(const char *deviceName);
+
+	// Releases a worker obtained via acquire(). Stops its thread once the last user has released it
+	static void release(SPIWorker *worker);
+
+	// Queues the given command for asynchronous execution. Returns immediately. Returns true on success, false if the queue is full
+	bool post(std::function<void()> &&command);
+
+	// Executes the given callable on the worker thread and waits for its completion.
+	// Runs inline if called from the worker thread itself. Never allocates
+	template<class F> void call(F &f) { callRaw(&invoke<F>, &f); }
+
+	// Returns true if the caller is running on the worker thread
+	bool isWorkerThread() const { return std::this_thread::get_id()==thread.get_id(); }
+
+	// Waits until all commands queued so far have been executed
+	void drain() { auto noop=[](){ }; call(noop); }
+
+	// Watches the given file descriptor for input while the worker is idle, and invokes the handler on the worker thread
+	// whenever it is readable. The handler must consume the input. Returns true on success, false if too many are watched
+	bool watch(int fd, std::function<void()> &&handler);
+
+	// Stops watching the given file descriptor. Once this returns, its handler is no longer running and will not be invoked again
+	void unwatch(int fd);
+
+	// Returns the name of the bus served by this worker
+	const char *getBusName() const { return busName; }
+
+	// Returns the arbiter sharing the bus with other processes. Use on the worker thread only
+	SPIArbiter *getArbiter() { return &arbiter; }
+
+	enum {
+		QUEUE_SIZE  = 256, // must be a power of two
+		MAX_WATCHES = 16   // maximum number of watched file descriptors
+	};
+
+protected:
+	// Creates a worker for the given bus and starts its thread
+	SPIWorker(const char *theBusName);
+
+	// Stops the thread and destroys this worker
+	~SPIWorker();
+
+	// Invokes a callable of the given type via a type-erased pointer
+	template<class F> static void invoke(void *f) { (*(F*) f)(); }
+
+	// Executes the given function with the given argument on the worker thread and waits for its completion
+	void callRaw(void (*fn)(void *), void *arg);
+
+	// A queued command. Either an owned function object for asynchronous posts,
+	// or a function pointer with argument and completion semaphore for synchronous calls
+	struct Slot {
+		std::atomic<uint32_t> sequence;
+		std::function<void()> command;
+		void (*fn)(void *);
+		void *arg;
+		void *done;  // sem_t to post on completion, or NULL
+	};
+
+	// Claims a queue slot, spinning while the queue is full if wait is true. Returns NULL if full and not waiting
+	Slot *claim(uint32_t *pos, bool wait);
+
+	// Publishes a claimed slot to the worker and wakes it up
+	void publish(Slot *slot, uint32_t pos);
+
+	// Main loop of the worker thread
+	void run();
+
+	// Sleeps until a producer signals or a watched file descriptor becomes readable, and invokes the handlers of the latter.
+	// Returns false with errno set on errors, else true
+	bool wait();
+
+	// Name of the bus served by this worker
+	char busName[64];
+
+	// Number of users which have acquired this worker
+	int refCount;
+
+	// Command ring with per-slot sequence numbers
+	Slot slots[QUEUE_SIZE];
+
+	// Next position to enqueue at, shared by producers
+	alignas(64) std::atomic<uint32_t> head;
+
+	// Next position to dequeue from, owned by the worker thread
+	alignas(64) uint32_t tail;
+
+	// Event file descriptor the worker thread sleeps on
+	int eventFd;
+
+	// A watched file descriptor with its input handler
+	struct Watch {
+		int fd;                        // file descriptor, or negative if unused
+		std::function<void()> handler; // invoked on the worker thread when fd is readable
+	};
+
+	// Watched file descriptors. Accessed on the worker thread only
+	Watch watches[MAX_WATCHES];
+
+	// Number of entries in watches
+	uint32_t numWatches;
+
+	// Cross-process arbiter for the bus, attached on first use by a hardware device
+	SPIArbiter arbiter;
+
+	// Flag: worker thread should keep running
+	std::atomic<bool> running;
+
+	// The worker thread
+	std::thread thread;
+
+	// Active workers, one per bus
+	static SPIWorker *workers[];
+
+	enum {
+		MAX_WORKERS = 8
+	};
+};
+
+#endif // PIMOCO_SPI_WORKER_H
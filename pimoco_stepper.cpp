@@ -25,9 +25,11 @@
 #include <linux/spi/spidev.h>
 #include <cstdio>
 #include <math.h> // for round(), M_PI
+#include <string.h>  // for strncpy, strtok_r
+#include <strings.h> // for strcasecmp
+#include <stdlib.h>  // for strtoul
 #include <sys/time.h>  // for gettimeofday() etc.
 #include <libindi/indilogger.h> // for LOG_..., LOGF_... macros
-#include <wiringPi.h> // for GPIO etc
 
 #include "pimoco_stepper.h"
 #include "pimoco_time.h"
@@ -39,72 +41,302 @@ const int32_t  Stepper::defaultMaxPosition= 1000ul*1000ul*256ul;
 const int32_t  Stepper::defaultMaxGoToSpeed=100000;
 const double   Stepper::defaultStepsPerRev =400;
 const double   Stepper::defaultGearRatio   =3*144;
+const uint32_t Stepper::calibrationSPISpeedsHz[]={ 1000000, 2000000, 3000000, 4000000, 5000000, 6000000, 8000000, 10000000, 12500000, 16000000, 20000000, 0 };
+const uint32_t Stepper::calibrationFrames=4000;
+const uint32_t Stepper::calibrationMarginPercent=75;
+const uint32_t Stepper::traceRecordsOnClose=64;
+const uint32_t Stepper::defaultTelemetryRateHz=10;
+const uint64_t Stepper::recoveryHoldoffNs=10000000000ull;
+
+#define PROFILE_FIELD(name, F, defaultValue)        { name, &Stepper::setField<F>, F::mask>>F::offset, defaultValue, false }
+#define PROFILE_MOTION_FIELD(name, F, defaultValue) { name, &Stepper::setField<F>, F::mask>>F::offset, defaultValue, true  }
+
+const Stepper::ProfileField Stepper::profileFields[Stepper::PROFILE_FIELDS_SIZE]={
+	// Diagnosis 0 output provides interrupts based on ramp function
+	PROFILE_FIELD("DIAG0_ERROR",        TMCF_DIAG0_ERROR,        0),
+	PROFILE_FIELD("DIAG0_OTPW",         TMCF_DIAG0_OTPW,         0),
+	PROFILE_FIELD("DIAG0_STALL_STEP",   TMCF_DIAG0_STALL_STEP,   0),
+	PROFILE_FIELD("DIAG0_INT_PUSHPULL", TMCF_DIAG0_INT_PUSHPULL, 1),
+
+	// Motor current ramp down and direction
+	PROFILE_FIELD("IHOLDDELAY",         TMCF_IHOLDDELAY,        10),
+	PROFILE_FIELD("TPOWERDOWN",         TMCF_TPOWERDOWN,        10),
+	PROFILE_FIELD("SHAFT",              TMCF_SHAFT,              0),
+	PROFILE_FIELD("SW_MODE",            TMCF_SW_MODE,            0),  // all switches and StallGuard disabled
+
+	// Default ramp, used in auto-tuning
+	PROFILE_FIELD("VSTART",             TMCF_VSTART,            10),
+	PROFILE_FIELD("A1",                 TMCF_A1,             11250),
+	PROFILE_FIELD("V1",                 TMCF_V1,            200000),
+	PROFILE_FIELD("AMAX",               TMCF_AMAX,            7000),
+	PROFILE_MOTION_FIELD("VMAX",        TMCF_VMAX,          100000),
+	PROFILE_FIELD("DMAX",               TMCF_DMAX,           11250),
+	PROFILE_FIELD("D1",                 TMCF_D1,              7000),
+	PROFILE_FIELD("VSTOP",              TMCF_VSTOP,             10),
+	PROFILE_FIELD("TZEROWAIT",          TMCF_TZEROWAIT,        100),
+
+	// PWM for StealthChop. Frequency divider 0=2/1024 f_clk, i.e. 29 KHz at 15 MHz clock. Should be in 20/40 KHz range
+	PROFILE_FIELD("PWM_FREQ",           TMCF_PWM_FREQ,           0),
+	PROFILE_FIELD("EN_PWM_MODE",        TMCF_EN_PWM_MODE,        1),
+	PROFILE_FIELD("PWM_AUTOSCALE",      TMCF_PWM_AUTOSCALE,      1),  // StealthChop current regulator
+	PROFILE_FIELD("PWM_AUTOGRAD",       TMCF_PWM_AUTOGRAD,       1),  // StealthChop gradient regulator
+
+	// Chopper. Threshold disabled to use only StealthChop during calibration, full 256 microsteps for internal operation
+	PROFILE_FIELD("CHM",                TMCF_CHM,                0),
+	PROFILE_FIELD("TPWMTHRS",           TMCF_TPWMTHRS,           0),
+	PROFILE_FIELD("MRES",               TMCF_MRES,               0),
+	PROFILE_FIELD("TOFF",               TMCF_TOFF,               5),
+	PROFILE_FIELD("TBL",                TMCF_TBL,                2),
+	PROFILE_FIELD("HSTRT",              TMCF_HSTRT,              4),
+	PROFILE_FIELD("HEND",               TMCF_HEND,               0),
+};
 
 
 Stepper::Stepper(const char *theIndiDeviceName, const char *theAxisName, int diag0Pin)
 					 : TMC5160(theIndiDeviceName, theAxisName, diag0Pin), 
 					 minPosition(defaultMinPosition), maxPosition(defaultMaxPosition),
 				     maxGoToSpeed(defaultMaxGoToSpeed), hardwareMaxCurrent_mA(defaultHardwareMaxCurrent_mA),
-				     stepsPerRev(defaultStepsPerRev), gearRatio(defaultGearRatio) {
+				     stepsPerRev(defaultStepsPerRev), gearRatio(defaultGearRatio), spiSpeedSetting(defaultSPIMaxSpeedHz),
+				     tunedPWMOffset(0), tunedPWMGradient(0), tuneFingerprint(0), warmStart(false), telemetryUpdateNs(0), telemetryUpdateSize(0),
+				     recoveryEnabled(false), recoveryPending(false), recoveryNs(0), recoveryFailed(false) {
+	setProfile("default", "");
+	telemetryRateHz=defaultTelemetryRateHz;
+	updateKinematics();
+
+	// recover after the message which revealed the fault has completed, not from within it
+	subscribeRampEvents(RAMP_EVENTS_FAULT, [this](enum TMCRampEvent /* event */, uint64_t /* timestampNs */) {
+		if(!recoveryEnabled || recoveryPending)
+			return;
+		recoveryPending=true;
+		if(!post([this](){ recover(); })) {
+			LOGF_ERROR("%s: Unable to queue recovery", getAxisName());
+			recoveryPending=false;
+		}
+	});
 }
 
 
 Stepper::~Stepper() {
-	stop();
+	close();
 }
 
 bool Stepper::open(const char *deviceName) {
 	if(!TMC5160::open(deviceName))
 		return false;
+	invalidateShadow();
+	warmStart=false;
 
-	if((!Handshake()) || (!Init())) {
+	// apply configured SPI clock, or calibrate after a handshake at the default clock if requested.
+	// Collect the configuration signature first, as handshake and calibration overwrite it
+	uint32_t signature=0;
+	if(!setSpeedHz(spiSpeedSetting!=0 ? spiSpeedSetting : defaultSPIMaxSpeedHz) || !getRegister(TMCR_X_ENC, &signature) || (!Handshake())) {
+		TMC5160::close();
+		return false;
+	}
+	// a failed calibration has reverted to the default clock, which the handshake has just confirmed
+	if(spiSpeedSetting==0 && !calibrateSPISpeed(&spiSpeedSetting))
+		LOGF_WARN("%s: Continuing at the default SPI clock of %u Hz", getAxisName(), defaultSPIMaxSpeedHz);
+	if(!WarmInit(signature) && !Init()) {
 		TMC5160::close();
 		return false;
 	}
 
+	// telemetry is diagnostic only, so the connection stands even if sampling cannot start
+	telemetryOpen();
+	telemetryUpdateNs=SPITrace::now();
+	telemetryUpdateSize=getTelemetry().size();
+	recoveryNs=0;
+	recoveryFailed=false;
+	recoveryEnabled=true;
 	return true;
 }
 
 
+void Stepper::recover() {
+	recoveryPending=false;
+	if(!recoveryEnabled)
+		return;
+
+	uint64_t start=SPITrace::now();
+	uint32_t gstat, drvStatus;
+	if(!getGStat(&gstat) || !getRegister(TMCR_DRV_STATUS, &drvStatus)) {
+		LOGF_ERROR("%s: Unable to read device status for recovery", getAxisName());
+		recoveryFailed=true;
+		return;
+	}
+	bool reset=TMCF_GSTAT_RESET::extract(gstat);
+	const char *cause=reset ? "reset" : "driver error";
+	if(recoveryNs!=0 && start-recoveryNs<recoveryHoldoffNs) {
+		LOGF_ERROR("%s: Device %s recurred within %llu s of recovering, DRV_STATUS 0x%08x. Giving up, reconnect to re-initialize", 
+		           getAxisName(), cause, (unsigned long long) (recoveryHoldoffNs/1000000000ull), drvStatus);
+		recoveryFailed=true;
+		return;
+	}
+	uint64_t previousNs=recoveryNs;
+	recoveryNs=start;
+
+	// a reset loses all registers, so the position can only be estimated. A driver error leaves the ramp generator and XACTUAL running
+	int32_t position;
+	if(reset) {
+		position=lastGoodPosition;
+		bool deferred, restored=restoreShadow(position, &deferred);
+		if(deferred) {
+			// retry once the INDI thread has committed its batch, which queues behind this command
+			recoveryNs=previousNs;
+			recoveryPending=true;
+			if(!post([this](){ recover(); })) {
+				LOGF_ERROR("%s: Unable to queue recovery", getAxisName());
+				recoveryPending=false;
+				recoveryFailed=true;
+			}
+			return;
+		}
+		if(!restored || !writeConfigSignature()) {
+			LOGF_ERROR("%s: Unable to restore registers after device reset", getAxisName());
+			recoveryFailed=true;
+			return;
+		}
+	} else if(!restartDriver() || !getPosition(&position)) {
+		LOGF_ERROR("%s: Unable to restart driver after driver error", getAxisName());
+		recoveryFailed=true;
+		return;
+	}
+	if(!getGStat(&gstat) || TMCF_GSTAT_DRV_ERR::extract(gstat)) {
+		LOGF_ERROR("%s: Driver error persists after recovery, DRV_STATUS 0x%08x", getAxisName(), drvStatus);
+		recoveryFailed=true;
+		return;
+	}
+	LOGF_WARN("%s: Recovered from device %s in %.1f ms, %s position %'+d and resumed motion", getAxisName(), cause,
+	          1e-6*(double) (SPITrace::now()-start), reset ? "restored" : "kept", position);
+}
+
+
 bool Stepper::Handshake() {
 	// try sending test pattern and capturing response
-	const uint32_t len=5*5;
-	uint8_t tx[len]={
-		TMCR_X_ENC | 0x80, 0x01, 0x02, 0x03, 0x04,  // set XENC to 0x01020304
-		TMCR_X_ENC       , 0x11, 0x12, 0x13, 0x14,  // get XENC
-		TMCR_X_ENC | 0x80, 0x21, 0x22, 0x23, 0x24,  // set XENC to 0x21222324
-		TMCR_X_ENC       , 0x31, 0x32, 0x33, 0x34,  // get XENC
-		TMCR_X_ENC       , 0x41, 0x42, 0x43, 0x44,  // get XENC
-	};
-	uint8_t rx[len];
-	if(!sendReceive(tx, rx, len)) {
-		LOGF_WARN("%s: Handshake failed: send/receive", getAxisName());
+	const uint32_t values[2]={ 0x01020304, 0x21222324 };
+	uint32_t errors;
+	if(!exchangeTestPattern(values, 2, &errors, true))
+		return false;
+	if(errors>0) {
+		LOGF_WARN("%s: Handshake failed: %d of 4 responses mismatched", getAxisName(), errors);
 		return false;
 	}
 
-	if(debugLevel>=TMC_DEBUG_DEBUG)
-		for(uint32_t i=0; i<5; i++)
-			LOGF_DEBUG("%d: sent %02x %02x %02x %02x %02x   recv %02x %02x %02x %02x %02x", i, tx[5*i+0], tx[5*i+1], tx[5*i+2], tx[5*i+3], tx[5*i+4],  rx[5*i+0], rx[5*i+1], rx[5*i+2], rx[5*i+3], rx[5*i+4]  );
+	LOGF_INFO("%s: Handshake successful", getAxisName());
+	return true;
+}
 
-	// validate responses
-	if(rx[5*1+1]!=tx[5*0+1] || rx[5*1+2]!=tx[5*0+2] || rx[5*1+3]!=tx[5*0+3] || rx[5*1+4]!=tx[5*0+4] ) {
-		LOGF_WARN("%s: Handshake failed: got %02x %02x %02x %02x after first set", getAxisName(), rx[5*1+1], rx[5*1+2], rx[5*1+3], rx[5*1+4]);
+
+bool Stepper::exchangeTestPattern(const uint32_t *values, uint32_t num, uint32_t *errors, bool verbose) {
+	// for each value, set XENC and get it back. A final get collects the last response
+	const uint32_t maxValues=(SPIBackend::MAX_FRAMES-1)/2;
+	if(num==0 || num>maxValues) {
+		LOGF_ERROR("%s: Test pattern of %d values not in range 1..%d", getAxisName(), num, maxValues);
 		return false;
 	}
-	if(rx[5*2+1]!=tx[5*0+1] || rx[5*2+2]!=tx[5*0+2] || rx[5*2+3]!=tx[5*0+3] || rx[5*2+4]!=tx[5*0+4] ) {
-		LOGF_WARN("%s: Handshake failed: got %02x %02x %02x %02x after first get", getAxisName(), rx[5*2+1], rx[5*2+2], rx[5*2+3], rx[5*2+4]);
+	uint32_t numFrames=2*num+1;
+	uint8_t tx[5*SPIBackend::MAX_FRAMES], rx[5*SPIBackend::MAX_FRAMES];
+	for(uint32_t i=0; i<num; i++) {
+		uint8_t *set=&tx[5*(2*i)], *get=&tx[5*(2*i+1)];
+		set[0]=TMCR_X_ENC | 0x80;
+		set[1]=(uint8_t) (values[i]>>24);
+		set[2]=(uint8_t) (values[i]>>16);
+		set[3]=(uint8_t) (values[i]>> 8);
+		set[4]=(uint8_t) (values[i]    );
+		get[0]=TMCR_X_ENC;
+		get[1]=get[2]=get[3]=get[4]=0;
+	}
+	uint8_t *last=&tx[5*(numFrames-1)];
+	last[0]=TMCR_X_ENC;
+	last[1]=last[2]=last[3]=last[4]=0;
+
+	if(!sendReceive(tx, rx, 5*numFrames)) {
+		LOGF_WARN("%s: Test pattern failed: send/receive", getAxisName());
 		return false;
 	}
-	if(rx[5*3+1]!=tx[5*2+1] || rx[5*3+2]!=tx[5*2+2] || rx[5*3+3]!=tx[5*2+3] || rx[5*3+4]!=tx[5*2+4] ) {
-		LOGF_WARN("%s: Handshake failed: got %02x %02x %02x %02x after second set", getAxisName(), rx[5*3+1], rx[5*3+2], rx[5*3+3], rx[5*3+4]);
+
+	if(verbose && debugLevel>=TMC_DEBUG_DEBUG)
+		for(uint32_t i=0; i<numFrames; i++)
+			LOGF_DEBUG("%d: sent %02x %02x %02x %02x %02x   recv %02x %02x %02x %02x %02x", i, tx[5*i+0], tx[5*i+1], tx[5*i+2], tx[5*i+3], tx[5*i+4],  rx[5*i+0], rx[5*i+1], rx[5*i+2], rx[5*i+3], rx[5*i+4]  );
+
+	// validate responses. The set echoes the value, and the following get returns it from the register
+	*errors=0;
+	for(uint32_t i=1; i<numFrames; i++) {
+		const uint8_t *r=&rx[5*i];
+		uint32_t expected=values[(i-1)/2];
+		uint32_t got=(((uint32_t) r[1])<<24) | (((uint32_t) r[2])<<16) | (((uint32_t) r[3])<<8) | ((uint32_t) r[4]);
+		if(got!=expected) {
+			if(verbose)
+				LOGF_WARN("%s: Test pattern mismatch: got %08x instead of %08x after %s", getAxisName(), got, expected, (i&1) ? "set" : "get");
+			(*errors)++;
+		}
+	}
+	return true;
+}
+
+
+bool Stepper::countProbeErrors(uint32_t speedHz, uint32_t numFrames, uint32_t *errors) {
+	uint8_t tx[5*SPIBackend::MAX_FRAMES]={0}, rx[5*SPIBackend::MAX_FRAMES];
+	for(uint32_t i=0; i<SPIBackend::MAX_FRAMES; i++)
+		tx[5*i]=TMCR_X_ENC;
+
+	uint32_t seed=0x9e3779b9;
+	*errors=0;
+	for(uint32_t sent=0; sent<numFrames; sent+=SPIBackend::MAX_FRAMES) {
+		// xorshift pseudo-random values exercise all data bits over the rounds. Writes happen at the default clock only
+		seed^=seed<<13;
+		seed^=seed>>17;
+		seed^=seed<<5;
+		uint32_t setErrors;
+		if(!setSpeedHz(defaultSPIMaxSpeedHz) || !exchangeTestPattern(&seed, 1, &setErrors, false) || setErrors>0)
+			return false;
+
+		// every datagram reads XENC, each response after the first must return the value
+		if(!setSpeedHz(speedHz) || !sendReceive(tx, rx, sizeof(tx)))
+			return false;
+		for(uint32_t i=1; i<SPIBackend::MAX_FRAMES; i++) {
+			const uint8_t *r=&rx[5*i];
+			uint32_t got=(((uint32_t) r[1])<<24) | (((uint32_t) r[2])<<16) | (((uint32_t) r[3])<<8) | ((uint32_t) r[4]);
+			if(got!=seed)
+				(*errors)++;
+		}
+	}
+	return true;
+}
+
+
+bool Stepper::calibrateSPISpeed(uint32_t *result) {
+	LOGF_INFO("%s: Calibrating SPI clock...", getAxisName());
+
+	// find highest speed without pattern errors, stopping at the first failure
+	uint32_t best=0;
+	for(uint32_t i=0; calibrationSPISpeedsHz[i]!=0; i++) {
+		uint32_t speed=calibrationSPISpeedsHz[i], errors;
+		if(!countProbeErrors(speed, calibrationFrames, &errors))
+			break;
+		if(debugLevel>=TMC_DEBUG_DEBUG)
+			LOGF_DEBUG("%s: %d test pattern errors at %d Hz", getAxisName(), errors, speed);
+		if(errors>0)
+			break;
+		best=speed;
+	}
+	if(best==0) {
+		LOGF_ERROR("%s: SPI clock calibration failed, reverting to %d Hz", getAxisName(), defaultSPIMaxSpeedHz);
+		setSpeedHz(defaultSPIMaxSpeedHz);
 		return false;
 	}
-	if(rx[5*4+1]!=tx[5*2+1] || rx[5*4+2]!=tx[5*2+2] || rx[5*4+3]!=tx[5*2+3] || rx[5*4+4]!=tx[5*2+4] ) {
-		LOGF_WARN("%s: Handshake failed: got %02x %02x %02x %02x after second get", getAxisName(), rx[5*4+1], rx[5*4+2], rx[5*4+3], rx[5*4+4]);
+
+	// apply safety margin and verify
+	uint32_t speed=(uint32_t) (((uint64_t) best)*calibrationMarginPercent/100);
+	uint32_t errors;
+	if(!countProbeErrors(speed, calibrationFrames, &errors) || errors>0 || !setSpeedHz(speed)) {
+		LOGF_ERROR("%s: SPI clock calibration failed to verify %d Hz, reverting to %d Hz", getAxisName(), speed, defaultSPIMaxSpeedHz);
+		setSpeedHz(defaultSPIMaxSpeedHz);
 		return false;
 	}
 
-	LOGF_INFO("%s: Handshake successful", getAxisName());
+	LOGF_INFO("%s: SPI clock calibrated to %d Hz, highest error-free speed %d Hz", getAxisName(), speed, best);
+	*result=speed;
 	return true;
 }
 
@@ -119,104 +351,213 @@ bool Stepper::Init() {
 	if(!setGStat(0x07))
 		return false;
 
-	// Setup Diagnosis 0 output to provide interrupts based on ramp function
-	//
-	if(!setDiag0EnableError(0))
-		return false;
-	if(!setDiag0EnableTemp(0))
+	// Read back the readable configuration registers, then collect the profile in the shadow register file
+	// and write each changed register once
+	if(!refreshShadow())
 		return false;
-	if(!setDiag0EnableInterruptStep(0))
-		return false;
-	if(!setDiag0PushPull(1))
+	beginBatch();
+	bool res=InitRegisters();
+	if(!commitBatch() || !res)
 		return false;
 
 	isrInit();
 
-	// Set motor current parameters
-	//
-	if(!setRunCurrent(800))
-		return false;
-	if(!setHoldCurrent(800)) // Hold current = run current for StealthChop configuration
-		return false;
-	if(!setIHoldDelay(10))
-		return false;
-	if(!setTPowerDown(10))
+	if(!tuneStealthChop())
 		return false;
 
-	if(!setInvertMotor(0)) 		// FIXME: should come from stored config data
+	// now that configuration is complete, set hold current to proper target 
+	if(!setHoldCurrent(100)) 
 		return false;
 
-	if(!setRegister(TMCR_SW_MODE, 0))  // Disable all switches and StallGuard for now
+	if(!writeConfigSignature())
 		return false;
 
-	// Set a default ramp (used in auto-tuning)
-	//
-	if(!setVStart(10))
-		return false;
-	if(!setA1(11250))
-		return false;
-	if(!setV1(200000))
-		return false;
-	if(!setAMax(7000))
-		return false;
-	if(!setVMax(100000))
-		return false;
-	if(!setMaxGoToSpeed(100000))
-		return false;
-	if(!setDMax(11250))
-		return false;
-	if(!setD1(7000))
-		return false;
-	if(!setVStop(10))
+	if(debugLevel>=TMC_DEBUG_DEBUG)
+		LOGF_DEBUG("%s: Successfully initialized", getAxisName());
+	
+	return true;
+}
+
+
+bool Stepper::WarmInit(uint32_t signature) {
+	// a power cycle or driver error since the last initialization requires a full one
+	uint32_t gstat;
+	if(!getGStat(&gstat) || TMCF_GSTAT_RESET::extract(gstat) || TMCF_GSTAT_DRV_ERR::extract(gstat))
 		return false;
-	if(!setTZeroWait(100))
+
+	// collect the configuration Init() would establish, without writing it. Requires a matching tuning result
+	if(!refreshShadow())
 		return false;
+	beginBatch();
+	bool res=InitRegisters() && getTuneFingerprint()==tuneFingerprint &&
+	         setField<TMCF_PWM_OFS>(tunedPWMOffset) && setField<TMCF_PWM_GRAD>(tunedPWMGradient) &&
+	         setHoldCurrent(100);
 
-	// Set PWM parameters for stealth chop
-	//
-	if(!setPWMFrequencyDivider(0))  // set PWM frequency divider to 0=2/1024 f_clk, i.e. 29 KHz at 15 MHz clock. Should be in 20/40 KHz range
+	// readable registers changed by it differ on the device, the signature covers the write-only ones
+	if(res && batchChangesReadableRegisters())
+		res=false;
+	if(!res || getConfigSignature()!=signature) {
+		abortBatch();
 		return false;
-	if(!setPWMEnableStealthChop(1))
+	}
+	assumeBatch();
+
+	// the signature covers neither the motion registers nor the write-only VMAX, so the batch values of these are guesses
+	invalidateMotionShadow();
+
+	isrInit();
+	if(!writeConfigSignature())
 		return false;
-	if(!setPWMAutoscale(1))         // stealth chop current regulator
+
+	// the driver has no record of motion left over from the previous session, so bring the axis to a halt
+	int32_t pos, speed;
+	if(!getPosition(&pos) || !getSpeed(&speed))
 		return false;
-	if(!setPWMAutoGradient(1))      // stealth chop gradient regulator
+	if(speed!=0) {
+		LOGF_WARN("%s: Stopping motion at speed %'+d left over from the previous session", getAxisName(), speed);
+		if(!stop())
+			return false;
+	}
+	warmStart=true;
+	LOGF_INFO("%s: Device kept its configuration, resuming at position %'+d without re-initialization", getAxisName(), pos);
+	return true;
+}
+
+
+uint32_t Stepper::getConfigSignature() {
+	// FNV-1a over all configuration registers, excluding those changed by motion commands
+	uint32_t hash=2166136261u;
+	for(int i=0; i<(int) TMCR_NUM_REGISTERS; i++) {
+		if(!canWriteRegister(i) || isVolatileRegister(i) || i==TMCR_RAMPMODE || i==TMCR_XTARGET || i==TMCR_VMAX)
+			continue;
+		uint32_t value=getShadowRegister(i);
+		for(int b=0; b<32; b+=8) {
+			hash^=(value>>b) & 0xff;
+			hash*=16777619u;
+		}
+	}
+	return hash!=0 ? hash : 1;
+}
+
+
+bool Stepper::writeConfigSignature() {
+	return setRegister(TMCR_X_ENC, getConfigSignature());
+}
+
+
+bool Stepper::InitRegisters() {
+	if(!writeProfile(true))
 		return false;
 
-	// Set chopper parameters
+	// Set motor current parameters
 	//
-	if(!setChopperMode(0))          // If above the threshold, move to spread cycle mode
-		return false;
-	if(!setTPWMThreshold(0))        // Disable threshold to use only StealthChop during calibration
-		return false;
-	if(!setChopperMicroRes(0))      // full 256 microsteps for internal operation
+	if(!setRunCurrent(800))
 		return false;
-	if(!setChopperTOff(5))
+	if(!setHoldCurrent(800)) // Hold current = run current for StealthChop configuration
 		return false;
-	if(!setChopperTBlank(2))
+
+	if(!setMaxGoToSpeed(100000))
 		return false;
-	if(!setChopperHStart(4))
+
+	return true;
+}
+
+
+bool Stepper::writeProfile(bool withMotion) {
+	for(int i=0; i<PROFILE_FIELDS_SIZE; i++)
+		if((withMotion || !profileFields[i].motion) && !(this->*profileFields[i].set)(profileValues[i])) {
+			LOGF_ERROR("%s: Unable to set profile field %s to %u", getAxisName(), profileFields[i].name, profileValues[i]);
+			return false;
+		}
+	return true;
+}
+
+
+bool Stepper::setProfile(const char *name, const char *fields) {
+	uint32_t values[PROFILE_FIELDS_SIZE];
+	for(int i=0; i<PROFILE_FIELDS_SIZE; i++)
+		values[i]=profileFields[i].defaultValue;
+
+	if(strlen(name)>=PROFILE_NAME_SIZE) {
+		LOGF_ERROR("%s: Profile name exceeds %d characters", getAxisName(), PROFILE_NAME_SIZE-1);
 		return false;
-	if(!setChopperHEnd(0))
+	}
+	if(strlen(fields)>=PROFILE_TEXT_SIZE) {
+		LOGF_ERROR("%s: Profile fields exceed %d characters", getAxisName(), PROFILE_TEXT_SIZE-1);
 		return false;
+	}
 
-	LOGF_INFO("%s: Auto-tuning...", getAxisName());
-	if(!chopperAutoTuneStealthChop(500, 5000))
-		return false;
+	// parse assignments of the form NAME=value into a copy, leaving the current profile untouched on errors
+	char buffer[PROFILE_TEXT_SIZE];
+	strcpy(buffer, fields);
+	char *savePtr=NULL;
+	for(char *token=strtok_r(buffer, " \t\r\n,;", &savePtr); token!=NULL; token=strtok_r(NULL, " \t\r\n,;", &savePtr)) {
+		char *eq=strchr(token, '=');
+		if(eq==NULL) {
+			LOGF_ERROR("%s: Profile assignment '%s' lacks '='", getAxisName(), token);
+			return false;
+		}
+		*eq=0;
+		int i;
+		for(i=0; i<PROFILE_FIELDS_SIZE && strcasecmp(token, profileFields[i].name); i++)
+			;
+		if(i==PROFILE_FIELDS_SIZE) {
+			LOGF_ERROR("%s: Unknown profile field '%s'", getAxisName(), token);
+			return false;
+		}
+		char *end=NULL;
+		unsigned long value=strtoul(eq+1, &end, 0);
+		if(end==eq+1 || *end!=0 || value>profileFields[i].maxValue) {
+			LOGF_ERROR("%s: Invalid value '%s' for profile field %s, maximum is %u", getAxisName(), eq+1, profileFields[i].name, profileFields[i].maxValue);
+			return false;
+		}
+		values[i]=(uint32_t) value;
+	}
 
-	// now that configuration is complete, set hold current to proper target 
-	if(!setHoldCurrent(100)) 
+	// ramp and chopper changes under way would disturb motion
+	if(isConnected()) {
+		int32_t speed;
+		if(!getSpeed(&speed))
+			return false;
+		if(speed!=0 || !(getStatus() & TMC_STAND_STILL)) {
+			LOGF_ERROR("%s: Stop the axis before changing the register profile", getAxisName());
+			return false;
+		}
+	}
+
+	strncpy(profileName, name, sizeof(profileName)-1);
+	profileName[sizeof(profileName)-1]=0;
+	for(int i=0; i<PROFILE_FIELDS_SIZE; i++)
+		profileValues[i]=values[i];
+	if(!isConnected())
+		return true;  // written on connect
+
+	// diff against the device and write all changed registers in one burst
+	if(!refreshShadow())
 		return false;
+	beginBatch();
+	bool res=writeProfile(false);
+	return commitBatch() && res && writeConfigSignature();
+}
 
-	if(debugLevel>=TMC_DEBUG_DEBUG)
-		LOGF_DEBUG("%s: Successfully initialized", getAxisName());
-	
-	return true;
+
+int Stepper::printProfile(char *buffer, int bufsize) {
+	int len=0;
+	if(bufsize>0)
+		buffer[0]=0;
+	for(int i=0; i<PROFILE_FIELDS_SIZE && len<bufsize; i++)
+		len+=snprintf(buffer+len, bufsize-len, "%s%s=%u", i>0 ? " " : "", profileFields[i].name, profileValues[i]);
+	return len<bufsize ? len : bufsize-1;
 }
 
 
 bool Stepper::close() {
-	bool res1=stop();
+	recoveryEnabled=false;
+	if(!isConnected())
+		return true;
+	bool res1=stop() && writeConfigSignature();  // signature reflects changes made since connecting
+	if(debugLevel>=TMC_DEBUG_REGISTERS)
+		logTrace(traceRecordsOnClose);
 	bool res2=TMC5160::close();
 	return res1 && res2;
 }
@@ -253,30 +594,85 @@ bool Stepper::chopperAutoTuneStealthChop(uint32_t secondSteps, uint32_t timeoutM
 }
 
 
-bool Stepper::setTargetVelocityArcsecPerSec(double arcsecPerSec) {
-	int32_t ustepsPerTRounded=arcsecPerSecToNative(arcsecPerSec);
+bool Stepper::tuneStealthChop() {
+	uint32_t fingerprint=getTuneFingerprint();
+	if(fingerprint==tuneFingerprint) {
+		// regulator starts from the stored result, no tuning motion needed
+		beginBatch();
+		bool res=setField<TMCF_PWM_OFS>(tunedPWMOffset) && setField<TMCF_PWM_GRAD>(tunedPWMGradient);
+		if(!commitBatch() || !res)
+			return false;
+		LOGF_INFO("%s: Restored StealthChop tuning PWM_OFS %u PWM_GRAD %u", getAxisName(), tunedPWMOffset, tunedPWMGradient);
+		return true;
+	}
 
-	if(debugLevel>=TMC_DEBUG_DEBUG)
-		LOGF_DEBUG("%s: Settingtarget velocity to %f arcsec/sec i.e. %d usteps/stepper_t", getAxisName(), arcsecPerSec, ustepsPerTRounded);
+	LOGF_INFO("%s: Auto-tuning...", getAxisName());
+	if(!chopperAutoTuneStealthChop(500, 5000))
+		return false;
 
-	return setTargetSpeed(ustepsPerTRounded);
+	const uint8_t addresses[2]={ TMCR_PWM_AUTO, TMCR_PWM_SCALE };
+	uint32_t values[2];
+	if(!getRegisters(addresses, values, 2))
+		return false;
+	tunedPWMOffset  =TMCF_PWM_OFS_AUTO ::extract(values[0]);
+	tunedPWMGradient=TMCF_PWM_GRAD_AUTO::extract(values[0]);
+	tuneFingerprint =fingerprint;
+	LOGF_INFO("%s: Auto-tuned PWM_OFS %u PWM_GRAD %u, PWM_SCALE_SUM %u PWM_SCALE_AUTO %d", getAxisName(), tunedPWMOffset, tunedPWMGradient,
+	          TMCF_PWM_SCALE_SUM::extract(values[1]), (int32_t) TMCF_PWM_SCALE_AUTO::extract(values[1]));
+
+	// use the result as initial values after the next power cycle of the driver, too
+	beginBatch();
+	bool res=setField<TMCF_PWM_OFS>(tunedPWMOffset) && setField<TMCF_PWM_GRAD>(tunedPWMGradient);
+	return commitBatch() && res;
 }
 
-int32_t Stepper::arcsecPerSecToNative(double arcsecPerSec) {
-	if(stepsPerRev==0 || gearRatio==0 || clockHz==0) {
-		LOGF_ERROR("%s: Zero value detected: %d steps/rev %d gear ratio %d Hz clock", getAxisName(), stepsPerRev, gearRatio, clockHz);
-	}
 
-	uint32_t ustepsPerRev=256*stepsPerRev*gearRatio;
-	double ustepsPerArcsec=((double) ustepsPerRev) * (1.0 / (360.0*60.0*60.0));
+uint32_t Stepper::getTuneFingerprint() {
+	// FNV-1a over the relevant registers, with the tuning result itself masked out of PWMCONF
+	const uint32_t registers[4]={
+		getShadowRegister(TMCR_IHOLD_IRUN),
+		getShadowRegister(TMCR_GLOBAL_SCALER),
+		getShadowRegister(TMCR_CHOPCONF),
+		getShadowRegister(TMCR_PWMCONF) & ~(TMCF_PWM_OFS::mask | TMCF_PWM_GRAD::mask),
+	};
+	uint32_t hash=2166136261u;
+	for(int i=0; i<4; i++)
+		for(int b=0; b<32; b+=8) {
+			hash^=(registers[i]>>b) & 0xff;
+			hash*=16777619u;
+		}
+	return hash!=0 ? hash : 1;
+}
+
+
+bool Stepper::setStealthChopTuning(uint32_t pwmOffset, uint32_t pwmGradient, uint32_t fingerprint) {
+	tunedPWMOffset  =pwmOffset;
+	tunedPWMGradient=pwmGradient;
+	tuneFingerprint =fingerprint;
+	return true;
+}
+
+
+bool Stepper::setTargetVelocityArcsecPerSec(double arcsecPerSec) {
+	double ustepsPerT=arcsecPerSecToNativeFractional(arcsecPerSec);
+
+	if(debugLevel>=TMC_DEBUG_DEBUG)
+		LOGF_DEBUG("%s: Setting target velocity to %f arcsec/sec i.e. %.6f usteps/stepper_t", getAxisName(), arcsecPerSec, ustepsPerT);
+
+	return setTargetSpeedFractional(ustepsPerT);
+}
 
-	uint32_t stepperChipTimeScaler=(1ul<<24);
-	double stepperTimeUnit=((double)stepperChipTimeScaler)/((double)clockHz);
+double Stepper::arcsecPerSecToNativeFractional(double arcsecPerSec) {
+	if(!kinematics.isSpeedValid())
+		LOGF_ERROR("%s: Zero value detected: %g steps/rev %g gear ratio %u Hz clock", getAxisName(), stepsPerRev, gearRatio, clockHz);
+	return kinematics.speedFromArcsecPerSec(arcsecPerSec);
+}
 
-	double ustepsPerT=arcsecPerSec * ustepsPerArcsec * stepperTimeUnit;
-	int32_t ustepsPerTRounded=round(ustepsPerT);
 
-	return ustepsPerTRounded;
+void Stepper::updateKinematics() {
+	if(kinematics.update((uint32_t) microsteps, stepsPerRev, gearRatio, clockHz) && debugLevel>=TMC_DEBUG_DEBUG)
+		LOGF_DEBUG("%s: %llu/%llu microsteps per revolution", getAxisName(),
+		           (unsigned long long) kinematics.getUstepsPerRevNumerator(), (unsigned long long) kinematics.getUstepsPerRevDenominator());
 }
 
 
@@ -289,11 +685,11 @@ bool Stepper::stop() {
 }
 
 
-bool Stepper::getPositionInUnits(double *result, double full) {
+bool Stepper::getPositionInUnits(double *result, enum Kinematics::Unit unit) {
 	int32_t pos;
 	if(!getPosition(&pos))
 		return false;
-	*result=(full * (double) pos) / (microsteps * stepsPerRev * gearRatio);
+	*result=nativeToUnits(pos, unit);
 	return true;
 }
 
@@ -311,25 +707,45 @@ bool Stepper::syncPosition(int32_t value) {
 	uint32_t rm;
 	if(!getRegister(TMCR_RAMPMODE, &rm))
 		return false;
-	if(!setRegister(TMCR_RAMPMODE, 3))
+	Transaction t;
+	if(!t.set(TMCR_RAMPMODE, 3) || !t.set(TMCR_XACTUAL, value))
 		return false;
-	if(!setRegister(TMCR_XACTUAL, value))
+	if(rm!=0) {
+		if(!t.set(TMCR_RAMPMODE, rm))
+			return false;
+	} else if(!t.set(TMCR_RAMPMODE, 0) ||                    // select absolute positioning mode
+	          !t.set(TMCR_VMAX, maxGoToSpeed) ||             // restore max speed in case setTargetSpeed() overwrote it
+	          !t.set(TMCR_XTARGET, (uint32_t) value))        // set target position to initiate movement
 		return false;
-	if(rm!=0) 
-		return setRegister(TMCR_RAMPMODE, rm);
-	return setRegister(TMCR_RAMPMODE, 0) &&                  // select absolute positioning mode
-		   setRegister(TMCR_VMAX, maxGoToSpeed) &&           // restore max speed in case setTargetSpeed() overwrote it
-	       setRegister(TMCR_XTARGET, (uint32_t) value);      // set target position to initiate movement
+	return execute(t);
+}
+
+
+bool Stepper::setTargetPosition(int32_t value, double restoreSpeed, std::future<bool> *completion) {
+	bool res=false;
+
+	// on the worker thread, so ramp events cannot interleave with starting the move
+	auto f=[&]() {
+		std::future<bool> move=beginMove();
+		res=setTargetPositionOnWorker(value, restoreSpeed);
+		if(!res)
+			completeMove(false);
+		if(completion!=NULL)
+			*completion=std::move(move);
+	};
+	call(f);
+	return res;
 }
 
 
-bool Stepper::syncPositionInUnits(double value, double full) {
-	int32_t stepsValue=round(value * (microsteps * stepsPerRev * gearRatio) / full);
-	return syncPosition(stepsValue);
+std::future<bool> Stepper::setTargetPositionAsync(int32_t value, double restoreSpeed) {
+	std::future<bool> completion;
+	setTargetPosition(value, restoreSpeed, &completion);
+	return completion;
 }
 
 
-bool Stepper::setTargetPosition(int32_t value, int32_t restoreSpeed) {
+bool Stepper::setTargetPositionOnWorker(int32_t value, double restoreSpeed) {
 	if(value<minPosition || value>maxPosition) {
 		LOGF_ERROR("%s: Unable to set target position %'+d outside defined limits [%'+d, %'+d]", getAxisName(), value, minPosition, maxPosition);
 		return false;
@@ -350,53 +766,82 @@ bool Stepper::setTargetPosition(int32_t value, int32_t restoreSpeed) {
 	if(actual==(uint32_t) value) {
 		if(debugLevel>=TMC_DEBUG_DEBUG)
 			LOGF_DEBUG("%s: Already at target", getAxisName());
-		setTargetSpeed(restoreSpeed);
-		hasReachedTarget=true;
-		return true; 
+		// the move completes right away. Reaching the target restores the given speed, or stops a velocity mode motion
+		setSpeedToRestore(0);
+		hasReachedTarget=false;
+		dispatchRampEvents(RAMP_EVENT_POSITION_REACHED, SPITrace::now());
+		return setTargetSpeedFractionalOnWorker(restoreSpeed);
 	}  
 
-	// FIXME: race condition if Goto is already active
 	setSpeedToRestore(restoreSpeed);
 	hasReachedTarget=false; 
 
-	return setRegister(TMCR_RAMPMODE, 0) &&                  // select absolute positioning mode
-		   setRegister(TMCR_VMAX, maxGoToSpeed) &&           // restore max speed in case setTargetSpeed() overwrote it
-	       setRegister(TMCR_XTARGET, (uint32_t) value) &&    // set target position to initiate movement
-		   setRegister(TMCR_RAMP_STAT, (1ul<<14)-1);         // clear ramp status register to enable interrupts
-}
-
-
-bool Stepper::setTargetPositionInUnits(double value, double full, int32_t restoreSpeed) {
-	int32_t stepsValue=unitsToNative(value, full);
-	return setTargetPosition(stepsValue, restoreSpeed);
+	Transaction t;
+	return t.set(TMCR_RAMPMODE, 0) &&                  // select absolute positioning mode
+		   t.set(TMCR_VMAX, maxGoToSpeed) &&           // restore max speed in case setTargetSpeed() overwrote it
+	       t.set(TMCR_XTARGET, (uint32_t) value) &&    // set target position to initiate movement
+		   t.set(TMCR_RAMP_STAT, RAMP_EVENTS_LATCHED) && // clear ramp events to enable interrupts
+		   executeOnWorker(t);
 }
 
 
 bool Stepper::setTargetPositionBlocking(int32_t value, uint32_t timeoutMs) {
 	Timestamp start;
 
-	if(!setTargetPosition(value))
+	std::future<bool> completion;
+	if(!setTargetPosition(value, 0, &completion))
+		return false;
+
+	// wait for the position reached event, delivered by interrupt or by polling on the I/O worker thread
+	if(timeoutMs>0 && completion.wait_for(std::chrono::milliseconds(timeoutMs))!=std::future_status::ready) {
+		LOGF_WARN("%s: Timeout after %u ms moving to target position %'+d", getAxisName(), timeoutMs, value);
+		return false;
+	}
+	if(!completion.get())
 		return false;
 
-	// wait until position reached or timeout occurs
-	for(int i=0; ; i++) {
-		usleep(10000l);  // 10 ms
+	if(debugLevel>=TMC_DEBUG_DEBUG) {
+		uint64_t elapsedUs=Timestamp().usSince(start);
+		LOGF_DEBUG("%s: Reached target position at %'+d in %llus %.1fms", getAxisName(), value, 
+		           (unsigned long long) (elapsedUs/1000000), (elapsedUs%1000000)*0.001);
+	}
+	return true;
+}
 
-		Timestamp now;
-		uint64_t elapsedMs=now.msSince(start);
-		if(timeoutMs>0 && elapsedMs>(uint64_t) timeoutMs)
-			return false; // timeout
 
-		if(hasReachedTarget) {
-			int32_t pos;
-			if(!getPosition(&pos))
-				return false; // timeout
+bool Stepper::getGoToRampSettings(Ramp::Settings *result) {
+	result->vmax=maxGoToSpeed;
+	return getVStart(&result->vstart) && getA1(&result->a1) && getV1(&result->v1) && getAMax(&result->amax) &&
+	       getDMax(&result->dmax) && getD1(&result->d1) && getVStop(&result->vstop) && getTZeroWait(&result->tzerowait);
+}
 
-			if(debugLevel>=TMC_DEBUG_DEBUG)
-				LOGF_DEBUG("%s: Reached target position at %'+d after %d polls in %llus %llums", getAxisName(), value, i, elapsedMs/1000, elapsedMs%1000);
-			return true;  // position reached
-		}
+
+bool Stepper::predictGoTo(Ramp *result, int32_t target, const MotionStatus &status) {
+	Ramp::Settings settings;
+	if(!getGoToRampSettings(&settings))
+		return false;
+	if(!result->plan(settings, status.position, status.speed, target)) {
+		LOGF_ERROR("%s: Unable to predict go-to to %'+d with AMAX %u DMAX %u VMAX %u", getAxisName(), target, settings.amax, settings.dmax, settings.vmax);
+		return false;
 	}
+	return true;
+}
+
+
+bool Stepper::setSPISpeedSetting(uint32_t value) {
+	if(!isConnected()) {
+		spiSpeedSetting=value;
+		return true;
+	}
+	if(value==0) {
+		// calibration overwrites XENC, which holds the configuration signature while connected
+		bool res=calibrateSPISpeed(&spiSpeedSetting);
+		return writeConfigSignature() && res;
+	}
+	if(!setSpeedHz(value))
+		return false;
+	spiSpeedSetting=value;
+	return true;
 }
 
 
@@ -545,9 +990,15 @@ bool Stepper::setHoldCurrent(uint32_t value_mA, bool suppressDebugOutput) {
 void Stepper::initProperties(INumber *MotorN, INumberVectorProperty *MotorNP, 
 						     ISwitch *MSwitchS, ISwitchVectorProperty *MSwitchSP, 
 	                         INumber *RampN, INumberVectorProperty *RampNP, 
+	                         IText *ProfileT, ITextVectorProperty *ProfileTP,
+	                         INumber *TuneN, INumberVectorProperty *TuneNP,
+	                         INumber *TelemetryN, INumberVectorProperty *TelemetryNP,
 	                         const char *motorVarName, const char *motorUILabel,
 	                         const char *mSwitchVarName, const char *mSwitchUILabel,
 	                         const char *rampVarName, const char *rampUILabel, 
+	                         const char *profileVarName, const char *profileUILabel,
+	                         const char *tuneVarName, const char *tuneUILabel,
+	                         const char *telemetryVarName, const char *telemetryUILabel,
 	                         const char *tabName) {
 
 	uint32_t currentHwMaxMa;
@@ -558,6 +1009,9 @@ void Stepper::initProperties(INumber *MotorN, INumberVectorProperty *MotorNP,
 	IUFillNumber(&MotorN[2], "HOLD",  "Hold current [mA]", "%.0f", 0, currentHwMaxMa, currentHwMaxMa/100, 200);
 	IUFillNumber(&MotorN[3], "RUN",   "Run current [mA]",  "%.0f", 0, currentHwMaxMa, currentHwMaxMa/100, 800);
 	IUFillNumber(&MotorN[4], "CLOCK", "Clock [Hz]",        "%.0f", 8000000, 16000000, 100000, 10000000);
+	IUFillNumber(&MotorN[5], "SPI_CLOCK", "SPI clock [Hz] (0=calibrate)", "%.0f", 0, 32000000, 100000, defaultSPIMaxSpeedHz);
+	IUFillNumber(&MotorN[6], "TELEMETRY", "Telemetry rate [Hz] (0=off)",  "%.0f", 0, MAX_TELEMETRY_RATE, 10, defaultTelemetryRateHz);
+	IUFillNumber(&MotorN[7], "TRACK_CADENCE", "Position tracking cadence [ms] (0=velocity)", "%.0f", 0, MAX_TRACKING_CADENCE, 10, 0);
 	IUFillNumberVector(MotorNP, MotorN, MOTORN_SIZE, getDeviceName(), motorVarName, motorUILabel, tabName, IP_RW, 0, IPS_IDLE);
 
 	IUFillSwitch(&MSwitchS[0], "INVERT", "Invert axis", ISS_OFF);
@@ -584,13 +1038,48 @@ void Stepper::initProperties(INumber *MotorN, INumberVectorProperty *MotorNP,
 	IUFillNumber(&RampN[15], "TOFF",      "Chopper off time",          "%.0f", 0, (1ul<< 4)-1,                  1,        5);
 	IUFillNumber(&RampN[16], "TBLANK",    "Chopper blank time",        "%.0f", 0, (1ul<< 4)-1,                  1,        2);
 	IUFillNumberVector(RampNP, RampN, RAMPN_SIZE, getDeviceName(), rampVarName, rampUILabel, tabName, IP_RW, 0, IPS_IDLE);
+
+	char fields[1024];
+	printProfile(fields, sizeof(fields));
+	IUFillText(&ProfileT[0], "NAME",   "Name",   profileName);
+	IUFillText(&ProfileT[1], "FIELDS", "Fields", fields);
+	IUFillTextVector(ProfileTP, ProfileT, PROFILET_SIZE, getDeviceName(), profileVarName, profileUILabel, tabName, IP_RW, 0, IPS_IDLE);
+
+	IUFillNumber(&TuneN[0], "PWM_OFS",     "PWM offset",                "%.0f", 0, 255,          1, 0);
+	IUFillNumber(&TuneN[1], "PWM_GRAD",    "PWM gradient",              "%.0f", 0, 255,          1, 0);
+	IUFillNumber(&TuneN[2], "FINGERPRINT", "Fingerprint (0=retune)",    "%.0f", 0, 4294967295.0, 1, 0);
+	IUFillNumberVector(TuneNP, TuneN, TUNEN_SIZE, getDeviceName(), tuneVarName, tuneUILabel, tabName, IP_RW, 0, IPS_IDLE);
+
+	IUFillNumber(&TelemetryN[ 0], "SG_MIN",     "StallGuard min",        "%.0f", 0, 1023,        1, 0);
+	IUFillNumber(&TelemetryN[ 1], "SG_MEAN",    "StallGuard mean",       "%.1f", 0, 1023,        1, 0);
+	IUFillNumber(&TelemetryN[ 2], "SG_MAX",     "StallGuard max",        "%.0f", 0, 1023,        1, 0);
+	IUFillNumber(&TelemetryN[ 3], "CS_MIN",     "Current scale min",     "%.0f", 0, 31,          1, 0);
+	IUFillNumber(&TelemetryN[ 4], "CS_MEAN",    "Current scale mean",    "%.1f", 0, 31,          1, 0);
+	IUFillNumber(&TelemetryN[ 5], "CS_MAX",     "Current scale max",     "%.0f", 0, 31,          1, 0);
+	IUFillNumber(&TelemetryN[ 6], "PWM_MIN",    "PWM scale min",         "%.0f", 0, 255,         1, 0);
+	IUFillNumber(&TelemetryN[ 7], "PWM_MEAN",   "PWM scale mean",        "%.1f", 0, 255,         1, 0);
+	IUFillNumber(&TelemetryN[ 8], "PWM_MAX",    "PWM scale max",         "%.0f", 0, 255,         1, 0);
+	IUFillNumber(&TelemetryN[ 9], "TSTEP_MIN",  "TStep min [t_clk]",     "%.0f", 0, (1ul<<20)-1, 1, 0);
+	IUFillNumber(&TelemetryN[10], "TSTEP_MEAN", "TStep mean [t_clk]",    "%.0f", 0, (1ul<<20)-1, 1, 0);
+	IUFillNumber(&TelemetryN[11], "TSTEP_MAX",  "TStep max [t_clk]",     "%.0f", 0, (1ul<<20)-1, 1, 0);
+	IUFillNumber(&TelemetryN[12], "LOST_STEPS", "Lost steps",            "%.0f", 0, (1ul<<20)-1, 1, 0);
+	IUFillNumber(&TelemetryN[13], "OTPW",       "Overtemp. warnings",    "%.0f", 0, 1e9,         1, 0);
+	IUFillNumber(&TelemetryN[14], "SAMPLES",    "Samples",               "%.0f", 0, 1e9,         1, 0);
+	IUFillNumber(&TelemetryN[15], "RATE_ERROR", "Rate error [ppb]",      "%.1f", -1e9, 1e9,      1, 0);
+	IUFillNumber(&TelemetryN[16], "RATE_RESID", "Rate residual [usteps]","%.3f", -1e9, 1e9,      1, 0);
+	IUFillNumber(&TelemetryN[17], "DROPPED",    "Dropped samples",       "%.0f", 0, 1e9,         1, 0);
+	IUFillNumber(&TelemetryN[18], "TRACK_ERROR","Tracking error [usteps]","%.3f", -1e9, 1e9,     1, 0);
+	IUFillNumberVector(TelemetryNP, TelemetryN, TELEMETRYN_SIZE, getDeviceName(), telemetryVarName, telemetryUILabel, tabName, IP_RO, 0, IPS_IDLE);
 }
 
 
 bool Stepper::updateProperties(INDI::DefaultDevice *iDevice,
 							   INumber *MotorN, INumberVectorProperty *MotorNP, 
 						       ISwitch *MSwitchS, ISwitchVectorProperty *MSwitchSP, 
-	                           INumber *RampN, INumberVectorProperty *RampNP) {
+	                           INumber * /* RampN */, INumberVectorProperty *RampNP,
+	                           IText *ProfileT, ITextVectorProperty *ProfileTP,
+	                           INumber *TuneN, INumberVectorProperty *TuneNP,
+	                           INumber * /* TelemetryN */, INumberVectorProperty *TelemetryNP) {
 	if(iDevice->isConnected()) {
 		// Motor settings
 		iDevice->defineProperty(MotorNP);
@@ -605,6 +1094,9 @@ bool Stepper::updateProperties(INDI::DefaultDevice *iDevice,
 		    MotorN[2].value = currentHoldMa;
 		    MotorN[3].value = currentRunMa;
 		    MotorN[4].value = clockHz;
+		    MotorN[5].value = spiSpeedSetting;
+		    MotorN[6].value = getTelemetryRate();
+		    MotorN[7].value = getTrackingCadence();
 		    MotorNP->s = IPS_OK;
 		    IDSetNumber(MotorNP, NULL);
 	    }				
@@ -628,54 +1120,120 @@ bool Stepper::updateProperties(INDI::DefaultDevice *iDevice,
 
 		// Ramp settings
 	    iDevice->defineProperty(RampNP);
-	    uint32_t vstart, a1, v1, amax, vmax, dmax, d1, vstop, tzerowait, 
-	    		 tpwmthrs, tcoolthrs, thigh, vdcmin, dctime, dcsg, toff, tbl;
-	    if(!getVStart(&vstart) || !getA1(&a1) || !getV1(&v1) || !getAMax(&amax) ||
-	       !getMaxGoToSpeed(&vmax) || 
-	       !getDMax(&dmax) || !getD1(&d1) || !getVStop(&vstop) || !getTZeroWait(&tzerowait) ||
-	       !getTPWMThreshold(&tpwmthrs) || !getTCoolThreshold(&tcoolthrs) || !getTHighThreshold(&thigh) ||
-	       !getVDCMin(&vdcmin) || !getDCTime(&dctime) || !getDCStallGuard(&dcsg) ||
-	       !getChopperTOff(&toff) || !getChopperTBlank(&tbl) ) {
-	       RampNP->s = IPS_ALERT;
-	       IDSetNumber(RampNP, NULL);
+	    if(!updateRampProperty(RampNP))
 	       return false;	
-	    } else {
-	    	RampN[0].value=vstart;
-	    	RampN[1].value=a1;
-	    	RampN[2].value=v1;
-	    	RampN[3].value=amax;
-	    	RampN[4].value=vmax;
-	    	RampN[5].value=dmax;
-	    	RampN[6].value=d1;
-	    	RampN[7].value=vstop;
-	    	RampN[8].value=tzerowait;
-	    	RampN[9].value=tpwmthrs;
-	    	RampN[10].value=tcoolthrs;
-	    	RampN[11].value=thigh;
-	    	RampN[12].value=vdcmin;
-	    	RampN[13].value=dctime;
-	    	RampN[14].value=dcsg;
-	    	RampN[15].value=toff;
-	    	RampN[16].value=tbl;
-	    	IDSetNumber(RampNP, NULL);
-	    }
+
+	    // Register profile
+	    iDevice->defineProperty(ProfileTP);
+	    char fields[1024];
+	    printProfile(fields, sizeof(fields));
+	    IUSaveText(&ProfileT[0], profileName);
+	    IUSaveText(&ProfileT[1], fields);
+	    ProfileTP->s=IPS_OK;
+	    IDSetText(ProfileTP, NULL);
+
+	    // StealthChop tuning result, as obtained or restored on connect
+	    iDevice->defineProperty(TuneNP);
+	    TuneN[0].value=tunedPWMOffset;
+	    TuneN[1].value=tunedPWMGradient;
+	    TuneN[2].value=tuneFingerprint;
+	    TuneNP->s=IPS_OK;
+	    IDSetNumber(TuneNP, NULL);
+
+	    // Driver telemetry, updated periodically while connected
+	    iDevice->defineProperty(TelemetryNP);
+	    updateTelemetry(TelemetryNP);
 	} else {
 		iDevice->deleteProperty(MotorNP->name);
 		iDevice->deleteProperty(MSwitchSP->name);
 		iDevice->deleteProperty(RampNP->name);
+		iDevice->deleteProperty(ProfileTP->name);
+		iDevice->deleteProperty(TuneNP->name);
+		iDevice->deleteProperty(TelemetryNP->name);
 	}
 	return true;
 }
 
 
-int Stepper::ISNewNumber(INumberVectorProperty *MotorNP, INumberVectorProperty *RampNP,
+bool Stepper::checkRecovery(INumberVectorProperty *MotorNP) {
+	if(!recoveryFailed.exchange(false))
+		return true;
+	MotorNP->s=IPS_ALERT;
+	IDSetNumber(MotorNP, NULL);
+	return false;
+}
+
+
+bool Stepper::updateTelemetry(INumberVectorProperty *TelemetryNP) {
+	uint64_t now=SPITrace::now();
+	Telemetry::Summary s;
+	getTelemetry().summarize(&s, telemetryUpdateNs, now);
+	telemetryUpdateNs=now;
+
+	// samples overwritten before this update saw them, if the ring is too small for the sampling rate and update interval
+	INumber *np=TelemetryNP->np;
+	np[17].value=getTelemetry().dropped(telemetryUpdateSize);
+	telemetryUpdateSize=getTelemetry().size();
+
+	// achieved versus requested mean speed of a fractional target speed, and the expected minus actual position: the integrated
+	// rate residual when alternating VMAX, the tracking error when streaming XTARGET. Integer speeds in velocity mode are exact
+	FractionalSpeedStatus ds;
+	np[15].value=np[16].value=np[18].value=0;
+	if(getFractionalSpeedStatus(&ds) && ds.active && ds.requested!=0) {
+		np[15].value=(ds.achieved-ds.requested)/ds.requested*1e9;
+		np[ds.position ? 18 : 16].value=ds.residual*clockHz/(double) (1ul<<24);
+	}
+
+	if(s.samples==0) {
+		TelemetryNP->s=(getTelemetryRate()>0) ? IPS_BUSY : IPS_IDLE;
+		IDSetNumber(TelemetryNP, NULL);
+		return true;
+	}
+
+	const enum Telemetry::Channel channels[4]={ Telemetry::CHANNEL_SG_RESULT, Telemetry::CHANNEL_CS_ACTUAL,
+	                                            Telemetry::CHANNEL_PWM_SCALE_SUM, Telemetry::CHANNEL_TSTEP };
+	for(int i=0; i<4; i++) {
+		np[3*i  ].value=s.min [channels[i]];
+		np[3*i+1].value=s.mean[channels[i]];
+		np[3*i+2].value=s.max [channels[i]];
+	}
+	np[12].value=s.max[Telemetry::CHANNEL_LOST_STEPS];
+	np[13].value=s.flagCounts[2];  // SAMPLE_OVERTEMP_PW
+	np[14].value=s.samples;
+
+	// overtemperature and shorted phases need attention. Open load is not reliable at stand still, so it is not alerted
+	bool alert=s.flagCounts[2]>0 || s.flagCounts[3]>0 || s.flagCounts[4]>0;
+	TelemetryNP->s=alert ? IPS_ALERT : IPS_OK;
+	IDSetNumber(TelemetryNP, NULL);
+	return true;
+}
+
+
+int Stepper::ISNewNumber(INumberVectorProperty *MotorNP, INumberVectorProperty *RampNP, INumberVectorProperty *TuneNP,
                          const char *name, double values[], char *names[], int n) {
     if(!strcmp(name, MotorNP->name)) { 
-        bool res=setStepsPerRev(values[0]) &&
-        		 setGearRatio(values[1]) &&
-        	     setHoldCurrent((uint32_t) round(values[2])) && 
-                 setRunCurrent ((uint32_t) round(values[3])) &&
-                 setClockHz(values[4]) ;
+        // elements not sent, e.g. by configs saved before they existed, keep their current values
+        int index[MOTORN_SIZE];
+        for(int j=0; j<MOTORN_SIZE; j++) {
+            index[j]=-1;
+            for(int i=0; i<n; i++)
+                if(!strcmp(names[i], MotorNP->np[j].name))
+                    index[j]=i;
+        }
+        auto has=[&](int j) { return index[j]>=0; };
+        auto value=[&](int j) { return values[index[j]]; };
+
+        // SPI clock, telemetry and clock settings come first, as they do not require a connection when loaded from config
+        bool res=(!has(5) || setSPISpeedSetting((uint32_t) round(value(5)))) &&
+        		 (!has(6) || setTelemetryRate((uint32_t) round(value(6)))) &&
+        		 (!has(4) || setClockHz(value(4))) &&
+        		 (!has(7) || setTrackingCadence((uint32_t) round(value(7)))) &&
+        		 (!has(0) || setStepsPerRev(value(0))) &&
+        		 (!has(1) || setGearRatio(value(1))) &&
+        	     (!has(2) || setHoldCurrent((uint32_t) round(value(2)))) && 
+                 (!has(3) || setRunCurrent ((uint32_t) round(value(3))));
+        if(has(5))
+        	values[index[5]]=spiSpeedSetting;  // show the calibrated value
         return ISUpdateNumber(MotorNP, values, names, n, res) ? 1 : 0;
     } else if(!strcmp(name, RampNP->name)) {
     	bool res=setVStart((uint32_t) round(values[0])) &&
@@ -696,6 +1254,11 @@ int Stepper::ISNewNumber(INumberVectorProperty *MotorNP, INumberVectorProperty *
     			 setChopperTOff((uint32_t) round(values[15])) &&
     			 setChopperTBlank((uint32_t) round(values[16])) ;
         return ISUpdateNumber(RampNP, values, names, n, res) ? 1 : 0; 
+    } else if(!strcmp(name, TuneNP->name)) {
+        // takes effect on next connect
+        bool res=n>=TUNEN_SIZE &&
+                 setStealthChopTuning((uint32_t) round(values[0]), (uint32_t) round(values[1]), (uint32_t) round(values[2]));
+        return ISUpdateNumber(TuneNP, values, names, n, res) ? 1 : 0;
     }
     
     return -1;
@@ -724,3 +1287,69 @@ int Stepper::ISNewSwitch(ISwitchVectorProperty *MSwitchSP,
     }    
     return -1;
 }
+
+bool Stepper::updateRampProperty(INumberVectorProperty *RampNP) {
+    INumber *RampN=RampNP->np;
+    uint32_t vstart, a1, v1, amax, vmax, dmax, d1, vstop, tzerowait, 
+    		 tpwmthrs, tcoolthrs, thigh, vdcmin, dctime, dcsg, toff, tbl;
+    if(!getVStart(&vstart) || !getA1(&a1) || !getV1(&v1) || !getAMax(&amax) ||
+       !getMaxGoToSpeed(&vmax) || 
+       !getDMax(&dmax) || !getD1(&d1) || !getVStop(&vstop) || !getTZeroWait(&tzerowait) ||
+       !getTPWMThreshold(&tpwmthrs) || !getTCoolThreshold(&tcoolthrs) || !getTHighThreshold(&thigh) ||
+       !getVDCMin(&vdcmin) || !getDCTime(&dctime) || !getDCStallGuard(&dcsg) ||
+       !getChopperTOff(&toff) || !getChopperTBlank(&tbl) ) {
+       RampNP->s = IPS_ALERT;
+       IDSetNumber(RampNP, NULL);
+       return false;	
+    }
+    RampN[0].value=vstart;
+    RampN[1].value=a1;
+    RampN[2].value=v1;
+    RampN[3].value=amax;
+    RampN[4].value=vmax;
+    RampN[5].value=dmax;
+    RampN[6].value=d1;
+    RampN[7].value=vstop;
+    RampN[8].value=tzerowait;
+    RampN[9].value=tpwmthrs;
+    RampN[10].value=tcoolthrs;
+    RampN[11].value=thigh;
+    RampN[12].value=vdcmin;
+    RampN[13].value=dctime;
+    RampN[14].value=dcsg;
+    RampN[15].value=toff;
+    RampN[16].value=tbl;
+    RampNP->s = IPS_OK;
+    IDSetNumber(RampNP, NULL);
+    return true;
+}
+
+
+int Stepper::ISNewText(ITextVectorProperty *ProfileTP, INumberVectorProperty *RampNP,
+                       const char *name, char *texts[], char *names[], int n) {
+    if(!strcmp(name, ProfileTP->name)) {
+        // elements not sent keep their current values
+        const char *newName  =ProfileTP->tp[0].text;
+        const char *newFields=ProfileTP->tp[1].text;
+        for(int i=0; i<n; i++)
+            if(!strcmp(names[i], ProfileTP->tp[0].name))
+                newName=texts[i];
+            else if(!strcmp(names[i], ProfileTP->tp[1].name))
+                newFields=texts[i];
+        bool res=setProfile(newName, newFields);
+        if(res) {
+            char fields[1024];
+            printProfile(fields, sizeof(fields));
+            IUSaveText(&ProfileTP->tp[0], profileName);
+            IUSaveText(&ProfileTP->tp[1], fields);
+        }
+        ProfileTP->s=res ? IPS_OK : IPS_ALERT;
+        IDSetText(ProfileTP, NULL);
+
+        // the profile covers most ramp settings
+        if(res && isConnected())
+            updateRampProperty(RampNP);
+        return res ? 1 : 0;
+    }
+    return -1;
+}
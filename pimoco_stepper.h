@@ -22,8 +22,10 @@
 #define PIMOCO_STEPPER_H
 
 #include "pimoco_tmc5160.h"
+#include "pimoco_kinematics.h"
+#include "pimoco_ramp.h"
 #include <libindi/indidevapi.h>
-#include <math.h> // for M_PI
+#include <math.h> // for round
 
 // Higher-level stepper functions, building on the underlying implementation of TMC5160 stepper registers
 class Stepper : public TMC5160 {
@@ -40,15 +42,62 @@ protected:
 	// Performs handshake on already open SPI connection. Returns true if successful, else false
 	bool Handshake();
 
+	// Sets XENC to each of the given values and reads it back, in a single SPI message of 2*num+1 datagrams.
+	// Counts mismatched responses in the variable pointed to by errors. Logs details if verbose. Returns true if the exchange succeeded, else false
+	bool exchangeTestPattern(const uint32_t *values, uint32_t num, uint32_t *errors, bool verbose);
+
+	// Probes the given SPI clock for at least the given number of datagrams. Loads pseudo-random values into XENC at the default
+	// clock and only reads them back at the given clock, so a corrupted datagram cannot write a meaningful value to another register.
+	// Counts mismatched responses in the variable pointed to by errors. Returns true if the exchange succeeded, else false
+	bool countProbeErrors(uint32_t speedHz, uint32_t numFrames, uint32_t *errors);
+
 	// Initializes the stepper parameters on an already open SPI connection. Returns true if successful, else false 
 	bool Init();
 
+	// Takes over a device which kept its configuration and position, e.g. after a driver restart, without stopping or moving it.
+	// Requires a clear reset flag in GSTAT, readable registers matching the configuration Init() would establish,
+	// and the given configuration signature read from the device to match. Returns true if taken over, else false
+	bool WarmInit(uint32_t signature);
+
+	// Returns a signature of the device configuration per the shadow register file, excluding motion registers. Never 0
+	uint32_t getConfigSignature();
+
+	// Stores the signature of the current configuration on the device, for a warm start after a driver restart.
+	// Uses X_ENC, as no encoder is connected. Returns true on success, else false
+	bool writeConfigSignature();
+
+	// Sets driver, ramp and chopper parameters from the register profile, and default currents. Called within a register batch by Init().
+	// Returns true if successful, else false
+	bool InitRegisters();
+
+	// Sets the target position as above, and if completion is non-NULL, stores a future for the go-to in the variable it points to.
+	// Returns true on success, else false
+	bool setTargetPosition(int32_t value, double restoreSpeed, std::future<bool> *completion);
+
+	// Sets the target position as above. Must be called on the I/O worker thread within a move begun with beginMove().
+	// Returns true on success, else false
+	bool setTargetPositionOnWorker(int32_t value, double restoreSpeed);
+
+	// Recovers from a device reset or driver error while connected. After a reset, restores the register image from the shadow register
+	// file and XACTUAL from the last known good position, and resumes the previous motion. After a driver error, restarts the driver,
+	// keeping the position and motion the device retained. Gives up if the fault recurs right away, see checkRecovery().
+	// Posted to the I/O worker thread on RAMP_EVENTS_FAULT, and reposts itself while the INDI thread holds a register batch open
+	void recover();
+
 public:
 	bool close();
 
-	// Sets the target velocity in arcseconds per second of the controlled object. Returns immediately. Returns true on success, else false
+	// Returns true if the last open() took over a still configured device without re-initializing or moving it
+	bool isWarmStart() { return warmStart; }
+
+	// Sets the target velocity in arcseconds per second of the controlled object, as fractional target speed without rounding.
+	// Returns immediately. Returns true on success, else false
 	bool setTargetVelocityArcsecPerSec(double arcsecPerSec);
 
+	// Queues setting the target velocity in arcseconds per second of the controlled object on the I/O worker, without
+	// waiting for the bus. Errors are logged from the worker. Returns true if queued, else false
+	bool setTargetVelocityArcsecPerSecAsync(double arcsecPerSec) { return setTargetSpeedFractionalAsync(arcsecPerSecToNativeFractional(arcsecPerSec)); }
+
 	// Stops all current movement. Returns true on success, else false
 	bool stop();
 
@@ -56,69 +105,97 @@ public:
 	bool getPosition(int32_t *result) { return getRegister(TMCR_XACTUAL, (uint32_t*) result); }
 
 	// Gets current position in radians, based on usteps, steps and gear ratio
-	bool getPositionRadians(double *result) { return getPositionInUnits(result, 2.0*M_PI); }
+	bool getPositionRadians(double *result) { return getPositionInUnits(result, Kinematics::UNIT_RADIANS); }
 
 	// Gets current position in degrees, based on usteps, steps and gear ratio
-	bool getPositionDegrees(double *result) { return getPositionInUnits(result, 360.0); }
+	bool getPositionDegrees(double *result) { return getPositionInUnits(result, Kinematics::UNIT_DEGREES); }
 
 	// Gets current position in hours, based on usteps, steps and gear ratio
-	bool getPositionHours(double *result) { return getPositionInUnits(result, 24.0); }
+	bool getPositionHours(double *result) { return getPositionInUnits(result, Kinematics::UNIT_HOURS); }
 
-	// Gets current position in given units for full circle
-	bool getPositionInUnits(double *result, double full);
+	// Gets current position in the given unit
+	bool getPositionInUnits(double *result, enum Kinematics::Unit unit);
 
 	// Syncs the current position on device to the given value. Temporarily enters holding mode to avoid moving the axis, 
 	// then restores previous ramping mode afterwards. Returns true on success, else false	
 	bool syncPosition(int32_t value);
 
 	// Syncs current position in radians, based on usteps, steps and gear ratio
-	bool syncPositionRadians(double value) { return syncPositionInUnits(value, 2.0*M_PI); }
+	bool syncPositionRadians(double value) { return syncPositionInUnits(value, Kinematics::UNIT_RADIANS); }
 
 	// Syncs current position in degrees, based on usteps, steps and gear ratio
-	bool syncPositionDegrees(double value) { return syncPositionInUnits(value, 360.0); }
+	bool syncPositionDegrees(double value) { return syncPositionInUnits(value, Kinematics::UNIT_DEGREES); }
 
 	// Syncs current position in hours, based on usteps, steps and gear ratio
-	bool syncPositionHours(double value) { return syncPositionInUnits(value, 24.0); }
+	bool syncPositionHours(double value) { return syncPositionInUnits(value, Kinematics::UNIT_HOURS); }
 
-	// Syncs current position in given units for full circle
-	bool syncPositionInUnits(double value, double full);
+	// Syncs current position in the given unit
+	bool syncPositionInUnits(double value, enum Kinematics::Unit unit) { return syncPosition(unitsToNative(value, unit)); }
 
 	// Gets the target position for gotos. Returns true on success, else false
 	bool getTargetPosition(int32_t *result) { return getRegister(TMCR_XTARGET, (uint32_t*) result); }
 
-	// Sets the target position, initiating a non-blocking go-to. If restoreSpeed is nonzero, restores the given speed once position is reached.
+	// Sets the target position, initiating a non-blocking go-to. If restoreSpeed is nonzero, restores the given fractional speed once position is reached.
 	// Returns immediately. Returns true on success, else false
-	bool setTargetPosition(int32_t value, int32_t restoreSpeed=0);
+	bool setTargetPosition(int32_t value, double restoreSpeed=0) { return setTargetPosition(value, restoreSpeed, NULL); }
 
-	// Sets the target position and performs a blocking go-to with optional timeout (0=no timeout). Returns when position reached, or timeout occurs. Returns true on success, else false
+	// Sets the target position, initiating a non-blocking go-to. If restoreSpeed is nonzero, restores the given speed once position is reached.
+	// Returns immediately with a future which becomes true once the position is reached, or false if the go-to fails, is stopped
+	// by a switch or StallGuard, or is superseded by another go-to or a speed change
+	std::future<bool> setTargetPositionAsync(int32_t value, double restoreSpeed=0);
+
+	// Sets the target position and performs a blocking go-to with optional timeout (0=no timeout). Returns when position reached, or timeout occurs.
+	// Must not be called on the I/O worker thread. Returns true on success, else false
 	bool setTargetPositionBlocking(int32_t value, uint32_t timeoutMs=0);
 
+	// Gets the ramp generator settings used for go-tos from the shadow register file, with the maximum go-to speed as VMAX.
+	// Returns true on success, else false
+	bool getGoToRampSettings(Ramp::Settings *result);
+
+	// Predicts a go-to to the given target from the position and speed in the given motion status. Returns true on success, else false
+	bool predictGoTo(Ramp *result, int32_t target, const MotionStatus &status);
+
 	// Sets the target position in radians, initiating a non-blocking go-to. Returns immediately. Returns true on success, else false
-	bool setTargetPositionRadians(double value, int32_t restoreSpeed=0) { return setTargetPositionInUnits(value, 2.0*M_PI, restoreSpeed); }
+	bool setTargetPositionRadians(double value, double restoreSpeed=0) { return setTargetPositionInUnits(value, Kinematics::UNIT_RADIANS, restoreSpeed); }
 
 	// Sets the target position in degrees, initiating a non-blocking go-to. Returns immediately. Returns true on success, else false
-	bool setTargetPositionDegrees(double value, int32_t restoreSpeed=0) { return setTargetPositionInUnits(value, 360.0, restoreSpeed); }
+	bool setTargetPositionDegrees(double value, double restoreSpeed=0) { return setTargetPositionInUnits(value, Kinematics::UNIT_DEGREES, restoreSpeed); }
 
 	// Sets the target position in hours, initiating a non-blocking go-to. Returns immediately. Returns true on success, else false
-	bool setTargetPositionHours(double value, int32_t restoreSpeed=0) { return setTargetPositionInUnits(value, 24.0, restoreSpeed); }
+	bool setTargetPositionHours(double value, double restoreSpeed=0) { return setTargetPositionInUnits(value, Kinematics::UNIT_HOURS, restoreSpeed); }
 
-	// Syncs current position in given units for full circle
-	bool setTargetPositionInUnits(double value, double full, int32_t restoreSpeed=0);
+	// Sets the target position in the given unit, initiating a non-blocking go-to. Returns immediately. Returns true on success, else false
+	bool setTargetPositionInUnits(double value, enum Kinematics::Unit unit, double restoreSpeed=0) { return setTargetPosition(unitsToNative(value, unit), restoreSpeed); }
 
 	// Converts radians to native steps
-	int32_t radiansToNative(double value) {	return unitsToNative(value, 2*M_PI); }
+	int32_t radiansToNative(double value) {	return unitsToNative(value, Kinematics::UNIT_RADIANS); }
 
 	// Converts degrees to native steps
-	int32_t degreesToNative(double value) {	return unitsToNative(value, 360.0); }
+	int32_t degreesToNative(double value) {	return unitsToNative(value, Kinematics::UNIT_DEGREES); }
 
 	// Converts hours to native steps
-	int32_t hoursToNative(double value) { return unitsToNative(value, 24.0); }
+	int32_t hoursToNative(double value) { return unitsToNative(value, Kinematics::UNIT_HOURS); }
+
+	// Converts the given unit to native steps
+	int32_t unitsToNative(double value, enum Kinematics::Unit unit) { return kinematics.toNative(value, unit); }
 
-	// Converts given full circle units to native steps
-	int32_t unitsToNative(double value, double full) {	return round(value * (microsteps * stepsPerRev * gearRatio) / full); }
+	// Converts native steps to radians
+	double nativeToRadians(int32_t value) { return nativeToUnits(value, Kinematics::UNIT_RADIANS); }
 
-	// Converts given speed in arcecs/sec to native step speed units
-	int32_t arcsecPerSecToNative(double arcsecPerSec);
+	// Converts native steps to degrees
+	double nativeToDegrees(int32_t value) { return nativeToUnits(value, Kinematics::UNIT_DEGREES); }
+
+	// Converts native steps to hours
+	double nativeToHours(int32_t value) { return nativeToUnits(value, Kinematics::UNIT_HOURS); }
+
+	// Converts native steps to the given unit
+	double nativeToUnits(int32_t value, enum Kinematics::Unit unit) { return kinematics.fromNative(value, unit); }
+
+	// Converts given speed in arcecs/sec to native step speed units, rounded to an integer
+	int32_t arcsecPerSecToNative(double arcsecPerSec) { return (int32_t) round(arcsecPerSecToNativeFractional(arcsecPerSec)); }
+
+	// Converts given speed in arcecs/sec to fractional native step speed units
+	double arcsecPerSecToNativeFractional(double arcsecPerSec);
 
 	// Get minimum position limit. Returns true on success, else false
 	bool getMinPosition(int32_t *result) { *result=minPosition; return true; }
@@ -163,23 +240,57 @@ public:
 	bool getMicrosteps(double *result) { *result=microsteps; return true; }
 
 	// Sets steps per revolution. Always succeeds
-	bool setStepsPerRev(double value) { stepsPerRev=value; return true; }
+	bool setStepsPerRev(double value) { stepsPerRev=value; updateKinematics(); return true; }
 
 	// Gets steps per revolution. Always succeeds
 	bool getStepsPerRev(double *result) { *result=stepsPerRev; return true; }
 
 	// Sets gear ratio. Motor must turn X times for one full turn of the controlled object. Always succeeds
-	bool setGearRatio(double value) { gearRatio=value; return true; }
+	bool setGearRatio(double value) { gearRatio=value; updateKinematics(); return true; }
 
 	// Gets gear ratio. Motor must turn X times for one full turn of the controlled object. Always succeeds
 	bool getGearRatio(double *result) { *result=gearRatio; return true; }
 
 	// Sets clock in Hz.  Does not change physical setting, used for physical position/speed/accel calculations only. Always succeeds
-	bool setClockHz(uint32_t value) { clockHz=value; return true; }
+	bool setClockHz(uint32_t value) { clockHz=value; updateKinematics(); return true; }
 
 	// Gets glock in Hz.  Does not change physical setting, used for physical position/speed/accel calculations only. Always succeeds
 	bool getClockHz(uint32_t *result) { *result=clockHz; return true; }
 
+	// Sets the SPI clock in Hz, or 0 to calibrate. Takes effect immediately if connected, else on connect. Returns true on success, else false
+	bool setSPISpeedSetting(uint32_t value);
+
+	// Gets the SPI clock setting in Hz, 0 if calibration is requested but has not succeeded yet. Always succeeds
+	bool getSPISpeedSetting(uint32_t *result) { *result=spiSpeedSetting; return true; }
+
+	// Calibrates the SPI clock by probing with read-only test patterns at increasing speeds, and applies the highest error-free
+	// speed minus a safety margin. Stores the resulting speed in the variable pointed to by result. Returns true on success, else false
+	bool calibrateSPISpeed(uint32_t *result);
+
+
+	// Register profile
+	//
+
+	// Sets the register profile to the given name and whitespace-separated field assignments, e.g. "TOFF=5 TBL=2".
+	// Fields not assigned take their default values. Written to the device in one register batch if connected, else on connect.
+	// While connected, the axis must be at a standstill, and motion fields such as VMAX take effect on the next initialization.
+	// Returns true on success, else false
+	bool setProfile(const char *name, const char *fields);
+
+	// Prints all field assignments of the register profile into the given buffer. Returns number of characters printed, excluding the terminating zero
+	int printProfile(char *buffer, int bufsize);
+
+	// Returns the name of the register profile
+	const char *getProfileName() { return profileName; }
+
+
+	// StealthChop tuning
+	//
+
+	// Sets the StealthChop tuning result to restore on connect instead of running the tuning motion, with the fingerprint of the
+	// motor and current configuration it was obtained with. A fingerprint of 0 forces tuning on the next connect. Always succeeds
+	bool setStealthChopTuning(uint32_t pwmOffset, uint32_t pwmGradient, uint32_t fingerprint);
+
 
 	// Indi UI
 	//
@@ -188,20 +299,36 @@ public:
 	void initProperties(INumber *MotorN, INumberVectorProperty *MotorNP,
 						ISwitch *MSwitchS, ISwitchVectorProperty *MSwitchSP, 
 	                    INumber *RampN, INumberVectorProperty *RampNP, 
+	                    IText *ProfileT, ITextVectorProperty *ProfileTP,
+	                    INumber *TuneN, INumberVectorProperty *TuneNP,
+	                    INumber *TelemetryN, INumberVectorProperty *TelemetryNP,
                         const char *motorVarName, const char *motorUILabel,
                         const char *mSwitchVarName, const char *mSwitchUILabel,
                         const char *rampVarName, const char *rampUILabel, 
+                        const char *profileVarName, const char *profileUILabel,
+                        const char *tuneVarName, const char *tuneUILabel,
+                        const char *telemetryVarName, const char *telemetryUILabel,
 	                    const char *tabName);
 
 	// Update INDI UI properties based on connection status. Returns true on success, else false
 	bool updateProperties(INDI::DefaultDevice *iDevice,
 					      INumber *MotorN, INumberVectorProperty *MotorNP, 
 						  ISwitch *MSwitchS, ISwitchVectorProperty *MSwitchSP, 
-	                      INumber *RampN, INumberVectorProperty *RampNP);
+	                      INumber *RampN, INumberVectorProperty *RampNP,
+	                      IText *ProfileT, ITextVectorProperty *ProfileTP,
+	                      INumber *TuneN, INumberVectorProperty *TuneNP,
+	                      INumber *TelemetryN, INumberVectorProperty *TelemetryNP);
+
+	// Updates the driver telemetry property with min/mean/max of the samples taken since the last update. Returns true on success, else false
+	bool updateTelemetry(INumberVectorProperty *TelemetryNP);
+
+	// Sets the motor settings property to alert if recovery from a device fault failed or gave up since the last call.
+	// Call periodically on the INDI thread. Returns true if the device is fine, else false
+	bool checkRecovery(INumberVectorProperty *MotorNP);
 
 	// Update stepper setting number based on new values coming from UI. 
 	// Returns 1 if successful, 0 if unsuccessful, -1 if handler not applicable for this name
-	int ISNewNumber(INumberVectorProperty *MotorNP, INumberVectorProperty *RampNP,
+	int ISNewNumber(INumberVectorProperty *MotorNP, INumberVectorProperty *RampNP, INumberVectorProperty *TuneNP,
                     const char *name, double values[], char *names[], int n);
 
     // Updates number vector property with the given values if res is true and display status IPS_OK, else display status IPS_ALERT. Returns res for convenience. 
@@ -212,17 +339,67 @@ public:
 	int ISNewSwitch(ISwitchVectorProperty *MSwitchSP, 
                     const char *name, ISState *states, char *names[], int n);
 
+    // Update register profile based on new values coming from UI or config file.
+	// Returns 1 if successful, 0 if unsuccessful, -1 if handler not applicable for this name
+	int ISNewText(ITextVectorProperty *ProfileTP, INumberVectorProperty *RampNP,
+                  const char *name, char *texts[], char *names[], int n);
+
+	// Updates the ramp settings property from the device. Returns true on success, else false
+	bool updateRampProperty(INumberVectorProperty *RampNP);
+
 public:
 	enum {
-		MOTORN_SIZE = 5,
+		MOTORN_SIZE = 8,
 		MSWITCHS_SIZE = 4,
 		RAMPN_SIZE = 17,
+		PROFILET_SIZE = 2,
+		TUNEN_SIZE = 3,
+		TELEMETRYN_SIZE = 19,
 	};
 
 protected:
+	// A register field assignable from a profile
+	struct ProfileField {
+		const char *name;                 // field name in profile text
+		bool (TMC5160::*set)(uint32_t);   // setter for the field
+		uint32_t maxValue;                // largest value fitting into the field
+		uint32_t defaultValue;            // value if not assigned in the profile
+		bool motion;                      // field starts motion if written in velocity mode, so it is only written on initialization
+	};
+
+	enum {
+		PROFILE_FIELDS_SIZE = 28,
+		PROFILE_NAME_SIZE   = 64,
+		PROFILE_TEXT_SIZE   = 1024,  // maximum length of the field assignments text, including the terminating zero
+	};
+
+	// Writes all profile fields into the shadow register file, including motion fields if requested. Call within a register batch.
+	// Returns true on success, else false
+	bool writeProfile(bool withMotion);
+
+	// Register fields assignable from a profile, in order of writing
+	static const ProfileField profileFields[PROFILE_FIELDS_SIZE];
+
+	// Name of the register profile
+	char profileName[PROFILE_NAME_SIZE];
+
+	// Field values of the register profile, indexed like profileFields
+	uint32_t profileValues[PROFILE_FIELDS_SIZE];
+
 	// Runs automatic chopper tuning procedure, as per TMC5160A datasheet section 7.1, p.57ff
 	bool chopperAutoTuneStealthChop(uint32_t secondSteps, uint32_t timeoutMs);
 
+	// Restores the stored StealthChop tuning result as PWM_OFS/PWM_GRAD if its fingerprint matches the current configuration.
+	// Otherwise runs the tuning motion, then reads back and stores the result. Returns true on success, else false
+	bool tuneStealthChop();
+
+	// Rebuilds the unit conversions from steps per revolution, gear ratio and clock
+	void updateKinematics();
+
+	// Returns a fingerprint of the register configuration the StealthChop tuning result depends on: currents, chopper
+	// and PWM settings as per the shadow register file. Never 0
+	uint32_t getTuneFingerprint();
+
 	// Minimum position, in microsteps
 	int32_t minPosition;
 
@@ -245,8 +422,41 @@ protected:
 	// Motor must turn X times for one full turn of the controlled object. 
 	double   gearRatio;
 
-	// Stepper clock in Hz. Does not change physical setting, used for physical position/speed/accel calculations only.
-	uint32_t clockHz;
+	// Conversion between native and physical units, rebuilt whenever steps per revolution, gear ratio or clock change
+	Kinematics kinematics;
+
+	// Configured SPI clock in Hz. Defaults to the safe default clock. 0 means calibrate on connect
+	uint32_t spiSpeedSetting;
+
+	// StealthChop tuning result PWM_OFS_AUTO, restored as initial PWM_OFS
+	uint32_t tunedPWMOffset;
+
+	// StealthChop tuning result PWM_GRAD_AUTO, restored as initial PWM_GRAD
+	uint32_t tunedPWMGradient;
+
+	// Fingerprint of the configuration the tuning result was obtained with. 0 if none
+	uint32_t tuneFingerprint;
+
+	// True if the last open() took over a still configured device
+	bool warmStart;
+
+	// CLOCK_MONOTONIC time in nanoseconds of the last driver telemetry property update
+	uint64_t telemetryUpdateNs;
+
+	// Total number of driver telemetry samples at the last property update, to count samples dropped since
+	uint64_t telemetryUpdateSize;
+
+	// Flag: recover from device faults? Set while connected and initialized
+	volatile bool recoveryEnabled;
+
+	// Flag: is a recovery posted to the I/O worker thread? Accessed on the I/O worker thread only
+	bool recoveryPending;
+
+	// CLOCK_MONOTONIC time in nanoseconds of the last recovery, 0 if none. Accessed on the I/O worker thread only
+	uint64_t recoveryNs;
+
+	// Flag: did recovery fail or give up since the last checkRecovery()? Set on the I/O worker thread, cleared on the INDI thread
+	std::atomic<bool> recoveryFailed;
 
 
 protected:	
@@ -269,6 +479,24 @@ protected:
 	// Motor must turn X times for one full turn of the controlled object. 
 	static const double   defaultGearRatio;
 
+	// SPI clock speeds tried during calibration in ascending order, terminated by 0
+	static const uint32_t calibrationSPISpeedsHz[];
+
+	// Number of datagrams exchanged per SPI clock speed during calibration
+	static const uint32_t calibrationFrames;
+
+	// Percentage of the highest error-free SPI clock speed used after calibration
+	static const uint32_t calibrationMarginPercent;
+
+	// Number of most recent SPI datagrams decoded into the log on close at register debug level
+	static const uint32_t traceRecordsOnClose;
+
+	// Default driver telemetry sampling rate in Hz
+	static const uint32_t defaultTelemetryRateHz;
+
+	// Minimum time between recoveries in nanoseconds. A fault recurring sooner is persistent, e.g. a shorted coil
+	static const uint64_t recoveryHoldoffNs;
+
  };
 
 #endif // PIMOCO_STEPPER_H
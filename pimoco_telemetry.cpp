@@ -0,0 +1,102 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "pimoco_telemetry.h"
+#include <string.h>  // for memmove
+
+
+void Telemetry::record(const Sample &sample) {
+	uint64_t h=head.load(std::memory_order_relaxed);
+	samples[h & (CAPACITY-1)]=sample;
+	head.store(h+1, std::memory_order_release);
+}
+
+
+uint32_t Telemetry::snapshot(Sample *result, uint32_t maxSamples) const {
+	uint64_t end=head.load(std::memory_order_acquire);
+	uint64_t available=end<(uint64_t) CAPACITY ? end : (uint64_t) CAPACITY;
+	uint64_t n=available<maxSamples ? available : maxSamples;
+	uint64_t start=end-n;
+	for(uint64_t i=0; i<n; i++)
+		result[i]=samples[(start+i) & (CAPACITY-1)];
+
+	// drop samples the writer may have overwritten while copying. Keeps one slot of slack for a write in progress
+	uint64_t newEnd=head.load(std::memory_order_acquire);
+	uint64_t firstValid=(newEnd+1>CAPACITY) ? newEnd+1-CAPACITY : 0;
+	if(start>=firstValid)
+		return (uint32_t) n;
+	uint64_t skip=firstValid-start;
+	if(skip>=n)
+		return 0;
+	memmove(result, result+skip, (n-skip)*sizeof(Sample));
+	return (uint32_t) (n-skip);
+}
+
+
+uint32_t Telemetry::summarize(Summary *result, uint64_t sinceNs, uint64_t untilNs) const {
+	*result=Summary();
+
+	std::lock_guard<std::mutex> lock(summaryMutex);
+	Sample *buffer=summaryBuffer;
+	uint32_t n=snapshot(buffer, CAPACITY);
+	while(n>0 && buffer[n-1].timestampNs>=untilNs)
+		n--;
+	uint32_t first=n;
+	while(first>0 && buffer[first-1].timestampNs>=sinceNs)
+		first--;
+
+	double sum[NUM_CHANNELS]={ 0 };
+	for(uint32_t i=first; i<n; i++) {
+		const Sample &s=buffer[i];
+		for(int c=0; c<NUM_CHANNELS; c++) {
+			double v=getChannel(s, (enum Channel) c);
+			if(i==first || v<result->min[c])
+				result->min[c]=v;
+			if(i==first || v>result->max[c])
+				result->max[c]=v;
+			sum[c]+=v;
+		}
+		for(int b=0; b<8; b++)
+			if(s.flags & (1u<<b))
+				result->flagCounts[b]++;
+	}
+	result->samples=n-first;
+	if(result->samples>0)
+		for(int c=0; c<NUM_CHANNELS; c++)
+			result->mean[c]=sum[c]/result->samples;
+	return result->samples;
+}
+
+
+uint64_t Telemetry::dropped(uint64_t sinceSize) const {
+	// snapshots keep one slot of slack for a write in progress
+	uint64_t appended=head.load(std::memory_order_acquire)-sinceSize;
+	return appended>CAPACITY-1 ? appended-(CAPACITY-1) : 0;
+}
+
+
+double Telemetry::getChannel(const Sample &sample, enum Channel channel) {
+	switch(channel) {
+		case CHANNEL_SG_RESULT:     return sample.sgResult;
+		case CHANNEL_CS_ACTUAL:     return sample.csActual;
+		case CHANNEL_PWM_SCALE_SUM: return sample.pwmScaleSum;
+		case CHANNEL_TSTEP:         return sample.tstep;
+		case CHANNEL_LOST_STEPS:    return sample.lostSteps;
+		default:                    return 0;
+	}
+}
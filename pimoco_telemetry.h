@@ -0,0 +1,116 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef PIMOCO_TELEMETRY_H
+#define PIMOCO_TELEMETRY_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+
+// A fixed-size ring buffer of decoded driver telemetry samples with monotonic timestamps. A single writer
+// (the I/O worker thread of the bus) appends; readers on any thread take consistent snapshots and summaries.
+class Telemetry {
+public:
+	// A telemetry sample
+	struct Sample {
+		uint64_t timestampNs;  // CLOCK_MONOTONIC time at which the sample was taken, in nanoseconds
+		uint32_t tstep;        // time between microsteps TSTEP, in clock cycles
+		uint32_t lostSteps;    // steps lost to StallGuard stops LOST_STEPS
+		uint16_t sgResult;     // StallGuard result SG_RESULT, lower means higher load
+		int16_t  pwmScaleAuto; // StealthChop amplitude regulator offset PWM_SCALE_AUTO
+		uint8_t  pwmScaleSum;  // StealthChop PWM amplitude PWM_SCALE_SUM
+		uint8_t  csActual;     // actual current scale CS_ACTUAL, 0..31
+		uint8_t  flags;        // SAMPLE_* flags from DRV_STATUS
+		uint8_t  pad;
+	};
+
+	// Sample flags
+	enum {
+		SAMPLE_STAND_STILL = 1,   // motor is at stand still
+		SAMPLE_STALL       = 2,   // StallGuard threshold reached
+		SAMPLE_OVERTEMP_PW = 4,   // overtemperature pre-warning
+		SAMPLE_OVERTEMP    = 8,   // overtemperature shutdown
+		SAMPLE_SHORT       = 16,  // short to ground or supply on a phase
+		SAMPLE_OPEN_LOAD   = 32,  // open load on a phase
+	};
+
+	// Summarized channels
+	enum Channel {
+		CHANNEL_SG_RESULT     = 0,
+		CHANNEL_CS_ACTUAL     = 1,
+		CHANNEL_PWM_SCALE_SUM = 2,
+		CHANNEL_TSTEP         = 3,
+		CHANNEL_LOST_STEPS    = 4,
+		NUM_CHANNELS          = 5
+	};
+
+	// Minimum, mean and maximum of each channel over a range of samples
+	struct Summary {
+		uint32_t samples;                   // number of samples summarized
+		uint32_t flagCounts[8];             // number of samples with the respective SAMPLE_* flag bit set
+		double   min [NUM_CHANNELS];
+		double   mean[NUM_CHANNELS];
+		double   max [NUM_CHANNELS];
+	};
+
+	enum {
+		CAPACITY = 1024  // number of samples, must be a power of two
+	};
+
+	// Creates an empty telemetry ring
+	Telemetry() : head(0) { }
+
+	// Appends the given sample. Writer thread only
+	void record(const Sample &sample);
+
+	// Copies up to the given number of most recent samples into the given array, oldest first.
+	// Returns the number of samples copied. Safe to call from any thread
+	uint32_t snapshot(Sample *result, uint32_t maxSamples) const;
+
+	// Summarizes the samples taken at or after the given first and before the given last CLOCK_MONOTONIC time in nanoseconds.
+	// Returns the number of samples summarized. Safe to call from any thread; concurrent summaries take turns
+	uint32_t summarize(Summary *result, uint64_t sinceNs, uint64_t untilNs) const;
+
+	// Returns the number of samples appended after the given total number of samples which were overwritten since,
+	// e.g. because readers summarized too rarely for the sampling rate. Safe to call from any thread
+	uint64_t dropped(uint64_t sinceSize) const;
+
+	// Returns the total number of samples appended since creation
+	uint64_t size() const { return head.load(std::memory_order_acquire); }
+
+	// Returns the value of the given channel in the given sample
+	static double getChannel(const Sample &sample, enum Channel channel);
+
+protected:
+	// Ring of samples, indexed by sequence number modulo CAPACITY
+	Sample samples[CAPACITY];
+
+	// Sequence number of the next sample to write
+	std::atomic<uint64_t> head;
+
+	// Snapshot buffer for summaries, preallocated to keep periodic summaries free of allocation. Protected by summaryMutex
+	mutable Sample summaryBuffer[CAPACITY];
+
+	// Serializes summaries sharing summaryBuffer
+	mutable std::mutex summaryMutex;
+};
+
+#endif // PIMOCO_TELEMETRY_H
@@ -26,17 +26,23 @@
 #include <cstdio>
 #include <sys/time.h>  // for gettimeofday() etc.
 #include <libindi/indilogger.h> // for LOG_..., LOGF_... macros
-#include <wiringPi.h> // for GPIO etc
+#include <linux/gpio.h> // for GPIO line events
+#include <sys/timerfd.h> // for telemetry sampling
+#include <stdlib.h>   // for getenv
+#include <math.h>     // for llround, ldexp
+#include <string.h>   // for memset, strerror
+#include <errno.h>
 
 #include "pimoco_tmc5160.h"
+#include "pimoco_emulator.h"
 
 
 const TMC5160::TMCRegisterMetaData TMC5160::registerMetaData[]={
 	{ "GCONF",          TMC5160::TMCRM_RW   }, // 0x00
-	{ "GSTAT",          TMC5160::TMCRM_RW   }, // 0x01
+	{ "GSTAT",          TMC5160::TMCRM_RWV  }, // 0x01
 	{ "IFCNT",          TMC5160::TMCRM_R    }, // 0x02
 	{ "SLAVECONF",      TMC5160::TMCRM_W    }, // 0x03
-	{ "IOIN_or_OUTPUT", TMC5160::TMCRM_RW   }, // 0x04
+	{ "IOIN_or_OUTPUT", TMC5160::TMCRM_RWV  }, // 0x04
 	{ "X_COMPARE",      TMC5160::TMCRM_W    }, // 0x05
 	{ "OPT_PROG",       TMC5160::TMCRM_W    }, // 0x06
 	{ "OPT_READ",       TMC5160::TMCRM_R    }, // 0x07
@@ -65,7 +71,7 @@ const TMC5160::TMCRegisterMetaData TMC5160::registerMetaData[]={
 	{ "UNDEFINED",      TMC5160::TMCRM_NONE }, // 0x1e
 	{ "UNDEFINED",      TMC5160::TMCRM_NONE }, // 0x1f
 	{ "RAMPMODE",       TMC5160::TMCRM_RW   }, // 0x20
-	{ "XACTUAL",        TMC5160::TMCRM_RW   }, // 0x21
+	{ "XACTUAL",        TMC5160::TMCRM_RWV  }, // 0x21
 	{ "VACTUAL",        TMC5160::TMCRM_R    }, // 0x22
 	{ "VSTART",         TMC5160::TMCRM_W    }, // 0x23
 	{ "A1",             TMC5160::TMCRM_W    }, // 0x24
@@ -85,13 +91,13 @@ const TMC5160::TMCRegisterMetaData TMC5160::registerMetaData[]={
 	{ "UNDEFINED",      TMC5160::TMCRM_NONE }, // 0x32
 	{ "VDCMIN",         TMC5160::TMCRM_W    }, // 0x33
 	{ "SW_MODE",        TMC5160::TMCRM_RW   }, // 0x34
-	{ "RAMP_STAT",      TMC5160::TMCRM_RW   }, // 0x35
+	{ "RAMP_STAT",      TMC5160::TMCRM_RWV  }, // 0x35
 	{ "XLATCH",         TMC5160::TMCRM_R    }, // 0x36
 	{ "UNDEFINED",      TMC5160::TMCRM_NONE }, // 0x07
 	{ "ENCMODE",        TMC5160::TMCRM_RW   }, // 0x38
-	{ "X_ENC",          TMC5160::TMCRM_RW   }, // 0x39
+	{ "X_ENC",          TMC5160::TMCRM_RWV  }, // 0x39
 	{ "ENC_CONST",      TMC5160::TMCRM_W    }, // 0x3a
-	{ "ENC_STATUS",     TMC5160::TMCRM_RW   }, // 0x3b
+	{ "ENC_STATUS",     TMC5160::TMCRM_RWV  }, // 0x3b
 	{ "ENC_LATCH",      TMC5160::TMCRM_R    }, // 0x3c
 	{ "ENC_DEVIATION",  TMC5160::TMCRM_W    }, // 0x3d
 	{ "UNDEFINED",      TMC5160::TMCRM_NONE }, // 0x3e
@@ -173,164 +179,502 @@ const char *TMC5160::statusFlagNames[]={
 		"STOP_R",            // Bit 7
 };
 
-bool TMC5160::isGPIOInitialized = false;
-
-void (*TMC5160::isrsByPin[TMC5160::RPI_PHYS_PIN_MAX+1])(void)={
-	NULL,
-	&TMC5160::isr01,
-	&TMC5160::isr02,
-	&TMC5160::isr03,
-	&TMC5160::isr04,
-	&TMC5160::isr05,
-	&TMC5160::isr06,
-	&TMC5160::isr07,
-	&TMC5160::isr08,
-	&TMC5160::isr09,
-	&TMC5160::isr10,
-	&TMC5160::isr11,
-	&TMC5160::isr12,
-	&TMC5160::isr13,
-	&TMC5160::isr14,
-	&TMC5160::isr15,
-	&TMC5160::isr16,
-	&TMC5160::isr17,
-	&TMC5160::isr18,
-	&TMC5160::isr19,
-	&TMC5160::isr20,
-	&TMC5160::isr21,
-	&TMC5160::isr22,
-	&TMC5160::isr23,
-	&TMC5160::isr24,
-	&TMC5160::isr25,
-	&TMC5160::isr26,
-	&TMC5160::isr27,
-	&TMC5160::isr28,
-	&TMC5160::isr29,
-	&TMC5160::isr30,
-	&TMC5160::isr31,
-	&TMC5160::isr32,
-	&TMC5160::isr33,
-	&TMC5160::isr34,
-	&TMC5160::isr35,
-	&TMC5160::isr36,
-	&TMC5160::isr37,
-	&TMC5160::isr38,
-	&TMC5160::isr39,
-	&TMC5160::isr40,
+const char *TMC5160::rampEventNames[]={
+		NULL,                // Bit 0, status_stop_l
+		NULL,                // Bit 1, status_stop_r
+		"LATCH_L",           // Bit 2
+		"LATCH_R",           // Bit 3
+		"STOP_L",            // Bit 4
+		"STOP_R",            // Bit 5
+		"STALL",             // Bit 6
+		"POSITION_REACHED",  // Bit 7
+		"VELOCITY_REACHED",  // Bit 8
+		NULL,                // Bit 9, position_reached
+		NULL,                // Bit 10, vzero
+		"ZERO_WAIT",         // Bit 11
+		"SECOND_MOVE",       // Bit 12
+		NULL,                // Bit 13, status_sg
+		NULL,                // Bit 14
+		NULL,                // Bit 15
+		"STAND_STILL",       // Bit 16, from status byte
+		"STALL_GUARD",       // Bit 17, from status byte
+		"DRIVER_ERROR",      // Bit 18, from status byte
+		"RESET",             // Bit 19, from status byte
 };
 
-TMC5160 *TMC5160::objectsByPin[TMC5160::RPI_PHYS_PIN_MAX+1];
-
-
-void TMC5160::initGPIO() {
-	if(!isGPIOInitialized) {
-		wiringPiSetupPhys();
-		isGPIOInitialized=true;
-	}
-}
-
-void TMC5160::isr01() { if(objectsByPin[ 1]!=NULL) objectsByPin[ 1]->isr(); }
-void TMC5160::isr02() { if(objectsByPin[ 2]!=NULL) objectsByPin[ 2]->isr(); }
-void TMC5160::isr03() { if(objectsByPin[ 3]!=NULL) objectsByPin[ 3]->isr(); }
-void TMC5160::isr04() { if(objectsByPin[ 4]!=NULL) objectsByPin[ 4]->isr(); }
-void TMC5160::isr05() { if(objectsByPin[ 5]!=NULL) objectsByPin[ 5]->isr(); }
-void TMC5160::isr06() { if(objectsByPin[ 6]!=NULL) objectsByPin[ 6]->isr(); }
-void TMC5160::isr07() { if(objectsByPin[ 7]!=NULL) objectsByPin[ 7]->isr(); }
-void TMC5160::isr08() { if(objectsByPin[ 8]!=NULL) objectsByPin[ 8]->isr(); }
-void TMC5160::isr09() { if(objectsByPin[ 9]!=NULL) objectsByPin[ 9]->isr(); }
-void TMC5160::isr10() { if(objectsByPin[10]!=NULL) objectsByPin[10]->isr(); }
-void TMC5160::isr11() { if(objectsByPin[11]!=NULL) objectsByPin[11]->isr(); }
-void TMC5160::isr12() { if(objectsByPin[12]!=NULL) objectsByPin[12]->isr(); }
-void TMC5160::isr13() { if(objectsByPin[13]!=NULL) objectsByPin[13]->isr(); }
-void TMC5160::isr14() { if(objectsByPin[14]!=NULL) objectsByPin[14]->isr(); }
-void TMC5160::isr15() { if(objectsByPin[15]!=NULL) objectsByPin[15]->isr(); }
-void TMC5160::isr16() { if(objectsByPin[16]!=NULL) objectsByPin[16]->isr(); }
-void TMC5160::isr17() { if(objectsByPin[17]!=NULL) objectsByPin[17]->isr(); }
-void TMC5160::isr18() { if(objectsByPin[18]!=NULL) objectsByPin[18]->isr(); }
-void TMC5160::isr19() { if(objectsByPin[19]!=NULL) objectsByPin[19]->isr(); }
-void TMC5160::isr20() { if(objectsByPin[20]!=NULL) objectsByPin[20]->isr(); }
-void TMC5160::isr21() { if(objectsByPin[21]!=NULL) objectsByPin[21]->isr(); }
-void TMC5160::isr22() { if(objectsByPin[22]!=NULL) objectsByPin[22]->isr(); }
-void TMC5160::isr23() { if(objectsByPin[23]!=NULL) objectsByPin[23]->isr(); }
-void TMC5160::isr24() { if(objectsByPin[24]!=NULL) objectsByPin[24]->isr(); }
-void TMC5160::isr25() { if(objectsByPin[25]!=NULL) objectsByPin[25]->isr(); }
-void TMC5160::isr26() { if(objectsByPin[26]!=NULL) objectsByPin[26]->isr(); }
-void TMC5160::isr27() { if(objectsByPin[27]!=NULL) objectsByPin[27]->isr(); }
-void TMC5160::isr28() { if(objectsByPin[28]!=NULL) objectsByPin[28]->isr(); }
-void TMC5160::isr29() { if(objectsByPin[29]!=NULL) objectsByPin[29]->isr(); }
-void TMC5160::isr30() { if(objectsByPin[30]!=NULL) objectsByPin[30]->isr(); }
-void TMC5160::isr31() { if(objectsByPin[31]!=NULL) objectsByPin[31]->isr(); }
-void TMC5160::isr32() { if(objectsByPin[32]!=NULL) objectsByPin[32]->isr(); }
-void TMC5160::isr33() { if(objectsByPin[33]!=NULL) objectsByPin[33]->isr(); }
-void TMC5160::isr34() { if(objectsByPin[34]!=NULL) objectsByPin[34]->isr(); }
-void TMC5160::isr35() { if(objectsByPin[35]!=NULL) objectsByPin[35]->isr(); }
-void TMC5160::isr36() { if(objectsByPin[36]!=NULL) objectsByPin[36]->isr(); }
-void TMC5160::isr37() { if(objectsByPin[37]!=NULL) objectsByPin[37]->isr(); }
-void TMC5160::isr38() { if(objectsByPin[38]!=NULL) objectsByPin[38]->isr(); }
-void TMC5160::isr39() { if(objectsByPin[39]!=NULL) objectsByPin[39]->isr(); }
-void TMC5160::isr40() { if(objectsByPin[40]!=NULL) objectsByPin[40]->isr(); }
-
-
-void TMC5160::isr() {
-	// retrieve interrupt event flags
+const char *TMC5160::gpioChipDevice="/dev/gpiochip0";
+
+const uint64_t TMC5160::movePollNs=2000000;
+const uint64_t TMC5160::ditherPeriodNs=50000000;
+const double   TMC5160::trackHeadroom=0.02;
+
+const int8_t TMC5160::gpioLinesByPin[TMC5160::RPI_PHYS_PIN_MAX+1]={
+	-1,          // no pin 0
+	-1, -1,      // 3.3V, 5V
+	 2, -1,      // GPIO2, 5V
+	 3, -1,      // GPIO3, GND
+	 4, 14,      // GPIO4, GPIO14
+	-1, 15,      // GND, GPIO15
+	17, 18,      // GPIO17, GPIO18
+	27, -1,      // GPIO27, GND
+	22, 23,      // GPIO22, GPIO23
+	-1, 24,      // 3.3V, GPIO24
+	10, -1,      // GPIO10, GND
+	 9, 25,      // GPIO9, GPIO25
+	11,  8,      // GPIO11, GPIO8
+	-1,  7,      // GND, GPIO7
+	 0,  1,      // GPIO0, GPIO1
+	 5, -1,      // GPIO5, GND
+	 6, 12,      // GPIO6, GPIO12
+	13, -1,      // GPIO13, GND
+	19, 16,      // GPIO19, GPIO16
+	26, 20,      // GPIO26, GPIO20
+	-1, 21,      // GND, GPIO21
+};
+
+
+bool TMC5160::diag0Open() {
+	diag0Close();
+	int line=gpioLinesByPin[diag0Pin];
+	if(line<0) {
+		LOGF_ERROR("%s: Physical pin %d is not a GPIO line", getAxisName(), diag0Pin);
+		return false;
+	}
+
+	int chipFd=::open(gpioChipDevice, O_RDONLY | O_CLOEXEC);
+	if(chipFd<0) {
+		LOGF_ERROR("%s: Unable to open %s: %s", getAxisName(), gpioChipDevice, strerror(errno));
+		return false;
+	}
+	// Pi has >50 KOhm, TMC needs <47 KOhm in open collector mode, so use TMC push/pull and no bias.
+	// Events carry CLOCK_MONOTONIC timestamps taken by the kernel on the edge
+	struct gpio_v2_line_request req;
+	memset(&req, 0, sizeof(req));
+	req.offsets[0]=(uint32_t) line;
+	req.num_lines=1;
+	req.config.flags=GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_BIAS_DISABLED;
+	snprintf(req.consumer, sizeof(req.consumer), "pimoco %s", getAxisName());
+	int res=ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &req);
+	int err=errno;
+	::close(chipFd);
+	if(res<0) {
+		LOGF_ERROR("%s: Unable to request GPIO line %d: %s", getAxisName(), line, strerror(err));
+		return false;
+	}
+
+	// never block the worker thread on reads
+	fcntl(req.fd, F_SETFL, fcntl(req.fd, F_GETFL) | O_NONBLOCK);
+	if(worker==NULL || !worker->watch(req.fd, [this](){ diag0Events(); })) {
+		LOGF_ERROR("%s: Unable to watch GPIO line %d", getAxisName(), line);
+		::close(req.fd);
+		return false;
+	}
+	diag0Fd=req.fd;
+	return true;
+}
+
+
+void TMC5160::diag0Close() {
+	if(diag0Fd<0)
+		return;
+	if(worker!=NULL)
+		worker->unwatch(diag0Fd);
+	::close(diag0Fd);
+	diag0Fd=-1;
+	interruptsEnabled=false;
+}
+
+
+void TMC5160::diag0Events() {
+	struct gpio_v2_line_event events[16];
+	ssize_t len=::read(diag0Fd, events, sizeof(events));
+	if(len<(ssize_t) sizeof(events[0])) {
+		if(len<0 && errno!=EAGAIN && errno!=EINTR)
+			LOGF_ERROR("%s: Error reading Diag0 line events: %s", getAxisName(), strerror(errno));
+		return;
+	}
+	// one ramp status read covers all queued edges. The first one marks the event
+	handleDiag0(events[0].timestamp_ns);
+}
+
+
+// Arms the given timer file descriptor to expire periodically with the given period in nanoseconds, or disarms it if 0
+static bool armTimer(int fd, uint64_t periodNs) {
+	struct itimerspec spec;
+	spec.it_interval.tv_sec =(time_t) (periodNs/1000000000ull);
+	spec.it_interval.tv_nsec=(long)   (periodNs%1000000000ull);
+	spec.it_value=spec.it_interval;
+	return timerfd_settime(fd, 0, &spec, NULL)==0;
+}
+
+
+void TMC5160::handleDiag0(uint64_t timestampNs) {
+	// retrieve interrupt event flags. A status poll may have consumed them already
 	uint32_t rampStat;
 	if(!getRegister(TMCR_RAMP_STAT, &rampStat)) {
 		LOGF_ERROR("%s: Error reading ramp status register from interrupt", getAxisName());
 		return;
 	}
-	// check which event caused the interrupt
-	if(rampStat && (1ul<<7)) {        // event_pos_reached
-		hasReachedTarget=true;
-		if(speedToRestore!=0)
-			if(!setTargetSpeed(speedToRestore))
-				LOGF_ERROR("%s: Position reached, unable to restore speed %d", getAxisName(), speedToRestore);
-		/*	else
-				LOGF_INFO("%s: Position reached, restored speed %d", getAxisName(), speedToRestore);
-		else
-			LOGF_INFO("%s: Position reached", getAxisName()); */
-	} else if(rampStat && (1ul<<6)) { // event_stop_sg
-		LOGF_INFO("%s Stall detected", getAxisName());	
-	} else {
-		LOGF_WARN("%s: Interrupt without position or ramp flag", getAxisName());
+	decodeRampStat(rampStat, timestampNs);
+}
+
+
+void TMC5160::trackStatus(const uint8_t *rx, uint32_t numFrames) {
+	uint32_t events=0;
+	for(uint32_t i=0; i<numFrames; i++) {
+		uint8_t status=rx[5*i];
+		uint8_t rising=status & ~lastStatus;
+		lastStatus=status;
+		uint32_t e=0;
+		if(rising & TMC_RESET)            e|=RAMP_EVENT_RESET;
+		if(rising & TMC_DRIVER_ERROR)     e|=RAMP_EVENT_DRIVER_ERROR;
+		if(rising & TMC_STALL_GUARD)      e|=RAMP_EVENT_STALL_GUARD;
+		if(rising & TMC_STAND_STILL)      e|=RAMP_EVENT_STAND_STILL;
+		if(rising & TMC_POSITION_REACHED) e|=RAMP_EVENT_POSITION_REACHED;
+
+		// status byte flags mirror these RAMP_STAT flags, so both sources share one edge detector
+		uint32_t velocityReached=(status & TMC_VELOCITY_REACHED) ? 1 : 0;
+		if(velocityReached && !TMCF_VELOCITY_REACHED::extract(lastRampStat))
+			e|=RAMP_EVENT_VELOCITY_REACHED;
+		lastRampStat=TMCF_VELOCITY_REACHED::insert(lastRampStat, velocityReached);
+		lastRampStat=TMCF_POSITION_REACHED::insert(lastRampStat, (status & TMC_POSITION_REACHED) ? 1 : 0);
+
+		// motion flags of a device which lost its state or disabled its driver are meaningless, e.g. XACTUAL=XTARGET=0 after a reset
+		if(status & (TMC_RESET | TMC_DRIVER_ERROR))
+			e&=RAMP_EVENTS_FAULT;
+		events|=e;
 	}
-	// clear the flags by writing all ones
-	if(!setRegister(TMCR_RAMP_STAT, (1ul<<14)-1)) { 
-		LOGF_ERROR("%s: Error clearing ramp status register from interrupt", getAxisName());
+	if(events==0)
 		return;
+
+	// executeOnWorker() is still evaluating its transaction, so defer dispatch until it completes
+	if(pendingEvents==0) {
+		pendingEventsSequence=moveSequence;
+		pendingEventsNs=SPITrace::now();
+	}
+	pendingEvents|=events;
+}
+
+
+void TMC5160::dispatchPendingEvents() {
+	// handlers may start transactions of their own. The outermost dispatch delivers the events these raise
+	if(dispatchingPendingEvents)
+		return;
+	dispatchingPendingEvents=true;
+	while(pendingEvents!=0) {
+		uint32_t events=pendingEvents;
+		pendingEvents=0;
+		if(pendingEventsSequence!=moveSequence)
+			events&=~RAMP_EVENT_POSITION_REACHED;
+		dispatchRampEvents(events, pendingEventsNs);
 	}
+	dispatchingPendingEvents=false;
+}
+
+
+bool TMC5160::decodeRampStat(uint32_t rampStat, uint64_t timestampNs) {
+	uint32_t latched=rampStat & RAMP_EVENTS_LATCHED;
+	uint32_t edges  =rampStat & ~lastRampStat & RAMP_EVENTS_EDGES;
+	lastRampStat=rampStat;
+	if((latched | edges)==0)
+		return true;
+	dispatchRampEvents(latched | edges, timestampNs);
+
+	// clear only the latched events seen, so events raised since reading are not lost
+	if(latched!=0 && !setRegister(TMCR_RAMP_STAT, latched)) {
+		LOGF_ERROR("%s: Error clearing ramp status register", getAxisName());
+		return false;
+	}
+	return true;
+}
+
+
+void TMC5160::dispatchRampEvents(uint32_t events, uint64_t timestampNs) {
+	// position reached is reported by status byte, interrupt and poll alike. Deliver it once per move
+	if(hasReachedTarget)
+		events&=~RAMP_EVENT_POSITION_REACHED;
+	if(events==0)
+		return;
+
+	if(debugLevel>=TMC_DEBUG_DEBUG) {
+		char buffer[128];
+		printRampEvents(buffer, sizeof(buffer), events);
+		LOGF_DEBUG("%s: Ramp events %s", getAxisName(), buffer);
+	}
+
+	for(uint32_t i=0; i<20; i++) {
+		enum TMCRampEvent event=(enum TMCRampEvent) (((uint32_t)1)<<i);
+		if(!(events & event))
+			continue;
+		if(event==RAMP_EVENT_POSITION_REACHED)
+			positionReached(timestampNs);
+		else if(event & RAMP_EVENTS_STOP)
+			motionStopped(event);
+		for(uint32_t j=0; j<MAX_RAMP_EVENT_SUBSCRIBERS; j++)
+			if(rampEventSubscribers[j].events & event) {
+				RampEventHandler handler=rampEventSubscribers[j].handler;  // handlers may unsubscribe
+				handler(event, timestampNs);
+			}
+	}
+}
+
+
+int TMC5160::subscribeRampEvents(uint32_t events, RampEventHandler &&handler) {
+	int res=-1;
+	auto f=[&]() {
+		for(uint32_t i=0; i<MAX_RAMP_EVENT_SUBSCRIBERS; i++)
+			if(rampEventSubscribers[i].events==0) {
+				rampEventSubscribers[i].events=events & RAMP_EVENTS_ALL;
+				rampEventSubscribers[i].handler=std::move(handler);
+				res=(int) i;
+				return;
+			}
+	};
+	call(f);
+	return res;
+}
+
+
+void TMC5160::unsubscribeRampEvents(int id) {
+	if(id<0 || id>=MAX_RAMP_EVENT_SUBSCRIBERS)
+		return;
+	auto f=[&]() {
+		rampEventSubscribers[id].events=0;
+		rampEventSubscribers[id].handler=nullptr;
+	};
+	call(f);
+}
+
+
+void TMC5160::positionReached(uint64_t timestampNs) {
+	positionReachedNs=timestampNs;
+	hasReachedTarget=true;
+	completeMove(true);
+	// restore once. Position mode tracking reaches its streamed targets all the time
+	double restore=speedToRestore;
+	speedToRestore=0;
+	if(restore!=0)
+		if(!setTargetSpeedFractionalOnWorker(restore))
+			LOGF_ERROR("%s: Position reached, unable to restore speed %+.3f", getAxisName(), restore);
+	/*	else
+			LOGF_INFO("%s: Position reached, restored speed %+.3f", getAxisName(), speedToRestore);
+	else
+		LOGF_INFO("%s: Position reached", getAxisName()); */
+}
+
+
+void TMC5160::motionStopped(enum TMCRampEvent event) {
+	LOGF_WARN("%s: Motion stopped by %s", getAxisName(), event==RAMP_EVENT_STOP_L ? "left reference switch" : 
+	          event==RAMP_EVENT_STOP_R ? "right reference switch" : "StallGuard");
+	speedToRestore=0;
+	fractionalSpeedStop();
+	completeMove(false);
+}
+
+
+std::future<bool> TMC5160::beginMove() {
+	completeMove(false);
+	moveSequence++;
+	fractionalSpeedStop();
+	movePromise=std::promise<bool>();
+	moveActive=true;
+	if(!interruptsEnabled)
+		armWatchedTimer(&movePollFd, movePollNs, &TMC5160::movePollExpired, "ramp status");
+	return movePromise.get_future();
+}
+
+
+void TMC5160::completeMove(bool reached) {
+	if(!moveActive)
+		return;
+	moveActive=false;
+	if(movePollFd>=0)
+		armWatchedTimer(&movePollFd, 0, &TMC5160::movePollExpired, "ramp status");
+	movePromise.set_value(reached);
+}
+
+
+void TMC5160::movePollExpired() {
+	if(moveActive)
+		handleDiag0(SPITrace::now());
+}
+
+
+bool TMC5160::armWatchedTimer(int *fd, uint64_t periodNs, void (TMC5160::*expired)(), const char *name) {
+	if(*fd<0) {
+		if(periodNs==0)
+			return true;
+		int newFd=timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if(newFd<0) {
+			LOGF_ERROR("%s: Unable to create %s timer: %s", getAxisName(), name, strerror(errno));
+			return false;
+		}
+		// overruns are dropped, the handler runs once for any number of expirations
+		auto handler=[this, newFd, expired]() {
+			uint64_t expirations;
+			if(::read(newFd, &expirations, sizeof(expirations))==(ssize_t) sizeof(expirations))
+				(this->*expired)();
+		};
+		if(worker==NULL || !worker->watch(newFd, handler)) {
+			LOGF_ERROR("%s: Unable to watch %s timer", getAxisName(), name);
+			::close(newFd);
+			return false;
+		}
+		*fd=newFd;
+	}
+	if(!armTimer(*fd, periodNs)) {
+		LOGF_ERROR("%s: Unable to %s %s timer: %s", getAxisName(), periodNs!=0 ? "arm" : "disarm", name, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+
+void TMC5160::closeWatchedTimer(int *fd) {
+	if(*fd<0)
+		return;
+	if(worker!=NULL)
+		worker->unwatch(*fd);
+	::close(*fd);
+	*fd=-1;
 }
 
 
 void TMC5160::isrInit() {
-	// setup ISR
-	if(diag0Pin>=0 && diag0Pin<=RPI_PHYS_PIN_MAX) {
+	// setup Diag0 interrupts
+	interruptsEnabled=false;
+	if(!isHardware()) {
+		LOGF_INFO("%s: No interrupts for emulated device, polling instead", getAxisName());
+	} else if(diag0Pin>=0 && diag0Pin<=RPI_PHYS_PIN_MAX) {
 		LOGF_INFO("%s: Enabling interrupts on physical pin %d", getAxisName(), diag0Pin);
 
-		initGPIO();
-		objectsByPin[diag0Pin]=this;
-		pinMode(diag0Pin, INPUT);
-		// Pi has >50 KOhm, TMC needs <47 KOhm in open collector mode, so use TMC push/pull
-		pullUpDnControl(diag0Pin, PUD_OFF);      
-		wiringPiISR(diag0Pin, INT_EDGE_RISING, isrsByPin[diag0Pin]);
-
-		// clear interrupt flags by writing all ones
-		if(!setRegister(TMCR_RAMP_STAT, (1ul<<14)-1))
-			LOGF_ERROR("%s: Error clearing ramp status register", getAxisName());
+		if(!diag0Open()) {
+			LOGF_WARN("%s: No interrupts for device, polling instead", getAxisName());
+			return;
+		}
+		interruptsEnabled=true;
 	} else 
 		LOGF_INFO("%s: No interrupts for device", getAxisName());
+
+	// clear stale event flags by writing all ones, and treat status flags already set as seen
+	lastRampStat=TMCF_RAMP_STAT::mask;
+	lastStatus=0xff;
+	if(!setRegister(TMCR_RAMP_STAT, RAMP_EVENTS_LATCHED))
+		LOGF_ERROR("%s: Error clearing ramp status register", getAxisName());
 }
 
 
 TMC5160::TMC5160(const char *theIndiDeviceName, const char *theAxisName, int theDiag0Pin) 
 : SPI(theIndiDeviceName, theAxisName), diag0Pin(theDiag0Pin), deviceStatus((enum TMCStatusFlags) 0) {
-    for(int i=0; i<(int) TMCR_NUM_REGISTERS; i++)
-		cachedRegisterValues[i]=0;
+	invalidateShadow();
+	for(uint32_t i=0; i<MAX_RAMP_EVENT_SUBSCRIBERS; i++)
+		rampEventSubscribers[i].events=0;
 }
 
 
 TMC5160::~TMC5160() {
-	if(diag0Pin>=0 && diag0Pin<=RPI_PHYS_PIN_MAX)
-		objectsByPin[diag0Pin]=NULL;
+	completeMove(false);
+	fractionalSpeedStop();
+	closeWatchedTimer(&trackFd);
+	closeWatchedTimer(&ditherFd);
+	closeWatchedTimer(&movePollFd);
+	telemetryClose();
+	diag0Close();
+}
+
+
+bool TMC5160::close() {
+	auto f=[&](){ completeMove(false); fractionalSpeedStop(); };
+	call(f);
+	closeWatchedTimer(&trackFd);
+	closeWatchedTimer(&ditherFd);
+	closeWatchedTimer(&movePollFd);
+	telemetryClose();
+	diag0Close();
+	return SPI::close();
+}
+
+
+bool TMC5160::setTelemetryRate(uint32_t hz) {
+	if(hz>MAX_TELEMETRY_RATE) {
+		LOGF_ERROR("%s: Telemetry rate %u Hz exceeds maximum of %d Hz", getAxisName(), hz, MAX_TELEMETRY_RATE);
+		return false;
+	}
+	telemetryRateHz=hz;
+	return !isConnected() || telemetryOpen();
+}
+
+
+bool TMC5160::telemetryOpen() {
+	telemetryClose();
+	if(telemetryRateHz==0)
+		return true;
+
+	int fd=timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(fd<0) {
+		LOGF_ERROR("%s: Unable to create telemetry timer: %s", getAxisName(), strerror(errno));
+		return false;
+	}
+	if(!armTimer(fd, 1000000000ull/telemetryRateHz)) {
+		LOGF_ERROR("%s: Unable to arm telemetry timer: %s", getAxisName(), strerror(errno));
+		::close(fd);
+		return false;
+	}
+	if(worker==NULL || !worker->watch(fd, [this](){ sampleTelemetry(); })) {
+		LOGF_ERROR("%s: Unable to watch telemetry timer", getAxisName());
+		::close(fd);
+		return false;
+	}
+	telemetryFd=fd;
+	if(debugLevel>=TMC_DEBUG_DEBUG)
+		LOGF_DEBUG("%s: Sampling driver telemetry at %u Hz", getAxisName(), telemetryRateHz);
+	return true;
+}
+
+
+void TMC5160::telemetryClose() {
+	if(telemetryFd<0)
+		return;
+	if(worker!=NULL)
+		worker->unwatch(telemetryFd);
+	::close(telemetryFd);
+	telemetryFd=-1;
+}
+
+
+void TMC5160::sampleTelemetry() {
+	// overruns are dropped, the next sample simply follows the current one
+	uint64_t expirations;
+	if(::read(telemetryFd, &expirations, sizeof(expirations))!=(ssize_t) sizeof(expirations))
+		return;
+
+	// telemetry yields the bus to regular commands of other processes
+	const uint8_t addresses[4]={ TMCR_DRV_STATUS, TMCR_TSTEP, TMCR_PWM_SCALE, TMCR_LOST_STEPS };
+	uint32_t values[4];
+	enum SPIArbiter::Priority previous=busPriority;
+	busPriority=SPIArbiter::PRIORITY_LOW;
+	bool res=getRegisters(addresses, values, 4);
+	busPriority=previous;
+	if(!res)
+		return;
+
+	uint32_t drvStatus=values[0];
+	Telemetry::Sample s;
+	s.timestampNs =SPITrace::now();
+	s.tstep       =TMCF_TSTEP::extract(values[1]);
+	s.lostSteps   =TMCF_LOST_STEPS::extract(values[3]);
+	s.sgResult    =(uint16_t) TMCF_SG_RESULT::extract(drvStatus);
+	s.pwmScaleAuto=(int16_t)  TMCF_PWM_SCALE_AUTO::extract(values[2]);
+	s.pwmScaleSum =(uint8_t)  TMCF_PWM_SCALE_SUM::extract(values[2]);
+	s.csActual    =(uint8_t)  TMCF_CS_ACTUAL::extract(drvStatus);
+	s.flags       =(TMCF_STST::extract(drvStatus)       ? Telemetry::SAMPLE_STAND_STILL : 0) |
+	               (TMCF_STALLGUARD::extract(drvStatus) ? Telemetry::SAMPLE_STALL       : 0) |
+	               (TMCF_OTPW::extract(drvStatus)       ? Telemetry::SAMPLE_OVERTEMP_PW : 0) |
+	               (TMCF_OT::extract(drvStatus)         ? Telemetry::SAMPLE_OVERTEMP    : 0) |
+	               ((TMCF_S2G::extract(drvStatus) | TMCF_S2VS::extract(drvStatus)) ? Telemetry::SAMPLE_SHORT : 0) |
+	               (TMCF_OL::extract(drvStatus)         ? Telemetry::SAMPLE_OPEN_LOAD   : 0);
+	s.pad         =0;
+	telemetry.record(s);
 }
 
 
@@ -338,160 +682,731 @@ bool TMC5160::setTargetSpeed(int32_t value) {
 	if(debugLevel>=TMC_DEBUG_DEBUG)
 		LOGF_DEBUG("%s: Setting target speed to %'+d", getAxisName(), value);
 
-	return setRegister(TMCR_RAMPMODE, value>=0 ? 1 : 2) &&    // select velocity mode and sign
-	       setRegister(TMCR_VMAX, value>=0 ? value : -value); // set absolute target speed to initiate movement
+	// velocity mode ends any pending move, and a fixed speed ends alternating VMAX
+	bool res=false;
+	auto f=[&]() {
+		completeMove(false);
+		fractionalSpeedStop();
+		Transaction t;
+		res=t.set(TMCR_RAMPMODE, value>=0 ? 1 : 2) &&    // select velocity mode and sign
+		    t.set(TMCR_VMAX, value>=0 ? value : -value) && // set absolute target speed to initiate movement
+		    executeOnWorker(t);
+	};
+	call(f);
+	return res;
+}
+
+
+bool TMC5160::setTargetSpeedAsync(int32_t value) {
+	return post([this, value]() {
+		// velocity changes, e.g. from guide pulses, take precedence over other processes' traffic on the bus
+		enum SPIArbiter::Priority previous=busPriority;
+		busPriority=SPIArbiter::PRIORITY_HIGH;
+		bool res=setTargetSpeed(value);
+		busPriority=previous;
+		if(!res)
+			LOGF_ERROR("%s: Unable to set target speed %'+d", getAxisName(), value);
+	});
 }
 
 
-bool TMC5160::getRegisterBits(uint8_t address, uint32_t *result, uint32_t firstBit, uint32_t numBits) {
-	uint32_t tmp;
-	if(!getRegister(address, &tmp))
+bool TMC5160::setTargetSpeedFractional(double value) {
+	if(debugLevel>=TMC_DEBUG_DEBUG)
+		LOGF_DEBUG("%s: Setting fractional target speed to %+.9f", getAxisName(), value);
+
+	bool res=false;
+	auto f=[&](){ res=setTargetSpeedFractionalOnWorker(value); };
+	call(f);
+	return res;
+}
+
+
+bool TMC5160::setTargetSpeedFractionalAsync(double value) {
+	return post([this, value]() {
+		enum SPIArbiter::Priority previous=busPriority;
+		busPriority=SPIArbiter::PRIORITY_HIGH;
+		bool res=setTargetSpeedFractionalOnWorker(value);
+		busPriority=previous;
+		if(!res)
+			LOGF_ERROR("%s: Unable to set fractional target speed %+.9f", getAxisName(), value);
+	});
+}
+
+
+bool TMC5160::setTargetSpeedFractionalOnWorker(double value) {
+	const int64_t one=((int64_t) 1)<<32;
+	if(!(fabs(value)<(double) TMCF_VMAX::mask)) {
+		LOGF_ERROR("%s: Fractional target speed %+.3f out of range", getAxisName(), value);
 		return false;
-	uint32_t mask=(uint32_t) ( (((uint64_t)1)<<numBits)-1 );
-	*result=(tmp>>firstBit) & mask;
-	return true;
+	}
+	// stopping needs no ephemeris
+	if(trackCadenceMs>0 && value!=0)
+		return trackSetSpeed(value);
+
+	int64_t speed=llround(ldexp(value, 32));
+	if((speed & (one-1))==0) {
+		if(!setTargetSpeed((int32_t) (speed/one)))
+			return false;
+		fractionalWholeSpeed=(int32_t) (speed/one);  // still tracking, so a cadence change switches modes
+		return true;
+	}
+
+	completeMove(false);
+	trackStop();
+	uint64_t now=SPITrace::now();
+	if(ditherActive)
+		ditherIntegrate(now);  // keep the residual of the previous speed, it is a position error all the same
+	else {
+		if(!armWatchedTimer(&ditherFd, ditherPeriodNs, &TMC5160::ditherExpired, "VMAX dither"))
+			return false;
+		ditherActive=true;
+		ditherWritten=false;
+		ditherCode=0;
+		ditherResidual=0;
+		ditherLastNs=now;
+	}
+	return ditherUpdate(speed, true);
 }
 
 
-bool TMC5160::setRegisterBits(uint8_t address, uint32_t value, uint32_t firstBit, uint32_t numBits) {
-	uint32_t tmp;
-	if(!getRegister(address, &tmp))
+void TMC5160::ditherStop() {
+	if(!ditherActive)
+		return;
+	ditherActive=false;
+	armWatchedTimer(&ditherFd, 0, &TMC5160::ditherExpired, "VMAX dither");
+}
+
+
+void TMC5160::ditherIntegrate(uint64_t timestampNs) {
+	// microsecond resolution keeps the product in range for intervals of hours. Truncation telescopes across calls
+	int64_t elapsedUs=(int64_t) (timestampNs/1000 - ditherLastNs/1000);
+	ditherResidual+=(ditherSpeed - ((int64_t) ditherCode)*(((int64_t) 1)<<32)) * elapsedUs;
+	ditherLastNs=timestampNs;
+}
+
+
+bool TMC5160::ditherUpdate(int64_t speed, bool newSpeed) {
+	const int64_t one=((int64_t) 1)<<32;
+	int64_t fraction=speed & (one-1);                // in [0, 1) also for negative speeds
+	int32_t floorCode=(int32_t) ((speed-fraction)/one);
+	int64_t periodUs=(int64_t) (ditherPeriodNs/1000);
+
+	// the upper value wins if it leaves the smaller residual at the next expiration
+	int64_t residualIfFloor=ditherResidual + fraction*periodUs;
+	int32_t code=floorCode + (residualIfFloor > (one/2)*periodUs ? 1 : 0);
+	auto restart=[&](uint64_t startNs) {
+		ditherSpeed=speed;
+		ditherStartNs=startNs;
+		ditherStartResidual=ditherResidual;
+		ditherUpdates=0;
+	};
+	if(ditherWritten && code==ditherCode) {
+		if(newSpeed)
+			restart(SPITrace::now());
+		return true;
+	}
+
+	// velocity mode and sign only change when crossing zero
+	Transaction t;
+	if(!(ditherWritten && (code>=0)==(ditherCode>=0)) && !t.set(TMCR_RAMPMODE, code>=0 ? 1 : 2))
+		return false;
+	if(!t.set(TMCR_VMAX, code>=0 ? code : -code))
+		return false;
+
+	// the previous speed was requested until the write started, the previous value in effect until it completed.
+	// Before the first write there is nothing to account for
+	if(ditherWritten) {
+		ditherIntegrate(SPITrace::now());
+		if(newSpeed)
+			restart(ditherLastNs);
+	}
+	bool res=executeOnWorker(t);
+	if(ditherWritten)
+		ditherIntegrate(SPITrace::now());
+	else {
+		ditherLastNs=SPITrace::now();
+		if(newSpeed)
+			restart(ditherLastNs);
+	}
+	if(!res)
 		return false;
-	uint32_t mask=(uint32_t) ( (((uint64_t)1)<<numBits)-1 ) << firstBit;
-	int tmp2=(tmp & ~mask) | ((value<<firstBit) & mask);
-	if(debugLevel>=TMC_DEBUG_REGISTERS)
-		LOGF_DEBUG("%s:    old %08x value %08x firstBit %d numBits %d mask %08x new %08x", getAxisName(), tmp, value, firstBit, numBits, mask, tmp2);
-	return setRegister(address, tmp2);
+	ditherCode=code;
+	ditherWritten=true;
+	ditherUpdates++;
+	return true;
 }
 
 
-bool TMC5160::getRegister(uint8_t address, uint32_t *result) {
-	// use driver-side cache for write-only registers, fail for undefined registers
-	if(!canReadRegister(address)) {
-		if(!canWriteRegister(address)) {
-			const int bufsize=1023;
-			char buffer[bufsize+1]={0};
-			printRegister(buffer, bufsize, address, 0, deviceStatus, "get", "error register is undefined");
-			LOG_ERROR(buffer);
+void TMC5160::ditherExpired() {
+	if(!ditherActive)
+		return;
+	uint64_t now=SPITrace::now();
+	ditherIntegrate(now);
+	if(!ditherUpdate(ditherSpeed, false))
+		LOGF_ERROR("%s: Unable to update VMAX for fractional target speed", getAxisName());
+}
+
+
+bool TMC5160::trackSetSpeed(double value) {
+	if(clockHz==0) {
+		LOGF_ERROR("%s: Position mode tracking requires the clock frequency", getAxisName());
+		return false;
+	}
+
+	completeMove(false);
+	ditherStop();
+	if(!armWatchedTimer(&trackFd, trackCadenceMs*1000000ull, &TMC5160::trackExpired, "position tracking"))
+		return false;
+
+	uint64_t now=SPITrace::now();
+	bool start=!trackActive;
+	if(start) {
+		uint32_t xactual;
+		if(!getRegister(TMCR_XACTUAL, &xactual)) {
+			armWatchedTimer(&trackFd, 0, &TMC5160::trackExpired, "position tracking");
 			return false;
-		}   
-		*result=cachedRegisterValues[address & (TMCR_NUM_REGISTERS-1)];
-		if(debugLevel>=TMC_DEBUG_REGISTERS) {
-			const int bufsize=1023;
-			char buffer[bufsize+1]={0};
-			printRegister(buffer, bufsize, address, *result, deviceStatus, "get", "cached");
-			LOG_DEBUG(buffer);
 		}
+		trackAnchorPos=(int32_t) xactual;
+		trackError=0;
+	} else
+		trackAnchorPos=trackPositionAt(now);
+	trackAnchorNs=now;
+	trackSpeed=value;
+	trackRate=ldexp(value*clockHz, -24);
+	trackStartNs=trackLastNs=now;
+	trackStartError=trackError;
+	trackUpdates=0;
+	trackActive=true;
+
+	// the ramp generator starts braking this far ahead of XTARGET, so the target leads the ephemeris by the same distance.
+	// Braking from v takes v^2/(2a) microsteps, i.e. v^2/(256*D) in native units: D1 below V1 if set, DMAX above
+	uint32_t v1=0, dmax=0, d1=0;
+	getV1(&v1);
+	getDMax(&dmax);
+	getD1(&d1);
+	double v=fabs(value), vSlow=(v1>0) ? fmin(v, (double) v1) : 0;
+	double braking=(dmax>0 ? (v*v-vSlow*vSlow)/(256.0*dmax) : 0) + (d1>0 ? vSlow*vSlow/(256.0*d1) : 0);
+	trackLead=(value>=0) ? braking : -braking;
+
+	double vmax=ceil(v*(1.0+trackHeadroom))+1;
+	bool res=trackUpdate(now, vmax<TMCF_VMAX::mask ? (uint32_t) vmax : TMCF_VMAX::mask, start);
+	if(!res)
+		trackStop();
+	return res;
+}
+
+
+void TMC5160::trackStop() {
+	if(!trackActive)
+		return;
+	trackActive=false;
+	armWatchedTimer(&trackFd, 0, &TMC5160::trackExpired, "position tracking");
+}
+
+
+bool TMC5160::trackUpdate(uint64_t timestampNs, uint32_t vmax, bool enterPositioning) {
+	// one cadence ahead, so the axis keeps moving until the next update instead of lagging behind.
+	// The target comes first, so entering positioning mode does not head for a stale one
+	int32_t target=(int32_t) llround(trackPositionAt(timestampNs + trackCadenceMs*1000000ull) + trackLead);
+	Transaction t;
+	uint32_t xactual;
+	if(!t.set(TMCR_XTARGET, (uint32_t) target) ||
+	   (vmax>0 && !t.set(TMCR_VMAX, vmax)) ||
+	   (enterPositioning && !t.set(TMCR_RAMPMODE, 0)) ||
+	   !t.get(TMCR_XACTUAL, &xactual) || !executeOnWorker(t))
+		return false;
+	trackLastNs=SPITrace::now();
+	trackError=(int32_t) xactual - trackPositionAt(trackLastNs);
+	trackUpdates++;
+	return true;
+}
+
+
+void TMC5160::trackExpired() {
+	if(!trackActive)
+		return;
+	if(!trackUpdate(SPITrace::now()))
+		LOGF_ERROR("%s: Unable to update XTARGET for position mode tracking", getAxisName());
+}
+
+
+bool TMC5160::setTrackingCadence(uint32_t ms) {
+	if(ms!=0 && (ms<MIN_TRACKING_CADENCE || ms>MAX_TRACKING_CADENCE)) {
+		LOGF_ERROR("%s: Tracking cadence %u ms outside [%d, %d] ms", getAxisName(), ms, MIN_TRACKING_CADENCE, MAX_TRACKING_CADENCE);
+		return false;
+	}
+	if(!isConnected()) {
+		trackCadenceMs=ms;
 		return true;
 	}
 
-	uint8_t tx[10]={ (uint8_t) (address & (TMCR_NUM_REGISTERS-1)),0,0,0,0,
-	        	     (uint8_t) (address & (TMCR_NUM_REGISTERS-1)),0,0,0,0, };
-	uint8_t rx[10];
+	// switch the active fractional target speed over to the new mode
+	bool res=true;
+	auto f=[&]() {
+		double speed=trackActive ? trackSpeed : ditherActive ? ldexp((double) ditherSpeed, -32) : (double) fractionalWholeSpeed;
+		bool active=trackActive || ditherActive || fractionalWholeSpeed!=0;
+		trackCadenceMs=ms;
+		if(active)
+			res=setTargetSpeedFractionalOnWorker(speed);
+	};
+	call(f);
+	return res;
+}
+
+
+bool TMC5160::getFractionalSpeedStatus(FractionalSpeedStatus *result) {
+	auto f=[&]() {
+		const double one=ldexp(1.0, 32);
+		if(trackActive) {
+			double elapsed=(trackLastNs-trackStartNs)*1e-9;
+			double chipTime=ldexp(1.0, 24)/clockHz;  // seconds per 2^24/f_clk
+			result->active   =true;
+			result->position =true;
+			result->requested=trackSpeed;
+			result->achieved =(elapsed>0) ? trackSpeed + (trackError-trackStartError)/elapsed*chipTime : trackSpeed;
+			result->residual =-trackError*chipTime;
+			result->updates  =trackUpdates;
+			return;
+		}
+		if(!ditherActive) {
+			*result=FractionalSpeedStatus();
+			return;
+		}
+		ditherIntegrate(SPITrace::now());
+		double elapsedUs=(double) (ditherLastNs/1000 - ditherStartNs/1000);
+		result->active   =ditherActive;
+		result->position =false;
+		result->requested=ditherSpeed/one;
+		result->achieved =(elapsedUs>0) ? (ditherSpeed - (ditherResidual-ditherStartResidual)/elapsedUs)/one : (double) ditherCode;
+		result->residual =ditherResidual/one*1e-6;
+		result->updates  =ditherUpdates;
+	};
+	call(f);
+	return true;
+}
+
+
+bool TMC5160::getSpeed(int32_t *result) {
+	uint32_t vactual;
+	if(!getRegister(TMCR_VACTUAL, &vactual))
+		return false;
+	*result=(int32_t) TMCF_VACTUAL::extract(vactual);
+	return true;
+}
+
+
+bool TMC5160::getMotionStatus(MotionStatus *result) {
+	const uint8_t addresses[4]={ TMCR_XACTUAL, TMCR_VACTUAL, TMCR_RAMP_STAT, TMCR_DRV_STATUS };
+	uint32_t values[4];
+	bool res=false;
+
+	// read and decode on the worker thread, so events are dispatched there in order with Diag0 interrupts
+	auto f=[&]() {
+		if(!getRegisters(addresses, values, 4))
+			return;
+		result->position =(int32_t) values[0];
+		result->speed    =(int32_t) TMCF_VACTUAL::extract(values[1]);
+		result->rampStat =values[2];
+		result->drvStatus=values[3];
+		result->status   =deviceStatus;
+		res=decodeRampStat(values[2], SPITrace::now());
+	};
+	call(f);
+	return res;
+}
+
+
+SPIBackend *TMC5160::createBackend(const char *deviceName) {
+	if(getenv("PIMOCO_EMULATOR")!=NULL) {
+		LOGF_INFO("%s: Using software emulator instead of %s", getAxisName(), deviceName);
+		return new TMC5160Emulator();
+	}
+	return SPI::createBackend(deviceName);
+}
+
+
+bool TMC5160::getRegisters(const uint8_t *addresses, uint32_t *results, uint32_t num) {
+	Transaction t;
+	for(uint32_t i=0; i<num; i++)
+		if(!t.get(addresses[i], &results[i])) {
+			LOGF_ERROR("%s: Unable to read %d registers in one transaction, maximum is %d", getAxisName(), num, Transaction::MAX_OPS);
+			return false;
+		}
+	return execute(t);
+}
+
+
+bool TMC5160::getRegister(uint8_t address, uint32_t *result) {
+	address&=TMCR_NUM_REGISTERS-1;
+	if(!isVolatileRegister(address)) {
+		std::lock_guard<std::mutex> lock(shadowMutex);
+		if(shadowFlags[address] & (SHADOW_VALID | SHADOW_DIRTY)) {
+			*result=shadowRegisters[address];
+			return true;
+		}
+	}
+	Transaction t;
+	return t.get(address, result) && execute(t);
+}
+
+
+bool TMC5160::setRegister(uint8_t address, uint32_t value) {
+	address&=TMCR_NUM_REGISTERS-1;
+	if(canWriteRegister(address) && !isVolatileRegister(address)) {
+		std::lock_guard<std::mutex> lock(shadowMutex);
+		if(ownsBatch()) {
+			uint8_t flags=shadowFlags[address];
+			if((flags & SHADOW_VALID) && !(flags & SHADOW_DIRTY) && shadowRegisters[address]==value)
+				return true;  // unchanged
+			if(!(flags & SHADOW_DIRTY))
+				dirtyRegisters[numDirtyRegisters++]=address;
+			shadowRegisters[address]=value;
+			shadowFlags[address]=flags | SHADOW_DIRTY;
+			return true;
+		}
+	}
+	Transaction t;
+	return t.set(address, value) && execute(t);
+}
+
+
+void TMC5160::beginBatch() {
+	std::lock_guard<std::mutex> lock(shadowMutex);
+	if(batchDepth==0)
+		batchOwner=std::this_thread::get_id();
+	if(batchOwner==std::this_thread::get_id())
+		batchDepth++;
+}
+
+
+bool TMC5160::commitBatch() {
+	Transaction ts[(TMCR_NUM_REGISTERS+Transaction::MAX_OPS-1)/Transaction::MAX_OPS];
+	uint32_t numTransactions=0;
+	{
+		std::lock_guard<std::mutex> lock(shadowMutex);
+		if(!ownsBatch() || --batchDepth>0)
+			return true;
+
+		// write dirty registers in chunks of at most one transaction each, in order of first modification
+		for(uint32_t i=0; i<numDirtyRegisters; i++) {
+			uint8_t address=dirtyRegisters[i];
+			if(numTransactions==0 || ts[numTransactions-1].size()==Transaction::MAX_OPS)
+				numTransactions++;
+			ts[numTransactions-1].set(address, shadowRegisters[address]);
+		}
+	}
+
+	// writes confirmed by their echo clear the dirty flag and become valid again
+	bool res=true;
+	for(uint32_t i=0; i<numTransactions; i++)
+		res=execute(ts[i]) && res;
+
+	// keep registers whose write failed dirty, so the next batch retries them
+	std::lock_guard<std::mutex> lock(shadowMutex);
+	uint32_t numRemaining=0;
+	for(uint32_t i=0; i<numDirtyRegisters; i++)
+		if(shadowFlags[dirtyRegisters[i]] & SHADOW_DIRTY)
+			dirtyRegisters[numRemaining++]=dirtyRegisters[i];
+	numDirtyRegisters=numRemaining;
+	return res;
+}
+
+
+void TMC5160::assumeBatch() {
+	std::lock_guard<std::mutex> lock(shadowMutex);
+	if(!ownsBatch())
+		return;
+	for(uint32_t i=0; i<numDirtyRegisters; i++)
+		shadowFlags[dirtyRegisters[i]]=SHADOW_VALID;
+	numDirtyRegisters=0;
+	batchDepth=0;
+}
+
+
+void TMC5160::abortBatch() {
+	std::lock_guard<std::mutex> lock(shadowMutex);
+	if(!ownsBatch())
+		return;
+	for(uint32_t i=0; i<numDirtyRegisters; i++)
+		shadowFlags[dirtyRegisters[i]]=0;
+	numDirtyRegisters=0;
+	batchDepth=0;
+}
+
+
+void TMC5160::invalidateMotionShadow() {
+	std::lock_guard<std::mutex> lock(shadowMutex);
+	shadowFlags[TMCR_RAMPMODE]=0;
+	shadowFlags[TMCR_XTARGET]=0;
+	shadowFlags[TMCR_VMAX]=0;
+}
+
+
+bool TMC5160::batchChangesReadableRegisters() {
+	std::lock_guard<std::mutex> lock(shadowMutex);
+	if(!ownsBatch())
+		return false;
+	for(uint32_t i=0; i<numDirtyRegisters; i++)
+		if(canReadRegister(dirtyRegisters[i]))
+			return true;
+	return false;
+}
+
+
+bool TMC5160::refreshShadow() {
+	uint32_t values[TMCR_NUM_REGISTERS];
+	Transaction t;
+	{
+		std::lock_guard<std::mutex> lock(shadowMutex);
+		for(int i=0; i<(int) TMCR_NUM_REGISTERS; i++)
+			if(canReadRegister(i) && canWriteRegister(i) && !isVolatileRegister(i) && !(shadowFlags[i] & SHADOW_DIRTY))
+				t.get(i, &values[i]);
+	}
+	return execute(t);
+}
+
 
-	// Per the datasheet, raw send/receive returns the value requested with the PREVIOUS transfer.
-	// As SPI is not performance critical for our application, we simply send read requests twice. 
-	if(!sendReceive(tx,rx,10)) {
-		const int bufsize=1023;
-		char buffer[bufsize+1]={0};
-		printRegister(buffer, bufsize, address, *result, rx[5], "get", "error");
-		LOG_ERROR(buffer);
+bool TMC5160::restoreShadow(int32_t position, bool *deferred) {
+	Transaction ts[(TMCR_NUM_REGISTERS+8+Transaction::MAX_OPS-1)/Transaction::MAX_OPS];
+	uint32_t numTransactions=0;
+	auto add=[&](uint8_t address, uint32_t value) {
+		if(numTransactions==0 || ts[numTransactions-1].size()==Transaction::MAX_OPS)
+			numTransactions++;
+		ts[numTransactions-1].set(address, value);
+	};
+	std::unique_lock<std::mutex> lock(shadowMutex);
+	*deferred=batchDepth>0 && !ownsBatch();
+	if(*deferred)
 		return false;
+
+	// clear reset and driver error flags. A driver disabled on error restarts when TOFF passes through zero
+	add(TMCR_GSTAT, TMCF_GSTAT::mask);
+	add(TMCR_CHOPCONF, TMCF_TOFF::insert(shadowRegisters[TMCR_CHOPCONF], 0));
+
+	// configuration, including values pending in a batch. Motion registers follow once the position is restored
+	for(int i=0; i<(int) TMCR_NUM_REGISTERS; i++) {
+		if(!(shadowFlags[i] & (SHADOW_VALID | SHADOW_DIRTY)) || !canWriteRegister(i) || isVolatileRegister(i) ||
+		   i==TMCR_RAMPMODE || i==TMCR_XTARGET || i==TMCR_VMAX)
+			continue;
+		add(i, shadowRegisters[i]);
 	}
 
-	deviceStatus=(enum TMCStatusFlags) rx[5];
+	// restoring XACTUAL in positioning mode would start a move, so hold until the target is restored as well
+	add(TMCR_RAMPMODE, 3);
+	add(TMCR_XACTUAL, (uint32_t) position);
+	add(TMCR_XTARGET, shadowRegisters[TMCR_XTARGET]);
+	add(TMCR_RAMPMODE, shadowRegisters[TMCR_RAMPMODE]);
+	add(TMCR_VMAX, shadowRegisters[TMCR_VMAX]);
+	lock.unlock();
+
+	bool res=true;
+	for(uint32_t i=0; i<numTransactions; i++)
+		res=execute(ts[i]) && res;
+	return res;
+}
+
 
-	*result=(((uint32_t) rx[5+1])<<24) | (((uint32_t) rx[5+2])<<16) | 
-	        (((uint32_t) rx[5+3])<<8)  |  ((uint32_t) rx[5+4]); 
-	if(debugLevel>=TMC_DEBUG_REGISTERS) {
-		const int bufsize=1023;
-		char buffer[bufsize+1]={0};
-		printRegister(buffer, bufsize, address, *result, rx[5], "get", NULL);
-		LOG_DEBUG(buffer);
+bool TMC5160::restartDriver() {
+	// a driver disabled on error restarts when TOFF passes through zero
+	Transaction t;
+	std::unique_lock<std::mutex> lock(shadowMutex);
+	uint32_t chopconf=shadowRegisters[TMCR_CHOPCONF];
+	lock.unlock();
+	return t.set(TMCR_GSTAT, TMCF_GSTAT::mask) &&
+	       t.set(TMCR_CHOPCONF, TMCF_TOFF::insert(chopconf, 0)) &&
+	       t.set(TMCR_CHOPCONF, chopconf) &&
+	       execute(t);
+}
+
+
+void TMC5160::invalidateShadow() {
+	std::lock_guard<std::mutex> lock(shadowMutex);
+	for(int i=0; i<(int) TMCR_NUM_REGISTERS; i++) {
+		shadowRegisters[i]=0;
+		shadowFlags[i]=0;
 	}
+	numDirtyRegisters=0;
+	batchDepth=0;
+}
+
 
+bool TMC5160::Transaction::get(uint8_t address, uint32_t *result) {
+	if(numOps>=MAX_OPS)
+		return false;
+	ops[numOps++]={ (uint8_t) (address & (TMCR_NUM_REGISTERS-1)), 0, result };
 	return true;
 }
 
 
-bool TMC5160::setRegister(uint8_t address, uint32_t value) {
-	if(!canWriteRegister(address)) {
-		const int bufsize=1023;
-		char buffer[bufsize+1]={0};
-		printRegister(buffer, bufsize, address, value, 0, "SET", "error register not writeable");
-		LOG_ERROR(buffer);
+bool TMC5160::Transaction::set(uint8_t address, uint32_t value) {
+	if(numOps>=MAX_OPS)
 		return false;
+	ops[numOps++]={ (uint8_t) (address | 0x0080), value, NULL };
+	return true;
+}
+
+
+bool TMC5160::execute(Transaction &t) {
+	bool res=false;
+	auto f=[&](){ res=executeOnWorker(t); };
+	call(f);
+	return res;
+}
+
+
+bool TMC5160::executeOnWorker(Transaction &t) {
+	// validate operations and build one datagram per operation that needs the bus
+	uint8_t *tx=txBuffer, *rx=rxBuffer;
+	uint32_t numFrames=0;
+	for(uint32_t i=0; i<t.numOps; i++) {
+		const Transaction::Op &op=t.ops[i];
+		if(op.result==NULL) {
+			if(!canWriteRegister(op.address)) {
+				const int bufsize=1023;
+				char buffer[bufsize+1]={0};
+				printRegister(buffer, bufsize, op.address, op.value, 0, "SET", "error register not writeable");
+				LOG_ERROR(buffer);
+				return false;
+			}
+		} else if(!canReadRegister(op.address)) {
+			if(!canWriteRegister(op.address)) {
+				const int bufsize=1023;
+				char buffer[bufsize+1]={0};
+				printRegister(buffer, bufsize, op.address, 0, deviceStatus, "get", "error register is undefined");
+				LOG_ERROR(buffer);
+				return false;
+			}   
+			continue; // use shadow for write-only registers
+		}
+
+		uint8_t *frame=&tx[5*numFrames++];
+		frame[0]=op.address;
+		frame[1]=(uint8_t) ((op.value>>24)&0x00ff);
+		frame[2]=(uint8_t) ((op.value>>16)&0x00ff);
+		frame[3]=(uint8_t) ((op.value>> 8)&0x00ff);
+		frame[4]=(uint8_t) ((op.value>> 0)&0x00ff);
 	}
 
 	// Per the datasheet, raw send/receive returns the value sent/requested with the PREVIOUS transfer.
-	// As SPI is not performance critical for our application, we simply send a dummy read request after the write.
-	// Returned data must be identical to the originally set data. 
-	uint8_t tx[10]={(uint8_t) (address | 0x0080), 
-		           (uint8_t) ((value>>24)&0x00ff), (uint8_t) ((value>>16)&0x00ff), 
-		           (uint8_t) ((value>>8)&0x00ff),  (uint8_t) ((value>>0)&0x00ff),
-		           0, 0, 0, 0, 0   };
-	uint8_t rx[10];
-	if(!sendReceive(tx,rx,10)) {
-		if(debugLevel>=TMC_DEBUG_REGISTERS) {
+	// Hence we append a dummy read request to retrieve the response to the last operation.
+	if(numFrames>0) {
+		for(uint32_t i=0; i<5; i++)
+			tx[5*numFrames+i]=0;
+		if(!sendReceive(tx, rx, 5*(numFrames+1))) {
 			const int bufsize=1023;
 			char buffer[bufsize+1]={0};
-			printRegister(buffer, bufsize, address, value, rx[5], "SET", "error");
-			LOG_DEBUG(buffer);
+			printRegister(buffer, bufsize, tx[0], 0, rx[0], (tx[0] & 0x0080) ? "SET" : "get", "error");
+			LOG_ERROR(buffer);
+			if(debugLevel>=TMC_DEBUG_REGISTERS)
+				logTrace(numFrames+1);
+			return false;
 		}
-		return false;
 	}
 
-	if(rx[5+1]!=tx[1] || rx[5+2]!=tx[2] || rx[5+3]!=tx[3] || rx[5+4]!=tx[4]) {
-		if(debugLevel>=TMC_DEBUG_REGISTERS) {
-			const int bufsize=1023;
-			char buffer[bufsize+1]={0};
-			printRegister(buffer, bufsize, address, value, rx[5], "get", "error");
-			LOG_DEBUG(buffer);
+	// evaluate responses in order, serving cached registers as we go
+	uint32_t frame=0;
+	uint8_t status=deviceStatus;
+	std::unique_lock<std::mutex> lock(shadowMutex);
+	for(uint32_t i=0; i<t.numOps; i++) {
+		const Transaction::Op &op=t.ops[i];
+		uint8_t address=op.address & (TMCR_NUM_REGISTERS-1);
+
+		if(op.result!=NULL && !canReadRegister(address)) {
+			*op.result=shadowRegisters[address];
+			continue;
 		}
-		return false;
+
+		const uint8_t *response=&rx[5*(++frame)];
+		status=response[0];
+		uint32_t value=(((uint32_t) response[1])<<24) | (((uint32_t) response[2])<<16) | 
+		               (((uint32_t) response[3])<<8)  |  ((uint32_t) response[4]); 
+
+		if(op.result!=NULL) {
+			*op.result=value;
+			if(canWriteRegister(address) && !isVolatileRegister(address) && !(shadowFlags[address] & SHADOW_DIRTY)) {
+				shadowRegisters[address]=value;
+				shadowFlags[address]=SHADOW_VALID;
+			}
+		} else {
+			// Returned data must be identical to the originally set data
+			if(value!=op.value) {
+				// the device received all writes of the message, but their values are uncertain. Invalidating their shadows
+				// keeps later batches from skipping them as unchanged
+				for(uint32_t j=0; j<t.numOps; j++)
+					if(t.ops[j].result==NULL)
+						shadowFlags[t.ops[j].address & (TMCR_NUM_REGISTERS-1)]&=~SHADOW_VALID;
+				lock.unlock();
+				deviceStatus=(enum TMCStatusFlags) rx[5*numFrames];
+				if(debugLevel>=TMC_DEBUG_REGISTERS)
+					logTrace(numFrames+1);
+				trackStatus(rx, numFrames+1);  // the transfer itself succeeded, so its status bytes are valid
+				dispatchPendingEvents();
+				return false;
+			}
+			// a different value pending in a batch of another thread is written when that batch commits
+			if(!(shadowFlags[address] & SHADOW_DIRTY) || batchDepth==0 || shadowRegisters[address]==op.value) {
+				shadowRegisters[address]=op.value;
+				shadowFlags[address]=SHADOW_VALID;
+			}
+		}
+		if(address==TMCR_XACTUAL && !(status & (TMC_RESET | TMC_DRIVER_ERROR)))
+			lastGoodPosition=(int32_t) (op.result!=NULL ? value : op.value);
 	}
+	lock.unlock();
 
-	deviceStatus=(enum TMCStatusFlags) rx[5];
-	cachedRegisterValues[address & (TMCR_NUM_REGISTERS-1)]=value;
+	deviceStatus=(enum TMCStatusFlags) status;
 
-	if(debugLevel>=TMC_DEBUG_REGISTERS) {
-		const int bufsize=1023;
-		char buffer[bufsize+1]={0};
-		printRegister(buffer, bufsize, address, value, rx[5], "SET", NULL);
-		LOG_DEBUG(buffer);
+	// the first datagram carries a status byte as well
+	if(numFrames>0) {
+		trackStatus(rx, numFrames+1);
+		dispatchPendingEvents();
 	}
 	return true;
 }
 
 
-bool TMC5160::sendReceive(const uint8_t *tx, uint8_t *rx, uint32_t len) {
-	const int bufsize=1023;
-	char buffer[bufsize+1]={0};
-	int bufpos=0;
-	int remaining=bufsize-bufpos;
+void TMC5160::logTrace(uint32_t maxRecords) {
+	SPITrace::Record *records=new SPITrace::Record[maxRecords];
+	uint32_t num=trace.snapshot(records, maxRecords);
+	decodeTrace(records, num, getAxisName(), debugLevel>=TMC_DEBUG_PACKETS, [this](const char *line) { LOG_DEBUG(line); });
+	delete[] records;
+}
 
-	if(debugLevel>=TMC_DEBUG_PACKETS) {
-		int numPrinted=printPacket(buffer + bufpos, remaining, tx, len, true, "TX", NULL);
-		bufpos+=numPrinted;
-		remaining-=numPrinted;
-		numPrinted=snprintf(buffer + bufpos, remaining, "  ");
-		bufpos+=numPrinted;
-		remaining-=numPrinted;
-	}
 
-	bool res=SPI::sendReceive(tx, rx, len);
+void TMC5160::decodeTrace(const SPITrace::Record *records, uint32_t num, const char *name, bool packets, const std::function<void(const char *line)> &emit) {
+	uint64_t latest=num>0 ? records[num-1].timestampNs : 0;
 
-	if(debugLevel>=TMC_DEBUG_PACKETS) {
-		int numPrinted=printPacket(buffer + bufpos, remaining, rx, len, false, "RX", NULL);
-		bufpos+=numPrinted;
-		remaining-=numPrinted;
-		numPrinted=snprintf(buffer + bufpos, remaining, "   Return %s", res?"true":"false");
-		bufpos+=numPrinted;
-		remaining-=numPrinted;
-		LOG_DEBUG(buffer);
-	}
+	const int bufsize=1023;
+	char buffer[bufsize+1]={0};
+	for(uint32_t i=0; i<num; i++) {
+		const SPITrace::Record &r=records[i];
+		char prefix[64];
+		snprintf(prefix, sizeof(prefix), "%s: %+10.3f ms %c%c", name, -1e-6*(double) (latest-r.timestampNs),
+		         (r.flags & SPITrace::TRACE_FIRST) ? '*' : ' ', (r.flags & SPITrace::TRACE_FAILED) ? '!' : ' ');
+
+		if(packets || r.len!=5) {
+			int bufpos=printPacket(buffer, bufsize, r.tx, r.len<sizeof(r.tx) ? r.len : sizeof(r.tx), true, prefix, NULL);
+			printPacket(buffer+bufpos, bufsize-bufpos, r.rx, r.len<sizeof(r.rx) ? r.len : sizeof(r.rx), false, "  ", NULL);
+			emit(buffer);
+			continue;
+		}
 
-	return res;
+		// the response to a datagram arrives with the next datagram of the same message. 
+		// The trailing datagram of a message only collects the previous response and is not shown
+		if(i+1>=num || (records[i+1].flags & SPITrace::TRACE_FIRST))
+			continue;
+		const uint8_t *response=records[i+1].rx;
+		uint32_t value=(((uint32_t) response[1])<<24) | (((uint32_t) response[2])<<16) | 
+		               (((uint32_t) response[3])<<8)  |  ((uint32_t) response[4]); 
+		uint8_t address=r.tx[0] & (TMCR_NUM_REGISTERS-1);
+		if(r.tx[0] & 0x80) {
+			uint32_t sent=(((uint32_t) r.tx[1])<<24) | (((uint32_t) r.tx[2])<<16) | 
+			              (((uint32_t) r.tx[3])<<8)  |  ((uint32_t) r.tx[4]); 
+			printRegister(buffer, bufsize, address, sent, response[0], prefix, sent==value ? "SET" : "SET error echo mismatch");
+		} else
+			printRegister(buffer, bufsize, address, value, response[0], prefix, "get");
+		emit(buffer);
+	}
 }
 
 
@@ -522,6 +1437,28 @@ int TMC5160::printRegister(char *buffer, int bufsize, uint8_t address, uint32_t
 }
 
 
+int TMC5160::printRampEvents(char *buffer, int bufsize, uint32_t events) {
+	int bufpos=0;
+	int remaining=bufsize-bufpos;
+
+	const char *separator="";
+	int numPrinted=snprintf(buffer+bufpos, remaining, "[");
+	bufpos+=numPrinted;
+	remaining-=numPrinted;
+	for(uint32_t i=0; i<20; i++)
+		if((events & (1u<<i)) && rampEventNames[i]!=NULL) {
+			numPrinted=snprintf(buffer + bufpos, remaining, "%s%s", separator, rampEventNames[i]);
+			bufpos+=numPrinted;
+			remaining-=numPrinted;
+			separator=" ";
+		}
+	numPrinted=snprintf(buffer + bufpos, remaining, "]");	
+	bufpos+=numPrinted;
+	remaining-=numPrinted;
+	return bufpos;
+}
+
+
 int TMC5160::printPacket(char *buffer, int bufsize, const uint8_t *data, uint32_t numBytes, bool isTX, const char *prefix, const char *suffix) {
 	int bufpos=0;
 	int remaining=bufsize-bufpos;
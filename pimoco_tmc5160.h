@@ -23,10 +23,17 @@
 #define PIMOCO_TMC5160_H
 
 #include "pimoco_spi.h"
+#include "pimoco_tmc5160_fields.h"
+#include "pimoco_telemetry.h"
+#include <future>
+#include <mutex>
+#include <thread>
 
 // A TMC5160 stepper connected via SPI
 class TMC5160 : public SPI {
 protected:
+	friend class TMC5160Emulator;
+
 	// Device register addresses
 	enum TMCRegisters : uint8_t {
 		// general configuration 
@@ -113,12 +120,15 @@ protected:
 		TMCR_NUM_REGISTERS = 0x080,
 	};
 
-	// Supported modes on a device register (none, read, write, both)
+	// Supported modes on a device register (none, read, write, both). Volatile registers change in hardware
+	// or have side effects on write, and are never served from the shadow register file
 	enum TMCRegisterModes : int {
 		TMCRM_NONE = 0,
 		TMCRM_R    = 1,
 		TMCRM_W    = 2,
 		TMCRM_RW   = 3,
+		TMCRM_V    = 4,
+		TMCRM_RWV  = 7,
 	};
 
 	// Metadata about TMC registers
@@ -127,6 +137,86 @@ protected:
 		enum TMCRegisterModes mode;
 	};
 
+	// Register fields used by this driver, per datasheet. See TMCField and TMCRegisterField for the template parameters
+	//
+	typedef TMCField<TMCR_GCONF,          2,  1, TMCRM_RW > TMCF_EN_PWM_MODE;
+	typedef TMCField<TMCR_GCONF,          4,  1, TMCRM_RW > TMCF_SHAFT;
+	typedef TMCField<TMCR_GCONF,          5,  1, TMCRM_RW > TMCF_DIAG0_ERROR;
+	typedef TMCField<TMCR_GCONF,          6,  1, TMCRM_RW > TMCF_DIAG0_OTPW;
+	typedef TMCField<TMCR_GCONF,          7,  1, TMCRM_RW > TMCF_DIAG0_STALL_STEP;
+	typedef TMCField<TMCR_GCONF,         12,  1, TMCRM_RW > TMCF_DIAG0_INT_PUSHPULL;
+	typedef TMCRegisterField<TMCR_GSTAT,           3, TMCRM_RWV> TMCF_GSTAT;
+	typedef TMCField<TMCR_GSTAT,          0,  1, TMCRM_RWV> TMCF_GSTAT_RESET;
+	typedef TMCField<TMCR_GSTAT,          1,  1, TMCRM_RWV> TMCF_GSTAT_DRV_ERR;
+	typedef TMCRegisterField<TMCR_GLOBAL_SCALER,   8, TMCRM_W  > TMCF_GLOBAL_SCALER;
+	typedef TMCField<TMCR_IHOLD_IRUN,     0,  5, TMCRM_W  > TMCF_IHOLD;
+	typedef TMCField<TMCR_IHOLD_IRUN,     8,  5, TMCRM_W  > TMCF_IRUN;
+	typedef TMCField<TMCR_IHOLD_IRUN,    16,  4, TMCRM_W  > TMCF_IHOLDDELAY;
+	typedef TMCRegisterField<TMCR_TPOWER_DOWN,     8, TMCRM_W  > TMCF_TPOWERDOWN;
+	typedef TMCRegisterField<TMCR_TSTEP,          20, TMCRM_R  > TMCF_TSTEP;
+	typedef TMCRegisterField<TMCR_TPWMTHRS,       20, TMCRM_W  > TMCF_TPWMTHRS;
+	typedef TMCRegisterField<TMCR_TCOOLTHRS,      20, TMCRM_W  > TMCF_TCOOLTHRS;
+	typedef TMCRegisterField<TMCR_THIGH,          20, TMCRM_W  > TMCF_THIGH;
+	typedef TMCRegisterField<TMCR_RAMPMODE,        2, TMCRM_RW > TMCF_RAMPMODE;
+	typedef TMCRegisterField<TMCR_VACTUAL,        24, TMCRM_R, true> TMCF_VACTUAL;
+	typedef TMCRegisterField<TMCR_VSTART,         18, TMCRM_W  > TMCF_VSTART;
+	typedef TMCRegisterField<TMCR_A1,             16, TMCRM_W  > TMCF_A1;
+	typedef TMCRegisterField<TMCR_V1,             20, TMCRM_W  > TMCF_V1;
+	typedef TMCRegisterField<TMCR_AMAX,           16, TMCRM_W  > TMCF_AMAX;
+	typedef TMCRegisterField<TMCR_VMAX,           23, TMCRM_W  > TMCF_VMAX;
+	typedef TMCRegisterField<TMCR_DMAX,           16, TMCRM_W  > TMCF_DMAX;
+	typedef TMCRegisterField<TMCR_D1,             16, TMCRM_W  > TMCF_D1;
+	typedef TMCRegisterField<TMCR_VSTOP,          18, TMCRM_W  > TMCF_VSTOP;
+	typedef TMCRegisterField<TMCR_TZEROWAIT,      16, TMCRM_W  > TMCF_TZEROWAIT;
+	typedef TMCRegisterField<TMCR_VDCMIN,         23, TMCRM_W  > TMCF_VDCMIN;
+	typedef TMCRegisterField<TMCR_SW_MODE,        12, TMCRM_RW > TMCF_SW_MODE;
+	typedef TMCField<TMCR_SW_MODE,       10,  1, TMCRM_RW > TMCF_SG_STOP;
+	typedef TMCRegisterField<TMCR_RAMP_STAT,      14, TMCRM_RWV> TMCF_RAMP_STAT;
+	typedef TMCField<TMCR_RAMP_STAT,      0,  1, TMCRM_R  > TMCF_STATUS_STOP_L;
+	typedef TMCField<TMCR_RAMP_STAT,      1,  1, TMCRM_R  > TMCF_STATUS_STOP_R;
+	typedef TMCField<TMCR_RAMP_STAT,      2,  1, TMCRM_RWV> TMCF_STATUS_LATCH_L;
+	typedef TMCField<TMCR_RAMP_STAT,      3,  1, TMCRM_RWV> TMCF_STATUS_LATCH_R;
+	typedef TMCField<TMCR_RAMP_STAT,      4,  1, TMCRM_R  > TMCF_EVENT_STOP_L;
+	typedef TMCField<TMCR_RAMP_STAT,      5,  1, TMCRM_R  > TMCF_EVENT_STOP_R;
+	typedef TMCField<TMCR_RAMP_STAT,      6,  1, TMCRM_RWV> TMCF_EVENT_STOP_SG;
+	typedef TMCField<TMCR_RAMP_STAT,      7,  1, TMCRM_RWV> TMCF_EVENT_POS_REACHED;
+	typedef TMCField<TMCR_RAMP_STAT,      8,  1, TMCRM_R  > TMCF_VELOCITY_REACHED;
+	typedef TMCField<TMCR_RAMP_STAT,      9,  1, TMCRM_R  > TMCF_POSITION_REACHED;
+	typedef TMCField<TMCR_RAMP_STAT,     10,  1, TMCRM_R  > TMCF_VZERO;
+	typedef TMCField<TMCR_RAMP_STAT,     11,  1, TMCRM_R  > TMCF_T_ZEROWAIT_ACTIVE;
+	typedef TMCField<TMCR_RAMP_STAT,     12,  1, TMCRM_RWV> TMCF_SECOND_MOVE;
+	typedef TMCField<TMCR_RAMP_STAT,     13,  1, TMCRM_R  > TMCF_STATUS_SG;
+	typedef TMCField<TMCR_CHOPCONF,       0,  4, TMCRM_RW > TMCF_TOFF;
+	typedef TMCField<TMCR_CHOPCONF,       4,  3, TMCRM_RW > TMCF_HSTRT;
+	typedef TMCField<TMCR_CHOPCONF,       7,  4, TMCRM_RW > TMCF_HEND;
+	typedef TMCField<TMCR_CHOPCONF,      14,  1, TMCRM_RW > TMCF_CHM;
+	typedef TMCField<TMCR_CHOPCONF,      15,  2, TMCRM_RW > TMCF_TBL;
+	typedef TMCField<TMCR_CHOPCONF,      18,  1, TMCRM_RW > TMCF_VHIGHFS;
+	typedef TMCField<TMCR_CHOPCONF,      19,  1, TMCRM_RW > TMCF_VHIGHCHM;
+	typedef TMCField<TMCR_CHOPCONF,      24,  4, TMCRM_RW > TMCF_MRES;
+	typedef TMCField<TMCR_DCCTRL,         0, 10, TMCRM_W  > TMCF_DC_TIME;
+	typedef TMCField<TMCR_DCCTRL,        16,  8, TMCRM_W  > TMCF_DC_SG;
+	typedef TMCField<TMCR_DRV_STATUS,     0, 10, TMCRM_R  > TMCF_SG_RESULT;
+	typedef TMCField<TMCR_DRV_STATUS,    12,  2, TMCRM_R  > TMCF_S2VS;
+	typedef TMCField<TMCR_DRV_STATUS,    16,  5, TMCRM_R  > TMCF_CS_ACTUAL;
+	typedef TMCField<TMCR_DRV_STATUS,    24,  1, TMCRM_R  > TMCF_STALLGUARD;
+	typedef TMCField<TMCR_DRV_STATUS,    25,  1, TMCRM_R  > TMCF_OT;
+	typedef TMCField<TMCR_DRV_STATUS,    26,  1, TMCRM_R  > TMCF_OTPW;
+	typedef TMCField<TMCR_DRV_STATUS,    27,  2, TMCRM_R  > TMCF_S2G;
+	typedef TMCField<TMCR_DRV_STATUS,    29,  2, TMCRM_R  > TMCF_OL;
+	typedef TMCField<TMCR_DRV_STATUS,    31,  1, TMCRM_R  > TMCF_STST;
+	typedef TMCField<TMCR_PWMCONF,        0,  8, TMCRM_W  > TMCF_PWM_OFS;
+	typedef TMCField<TMCR_PWMCONF,        8,  8, TMCRM_W  > TMCF_PWM_GRAD;
+	typedef TMCField<TMCR_PWMCONF,       16,  2, TMCRM_W  > TMCF_PWM_FREQ;
+	typedef TMCField<TMCR_PWMCONF,       18,  1, TMCRM_W  > TMCF_PWM_AUTOSCALE;
+	typedef TMCField<TMCR_PWMCONF,       19,  1, TMCRM_W  > TMCF_PWM_AUTOGRAD;
+	typedef TMCField<TMCR_PWMCONF,       28,  4, TMCRM_W  > TMCF_PWM_LIM;
+	typedef TMCField<TMCR_PWM_SCALE,      0,  8, TMCRM_R  > TMCF_PWM_SCALE_SUM;
+	typedef TMCField<TMCR_PWM_SCALE,     16,  9, TMCRM_R,   true> TMCF_PWM_SCALE_AUTO;
+	typedef TMCField<TMCR_PWM_AUTO,       0,  8, TMCRM_R  > TMCF_PWM_OFS_AUTO;
+	typedef TMCRegisterField<TMCR_LOST_STEPS,     20, TMCRM_R  > TMCF_LOST_STEPS;
+	typedef TMCField<TMCR_PWM_AUTO,      16,  8, TMCRM_R  > TMCF_PWM_GRAD_AUTO;
+
 public:
 	// Device status bit flags
 	enum TMCStatusFlags : uint8_t {
@@ -140,203 +230,335 @@ public:
 		TMC_STOP_R           = ((uint8_t)1)<<7
 	};
 
+	// Ramp generator events decoded from RAMP_STAT. Each flag sits at the bit position of its source in RAMP_STAT
+	enum TMCRampEvent : uint32_t {
+		RAMP_EVENT_LATCH_L          = ((uint32_t)1)<<2,  // position latched on left reference switch
+		RAMP_EVENT_LATCH_R          = ((uint32_t)1)<<3,  // position latched on right reference switch
+		RAMP_EVENT_STOP_L           = ((uint32_t)1)<<4,  // motion stopped by left reference switch, from the rising edge of event_stop_l
+		RAMP_EVENT_STOP_R           = ((uint32_t)1)<<5,  // motion stopped by right reference switch, from the rising edge of event_stop_r
+		RAMP_EVENT_STALL            = ((uint32_t)1)<<6,  // motion stopped by StallGuard
+		RAMP_EVENT_POSITION_REACHED = ((uint32_t)1)<<7,  // target position reached
+		RAMP_EVENT_VELOCITY_REACHED = ((uint32_t)1)<<8,  // target velocity reached, from the rising edge of velocity_reached
+		RAMP_EVENT_ZERO_WAIT        = ((uint32_t)1)<<11, // zero wait after a stop started, from the rising edge of t_zerowait_active
+		RAMP_EVENT_SECOND_MOVE      = ((uint32_t)1)<<12, // target change required a move in the opposite direction
+		RAMP_EVENT_STAND_STILL      = ((uint32_t)1)<<16, // motor came to a stand still, from the status byte
+		RAMP_EVENT_STALL_GUARD      = ((uint32_t)1)<<17, // StallGuard threshold hit, from the status byte
+		RAMP_EVENT_DRIVER_ERROR     = ((uint32_t)1)<<18, // driver shut down on error, from the status byte
+		RAMP_EVENT_RESET            = ((uint32_t)1)<<19, // device was reset, from the status byte
+
+		RAMP_EVENTS_LATCHED = 0x10cc,  // events latched by the device until cleared by writing 1
+		RAMP_EVENTS_EDGES   = 0x0930,  // events derived from rising edges of RAMP_STAT status flags. Stop events persist while the stop condition holds
+		RAMP_EVENTS_STATUS  = 0xf0000, // events derived from rising edges of status byte flags
+		RAMP_EVENTS_STOP    = RAMP_EVENT_STOP_L | RAMP_EVENT_STOP_R | RAMP_EVENT_STALL, // events of unplanned stops
+		RAMP_EVENTS_FAULT   = RAMP_EVENT_RESET | RAMP_EVENT_DRIVER_ERROR,  // events of the device losing its state or disabling its driver
+		RAMP_EVENTS_ALL     = RAMP_EVENTS_LATCHED | RAMP_EVENTS_EDGES | RAMP_EVENTS_STATUS
+	};
+
+	// Handler for ramp generator events. Called on the I/O worker thread with one event and the CLOCK_MONOTONIC time
+	// in nanoseconds at which it was observed. Must not block. May access this device
+	typedef std::function<void(enum TMCRampEvent event, uint64_t timestampNs)> RampEventHandler;
+
+	enum {
+		MAX_RAMP_EVENT_SUBSCRIBERS = 8
+	};
+
 	// Creates a TMC5160 stepper connected via SPI, with optional physical connector pin for diag0 interrupt (negative=unused)
 	TMC5160(const char *theIndiDeviceName, const char *theAxisName, int thDiag0Pin=-1);
 
 	// Destroys this TMC5160 stepper connected via SPI
 	~TMC5160();
 
-	// Initialize interrupt service routine
+	// Initializes Diag0 interrupt handling. Position reached events are then handled on the I/O worker thread as they arrive
 	void isrInit();
 
+	// Closes the device and releases the Diag0 line. Returns true on success, else false
+	bool close();
+
 	// Returns the device status flags from the latest command	
 	enum TMCStatusFlags getStatus() { return deviceStatus; }
 
 	// Prints status flags. Returns number of characters printed, excluding the terminating zero.
 	static int printStatus(char *buffer, int bufsize, enum TMCStatusFlags status);
 
+	// Prints ramp event flags. Returns number of characters printed, excluding the terminating zero.
+	static int printRampEvents(char *buffer, int bufsize, uint32_t events);
+
+	// Subscribes the given handler to the given RAMP_EVENT_... flags. Events are decoded from Diag0 interrupts, from every
+	// getMotionStatus(), and from the status byte of every datagram. Position reached is delivered once per move.
+	// Returns a subscription id, or negative if there are too many subscribers
+	int subscribeRampEvents(uint32_t events, RampEventHandler &&handler);
+
+	// Cancels the subscription with the given id. Once this returns, its handler is no longer running and will not be invoked again
+	void unsubscribeRampEvents(int id);
+
 
 public:
 	// Basic motion settings
 	//
-	// Returns the current speed in the variable pointed to by result. Returns true on success, else false	
-	bool getSpeed(int32_t *result) { return getRegister(TMCR_VACTUAL, (uint32_t*) result); }
+	// Returns the current speed in the variable pointed to by result. Returns true on success, else false
+	bool getSpeed(int32_t *result);
+
+	// Snapshot of the motion state of the device, retrieved in a single pipelined exchange
+	struct MotionStatus {
+		int32_t  position;          // actual position XACTUAL in microsteps
+		int32_t  speed;             // actual speed VACTUAL in units of 2^24/f_clk
+		uint32_t rampStat;          // ramp generator status and event flags RAMP_STAT
+		uint32_t drvStatus;         // driver status flags DRV_STATUS
+		enum TMCStatusFlags status; // device status returned by the last datagram
+	};
+
+	// Gets position, speed, ramp status and driver status with four pipelined reads in a single 25-byte SPI message.
+	// Dispatches ramp events found in the status, and clears them on the device. Returns true on success, else false
+	bool getMotionStatus(MotionStatus *result);
 
 	// Sets the target speed to the given number of microsteps per second. Returns immediately. Returns true on success, else false
 	bool setTargetSpeed(int32_t value);
 
+	// Queues setting the target speed on the I/O worker without waiting for the bus. Errors are logged from the worker.
+	// Returns true if queued, else false
+	bool setTargetSpeedAsync(int32_t value);
+
+	// Sets the target speed to the given fractional number of microsteps per 2^24/f_clk. With a tracking cadence, streams XTARGET
+	// in positioning mode from an ephemeris, see setTrackingCadence(). Else integer values are set directly, and otherwise VMAX
+	// alternates between the two adjacent integer values on a timer on the I/O worker thread, first-order sigma-delta style,
+	// so the mean speed matches the given value. Returns immediately. Returns true on success, else false
+	bool setTargetSpeedFractional(double value);
+
+	// Queues setting the fractional target speed on the I/O worker without waiting for the bus. Errors are logged from the worker.
+	// Returns true if queued, else false
+	bool setTargetSpeedFractionalAsync(double value);
+
+	// Requested versus achieved speed of the last fractional target speed, in microsteps per 2^24/f_clk
+	struct FractionalSpeedStatus {
+		bool     active;    // is VMAX alternating between two values, or XTARGET streaming?
+		bool     position;  // streaming XTARGET in positioning mode rather than alternating VMAX?
+		double   requested; // requested mean speed
+		double   achieved;  // mean speed since the request. Of the VMAX values written, weighted by how long each was in effect,
+		                    // or of XACTUAL as read with the XTARGET updates
+		double   residual;  // expected minus actual position, in microsteps per 2^24/f_clk times seconds. The running integral of
+		                    // requested minus written speed, or the ephemeris minus XACTUAL as of the last XTARGET update
+		uint32_t updates;   // number of VMAX or XTARGET writes since the request
+	};
+
+	// Gets the status of the fractional target speed. Returns true on success, else false
+	bool getFractionalSpeedStatus(FractionalSpeedStatus *result);
+
+	// Returns the interval in milliseconds between XTARGET updates for position mode tracking, 0 for velocity mode
+	uint32_t getTrackingCadence() const { return trackCadenceMs; }
+
+	// Sets the interval in milliseconds between XTARGET updates for position mode tracking, or 0 for velocity mode. In position mode,
+	// fractional target speeds are realized by computing the expected position from time and speed, and streaming it to XTARGET
+	// in positioning mode with VMAX slightly above the speed. The ramp generator thus corrects any deviation of XACTUAL, and the
+	// tracking error stays bounded. Speed 0 still stops in velocity mode. Requires the clock frequency. Applies to the active fractional
+	// target speed immediately, also to a whole one running as a plain VMAX. Returns true on success, else false
+	bool setTrackingCadence(uint32_t ms);
+
+	enum {
+		MIN_TRACKING_CADENCE = 10,   // shortest XTARGET update interval in ms
+		MAX_TRACKING_CADENCE = 1000  // longest XTARGET update interval in ms
+	};
+
 	// Gets the speed to restore after target position was reached. 0 means no action. Always succeeds and returns true 
-	bool getSpeedToRestore(int32_t *result) { *result=speedToRestore; return true; }
+	bool getSpeedToRestore(double *result) { *result=speedToRestore; return true; }
 
-	// Sets the speed to restore after target position was reached. 0 means no action. Always succeeds and returns true 
-	bool setSpeedToRestore(int32_t value) { speedToRestore=value; return true; }
+	// Sets the speed to restore after target position was reached, as fractional target speed. 0 means no action. Always succeeds and returns true 
+	bool setSpeedToRestore(double value) { speedToRestore=value; return true; }
 
 	// Returns true if the stepper has reached its target position
 	bool hasReachedTargetPos() { return hasReachedTarget; }
 
+	// Returns the CLOCK_MONOTONIC time in nanoseconds at which the target position was last reached, 0 if never.
+	// Taken by the kernel on the Diag0 edge with interrupts, else at the poll which detected it
+	uint64_t getPositionReachedTime() { return positionReachedNs; }
+
+	// Returns true if Diag0 interrupts are enabled for this stepper
+	bool hasInterrupts() { return interruptsEnabled; }
+
+	// Decodes up to the given number of most recent datagrams from the SPI trace into register names and values,
+	// and logs them at debug level. Includes raw bytes at packet debug level. Safe to call from any thread
+	void logTrace(uint32_t maxRecords);
+
+	// Decodes the given trace records into one line of text per datagram with the given prefix, timed relative to the last record,
+	// and passes each line to the given function. Shows raw bytes instead of register names and values if packets is set
+	static void decodeTrace(const SPITrace::Record *records, uint32_t num, const char *prefix, bool packets, const std::function<void(const char *line)> &emit);
+
+	// Returns the rate in Hz at which driver telemetry is sampled while connected. 0 means off
+	uint32_t getTelemetryRate() const { return telemetryRateHz; }
+
+	// Sets the rate in Hz at which DRV_STATUS, TSTEP, PWM_SCALE and LOST_STEPS are sampled while connected, 0 for off.
+	// Takes effect immediately if connected, else on connect. Returns true on success, else false
+	bool setTelemetryRate(uint32_t hz);
+
+	// Returns the ring of driver telemetry samples. Safe to read from any thread
+	const Telemetry &getTelemetry() const { return telemetry; }
+
+	enum {
+		MAX_TELEMETRY_RATE = 500  // highest telemetry sampling rate in Hz
+	};
+
 
 	// General configuration settings
 	//
 
 	// Gets motor inversion flag 0/1 from device. Returns true on success, else false
-	bool getInvertMotor(uint32_t *result) { return getRegisterBits(TMCR_GCONF, result, 4, 1); }
+	bool getInvertMotor(uint32_t *result) { return getField<TMCF_SHAFT>(result); }
 
 	// Sets motor inversion flag 0/1 on device. Returns true on success, else false
-	bool setInvertMotor(uint32_t value) { return setRegisterBits(TMCR_GCONF, value, 4, 1); }
+	bool setInvertMotor(uint32_t value) { return setField<TMCF_SHAFT>(value); }
 
 public:
 	// Gets diagnosis 0 enable on error flag 0/1 from device. Returns true on success, else false
-	bool getDiag0EnableError(uint32_t *result) { return getRegisterBits(TMCR_GCONF, result, 5, 1); }
+	bool getDiag0EnableError(uint32_t *result) { return getField<TMCF_DIAG0_ERROR>(result); }
 
 	// Sets diagnosis 0 enable on error flag 0/1 on device. Returns true on success, else false
-	bool setDiag0EnableError(uint32_t value) { return setRegisterBits(TMCR_GCONF, value, 5, 1); }
+	bool setDiag0EnableError(uint32_t value) { return setField<TMCF_DIAG0_ERROR>(value); }
 
 	// Gets diagnosis 0 enable on overtemperature flag 0/1 from device. Returns true on success, else false
-	bool getDiag0EnableTemp(uint32_t *result) { return getRegisterBits(TMCR_GCONF, result, 6, 1); }
+	bool getDiag0EnableTemp(uint32_t *result) { return getField<TMCF_DIAG0_OTPW>(result); }
 
 	// Sets diagnosis 0 enable on overtemperature flag 0/1 on device. Returns true on success, else false
-	bool setDiag0EnableTemp(uint32_t value) { return setRegisterBits(TMCR_GCONF, value, 6, 1); }
+	bool setDiag0EnableTemp(uint32_t value) { return setField<TMCF_DIAG0_OTPW>(value); }
 
 	// Gets diagnosis 0 enable on interrupt=0 or step=1 flag from device. Returns true on success, else false
-	bool getDiag0EnableInterruptStep(uint32_t *result) { return getRegisterBits(TMCR_GCONF, result, 7, 1); }
+	bool getDiag0EnableInterruptStep(uint32_t *result) { return getField<TMCF_DIAG0_STALL_STEP>(result); }
 
 	// Sets diagnosis 0 enable on interrupt=0 or step=1 on device. Returns true on success, else false
-	bool setDiag0EnableInterruptStep(uint32_t value) { return setRegisterBits(TMCR_GCONF, value, 7, 1); }
+	bool setDiag0EnableInterruptStep(uint32_t value) { return setField<TMCF_DIAG0_STALL_STEP>(value); }
 
 	// Gets diagnosis 0 push-pull from device. Returns true on success, else false
-	bool getDiag0PushPull(uint32_t *result) { return getRegisterBits(TMCR_GCONF, result, 12, 1); }
+	bool getDiag0PushPull(uint32_t *result) { return getField<TMCF_DIAG0_INT_PUSHPULL>(result); }
 
 	// Sets diagnosis 0 push-pull on device. Returns true on success, else false
-	bool setDiag0PushPull(uint32_t value) { return setRegisterBits(TMCR_GCONF, value, 12, 1); }
+	bool setDiag0PushPull(uint32_t value) { return setField<TMCF_DIAG0_INT_PUSHPULL>(value); }
 
 	// Gets PWM enable flag 0/1 from device. Returns true on success, else false
-	bool getPWMEnableStealthChop(uint32_t *result) { return getRegisterBits(TMCR_GCONF, result, 2, 1); }
+	bool getPWMEnableStealthChop(uint32_t *result) { return getField<TMCF_EN_PWM_MODE>(result); }
 
 	// Sets PWM enable flag 0/1 on device. Returns true on success, else false
-	bool setPWMEnableStealthChop(uint32_t value) { return setRegisterBits(TMCR_GCONF, value, 2, 1); }
+	bool setPWMEnableStealthChop(uint32_t value) { return setField<TMCF_EN_PWM_MODE>(value); }
 
 	// Gets global status flags from device. Returns true on success, else false
-	bool getGStat(uint32_t *result) { return getRegister(TMCR_GSTAT, result); }
+	bool getGStat(uint32_t *result) { return getField<TMCF_GSTAT>(result); }
 
 	// Sets global status flags on device, e.g. to clear device status flags. Returns true on success, else false
-	bool setGStat(uint32_t value) { return setRegister(TMCR_GSTAT, value); }
+	bool setGStat(uint32_t value) { return setField<TMCF_GSTAT>(value); }
 
 
 	// PWM settings
 	//
 
 	// Gets PWM autoscaling flag 0/1 from device. Returns true on success, else false
-	bool getPWMAutoscale(uint32_t *result) { return getRegisterBits(TMCR_PWMCONF, result, 18, 1); }
+	bool getPWMAutoscale(uint32_t *result) { return getField<TMCF_PWM_AUTOSCALE>(result); }
 
 	// Sets PWM autoscaling flag 0/1 on device. Returns true on success, else false
-	bool setPWMAutoscale(uint32_t value) { return setRegisterBits(TMCR_PWMCONF, value, 18, 1); }
+	bool setPWMAutoscale(uint32_t value) { return setField<TMCF_PWM_AUTOSCALE>(value); }
 
 	// Gets PWM automatic gradient flag 0/1 from device. Returns true on success, else false
-	bool getPWMAutoGradient(uint32_t *result) { return getRegisterBits(TMCR_PWMCONF, result, 19, 1); }
+	bool getPWMAutoGradient(uint32_t *result) { return getField<TMCF_PWM_AUTOGRAD>(result); }
 
 	// Sets PWM automatic gradient flag 0/1 on device. Returns true on success, else false
-	bool setPWMAutoGradient(uint32_t value) { return setRegisterBits(TMCR_PWMCONF, value, 19, 1); }
+	bool setPWMAutoGradient(uint32_t value) { return setField<TMCF_PWM_AUTOGRAD>(value); }
 
 	// Gets PWM frequency divider from device. 0=2/1024 clk, 1=2/683, 2=2/512, 3=2/510. Returns true on success, else false
-	bool getPWMFrequencyDivider(uint32_t *result) { return getRegisterBits(TMCR_PWMCONF, result, 17, 2); }
+	bool getPWMFrequencyDivider(uint32_t *result) { return getField<TMCF_PWM_FREQ>(result); }
 
 	// Sets PWM frequency divider on device. 0=2/1024 clk, 1=2/683, 2=2/512, 3=2/510. Returns true on success, else false
-	bool setPWMFrequencyDivider(uint32_t value) { return setRegisterBits(TMCR_PWMCONF, value, 17, 2); }
+	bool setPWMFrequencyDivider(uint32_t value) { return setField<TMCF_PWM_FREQ>(value); }
 
 	// Gets PWM autoscale amplitude limit from device. See datasheet. Returns true on success, else false
-	bool getPWMLimit(uint32_t *result) { return getRegisterBits(TMCR_PWMCONF, result, 28, 4); }
+	bool getPWMLimit(uint32_t *result) { return getField<TMCF_PWM_LIM>(result); }
 
 	// Sets PWM autoscale amplitude limit on device. See datasheet. Returns true on success, else false
-	bool setPWMLimit(uint32_t value) { return setRegisterBits(TMCR_PWMCONF, value, 28, 4); }
+	bool setPWMLimit(uint32_t value) { return setField<TMCF_PWM_LIM>(value); }
 
 
 	// Chopper settings
 	//
 
 	// Gets chopper mode from device. 0=SpreadCycle, 1=constant off time. Returns true on success, else false
-	bool getChopperMode(uint32_t *result) { return getRegisterBits(TMCR_CHOPCONF, result, 14, 1); }
+	bool getChopperMode(uint32_t *result) { return getField<TMCF_CHM>(result); }
 
 	// Sets chopper mode on device. 0=SpreadCycle, 1=constant off time. Returns true on success, else false
-	bool setChopperMode(uint32_t value) { return setRegisterBits(TMCR_CHOPCONF, value, 14, 1); }
+	bool setChopperMode(uint32_t value) { return setField<TMCF_CHM>(value); }
 
 	// Gets chopper enable high velocity fullstep mode 0/1 from device. Returns true on success, else false
-	bool getChopperHighVelFullstep(uint32_t *result) { return getRegisterBits(TMCR_CHOPCONF, result, 18, 1); }
+	bool getChopperHighVelFullstep(uint32_t *result) { return getField<TMCF_VHIGHFS>(result); }
 
 	// Sets chopper enable high velocity fullstep mode 0/1 on device. Returns true on success, else false
-	bool setChopperHighVelFullstep(uint32_t value) { return setRegisterBits(TMCR_CHOPCONF, value, 18, 1); }
+	bool setChopperHighVelFullstep(uint32_t value) { return setField<TMCF_VHIGHFS>(value); }
 
 	// Gets chopper enable high velocity mode 0/1 from device. Returns true on success, else false
-	bool getChopperHighVel(uint32_t *result) { return getRegisterBits(TMCR_CHOPCONF, result, 19, 1); }
+	bool getChopperHighVel(uint32_t *result) { return getField<TMCF_VHIGHCHM>(result); }
 
 	// Sets chopper enable high velocity mode 0/1 on device. Returns true on success, else false
-	bool setChopperHighVel(uint32_t value) { return setRegisterBits(TMCR_CHOPCONF, value, 19, 1); }
+	bool setChopperHighVel(uint32_t value) { return setField<TMCF_VHIGHCHM>(value); }
 
 	// Gets chopper micro step resolution from device. 0=native 256, 1=128, 2=64, 3=32, 4=16, 5=8, 6=4, 7=2 8=full step. Returns true on success, else false
-	bool getChopperMicroRes(uint32_t *result) { return getRegisterBits(TMCR_CHOPCONF, result, 24, 4); }
+	bool getChopperMicroRes(uint32_t *result) { return getField<TMCF_MRES>(result); }
 
 	// Sets chopper micro step resolution on device. 0=native 256, 1=128, 2=64, 3=32, 4=16, 5=8, 6=4, 7=2 8=full step. Returns true on success, else false
-	bool setChopperMicroRes(uint32_t value) { return setRegisterBits(TMCR_CHOPCONF, value, 24, 4); }
+	bool setChopperMicroRes(uint32_t value) { return setField<TMCF_MRES>(value); }
 
 	// Gets chopper off time and driver enable from device. 24+32*TOFF clocks. Returns true on success, else false
-	bool getChopperTOff(uint32_t *result) { return getRegisterBits(TMCR_CHOPCONF, result, 0, 4); }
+	bool getChopperTOff(uint32_t *result) { return getField<TMCF_TOFF>(result); }
 
 	// Sets chopper off time and driver enable on device. 24+32*TOFF clocks. Returns true on success, else false
-	bool setChopperTOff(uint32_t value) { return setRegisterBits(TMCR_CHOPCONF, value, 0, 4); }
+	bool setChopperTOff(uint32_t value) { return setField<TMCF_TOFF>(value); }
 
 	// Gets chopper blank time select from device. 24+32*TOFF clocks. Returns true on success, else false
-	bool getChopperTBlank(uint32_t *result) { return getRegisterBits(TMCR_CHOPCONF, result, 15, 2); }
+	bool getChopperTBlank(uint32_t *result) { return getField<TMCF_TBL>(result); }
 
 	// Sets chopper blank time select on device. 24+32*TOFF clocks. Returns true on success, else false
-	bool setChopperTBlank(uint32_t value) { return setRegisterBits(TMCR_CHOPCONF, value, 15, 2); }
+	bool setChopperTBlank(uint32_t value) { return setField<TMCF_TBL>(value); }
 
 	// Gets chopper hysteresis start value from device. 24+32*TOFF clocks. Returns true on success, else false
-	bool getChopperHStart(uint32_t *result) { return getRegisterBits(TMCR_CHOPCONF, result, 4, 3); }
+	bool getChopperHStart(uint32_t *result) { return getField<TMCF_HSTRT>(result); }
 
 	// Sets chopper hysteresis start value on device. 24+32*TOFF clocks. Returns true on success, else false
-	bool setChopperHStart(uint32_t value) { return setRegisterBits(TMCR_CHOPCONF, value, 4, 3); }
+	bool setChopperHStart(uint32_t value) { return setField<TMCF_HSTRT>(value); }
 
 	// Gets chopper hysteresis end value from device. 24+32*TOFF clocks. Returns true on success, else false
-	bool getChopperHEnd(uint32_t *result) { return getRegisterBits(TMCR_CHOPCONF, result, 7, 4); }
+	bool getChopperHEnd(uint32_t *result) { return getField<TMCF_HEND>(result); }
 
 	// Sets chopper hysteresis end value on device. 24+32*TOFF clocks. Returns true on success, else false
-	bool setChopperHEnd(uint32_t value) { return setRegisterBits(TMCR_CHOPCONF, value, 7, 4); }
+	bool setChopperHEnd(uint32_t value) { return setField<TMCF_HEND>(value); }
 
 
 	// Velocity dependent configuration settings
 	//
 
 	// Gets global current scaler from device, from 0..255, where 0 counts as 256. Returns true on success, else false
-	bool getGlobalCurrentScaler(uint32_t *result) { return getRegister(TMCR_GLOBAL_SCALER, result); }
+	bool getGlobalCurrentScaler(uint32_t *result) { return getField<TMCF_GLOBAL_SCALER>(result); }
 
 	// Sets global current scaler on device, from 0..255, where 0 counts as 256. Returns true on success, else false
-	bool setGlobalCurrentScaler(uint32_t value) { return setRegister(TMCR_GLOBAL_SCALER, value); }
+	bool setGlobalCurrentScaler(uint32_t value) { return setField<TMCF_GLOBAL_SCALER>(value); }
 
 	// Gets hold motor current from device. 0=1/32 ... 31=32/32. Returns true on success, else false
-	bool getIHold(uint32_t *result) { return getRegisterBits(TMCR_IHOLD_IRUN, result, 0, 5); }
+	bool getIHold(uint32_t *result) { return getField<TMCF_IHOLD>(result); }
 
 	// Sets hold motor current on device. 0=1/32 ... 31=32/32. Returns true on success, else false
-	bool setIHold(uint32_t value) { return setRegisterBits(TMCR_IHOLD_IRUN, value, 0, 5); }
+	bool setIHold(uint32_t value) { return setField<TMCF_IHOLD>(value); }
 
 	// Gets run motor current from device. 0=1/32 ... 31=32/32. Returns true on success, else false
-	bool getIRun(uint32_t *result) { return getRegisterBits(TMCR_IHOLD_IRUN, result, 8, 5); }
+	bool getIRun(uint32_t *result) { return getField<TMCF_IRUN>(result); }
 
 	// Sets run motor current on device. 0=1/32 ... 31=32/32. Returns true on success, else false
-	bool setIRun(uint32_t value) { return setRegisterBits(TMCR_IHOLD_IRUN, value, 8, 5); }
+	bool setIRun(uint32_t value) { return setField<TMCF_IRUN>(value); }
 
 	// Gets ramp time for powering down motor current from device. In 2^18 clocks. Works after TPowerdown. Returns true on success, else false
-	bool getIHoldDelay(uint32_t *result) { return getRegisterBits(TMCR_IHOLD_IRUN, result, 16, 4); }
+	bool getIHoldDelay(uint32_t *result) { return getField<TMCF_IHOLDDELAY>(result); }
 
 	// Sets ramp time for powering down motor current on device. In 2^18 clocks. Works after TPowerdown. Returns true on success, else false
-	bool setIHoldDelay(uint32_t value) { return setRegisterBits(TMCR_IHOLD_IRUN, value, 16, 4); }
+	bool setIHoldDelay(uint32_t value) { return setField<TMCF_IHOLDDELAY>(value); }
 
 	// Gets motor powerdown delay from device. In 2^18 clocks. Works before IHoldDelay. Returns true on success, else false
-	bool getTPowerDown(uint32_t *result) { return getRegister(TMCR_TPOWER_DOWN, result); }
+	bool getTPowerDown(uint32_t *result) { return getField<TMCF_TPOWERDOWN>(result); }
 
 	// Sets motor powerdown delay on device. In 2^18 clocks. Works before IHoldDelay. Returns true on success, else false
-	bool setTPowerDown(uint32_t value) { return setRegister(TMCR_TPOWER_DOWN, value); }
+	bool setTPowerDown(uint32_t value) { return setField<TMCF_TPOWERDOWN>(value); }
 
 	// Gets actual measured time between two 1/256 microsteps measured in clocks. Returns true on success, else false
-	bool getTStep(uint32_t *result) { return getRegister(TMCR_TSTEP, result); }
+	bool getTStep(uint32_t *result) { return getField<TMCF_TSTEP>(result); }
 
 	// Setter omitted intentionally, this is a read only property
 
@@ -344,22 +566,22 @@ public:
 	uint32_t tStepFromSpeed(uint32_t speed) { return (((uint32_t)1)<<24)/speed; }
 
 	// Gets step time threshold for StealthChop voltage PWM mode from device. PWM is on iff getTStep() is >= this. Returns true on success, else false
-	bool getTPWMThreshold(uint32_t *result) { return getRegister(TMCR_TPWMTHRS, result); }
+	bool getTPWMThreshold(uint32_t *result) { return getField<TMCF_TPWMTHRS>(result); }
 
 	// Sets step time threshold for StealthChop voltage PWM mode on device. PWM is on iff getTStep() is >= this. Returns true on success, else false
-	bool setTPWMThreshold(uint32_t value) { return setRegister(TMCR_TPWMTHRS, value); }
+	bool setTPWMThreshold(uint32_t value) { return setField<TMCF_TPWMTHRS>(value); }
 
 	// Gets step time threshold for CoolStep and StallGuard mode from device. CoolStep is on iff this >= getTStep() >= getTHigh(). Returns true on success, else false
-	bool getTCoolThreshold(uint32_t *result) { return getRegister(TMCR_TCOOLTHRS, result); }
+	bool getTCoolThreshold(uint32_t *result) { return getField<TMCF_TCOOLTHRS>(result); }
 
 	// Sets step time threshold for  for CoolStep and StallGuard mode on device. CoolStep is on iff this >= getTStep() >= getTHigh(). Returns true on success, else false
-	bool setTCoolThreshold(uint32_t value) { return setRegister(TMCR_TCOOLTHRS, value); }
+	bool setTCoolThreshold(uint32_t value) { return setField<TMCF_TCOOLTHRS>(value); }
 
 	// Gets step time threshold for high-speed voltage PWM mode from device. High-speed is on iff getTStep() <= this. Returns true on success, else false
-	bool getTHighThreshold(uint32_t *result) { return getRegister(TMCR_THIGH, result); }
+	bool getTHighThreshold(uint32_t *result) { return getField<TMCF_THIGH>(result); }
 
 	// Sets step time threshold for high-speed mode on device. High-speed is on iff getTStep() <= this. Returns true on success, else false
-	bool setTHighThreshold(uint32_t value) { return setRegister(TMCR_THIGH, value); }
+	bool setTHighThreshold(uint32_t value) { return setField<TMCF_THIGH>(value); }
 
 
 public:
@@ -367,96 +589,206 @@ public:
 	//
 
 	// Gets initial motor speed when starting from standstill. In units of 2^24/f_clk. Returns true on success, else false
-	bool getVStart(uint32_t *result) { return getRegister(TMCR_VSTART, result); }
+	bool getVStart(uint32_t *result) { return getField<TMCF_VSTART>(result); }
 
 	// Sets initial motor speed when starting from standstill. In units of 2^24/f_clk. Returns true on success, else false
-	bool setVStart(uint32_t value) { return setRegister(TMCR_VSTART, value); }
+	bool setVStart(uint32_t value) { return setField<TMCF_VSTART>(value); }
 
 	// Gets initial motor acceleration after starting from standstill. In units of 2^41/f_clk^2. Returns true on success, else false
-	bool getA1(uint32_t *result) { return getRegister(TMCR_A1, result); }
+	bool getA1(uint32_t *result) { return getField<TMCF_A1>(result); }
 
 	// Sets initial motor acceleration after starting from standstill. In units of 2^41/f_clk^2. Returns true on success, else false
-	bool setA1(uint32_t value) { return setRegister(TMCR_A1, value); }
+	bool setA1(uint32_t value) { return setField<TMCF_A1>(value); }
 
 	// Gets motor speed for switchover to max acceleration. In units of 2^24/f_clk. Returns true on success, else false
-	bool getV1(uint32_t *result) { return getRegister(TMCR_V1, result); }
+	bool getV1(uint32_t *result) { return getField<TMCF_V1>(result); }
 
 	// Sets motor speed for switchover to max acceleration. In units of 2^24/f_clk. Returns true on success, else false
-	bool setV1(uint32_t value) { return setRegister(TMCR_V1, value); }
+	bool setV1(uint32_t value) { return setField<TMCF_V1>(value); }
 
 	// Gets maximal motor acceleration. In units of 2^41/f_clk^2. Returns true on success, else false
-	bool getAMax(uint32_t *result) { return getRegister(TMCR_AMAX, result); }
+	bool getAMax(uint32_t *result) { return getField<TMCF_AMAX>(result); }
 
 	// Sets maximal motor acceleration. In units of 2^41/f_clk^2. Returns true on success, else false
-	bool setAMax(uint32_t value) { return setRegister(TMCR_AMAX, value); }
+	bool setAMax(uint32_t value) { return setField<TMCF_AMAX>(value); }
 
 	// Gets maximal motor speed. In units of 2^24/f_clk. Returns true on success, else false
-	bool getVMax(uint32_t *result) { return getRegister(TMCR_VMAX, result); }
+	bool getVMax(uint32_t *result) { return getField<TMCF_VMAX>(result); }
 
 	// Sets maximal motor speed. In units of 2^24/f_clk. Returns true on success, else false
-	bool setVMax(uint32_t value) { return setRegister(TMCR_VMAX, value); }
+	bool setVMax(uint32_t value) { return setField<TMCF_VMAX>(value); }
 
 	// Gets maximal motor deceleration. In units of 2^41/f_clk^2. Returns true on success, else false
-	bool getDMax(uint32_t *result) { return getRegister(TMCR_DMAX, result); }
+	bool getDMax(uint32_t *result) { return getField<TMCF_DMAX>(result); }
 
 	// Sets maximal motor deceleration. In units of 2^41/f_clk^2. Returns true on success, else false
-	bool setDMax(uint32_t value) { return setRegister(TMCR_DMAX, value); }
+	bool setDMax(uint32_t value) { return setField<TMCF_DMAX>(value); }
 
 	// Gets final motor acceleration for deceleration to stop. In units of 2^41/f_clk^2. Returns true on success, else false
-	bool getD1(uint32_t *result) { return getRegister(TMCR_D1, result); }
+	bool getD1(uint32_t *result) { return getField<TMCF_D1>(result); }
 
 	// Sets final motor acceleration for deceleration to stop. In units of 2^41/f_clk^2. Returns true on success, else false
-	bool setD1(uint32_t value) { return setRegister(TMCR_D1, value); }
+	bool setD1(uint32_t value) { return setField<TMCF_D1>(value); }
 
 	// Gets final motor speed before stopping. In units of 2^24/f_clk. Must be greater or equal than VStart. Do not set to 0 in positioning mode, minimum 10 recommended. Returns true on success, else false
-	bool getVStop(uint32_t *result) { return getRegister(TMCR_VSTOP, result); }
+	bool getVStop(uint32_t *result) { return getField<TMCF_VSTOP>(result); }
 
 	// Sets final  motor speed before stopping. In units of 2^24/f_clk. Must be greater or equal than VStart. Do not set to 0 in positioning mode, minimum 10 recommended. Returns true on success, else false
-	bool setVStop(uint32_t value) { return setRegister(TMCR_VSTOP, value); }
+	bool setVStop(uint32_t value) { return setField<TMCF_VSTOP>(value); }
 
 	// Gets waiting time between movements in opposite directions. In units of 512*t_clk. Returns true on success, else false
-	bool getTZeroWait(uint32_t *result) { return getRegister(TMCR_TZEROWAIT, result); }
+	bool getTZeroWait(uint32_t *result) { return getField<TMCF_TZEROWAIT>(result); }
 
 	// Gets waiting time between movements in opposite directions. In units of 512*t_clk. Returns true on success, else false
-	bool setTZeroWait(uint32_t value) { return setRegister(TMCR_TZEROWAIT, value); }
+	bool setTZeroWait(uint32_t value) { return setField<TMCF_TZEROWAIT>(value); }
 
 	// Gets DCStep minimum speed from device. Returns true on success, else false
-	bool getVDCMin(uint32_t *result) { return getRegister(TMCR_VDCMIN, result); }
+	bool getVDCMin(uint32_t *result) { return getField<TMCF_VDCMIN>(result); }
 
 	// Sets DCStep minimum speed on device. Returns true on success, else false
-	bool setVDCMin(uint32_t value) { return setRegister(TMCR_VDCMIN, value); }
+	bool setVDCMin(uint32_t value) { return setField<TMCF_VDCMIN>(value); }
 
 	// Gets DC time from device. Returns true on success, else false
-	bool getDCTime(uint32_t *result) { return getRegisterBits(TMCR_DCCTRL, result, 0, 10); }
+	bool getDCTime(uint32_t *result) { return getField<TMCF_DC_TIME>(result); }
 
 	// Sets DC time on device. Returns true on success, else false
-	bool setDCTime(uint32_t value) { return setRegisterBits(TMCR_DCCTRL, value, 0, 10); }
+	bool setDCTime(uint32_t value) { return setField<TMCF_DC_TIME>(value); }
 
 	// Gets DC stall guard from device. Returns true on success, else false
-	bool getDCStallGuard(uint32_t *result) { return getRegisterBits(TMCR_DCCTRL, result, 16, 8); }
+	bool getDCStallGuard(uint32_t *result) { return getField<TMCF_DC_SG>(result); }
 
 	// Sets DC stall guardon device. Returns true on success, else false
-	bool setDCStallGuard(uint32_t value) { return setRegisterBits(TMCR_DCCTRL, value, 16, 8); }
+	bool setDCStallGuard(uint32_t value) { return setField<TMCF_DC_SG>(value); }
 
 protected:
 	// Gets StallGuard stop enablement status 0/1 from device. Returns true on success, else false
-	bool getEnableStallGuardStop(uint32_t *result) { return getRegisterBits(TMCR_SW_MODE, result, 10, 1); }
+	bool getEnableStallGuardStop(uint32_t *result) { return getField<TMCF_SG_STOP>(result); }
 
 	// Sets StallGuard stop enablement status 0/1 on device. Returns true on success, else false
-	bool setEnableStallGuardStop(uint32_t value) { return setRegisterBits(TMCR_SW_MODE, value, 10, 1); }
+	bool setEnableStallGuardStop(uint32_t value) { return setField<TMCF_SG_STOP>(value); }
 
 	// Gets StallGuard stop event status 0/1 from device. Returns true on success, else false
-	bool getStallGuardStopEvent(uint32_t *result) { return getRegisterBits(TMCR_RAMP_STAT, result, 6, 1); }
+	bool getStallGuardStopEvent(uint32_t *result) { return getField<TMCF_EVENT_STOP_SG>(result); }
 
 	// Sets StallGuard stop event status 0/1 on device (write 1 to clear). Returns true on success, else false
-	bool setStallGuardStopEvent(uint32_t value) { return setRegisterBits(TMCR_RAMP_STAT, value, 6, 1); }
+	bool setStallGuardStopEvent(uint32_t value) { return setField<TMCF_EVENT_STOP_SG>(value); }
 	
 	// Gets target position reached event status 0/1 from device. Returns true on success, else false
-	bool getTargetPositionReachedEvent(uint32_t *result) { return getRegisterBits(TMCR_RAMP_STAT, result, 7, 1); }
+	bool getTargetPositionReachedEvent(uint32_t *result) { return getField<TMCF_EVENT_POS_REACHED>(result); }
 
 	// Sets target position reached event status 0/1 on device (write 1 to clear). Returns true on success, else false
-	bool setTargetPositionReachedEvent(uint32_t value) { return setRegisterBits(TMCR_RAMP_STAT, value, 7, 1); }
-	
+	bool setTargetPositionReachedEvent(uint32_t value) { return setField<TMCF_EVENT_POS_REACHED>(value); }
+
+
+	// Register transactions
+	//
+
+	// A sequence of register reads and writes, sent to the device as a single SPI message with chip select toggled between datagrams.
+	// Per the datasheet, each datagram returns the response to the previous one, so N operations take N+1 datagrams.
+	class Transaction {
+	public:
+		// Creates an empty transaction
+		Transaction() : numOps(0) { }
+
+		// Queues a read of the given register. Result is stored in the variable pointed to by result on execution. Returns true on success, false if full
+		bool get(uint8_t address, uint32_t *result);
+
+		// Queues a write of the given value to the given register. Returns true on success, false if full
+		bool set(uint8_t address, uint32_t value);
+
+		// Removes all queued operations
+		void clear() { numOps=0; }
+
+		// Returns the number of queued operations
+		uint32_t size() const { return numOps; }
+
+		enum {
+			MAX_OPS = 64
+		};
+
+	protected:
+		friend class TMC5160;
+
+		// A queued register operation
+		struct Op {
+			uint8_t   address; // register address, with the 0x80 flag set for writes
+			uint32_t  value;   // value to write, unused for reads
+			uint32_t *result;  // destination for read results, NULL for writes
+		};
+
+		// Queued operations, in order of execution
+		Op ops[MAX_OPS];
+
+		// Number of queued operations
+		uint32_t numOps;
+	};
+
+	// Executes all operations of the given transaction in a single SPI message on the I/O worker thread of the bus. Reads of
+	// write-only registers are served from the shadow register file without bus traffic. Confirmed writes and reads of non-volatile
+	// registers update the shadow. Updates deviceStatus if successful. Returns true on success, else false
+	bool execute(Transaction &t);
+
+	// Executes the given transaction on the current thread. Callers must be on the I/O worker thread. Returns true on success, else false
+	bool executeOnWorker(Transaction &t);
+
+
+	// Shadow register file
+	//
+
+	// Starts a register batch. Until the matching commitBatch(), writes to non-volatile registers by the calling thread only update
+	// the shadow and mark the register dirty. Batches nest. Batches are per thread: while one thread holds a batch, batch calls
+	// by other threads have no effect, and their writes go to the device immediately
+	void beginBatch();
+
+	// Ends a register batch. When the outermost batch ends, writes each dirty register to the device once,
+	// in order of first modification and in as few SPI messages as possible. Registers stay dirty until their write is
+	// confirmed, so a later batch retries failed writes. Returns true on success, else false
+	bool commitBatch();
+
+	// Ends a register batch without bus traffic, taking the dirty values as the device state. Only valid if the device is
+	// known to hold these values, e.g. after verifying it kept its configuration
+	void assumeBatch();
+
+	// Ends a register batch without bus traffic, discarding the dirty values. Their registers become unknown
+	void abortBatch();
+
+	// Marks the shadow values of the motion registers RAMPMODE, XTARGET and VMAX as unknown, so the next write of each goes to the device.
+	// For use after assumeBatch(), as motion commands change these registers without the configuration noticing
+	void invalidateMotionShadow();
+
+	// Marks all shadow registers as unknown and resets them to the power-on value of zero, e.g. after connecting to the device.
+	// Discards pending batched writes
+	void invalidateShadow();
+
+	// Reads all readable, writable and non-volatile registers from the device in a single pipelined SPI message, so the shadow
+	// register file reflects the device and later batches skip unchanged values. Returns true on success, else false
+	bool refreshShadow();
+
+	// Writes the shadow register file back to a device which lost its state to a reset, in as few SPI messages as possible.
+	// Clears the error flags and restarts the driver, restores the configuration, sets XACTUAL to the given position while holding,
+	// then resumes the motion mode, target and speed last set. Writes nothing and sets *deferred while another thread holds a batch
+	// open, as the shadow then mixes committed and half-built values. Returns true on success, else false
+	bool restoreShadow(int32_t position, bool *deferred);
+
+	// Clears the error flags and restarts a driver which disabled itself on an error, leaving all other registers and thus the
+	// position and motion untouched. Returns true on success, else false
+	bool restartDriver();
+
+	// Returns the shadow value of the given register. Safe to call from any thread
+	uint32_t getShadowRegister(uint8_t address) { std::lock_guard<std::mutex> lock(shadowMutex); return shadowRegisters[address & (TMCR_NUM_REGISTERS-1)]; }
+
+	// Returns true if the batch of the calling thread changed a register which can be read back from the device
+	bool batchChangesReadableRegisters();
+
+	// Returns true if the calling thread holds a batch. Requires shadowMutex
+	bool ownsBatch() const { return batchDepth>0 && batchOwner==std::this_thread::get_id(); }
+
+	// Shadow register flags
+	enum {
+		SHADOW_VALID = 1,  // shadow value matches the device
+		SHADOW_DIRTY = 2,  // shadow value awaits writing to the device at the end of the batch
+	};
+
 
 	// Register metadata functions
 	//
@@ -470,23 +802,43 @@ protected:
 	// Returns true if a register can be written to in harwdare. Drops the 0x80 flag used for setting registers
 	static bool canWriteRegister(uint8_t address) { return registerMetaData[address & (TMCR_NUM_REGISTERS-1)].mode & TMCRM_W; }
 
-	// Gets bits from a register value from the device. For convenience, uses a driver-side cache for write-only registers. 
-	// Updates spiStatus if successfully read from device. Fails if the register is undefined. Returns true on success, else false.
-	bool getRegisterBits(uint8_t address, uint32_t *result, uint32_t firstBit, uint32_t numBits);
-
-	// Sets bits in a register value on the device. For convenience, uses a driver-side cache for write-only registers. 
-	// Other bits left unchanged. Updates spiStatus if successful. Fails if the register is not writeable. Returns true on success, else false
-	bool setRegisterBits(uint8_t address, uint32_t value, uint32_t firstBit, uint32_t numBits);
-
-	// Gets a register value from the device. For convenience, uses a driver-side cache for write-only registers.
+	// Returns true if a register changes in hardware or has side effects on write, so it is never shadowed. Drops the 0x80 flag
+	static bool isVolatileRegister(uint8_t address) { return registerMetaData[address & (TMCR_NUM_REGISTERS-1)].mode & TMCRM_V; }
+
+	// Gets the given register field. Served from the shadow register file if possible, else read from the device.
+	// Updates spiStatus if successfully read from device. Returns true on success, else false
+	template<class F> bool getField(uint32_t *result) {
+		uint32_t tmp;
+		if(!getRegister(F::address, &tmp))
+			return false;
+		*result=F::extract(tmp);
+		return true;
+	}
+
+	// Sets the given register field, leaving other bits unchanged based on the shadow register file if possible. Fields of volatile
+	// registers are written alone with other bits zero, as a read-modify-write would e.g. clear all write-1-to-clear flags.
+	// Deferred to the end of the batch if one is active. Writes to read-only fields do not compile. Returns true on success, else false
+	template<class F> bool setField(uint32_t value) {
+		static_assert(F::access & TMCRM_W, "register field is read-only");
+		if(F::isWhole || (F::access & TMCRM_V))
+			return setRegister(F::address, F::insert(0, value));
+		uint32_t tmp;
+		if(!getRegister(F::address, &tmp))
+			return false;
+		return setRegister(F::address, F::insert(tmp, value));
+	}
+
+	// Gets a register value. Served from the shadow register file if possible, else read from the device.
 	// Updates spiStatus if successfully read from device. Fails if the register is undefined. Returns true on success, else false
 	bool getRegister(uint8_t address, uint32_t *result);
 
-	// Sets a register on device to the given value. For convenience, uses a driver-side cache for write-only registers.
-	// Updates spiStatus if successful. Fails if the register is not writeable. Returns true on success, else false
+	// Sets a register to the given value. Deferred to the end of the batch if one is active, else written to the device immediately.
+	// Updates spiStatus if written. Fails if the register is not writeable. Returns true on success, else false
 	bool setRegister(uint8_t address, uint32_t value);
 
-	virtual bool sendReceive(const uint8_t *tx, uint8_t *rx, uint32_t numBytes);
+	// Gets the given number of register values from the device with pipelined reads, where each datagram requests the next
+	// register while collecting the previous one's answer. N reads take N+1 datagrams. Returns true on success, else false
+	bool getRegisters(const uint8_t *addresses, uint32_t *results, uint32_t num);
 
 	// Prints a packet into given buffer given prefix and suffix (if non-NULL). Returns number of bytes printed, excluding trailing zero
 	static int printPacket(char *buffer, int bufsize, const uint8_t *data, uint32_t numBytes, bool isTX, const char *prefix, const char *suffix);
@@ -494,72 +846,258 @@ protected:
 	// Prints a register get/set command. Returns number of bytes printed, excluding trailing zero
 	static int printRegister(char *buffer, int bufsize, uint8_t address, uint32_t value, uint8_t status, const char *prefix, const char *suffix);
 
-	// Initializes GPIO to use physical pin numbers on the 40-pin connector. Multiple calls have no additional effect
-	static void initGPIO();
+protected:
+	// Requests rising edge events for the Diag0 line from the GPIO character device, and watches them on the I/O worker thread.
+	// Returns true on success, else false
+	bool diag0Open();
 
-public:
-	static void isr01(); // ISR for physical Diag0 pin number 01
-	static void isr02(); // ISR for physical Diag0 pin number 02
-	static void isr03(); // ISR for physical Diag0 pin number 03
-	static void isr04(); // ISR for physical Diag0 pin number 04
-	static void isr05(); // ISR for physical Diag0 pin number 05
-	static void isr06(); // ISR for physical Diag0 pin number 06
-	static void isr07(); // ISR for physical Diag0 pin number 07
-	static void isr08(); // ISR for physical Diag0 pin number 08
-	static void isr09(); // ISR for physical Diag0 pin number 09
-	static void isr10(); // ISR for physical Diag0 pin number 10
-	static void isr11(); // ISR for physical Diag0 pin number 11
-	static void isr12(); // ISR for physical Diag0 pin number 12
-	static void isr13(); // ISR for physical Diag0 pin number 13
-	static void isr14(); // ISR for physical Diag0 pin number 14
-	static void isr15(); // ISR for physical Diag0 pin number 15
-	static void isr16(); // ISR for physical Diag0 pin number 16
-	static void isr17(); // ISR for physical Diag0 pin number 17
-	static void isr18(); // ISR for physical Diag0 pin number 18
-	static void isr19(); // ISR for physical Diag0 pin number 19
-	static void isr20(); // ISR for physical Diag0 pin number 20
-	static void isr21(); // ISR for physical Diag0 pin number 21
-	static void isr22(); // ISR for physical Diag0 pin number 22
-	static void isr23(); // ISR for physical Diag0 pin number 23
-	static void isr24(); // ISR for physical Diag0 pin number 24
-	static void isr25(); // ISR for physical Diag0 pin number 25
-	static void isr26(); // ISR for physical Diag0 pin number 26
-	static void isr27(); // ISR for physical Diag0 pin number 27
-	static void isr28(); // ISR for physical Diag0 pin number 28
-	static void isr29(); // ISR for physical Diag0 pin number 29
-	static void isr30(); // ISR for physical Diag0 pin number 30
-	static void isr31(); // ISR for physical Diag0 pin number 31
-	static void isr32(); // ISR for physical Diag0 pin number 32
-	static void isr33(); // ISR for physical Diag0 pin number 33
-	static void isr34(); // ISR for physical Diag0 pin number 34
-	static void isr35(); // ISR for physical Diag0 pin number 35
-	static void isr36(); // ISR for physical Diag0 pin number 36
-	static void isr37(); // ISR for physical Diag0 pin number 37
-	static void isr38(); // ISR for physical Diag0 pin number 38
-	static void isr39(); // ISR for physical Diag0 pin number 39
-	static void isr40(); // ISR for physical Diag0 pin number 40
+	// Stops watching Diag0 line events and releases the line
+	void diag0Close();
 
-protected:
-	// ISR for this object, reacting to Diag0 output
-	void isr(); 
+	// Reads pending Diag0 line events and handles them. Called on the I/O worker thread when the line has events
+	void diag0Events();
+
+	// Handles a Diag0 event with the given kernel timestamp on the I/O worker thread
+	void handleDiag0(uint64_t timestampNs);
+
+	// Starts sampling driver telemetry at the configured rate with a timer watched by the I/O worker thread.
+	// Stops sampling if the rate is 0. Returns true on success, else false
+	bool telemetryOpen();
+
+	// Stops sampling driver telemetry and releases the timer
+	void telemetryClose();
+
+	// Starts tracking a new move on the I/O worker thread, superseding a pending one. Without Diag0 interrupts, polls the ramp
+	// status while the move is pending. Returns a future which becomes true once the target is reached, or false if the move is
+	// superseded, stopped by a switch or StallGuard, or the device is closed. Call on the I/O worker thread
+	std::future<bool> beginMove();
+
+	// Completes the pending move, if any, with the given result and stops polling. Call on the I/O worker thread
+	void completeMove(bool reached);
+
+	// Arms the timer in the variable pointed to by fd to expire periodically with the given period in nanoseconds, or disarms it if 0.
+	// Creates the timer on first use, and watches it on the I/O worker thread with a handler which consumes the expirations and invokes
+	// the given member function. The given name is used in error messages. Returns true on success, else false
+	bool armWatchedTimer(int *fd, uint64_t periodNs, void (TMC5160::*expired)(), const char *name);
+
+	// Stops watching the timer in the variable pointed to by fd, if any, and releases it
+	void closeWatchedTimer(int *fd);
+
+	// Reads and decodes the ramp status while a move is pending, just as a Diag0 interrupt would. Called when the move poll timer expires
+	void movePollExpired();
+
+	// Sets the fractional target speed as above. Call on the I/O worker thread. Returns true on success, else false
+	bool setTargetSpeedFractionalOnWorker(double value);
+
+	// Stops alternating VMAX or streaming XTARGET, leaving the last values written in effect. Call on the I/O worker thread
+	void fractionalSpeedStop() { ditherStop(); trackStop(); fractionalWholeSpeed=0; }
+
+	// Stops alternating VMAX, leaving the last value written in effect. Call on the I/O worker thread
+	void ditherStop();
+
+	// Accumulates the difference between requested and written speed since the last call into the residual. Call on the I/O worker thread
+	void ditherIntegrate(uint64_t timestampNs);
+
+	// Writes whichever of the two VMAX values adjacent to the given speed minimizes the residual at the next timer expiration,
+	// if it differs from the value in effect. A new speed takes effect as the write starts, or right away if nothing needs writing.
+	// Call on the I/O worker thread with the residual integrated up to now. Returns true on success, else false
+	bool ditherUpdate(int64_t speed, bool newSpeed);
+
+	// Integrates and updates VMAX. Called when the dither timer expires
+	void ditherExpired();
+
+	// Starts or updates position mode tracking with the given fractional speed. Anchors the ephemeris at XACTUAL when starting,
+	// else at the expected position, so speed changes such as guide pulses keep it continuous. Call on the I/O worker thread.
+	// Returns true on success, else false
+	bool trackSetSpeed(double value);
+
+	// Stops streaming XTARGET, leaving the axis to stop at the last target written. Call on the I/O worker thread
+	void trackStop();
+
+	// Returns the expected position per the ephemeris at the given CLOCK_MONOTONIC time in nanoseconds, in microsteps
+	double trackPositionAt(uint64_t timestampNs) { return trackAnchorPos + trackRate*1e-9*(double) (int64_t) (timestampNs-trackAnchorNs); }
+
+	// Writes the expected position one cadence ahead of the given time plus the lead to XTARGET, then the given VMAX unless 0, and enters positioning
+	// mode if requested. Reads XACTUAL alongside to track the error. Call on the I/O worker thread. Returns true on success, else false
+	bool trackUpdate(uint64_t timestampNs, uint32_t vmax=0, bool enterPositioning=false);
+
+	// Updates XTARGET. Called when the tracking timer expires
+	void trackExpired();
+
+	// Takes a driver telemetry sample in a single pipelined SPI message at low bus priority. Called on the I/O worker thread when the timer expires
+	void sampleTelemetry();
+
+	// Tracks the status bytes of the given number of response datagrams, and adds events for their rising edges to the pending
+	// set. Position reached and velocity reached are thus seen with any transfer, without reading RAMP_STAT. Call on the I/O worker thread
+	void trackStatus(const uint8_t *rx, uint32_t numFrames);
+
+	// Dispatches the pending events once the shadow lock is released, so handlers may start transactions of their own.
+	// Does nothing while already dispatching. Call on the I/O worker thread
+	void dispatchPendingEvents();
+
+	// Decodes events from the given RAMP_STAT value observed at the given CLOCK_MONOTONIC time in nanoseconds, dispatches them
+	// and clears the latched ones on the device. Call on the I/O worker thread. Returns true on success, else false
+	bool decodeRampStat(uint32_t rampStat, uint64_t timestampNs);
+
+	// Dispatches the given RAMP_EVENT_... flags observed at the given CLOCK_MONOTONIC time in nanoseconds, first to
+	// built-in handling, then to subscribers in order of subscription. Runs on the I/O worker thread
+	void dispatchRampEvents(uint32_t events, uint64_t timestampNs);
+
+	// Handles the target position being reached at the given CLOCK_MONOTONIC time in nanoseconds: sets the flag
+	// and restores the configured speed, if any. Called for position reached events
+	void positionReached(uint64_t timestampNs);
+
+	// Handles an unplanned stop by a reference switch or StallGuard: cancels restoring the speed, so the axis remains stopped
+	void motionStopped(enum TMCRampEvent event);
+
+	// Creates the SPI backend. Uses the software emulator if environment variable PIMOCO_EMULATOR is set
+	virtual SPIBackend *createBackend(const char *deviceName) override;
 
 	// Physical Diag0 pin on RPI GPIO connector. <=0 means none
 	int diag0Pin=0;
 
-	// Flag: has the motor reached the target position? Updated in ISR
+	// File descriptor for Diag0 line events, or negative if none
+	int diag0Fd=-1;
+
+	// Driver telemetry sampling rate in Hz, 0 if off
+	uint32_t telemetryRateHz=0;
+
+	// Timer file descriptor for driver telemetry sampling, or negative if none
+	int telemetryFd=-1;
+
+	// Ring of driver telemetry samples, written on the I/O worker thread only
+	Telemetry telemetry;
+
+	// Timer file descriptor for polling the ramp status during moves without interrupts, or negative if none
+	int movePollFd=-1;
+
+	// Flag: is a move pending completion? Accessed on the I/O worker thread only
+	bool moveActive=false;
+
+	// Number of moves begun, to discard deferred position reached events of superseded moves. Accessed on the I/O worker thread only
+	uint32_t moveSequence=0;
+
+	// RAMP_EVENT_... flags from status bytes pending dispatch, with the move sequence and CLOCK_MONOTONIC time in nanoseconds
+	// of the first. Accessed on the I/O worker thread only
+	uint32_t pendingEvents=0;
+	uint32_t pendingEventsSequence=0;
+	uint64_t pendingEventsNs=0;
+
+	// Flag: are pending events being dispatched? Accessed on the I/O worker thread only
+	bool dispatchingPendingEvents=false;
+
+	// Completion of the pending move. Accessed on the I/O worker thread only
+	std::promise<bool> movePromise;
+
+	// Interval for polling the ramp status during moves without interrupts, in nanoseconds
+	static const uint64_t movePollNs;
+
+	// Timer file descriptor for alternating VMAX, or negative if none
+	int ditherFd=-1;
+
+	// Fractional target speed which was a whole number and thus set as a plain VMAX in velocity mode, or 0 if none.
+	// Accessed on the I/O worker thread only
+	int32_t fractionalWholeSpeed=0;
+
+	// Flag: is VMAX alternating to approximate a fractional target speed? Accessed on the I/O worker thread only
+	bool ditherActive=false;
+
+	// Flag: has a VMAX value been written for the current fractional target speed? Accessed on the I/O worker thread only
+	bool ditherWritten=false;
+
+	// Requested fractional target speed in 32.32 fixed point, signed. Accessed on the I/O worker thread only
+	int64_t ditherSpeed=0;
+
+	// Signed VMAX value in effect, i.e. negative in velocity mode 2. Accessed on the I/O worker thread only
+	int32_t ditherCode=0;
+
+	// Number of VMAX writes since the request. Accessed on the I/O worker thread only
+	uint32_t ditherUpdates=0;
+
+	// Running integral of requested minus written speed, in 32.32 fixed point times microseconds. Accessed on the I/O worker thread only
+	int64_t ditherResidual=0;
+
+	// Residual at the time of the request, for the achieved mean speed. Accessed on the I/O worker thread only
+	int64_t ditherStartResidual=0;
+
+	// CLOCK_MONOTONIC times in nanoseconds of the request and the last integration. Accessed on the I/O worker thread only
+	uint64_t ditherStartNs=0, ditherLastNs=0;
+
+	// Interval between VMAX updates for fractional target speeds, in nanoseconds. Bounds the bus traffic to one datagram per interval
+	static const uint64_t ditherPeriodNs;
+
+	// Interval in milliseconds between XTARGET updates for position mode tracking, 0 for velocity mode
+	uint32_t trackCadenceMs=0;
+
+	// Timer file descriptor for streaming XTARGET, or negative if none
+	int trackFd=-1;
+
+	// Flag: is XTARGET streaming for position mode tracking? Accessed on the I/O worker thread only
+	bool trackActive=false;
+
+	// Requested fractional speed in microsteps per 2^24/f_clk, and in microsteps per second. Accessed on the I/O worker thread only
+	double trackSpeed=0, trackRate=0;
+
+	// Ephemeris anchor: expected position in microsteps at the given CLOCK_MONOTONIC time in nanoseconds. Accessed on the I/O worker thread only
+	double   trackAnchorPos=0;
+	uint64_t trackAnchorNs=0;
+
+	// Distance in microsteps by which XTARGET leads the ephemeris, signed. The braking distance of the ramp generator at the requested speed.
+	// Accessed on the I/O worker thread only
+	double trackLead=0;
+
+	// XACTUAL minus expected position in microsteps as of the last XTARGET update, and at the request. Accessed on the I/O worker thread only
+	double trackError=0, trackStartError=0;
+
+	// CLOCK_MONOTONIC times in nanoseconds of the request and of the last XTARGET update. Accessed on the I/O worker thread only
+	uint64_t trackStartNs=0, trackLastNs=0;
+
+	// Number of XTARGET writes since the request. Accessed on the I/O worker thread only
+	uint32_t trackUpdates=0;
+
+	// Fraction by which VMAX exceeds the speed in position mode tracking, so the ramp generator can catch up with the ephemeris
+	static const double trackHeadroom;
+
+	// Stepper clock in Hz. Does not change physical setting, used for physical position/speed/accel calculations only.
+	uint32_t clockHz=0;
+
+	// Flag: has the motor reached the target position? Updated on the I/O worker thread
 	volatile bool hasReachedTarget=false;
 
-	// The speed to restore in the ISR once the motor has reached the target position
-	int32_t speedToRestore=0;
+	// CLOCK_MONOTONIC time in nanoseconds at which the target position was last reached. 0 if never
+	volatile uint64_t positionReachedNs=0;
+
+	// Flag: are Diag0 interrupts enabled? If not, position reached events are derived from polled status
+	bool interruptsEnabled=false;
+
+	// The fractional speed to restore once the motor has reached the target position
+	double speedToRestore=0;
+
+	// RAMP_STAT as of the last decode, for detecting rising edges of status flags. Velocity and position reached
+	// are also updated from status bytes. Accessed on the I/O worker thread only
+	uint32_t lastRampStat=TMCF_RAMP_STAT::mask;
+
+	// Status byte of the last response datagram, for detecting rising edges. Accessed on the I/O worker thread only
+	uint8_t lastStatus=0xff;
+
+	// XACTUAL as last read from or written to the device while it reported neither reset nor driver error.
+	// The best estimate of the position to restore after a reset. Accessed on the I/O worker thread only
+	int32_t lastGoodPosition=0;
+
+	// A subscription to ramp events
+	struct RampEventSubscriber {
+		uint32_t events;          // subscribed RAMP_EVENT_... flags, 0 if unused
+		RampEventHandler handler; // handler to invoke
+	};
 
-	// True if GPIO has been initialized
-	static bool isGPIOInitialized;
+	// Subscriptions to ramp events, indexed by subscription id. Accessed on the I/O worker thread only
+	RampEventSubscriber rampEventSubscribers[MAX_RAMP_EVENT_SUBSCRIBERS];
 
-	// Array of objects indexed by physical Diag0 pin number on the Raspberry Pi connector [1..RPI_PHYS_PIN_MAX]
-	static TMC5160 *objectsByPin[];
+	// GPIO character device with the lines of the Raspberry Pi connector
+	static const char *gpioChipDevice;
 
-	// Array of static interrupt service routines by physical Diag0 pin number on the on the Raspberry Pi connector [1..RPI_PHYS_PIN_MAX]
-	static void (*isrsByPin[])(void);
+	// Broadcom GPIO line numbers by physical pin number on the Raspberry Pi connector [1..RPI_PHYS_PIN_MAX]. Negative if not a GPIO
+	static const int8_t gpioLinesByPin[];
 
 public:
 	enum {
@@ -570,8 +1108,32 @@ protected:
 	// Device status returned by the last SPI datagram
 	TMCStatusFlags deviceStatus;
 
-	// Last value written to write-only register TMCR_IHOLD_IRUN
-	uint32_t cachedRegisterValues[TMCR_NUM_REGISTERS];
+	// Protects the shadow register file and the batch state, which the I/O worker thread updates as transactions complete.
+	// Held briefly, never across bus traffic
+	std::mutex shadowMutex;
+
+	// Shadow register file. Holds the last value written to or read from each writable register, or the value pending while dirty
+	uint32_t shadowRegisters[TMCR_NUM_REGISTERS];
+
+	// Per-register SHADOW_... flags
+	uint8_t shadowFlags[TMCR_NUM_REGISTERS];
+
+	// Addresses of dirty shadow registers, in order of first modification
+	uint8_t dirtyRegisters[TMCR_NUM_REGISTERS];
+
+	// Number of entries in dirtyRegisters
+	uint32_t numDirtyRegisters=0;
+
+	// Nesting depth of register batches. Writes by batchOwner are deferred to the shadow while positive
+	uint32_t batchDepth=0;
+
+	// Thread holding the current batch
+	std::thread::id batchOwner;
+
+	// Preallocated datagram buffers for executing transactions. Only used on the I/O worker thread
+	alignas(64) uint8_t txBuffer[5*(Transaction::MAX_OPS+1)];
+	alignas(64) uint8_t rxBuffer[5*(Transaction::MAX_OPS+1)];
+	static_assert(Transaction::MAX_OPS+1<=SPIBackend::MAX_FRAMES, "transactions must fit into a single SPI message");
 
 
 	// Table of register metadata (names etc.) 
@@ -579,6 +1141,9 @@ protected:
 
 	// Table of status flag names
 	static const char *statusFlagNames[];
+
+	// Table of ramp event names by RAMP_STAT bit position. NULL if the bit is not an event
+	static const char *rampEventNames[];
 };
 
 #endif // PIMOCO_TMC5160_H
@@ -0,0 +1,62 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef PIMOCO_TMC5160_FIELDS_H
+#define PIMOCO_TMC5160_FIELDS_H
+
+#include <stdint.h>
+
+// Compile-time descriptor of a bit field in a 32-bit device register: register address, first bit, number of bits,
+// access mode (a combination of TMC5160::TMCRegisterModes) and signedness. Masks and shifts fold into constants,
+// so accessors built on top of it compile down to a single and/or. Whole registers are fields of width 32
+template<uint8_t Address, uint8_t Offset, uint8_t Width, int Access, bool Signed=false>
+struct TMCField {
+	static_assert(Width>0 && Offset+Width<=32, "field exceeds register");
+
+	static constexpr uint8_t  address =Address;
+	static constexpr uint8_t  offset  =Offset;
+	static constexpr uint8_t  width   =Width;
+	static constexpr int      access  =Access;
+	static constexpr bool     isSigned=Signed;
+	static constexpr bool     isWhole =false;
+
+	// Mask of the field bits within the register
+	static constexpr uint32_t mask=(uint32_t) ((((uint64_t)1)<<Width)-1) << Offset;
+
+	// Returns the field value from the given register value, sign-extended to 32 bits if the field is signed
+	static constexpr uint32_t extract(uint32_t reg) {
+		return Signed ? (uint32_t) (((int32_t) ((reg & mask) << (32-Offset-Width))) >> (32-Width))
+		              : (reg & mask) >> Offset;
+	}
+
+	// Returns the given register value with the field replaced by the given value. Excess value bits are dropped
+	static constexpr uint32_t insert(uint32_t reg, uint32_t value) {
+		return (reg & ~mask) | ((value << Offset) & mask);
+	}
+};
+
+// Compile-time descriptor of a field spanning all defined bits of a register, starting at bit zero. Undefined bits are
+// reserved, so the register can be written without reading it first
+template<uint8_t Address, uint8_t Width, int Access, bool Signed=false>
+struct TMCRegisterField : public TMCField<Address, 0, Width, Access, Signed> {
+	static constexpr bool isWhole=true;
+};
+
+#endif // PIMOCO_TMC5160_FIELDS_H
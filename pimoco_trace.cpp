@@ -0,0 +1,81 @@
+/*
+    PiMoCo: Raspberry Pi Telescope Mount and Focuser Control
+    Copyright (C) 2021 Markus Noga
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h> // for getopt
+#include <libindi/indifocuser.h>
+
+#include "pimoco_tmc5160.h"
+
+
+// Offline decoder for SPI traces saved in raw binary form, e.g. with pimoco_test -t <file>.
+// Prints one line per datagram with register names and values, or raw bytes with option -p
+
+
+// Dummy INDI entry points, required for linking against libindidriver
+extern "C" {
+
+void ISGetProperties(const char *dev) {}
+
+void ISNewBLOB(const char *dev, const char *name, int sizes[], int blobsizes[], char *blobs[], char *formats[], char *names[], int n) {}
+
+void ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n) {}
+
+void ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n) {}
+
+void ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n) {}
+
+void ISSnoopDevice(XMLEle *root) {}
+
+} // extern "C"
+
+
+int main(int argc, char **argv) {
+	bool packets=false;
+	int opt;
+	while((opt=getopt(argc, argv, "p"))!=-1) {
+		switch(opt) {
+			case 'p':
+				packets=true;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-p] file...\n  -p  show raw packet bytes instead of register names and values\n", argv[0]);
+				return -1;
+		}
+	}
+	if(optind>=argc) {
+		fprintf(stderr, "Usage: %s [-p] file...\n", argv[0]);
+		return -1;
+	}
+
+	SPITrace::Record *records=new SPITrace::Record[SPITrace::CAPACITY];
+	int res=0;
+	for(int i=optind; i<argc; i++) {
+		uint32_t num;
+		if(!SPITrace::load(argv[i], records, SPITrace::CAPACITY, &num)) {
+			fprintf(stderr, "Error reading trace from %s\n", argv[i]);
+			res=-1;
+			continue;
+		}
+		TMC5160::decodeTrace(records, num, argv[i], packets, [](const char *line) { puts(line); });
+	}
+	delete[] records;
+	return res;
+}
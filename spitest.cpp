@@ -16,6 +16,9 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
 #include <getopt.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
@@ -40,6 +43,52 @@ static uint8_t bits = 8;
 static uint32_t speed = 1000000;
 static uint16_t delay=0;
 
+/* benchmark settings. Lists are comma-separated */
+static int bench = 0;
+static int emulate = 0;
+static const char *speeds = NULL;
+static const char *batches = "1,2,4,8,16,32,64";
+static const char *cpus = "-1";
+static uint32_t iterations = 2000;
+
+#define MAX_BATCH 64
+#define MAX_LIST  32
+
+/* performs one SPI message of the given transfers. Returns negative on error */
+typedef int (*message_fn)(int fd, struct spi_ioc_transfer *tr, uint32_t n);
+
+static int message_spidev(int fd, struct spi_ioc_transfer *tr, uint32_t n)
+{
+	return ioctl(fd, SPI_IOC_MESSAGE(n), tr);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/* software loopback for machines without SPI hardware. Mimics the TMC5160 one-datagram latency,
+ * and spins for the time the bits would take on the wire at the requested clock speed */
+static int message_loopback(int fd, struct spi_ioc_transfer *tr, uint32_t n)
+{
+	static uint8_t pending[5];
+	uint64_t wire_ns = 0;
+	uint64_t start = now_ns();
+	(void) fd;
+	for (uint32_t t = 0; t < n; t++) {
+		uint8_t *tx = (uint8_t *) (unsigned long) tr[t].tx_buf;
+		uint8_t *rx = (uint8_t *) (unsigned long) tr[t].rx_buf;
+		memcpy(rx, pending, 5);
+		memcpy(pending, tx, 5);
+		wire_ns += 8ull * tr[t].len * 1000000000ull / (tr[t].speed_hz ? tr[t].speed_hz : speed);
+	}
+	while (now_ns() - start < wire_ns)
+		;
+	return 5 * n;
+}
+
 static void transfer(int fd)
 {
 	uint8_t tx[]={
@@ -96,9 +145,105 @@ static void transfer(int fd)
 	printf("OK\n");
 }
 
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/* parses a comma-separated list of integers. Returns the number of entries */
+static int parse_list(const char *s, long *values, int max)
+{
+	int n = 0;
+	while (s != NULL && *s && n < max) {
+		char *end;
+		values[n++] = strtol(s, &end, 0);
+		s = (*end == ',') ? end + 1 : NULL;
+	}
+	return n;
+}
+
+/* runs one benchmark configuration and prints a CSV line */
+static void bench_run(int fd, message_fn message, uint32_t hz, uint32_t batch, long cpu)
+{
+	static uint8_t tx[5 * MAX_BATCH], rx[5 * MAX_BATCH];
+	struct spi_ioc_transfer tr[MAX_BATCH];
+	uint64_t *latencies = (uint64_t *) malloc(iterations * sizeof(uint64_t));
+	if (latencies == NULL)
+		pabort("can't allocate latencies");
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			pabort("can't set cpu affinity");
+	}
+	if (!emulate && ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &hz) == -1)
+		pabort("can't set max speed hz");
+
+	/* harmless reads of XENC, one datagram each */
+	memset(tx, 0, sizeof(tx));
+	memset(tr, 0, sizeof(tr));
+	for (uint32_t t = 0; t < batch; t++) {
+		tx[5 * t] = TMCR_X_ENC;
+		tr[t].tx_buf        = (unsigned long) &tx[5 * t];
+		tr[t].rx_buf        = (unsigned long) &rx[5 * t];
+		tr[t].len           = 5;
+		tr[t].speed_hz      = hz;
+		tr[t].delay_usecs   = delay;
+		tr[t].bits_per_word = bits;
+		tr[t].cs_change     = (t == batch - 1) ? 0 : 1;
+	}
+
+	uint64_t start = now_ns();
+	for (uint32_t i = 0; i < iterations; i++) {
+		uint64_t t0 = now_ns();
+		if (message(fd, tr, batch) < 0)
+			pabort("can't send spi message");
+		latencies[i] = now_ns() - t0;
+	}
+	double seconds = (now_ns() - start) * 1e-9;
+
+	qsort(latencies, iterations, sizeof(uint64_t), compare_u64);
+	printf("%s,%s,%u,%u,%ld,%u,%u,%.6f,%.0f,%.2f,%.2f,%.2f\n",
+	       emulate ? "loopback" : "spidev", device, hz, batch, cpu, iterations, iterations * batch, seconds,
+	       iterations * batch / seconds, latencies[iterations / 2] * 1e-3, latencies[(iterations * 99) / 100] * 1e-3,
+	       latencies[iterations - 1] * 1e-3);
+	fflush(stdout);
+	free(latencies);
+}
+
+/* benchmarks all combinations of clock speeds, batch sizes and cpu affinities. Prints CSV to stdout */
+static void benchmark(int fd)
+{
+	long speed_list[MAX_LIST], batch_list[MAX_LIST], cpu_list[MAX_LIST];
+	int num_speeds = speeds != NULL ? parse_list(speeds, speed_list, MAX_LIST) : 0;
+	int num_batches = parse_list(batches, batch_list, MAX_LIST);
+	int num_cpus = parse_list(cpus, cpu_list, MAX_LIST);
+	if (num_speeds == 0) {
+		speed_list[0] = speed;
+		num_speeds = 1;
+	}
+	if (iterations == 0)
+		iterations = 1;
+
+	message_fn message = emulate ? message_loopback : message_spidev;
+	printf("backend,device,speed_hz,batch,cpu,messages,frames,seconds,frames_per_s,p50_us,p99_us,max_us\n");
+	for (int c = 0; c < num_cpus; c++)
+		for (int s = 0; s < num_speeds; s++)
+			for (int b = 0; b < num_batches; b++) {
+				if (batch_list[b] < 1 || batch_list[b] > MAX_BATCH) {
+					fprintf(stderr, "skipping batch size %ld, not in range 1..%d\n", batch_list[b], MAX_BATCH);
+					continue;
+				}
+				bench_run(fd, message, (uint32_t) speed_list[s], (uint32_t) batch_list[b], cpu_list[c]);
+			}
+}
+
 void print_usage(const char *prog)
 {
-	printf("Usage: %s [-DsbdlHOLC3]\n", prog);
+	printf("Usage: %s [-DsbdlHOLC3] [-B [-S speeds] [-n batches] [-c cpus] [-i iterations] [-E]]\n", prog);
 	puts("  -D --device   device to use (default /dev/spidev1.1)\n"
 	     "  -s --speed    max speed (Hz)\n"
 	     "  -d --delay    delay (usec)\n"
@@ -108,7 +253,13 @@ void print_usage(const char *prog)
 	     "  -O --cpol     clock polarity\n"
 	     "  -L --lsb      least significant bit first\n"
 	     "  -C --cs-high  chip select active high\n"
-	     "  -3 --3wire    SI/SO signals shared\n");
+	     "  -3 --3wire    SI/SO signals shared\n"
+	     "  -B --bench    benchmark instead of handshake, print CSV results\n"
+	     "  -S --speeds   comma-separated clock speeds (Hz) to benchmark (default: -s)\n"
+	     "  -n --batches  comma-separated frames per message to benchmark (default 1,2,4,8,16,32,64)\n"
+	     "  -c --cpus     comma-separated cpus to pin to, -1 for none (default -1)\n"
+	     "  -i --iter     messages per configuration (default 2000)\n"
+	     "  -E --emulate  use a software loopback instead of the device\n");
 	exit(1);
 }
 
@@ -126,11 +277,17 @@ void parse_opts(int argc, char *argv[])
 			{ "lsb",     0, 0, 'L' },
 			{ "cs-high", 0, 0, 'C' },
 			{ "3wire",   0, 0, '3' },
+			{ "bench",   0, 0, 'B' },
+			{ "speeds",  1, 0, 'S' },
+			{ "batches", 1, 0, 'n' },
+			{ "cpus",    1, 0, 'c' },
+			{ "iter",    1, 0, 'i' },
+			{ "emulate", 0, 0, 'E' },
 			{ NULL, 0, 0, 0 },
 		};
 		int c;
 
-		c = getopt_long(argc, argv, "D:s:d:b:lHOLC3", lopts, NULL);
+		c = getopt_long(argc, argv, "D:s:d:b:lHOLC3BS:n:c:i:E", lopts, NULL);
 
 		if (c == -1)
 			break;
@@ -166,6 +323,24 @@ void parse_opts(int argc, char *argv[])
 		case '3':
 			mode |= SPI_3WIRE;
 			break;
+		case 'B':
+			bench = 1;
+			break;
+		case 'S':
+			speeds = optarg;
+			break;
+		case 'n':
+			batches = optarg;
+			break;
+		case 'c':
+			cpus = optarg;
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'E':
+			emulate = 1;
+			break;
 		default:
 			print_usage(argv[0]);
 			break;
@@ -180,14 +355,26 @@ int main(int argc, char *argv[])
 
 	parse_opts(argc, argv);
 
+	if (bench && emulate) {
+		benchmark(-1);
+		return 0;
+	}
+
 	fd = open(device, O_RDWR);
+	if (fd < 0 && bench) {
+		fprintf(stderr, "can't open device %s, benchmarking software loopback instead\n", device);
+		emulate = 1;
+		benchmark(-1);
+		return 0;
+	}
 	if (fd < 0)
 		pabort("can't open device");
 
 	/*
 	 * spi mode
 	 */
-	printf("mode %d\n", mode);
+	if (!bench)
+		printf("mode %d\n", mode);
 	ret = ioctl(fd, SPI_IOC_WR_MODE, &mode);
 	if (ret == -1)
 		pabort("can't set spi mode");
@@ -218,6 +405,12 @@ int main(int argc, char *argv[])
 	if (ret == -1)
 		pabort("can't get max speed hz");
 
+	if (bench) {
+		benchmark(fd);
+		close(fd);
+		return ret;
+	}
+
 	printf("spi mode: %d\n", mode);
 	printf("bits per word: %d\n", bits);
 	printf("max speed: %d Hz (%d KHz)\n", speed, speed/1000);